@@ -1,3 +1,4 @@
+#include <windows.h>
 #include <cassert>
 #include <signal.h>
 
@@ -5,6 +6,60 @@
 
 /******************************************************************************/
 
+// Calls of different lanes are executed in parallel, so outgoing orders
+// are encoded without waiting for decode of incoming stream
+enum
+{
+    DefaultLane = 0,
+    EncodeLane = 1,
+    DecodeLane = 2
+};
+
+struct LaneThreadArg
+{
+    void* (*fn)(void*);
+    void* arg;
+};
+
+static DWORD WINAPI laneThreadProc ( LPVOID param )
+{
+    LaneThreadArg* threadArg = (LaneThreadArg*)param;
+    threadArg->fn(threadArg->arg);
+    delete threadArg;
+    return 0;
+}
+
+// Threads which call ADAPI lib must be created by Wine, not by pthread
+static bool spawnLaneThread ( void* (*fn)(void*), void* arg )
+{
+    LaneThreadArg* threadArg = new LaneThreadArg;
+    threadArg->fn = fn;
+    threadArg->arg = arg;
+    HANDLE thread = ::CreateThread(0, 0, laneThreadProc, threadArg, 0, 0);
+    if ( thread == 0 ) {
+        delete threadArg;
+        return false;
+    }
+    ::CloseHandle(thread);
+    return true;
+}
+
+struct ChannelThreadArg
+{
+    ADAPIServerBase* server;
+    int sock;
+};
+
+static DWORD WINAPI channelThreadProc ( LPVOID param )
+{
+    ChannelThreadArg* threadArg = (ChannelThreadArg*)param;
+    threadArg->server->serveChannel(threadArg->sock);
+    delete threadArg;
+    return 0;
+}
+
+/******************************************************************************/
+
 // Params:  bytestring,bytestring,bytestring
 // Retvals: int,bytestring
 void ADRPC_Encode(void* param,
@@ -36,15 +91,12 @@ void ADRPC_Encode(void* param,
         dataSize,
         &pResultData, &cResultSize);
 
-    std::vector<unsigned char> resData;
-    if (pResultData && cResultSize)
-        resData = std::vector<unsigned char>(pResultData, pResultData + cResultSize);
-
-    server->freeMemory(pResultData);
-
     // Create retval vector
     retval.push_back(ADRPC::value::create_value((uint32_t)res));
-    retval.push_back(ADRPC::value::create_value(resData));
+    retval.push_back(ADRPC::value::create_value(
+                         pResultData, (pResultData ? cResultSize : 0)));
+
+    server->freeMemory(pResultData);
 }
 
 // Params:  bytestring,bytestring,bytestring
@@ -79,16 +131,73 @@ void ADRPC_Decode(void* param,
         dataSize,
         &pResultData, &cResultSize, &cParsedSize);
 
-    std::vector<unsigned char> resData;
-    if (pResultData && cResultSize)
-        resData = std::vector<unsigned char>(pResultData, pResultData + cResultSize);
+    // Create retval vector
+    retval.push_back(ADRPC::value::create_value((uint32_t)res));
+    retval.push_back(ADRPC::value::create_value(
+                         pResultData, (pResultData ? cResultSize : 0)));
+    retval.push_back(ADRPC::value::create_value((uint32_t)cParsedSize));
 
     server->freeMemory(pResultData);
+}
+
+// Params:  int,bytestring,bytestring,bytestring
+// Retvals: int,bytestring
+void ADRPC_DecodeStream(void* param,
+                        const std::vector<ADRPC::value*>& params,
+                        std::vector<ADRPC::value*>& retval)
+{
+    assert(params.size() == 4);
+    ADAPIServerBase* server = (ADAPIServerBase*)param;
+    uint32_t streamId = 0;
+    params[0]->to_uint32(streamId);
+
+    const unsigned char* encType;
+    unsigned int encSize;
+    params[1]->to_bytearray_ptr(encType, encSize);
+
+    const unsigned char* key;
+    unsigned int keySize;
+    params[2]->to_bytearray_ptr(key, keySize);
+
+    const unsigned char* data;
+    unsigned int dataSize;
+    params[3]->to_bytearray_ptr(data, dataSize);
+
+    char* pResultData = 0;
+    unsigned int cResultSize = 0;
+
+    bool res = server->decodeStream(streamId).decode(
+        (encSize > 0 ? (const char*)encType : 0),
+        encSize,
+        (keySize > 0 ? (const char*)key : 0),
+        (dataSize > 0 ? (const char*)data : 0),
+        dataSize,
+        &pResultData, &cResultSize);
 
     // Create retval vector
     retval.push_back(ADRPC::value::create_value((uint32_t)res));
-    retval.push_back(ADRPC::value::create_value(resData));
-    retval.push_back(ADRPC::value::create_value((uint32_t)cParsedSize));
+    retval.push_back(ADRPC::value::create_value(
+                         pResultData, (pResultData ? cResultSize : 0)));
+
+    if (pResultData)
+        server->freeMemory(pResultData);
+}
+
+// Params:  int
+// Retvals: int
+void ADRPC_ResetDecodeStream(void* param,
+                             const std::vector<ADRPC::value*>& params,
+                             std::vector<ADRPC::value*>& retval)
+{
+    assert(params.size() == 1);
+    ADAPIServerBase* server = (ADAPIServerBase*)param;
+    uint32_t streamId = 0;
+    params[0]->to_uint32(streamId);
+
+    server->resetDecodeStream(streamId);
+
+    // Create retval vector
+    retval.push_back(ADRPC::value::create_value((uint32_t)1));
 }
 
 // Params:  void
@@ -137,15 +246,105 @@ void ADRPC_GetConnectionType(void* param,
     retval.push_back(ADRPC::value::create_value(data));
 }
 
+// Params:  void
+// Retvals: int
+void ADRPC_Ping(void*,
+                const std::vector<ADRPC::value*>& params,
+                std::vector<ADRPC::value*>& retval)
+{
+    assert(params.size() == 0);
+    (void)params;
+
+    // Health check of warm server
+    retval.push_back(ADRPC::value::create_value((uint32_t)1));
+}
+
 /******************************************************************************/
 
 ADAPIServerBase::ADAPIServerBase ( int fd )
 {
+    pthread_mutex_init(&m_decodeStreamsLock, 0);
     m_rpc.set_fd(fd);
 }
 
 ADAPIServerBase::~ADAPIServerBase ()
-{}
+{
+    std::map<uint32_t, ADDecodeStream*>::iterator it = m_decodeStreams.begin();
+    for ( ; it != m_decodeStreams.end(); ++it )
+        delete it->second;
+    pthread_mutex_destroy(&m_decodeStreamsLock);
+}
+
+ADDecodeStream& ADAPIServerBase::decodeStream ( uint32_t streamId )
+{
+    // Stream itself is used only by decode lane of own channel
+    pthread_mutex_lock(&m_decodeStreamsLock);
+    ADDecodeStream* stream = 0;
+    std::map<uint32_t, ADDecodeStream*>::iterator it =
+        m_decodeStreams.find(streamId);
+    if ( it != m_decodeStreams.end() )
+        stream = it->second;
+    else {
+        stream = new ADDecodeStream(*this);
+        m_decodeStreams.insert(std::make_pair(streamId, stream));
+    }
+    pthread_mutex_unlock(&m_decodeStreamsLock);
+    return *stream;
+}
+
+void ADAPIServerBase::resetDecodeStream ( uint32_t streamId )
+{
+    ADDecodeStream* stream = 0;
+    pthread_mutex_lock(&m_decodeStreamsLock);
+    std::map<uint32_t, ADDecodeStream*>::iterator it =
+        m_decodeStreams.find(streamId);
+    if ( it != m_decodeStreams.end() ) {
+        stream = it->second;
+        m_decodeStreams.erase(it);
+    }
+    pthread_mutex_unlock(&m_decodeStreamsLock);
+    delete stream;
+}
+
+void ADAPIServerBase::registerCalls ( ADRPC& rpc )
+{
+    rpc.set_spawn(spawnLaneThread);
+    rpc.register_call("adapi.encode", ADRPC_Encode, this, EncodeLane);
+    rpc.register_call("adapi.decode", ADRPC_Decode, this, DecodeLane);
+    rpc.register_call("adapi.decodeStream", ADRPC_DecodeStream, this, DecodeLane);
+    rpc.register_call("adapi.resetDecodeStream", ADRPC_ResetDecodeStream, this, DecodeLane);
+    rpc.register_call("adapi.getProtocolVersion", ADRPC_GetProtocolVersion, this, DefaultLane);
+    rpc.register_call("adapi.getConnectionType", ADRPC_GetConnectionType, this, DefaultLane);
+    rpc.register_call("adapi.ping", ADRPC_Ping, this, DefaultLane);
+}
+
+bool ADAPIServerBase::openChannel ( void* param, int sock )
+{
+    ChannelThreadArg* threadArg = new ChannelThreadArg;
+    threadArg->server = (ADAPIServerBase*)param;
+    threadArg->sock = sock;
+    // Channel loop spawns its lanes by Wine, so it is a Wine thread as well
+    HANDLE thread = ::CreateThread(0, 0, channelThreadProc, threadArg, 0, 0);
+    if ( thread == 0 ) {
+        delete threadArg;
+        return false;
+    }
+    ::CloseHandle(thread);
+    return true;
+}
+
+void ADAPIServerBase::serveChannel ( int sock )
+{
+    ADRPC rpc;
+    rpc.set_fd(sock);
+    registerCalls(rpc);
+
+    // Enters loop, exits when client closes channel
+    rpc.exec_loop();
+
+    rpc.set_fd(-1);
+    ::close(sock);
+}
 
 int ADAPIServerBase::startServer ()
 {
@@ -154,13 +353,12 @@ int ADAPIServerBase::startServer ()
     // get killed by the OS.
     signal(SIGPIPE, SIG_IGN);
 
-    // Register rpc calls
-    m_rpc.register_call("adapi.encode", ADRPC_Encode, this);
-    m_rpc.register_call("adapi.decode", ADRPC_Decode, this);
-    m_rpc.register_call("adapi.getProtocolVersion", ADRPC_GetProtocolVersion, this);
-    m_rpc.register_call("adapi.getConnectionType", ADRPC_GetConnectionType, this);
+    // Register rpc calls. Every client session opens own channel,
+    // control channel is shared by sessions of this process.
+    registerCalls(m_rpc);
+    m_rpc.set_channel_handler(openChannel, this);
 
-    // Enters loop
+    // Enters loop, process exits when control channel is closed
     m_rpc.exec_loop();
 
     return 0;
@@ -1,7 +1,10 @@
 #ifndef ADAPISERVERBASE_H
 #define ADAPISERVERBASE_H
 
+#include <map>
+
 #include "ADAPIInterface.h"
+#include "ADDecodeStream.h"
 #include "ADRPC.h"
 
 class ADAPIServerBase : public ADAPIInterface
@@ -12,8 +15,22 @@ public:
 
     int startServer ();
 
+    // Serves channel opened by client till it is closed
+    void serveChannel ( int sock );
+
+    // Decode streams of clients, created on demand
+    ADDecodeStream& decodeStream ( uint32_t streamId );
+    void resetDecodeStream ( uint32_t streamId );
+
+private:
+    void registerCalls ( ADRPC& rpc );
+    static bool openChannel ( void* param, int sock );
+
 private:
     ADRPC m_rpc;
+    // Channels are served by own threads
+    pthread_mutex_t m_decodeStreamsLock;
+    std::map<uint32_t, ADDecodeStream*> m_decodeStreams;
 };
 
 #endif // ADAPISERVERBASE_H
@@ -21,11 +21,14 @@ INCLUDEPATH += \
                $$LEVEL/src \
                $$LEVEL/ADAPI/include \
 
+LIBS += -lrt -lpthread
+
 SOURCES = \
           Main.cpp \
           ADAPIServer.cpp \
           $$LEVEL/src/ADRPC.cpp \
           $$LEVEL/src/ADLocalLibrary.cpp \
+          $$LEVEL/src/ADDecodeStream.cpp \
           $$LEVEL/src/ADDynaLoader.cpp
 
 QMAKE_LFLAGS += -Wl,-rpath,$$DESTDIR
@@ -0,0 +1,197 @@
+/*
+ * Micro-benchmark of reading top of the book: copy of the whole quote
+ * under shard read lock (as getQuote does) against lock free quote
+ * snapshot (getQuoteSnapshot) and top 5 levels (getDepth<5>).
+ * Every case runs on idle quotes and with a writer thread which keeps
+ * changing and publishing them, as connection thread does.
+ *
+ * Public getQuote/getDepth are not called: quotes of ADConnection are
+ * filled only from AD server streams. Benchmark exercises internals
+ * instead, the same shard lock + QHash copy which getQuote does and the
+ * same ADQuoteSnapshots reads which getQuoteSnapshot/getDepth forward
+ * to, so call overhead of the public wrappers is not measured.
+ * Usage: ADDepthBench [iterations]
+ */
+
+#include <stdio.h>
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QThread>
+
+#include "ADConnection.h"
+#include "ADQuoteSnapshots.h"
+#include "ADStatLock.h"
+
+/****************************************************************************/
+
+namespace
+{
+    enum { Papers = 300, Levels = 20 };
+
+    // Quotes are kept as in one shard of connection
+    // (see ADConnection::getQuote and _getQuote)
+    struct Book
+    {
+        ADStatRWLock lock;
+        QHash<int, ADConnection::Quote> quotes;
+        ADQuoteSnapshots snapshots;
+    };
+
+    ADPrice levelPrice ( int paperNo, int level )
+    {
+        return ADPrice::fromValue( (paperNo * 1000 + level) * ADPrice::Scale / 100 );
+    }
+
+    void fillBook ( Book& book )
+    {
+        ADConnection::TimeMark nowMark = 0;
+        ADConnection::timeMark( nowMark );
+        for ( int p = 0; p < Papers; ++p ) {
+            int paperNo = 40000 + p;
+            ADConnection::Quote& quote = book.quotes[paperNo];
+            quote.paperNo = paperNo;
+            quote.paperCode = QString("CODE%1").arg(paperNo);
+            quote.market = "FORTS";
+            quote.lastPrice = levelPrice( paperNo, Levels );
+            for ( int i = 0; i < Levels; ++i ) {
+                quote.buyers.set( levelPrice(paperNo, i), 10 + i );
+                quote.sellers.set( levelPrice(paperNo, Levels + 1 + i), 20 + i );
+            }
+            book.snapshots.publish( quote, nowMark );
+        }
+    }
+
+    // Changes one level of every paper in turn, as queue lines do
+    class Writer : public QThread
+    {
+    public:
+        Writer ( Book& book ) : m_book(book), m_stop(0), m_updates(0) {}
+
+        void stop () { m_stop = 1; }
+        quint64 updates () const { return m_updates; }
+
+    protected:
+        void run ()
+        {
+            for ( int n = 0; ! m_stop; ++n ) {
+                int paperNo = 40000 + n % Papers;
+                ADConnection::TimeMark nowMark = 0;
+                ADConnection::timeMark( nowMark );
+
+                // Lock
+                ADWriteLocker wLocker( &m_book.lock );
+                ADConnection::Quote& quote = m_book.quotes[paperNo];
+                quote.buyers.set( levelPrice(paperNo, n % Levels), 1 + n % 100 );
+                m_book.snapshots.publish( quote, nowMark );
+                ++m_updates;
+            }
+        }
+
+    private:
+        Book& m_book;
+        volatile int m_stop;
+        quint64 m_updates;
+    };
+
+    qint64 readQuotes ( Book& book, int iters, qint64& sum )
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for ( int i = 0; i < iters; ++i ) {
+            int paperNo = 40000 + i % Papers;
+            ADConnection::Quote quote;
+            {
+                // Lock
+                ADReadLocker rLocker( &book.lock );
+                QHash<int, ADConnection::Quote>::ConstIterator it =
+                    book.quotes.constFind( paperNo );
+                if ( it == book.quotes.constEnd() )
+                    continue;
+                quote = *it;
+            }
+            for ( int l = 0; l < 5 && l < quote.buyers.size(); ++l )
+                sum += quote.buyers[l].qty;
+        }
+        return timer.nsecsElapsed();
+    }
+
+    qint64 readSnapshots ( Book& book, int iters, qint64& sum )
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for ( int i = 0; i < iters; ++i ) {
+            ADConnection::QuoteSnapshot snapshot;
+            if ( ! book.snapshots.read(40000 + i % Papers, snapshot) )
+                continue;
+            for ( int l = 0; l < 5 && l < snapshot.buyersNum; ++l )
+                sum += snapshot.buyers[l].qty;
+        }
+        return timer.nsecsElapsed();
+    }
+
+    qint64 readDepth ( Book& book, int iters, qint64& sum )
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for ( int i = 0; i < iters; ++i ) {
+            ADConnection::DepthSnapshot<5> depth;
+            if ( ! book.snapshots.readDepth(40000 + i % Papers, depth.Depth,
+                                            depth, depth.buyers, depth.sellers) )
+                continue;
+            for ( int l = 0; l < depth.buyersNum; ++l )
+                sum += depth.buyers[l].qty;
+        }
+        return timer.nsecsElapsed();
+    }
+
+    void run ( Book& book, int iters, bool withWriter )
+    {
+        Writer writer( book );
+        if ( withWriter )
+            writer.start();
+
+        qint64 quoteSum = 0, snapshotSum = 0, depthSum = 0;
+        qint64 quoteNs = readQuotes( book, iters, quoteSum );
+        qint64 snapshotNs = readSnapshots( book, iters, snapshotSum );
+        qint64 depthNs = readDepth( book, iters, depthSum );
+
+        if ( withWriter ) {
+            writer.stop();
+            writer.wait();
+        }
+
+        printf("%-7s quote: %7.1f ns  snapshot: %7.1f ns  depth<5>: %7.1f ns  "
+               "speedup: %5.2fx",
+               withWriter ? "writer" : "idle",
+               double(quoteNs) / iters, double(snapshotNs) / iters,
+               double(depthNs) / iters,
+               depthNs ? double(quoteNs) / depthNs : 0.0);
+        if ( withWriter )
+            printf("  (%llu updates)", (unsigned long long)writer.updates());
+        // Idle book is not changed, so all reads see the same levels
+        if ( ! withWriter && (quoteSum != snapshotSum || quoteSum != depthSum) )
+            printf("  (results differ!)");
+        printf("\n");
+    }
+}
+
+/****************************************************************************/
+
+int main ( int argc, char** argv )
+{
+    QCoreApplication app( argc, argv );
+
+    int iters = (argc > 1 ? QString(argv[1]).toInt() : 1000000);
+    if ( iters <= 0 )
+        iters = 1000000;
+
+    Book book;
+    fillBook( book );
+
+    run( book, iters, false );
+    run( book, iters, true );
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+TARGET = ADDepthBench
+QT -= gui
+QT += network sql
+CONFIG += warn_on console release
+
+LEVEL = ..
+
+!include($$LEVEL/AlfaDirectAPI.pri):error("Can't load AlfaDirectAPI.pri")
+
+TEMPLATE = app
+
+INCLUDEPATH += $$LEVEL/src
+
+# Quote and book side are implemented by connection,
+# so library must be built first
+QMAKE_LIBDIR += $$LEVEL/build $$LEVEL/src
+LIBS += -lAlfaDirectAPI
+
+SOURCES += \
+           ADDepthBench.cpp \
@@ -0,0 +1,256 @@
+/*
+ * Micro-benchmark of AD stream line parsing: QString split and
+ * conversions (old path) against in place tokenizers of ADTextParser
+ * and SIMD separator index (ADBlockIndex) on wide lines.
+ * Usage: ADTextParserBench [iterations]
+ */
+
+#include <stdio.h>
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QTextCodec>
+#include <QElapsedTimer>
+
+#include "ADTextParser.h"
+
+/****************************************************************************/
+
+namespace
+{
+    // Queue lines: {paper_no, price, buy_qty, sell_qty, i_last_update, yield}
+    QByteArray makeQueueBlock ( int lines )
+    {
+        QByteArray ba;
+        for ( int i = 0; i < lines; ++i )
+            ba += QString("%1|%2.%3|%4|%5|%6|0|\r\n").
+                arg(40000 + i % 300).arg(100 + i % 5000).arg(i % 100, 2, 10, QChar('0')).
+                arg(i % 7 ? i % 1000 : 0).arg(i % 5 ? 0 : i % 300).
+                arg(400000000 + i).toLatin1();
+        return ba;
+    }
+
+    // Historical lines: {paper_no, datetime, open, high, low, close, volume}
+    QByteArray makeHistBlock ( int lines )
+    {
+        QByteArray ba;
+        for ( int i = 0; i < lines; ++i )
+            ba += QString("%1|%2/%3/2012 %4:%5:00|%6.5|%7.25|%8.75|%9.5|%10|\r\n").
+                arg(40000 + i % 300).
+                arg(1 + i % 12, 2, 10, QChar('0')).arg(1 + i % 28, 2, 10, QChar('0')).
+                arg(10 + i % 9, 2, 10, QChar('0')).arg(i % 60, 2, 10, QChar('0')).
+                arg(100 + i % 50).arg(101 + i % 50).arg(99 + i % 50).arg(100 + i % 50).
+                arg(i * 10).toLatin1();
+        return ba;
+    }
+
+    // Wide lines like balance or papers snapshot: 35 columns
+    QByteArray makeWideBlock ( int lines )
+    {
+        QByteArray ba;
+        for ( int i = 0; i < lines; ++i ) {
+            QByteArray line;
+            for ( int c = 0; c < 35; ++c )
+                line += (c % 3 ? QByteArray::number(i * 35 + c) :
+                                 QByteArray("CODE") + QByteArray::number(c)) + "|";
+            ba += line + "\r\n";
+        }
+        return ba;
+    }
+
+    double oldWide ( QTextCodec* codec, const QByteArray& block )
+    {
+        double sum = 0;
+        QStringList lines = codec->toUnicode(block).split("\n", QString::SkipEmptyParts);
+        for ( QStringList::Iterator it = lines.begin();
+              it != lines.end(); ++it ) {
+            QStringList cols = (*it).split("|");
+            if ( cols.size() < 35 )
+                continue;
+            bool ok = false;
+            sum += cols[4].toDouble(&ok) + cols[9].toInt(&ok) + cols[34].toDouble(&ok);
+        }
+        return sum;
+    }
+
+    double tokenizerWide ( const QByteArray& block )
+    {
+        double sum = 0;
+        ADLineTokenizer lines( block.constData(), block.size() );
+        ADTextRange line;
+        while ( lines.next(line) ) {
+            ADColumnTokenizer cols( line );
+            if ( cols.size() < 35 )
+                continue;
+            bool ok = false;
+            sum += ADTextParser::toDouble(cols[4], &ok) +
+                   ADTextParser::toInt(cols[9], &ok) +
+                   ADTextParser::toDouble(cols[34], &ok);
+        }
+        return sum;
+    }
+
+    double indexWide ( const QByteArray& block )
+    {
+        double sum = 0;
+        ADBlockIndex index( block.constData(), block.size() );
+        ADColumnTokenizer cols;
+        while ( index.next(cols) ) {
+            if ( cols.size() < 35 )
+                continue;
+            bool ok = false;
+            sum += ADTextParser::toDouble(cols[4], &ok) +
+                   ADTextParser::toInt(cols[9], &ok) +
+                   ADTextParser::toDouble(cols[34], &ok);
+        }
+        return sum;
+    }
+
+    double oldQueue ( QTextCodec* codec, const QByteArray& block )
+    {
+        double sum = 0;
+        QStringList lines = codec->toUnicode(block).split("\n", QString::SkipEmptyParts);
+        for ( QStringList::Iterator it = lines.begin();
+              it != lines.end(); ++it ) {
+            QStringList cols = (*it).split("|");
+            if ( cols.size() < 4 )
+                continue;
+            bool ok = false;
+            sum += cols[0].toInt(&ok);
+            sum += cols[1].toFloat(&ok);
+            sum += cols[2].toInt(&ok);
+            sum += cols[3].toInt(&ok);
+        }
+        return sum;
+    }
+
+    double newQueue ( const QByteArray& block )
+    {
+        double sum = 0;
+        ADBlockIndex index( block.constData(), block.size() );
+        ADColumnTokenizer cols;
+        while ( index.next(cols) ) {
+            if ( cols.size() < 4 )
+                continue;
+            bool ok = false;
+            sum += ADTextParser::toInt(cols[0], &ok);
+            sum += ADTextParser::toFloat(cols[1], &ok);
+            sum += ADTextParser::toInt(cols[2], &ok);
+            sum += ADTextParser::toInt(cols[3], &ok);
+        }
+        return sum;
+    }
+
+    double oldHist ( QTextCodec* codec, const QByteArray& block )
+    {
+        double sum = 0;
+        QStringList lines = codec->toUnicode(block).split("\n", QString::SkipEmptyParts);
+        for ( QStringList::Iterator it = lines.begin();
+              it != lines.end(); ++it ) {
+            QStringList cols = (*it).split("|");
+            if ( cols.size() < 7 )
+                continue;
+            bool ok = false;
+            sum += cols[0].toInt(&ok);
+            QDateTime dt = QDateTime::fromString(cols[1], "MM/dd/yyyy hh:mm:ss");
+            sum += dt.time().minute();
+            for ( int i = 2; i < 7; ++i )
+                sum += cols[i].toDouble(&ok);
+        }
+        return sum;
+    }
+
+    double newHist ( const QByteArray& block )
+    {
+        double sum = 0;
+        ADBlockIndex index( block.constData(), block.size() );
+        ADColumnTokenizer cols;
+        while ( index.next(cols) ) {
+            if ( cols.size() < 7 )
+                continue;
+            bool ok = false;
+            sum += ADTextParser::toInt(cols[0], &ok);
+            qint64 ms = ADTextParser::toMSecsSinceEpoch(cols[1], ADTextParser::MonthDayYear, &ok);
+            sum += (ms / 60000) % 60;
+            for ( int i = 2; i < 7; ++i )
+                sum += ADTextParser::toDouble(cols[i], &ok);
+        }
+        return sum;
+    }
+
+    void report ( const char* name, int lines, int iters,
+                  qint64 oldNs, qint64 newNs, double oldSum, double newSum )
+    {
+        double total = double(lines) * iters;
+        printf("%-8s old: %8.1f ns/line  new: %8.1f ns/line  speedup: %5.2fx%s\n",
+               name, oldNs / total, newNs / total,
+               newNs ? double(oldNs) / newNs : 0.0,
+               oldSum == newSum ? "" : "  (results differ!)");
+    }
+}
+
+/****************************************************************************/
+
+int main ( int argc, char** argv )
+{
+    QCoreApplication app( argc, argv );
+
+    int iters = (argc > 1 ? QString(argv[1]).toInt() : 200);
+    if ( iters <= 0 )
+        iters = 200;
+
+    QTextCodec* codec = QTextCodec::codecForName("Windows-1251");
+    if ( ! codec ) {
+        printf("Windows-1251 codec is not found\n");
+        return 1;
+    }
+
+    const int Lines = 1000;
+    QByteArray queue = makeQueueBlock( Lines );
+    QByteArray hist = makeHistBlock( Lines );
+    QElapsedTimer timer;
+    double oldSum = 0, newSum = 0;
+    qint64 oldNs = 0, newNs = 0;
+
+    timer.start();
+    for ( int i = 0; i < iters; ++i )
+        oldSum += oldQueue( codec, queue );
+    oldNs = timer.nsecsElapsed();
+    timer.start();
+    for ( int i = 0; i < iters; ++i )
+        newSum += newQueue( queue );
+    newNs = timer.nsecsElapsed();
+    report( "queue", Lines, iters, oldNs, newNs, oldSum, newSum );
+
+    oldSum = newSum = 0;
+    timer.start();
+    for ( int i = 0; i < iters; ++i )
+        oldSum += oldHist( codec, hist );
+    oldNs = timer.nsecsElapsed();
+    timer.start();
+    for ( int i = 0; i < iters; ++i )
+        newSum += newHist( hist );
+    newNs = timer.nsecsElapsed();
+    report( "history", Lines, iters, oldNs, newNs, oldSum, newSum );
+
+    QByteArray wide = makeWideBlock( Lines );
+    double tokSum = 0;
+    qint64 tokNs = 0;
+    oldSum = newSum = 0;
+    timer.start();
+    for ( int i = 0; i < iters; ++i )
+        oldSum += oldWide( codec, wide );
+    oldNs = timer.nsecsElapsed();
+    timer.start();
+    for ( int i = 0; i < iters; ++i )
+        tokSum += tokenizerWide( wide );
+    tokNs = timer.nsecsElapsed();
+    timer.start();
+    for ( int i = 0; i < iters; ++i )
+        newSum += indexWide( wide );
+    newNs = timer.nsecsElapsed();
+    report( "wide/tok", Lines, iters, oldNs, tokNs, oldSum, tokSum );
+    report( "wide/idx", Lines, iters, oldNs, newNs, oldSum, newSum );
+
+    return 0;
+}
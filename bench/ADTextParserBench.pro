@@ -0,0 +1,20 @@
+TARGET = ADTextParserBench
+QT -= gui
+CONFIG += warn_on console release
+
+LEVEL = ..
+
+!include($$LEVEL/AlfaDirectAPI.pri):error("Can't load AlfaDirectAPI.pri")
+
+TEMPLATE = app
+
+INCLUDEPATH += $$LEVEL/src
+
+HEADERS += \
+           $$LEVEL/src/ADTextParser.h \
+           $$LEVEL/src/ADPrice.h \
+
+SOURCES += \
+           ADTextParserBench.cpp \
+           $$LEVEL/src/ADTextParser.cpp \
+           $$LEVEL/src/ADPrice.cpp \
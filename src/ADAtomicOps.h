@@ -72,6 +72,49 @@ __inline atomic32_t __stdcall atomic_swap32 ( volatile atomic32_t* dst, atomic32
     return  __sync_lock_test_and_set(dst, val);
 }
 
+__inline atomic32_t __stdcall atomic_or32 ( volatile atomic32_t* dst, atomic32_t val )
+{
+    return __sync_fetch_and_or(dst, val);
+}
+
+/* Plain load without locked instruction, use barriers around */
+__inline atomic32_t __stdcall atomic_load32 ( const volatile atomic32_t* src )
+{
+    return *src;
+}
+
+/* x86 does not reorder loads with loads and stores with stores */
+__inline void __stdcall atomic_rmb ( void )
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+__inline void __stdcall atomic_wmb ( void )
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+/* Spin wait hint, lets sibling hyperthread run and avoids pipeline
+ * flush on memory order violation when the awaited value changes */
+__inline void __stdcall atomic_cpu_relax ( void )
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
 #undef __inline
 
 /*
@@ -93,6 +136,8 @@ __inline atomic32_t __stdcall atomic_swap32 ( volatile atomic32_t* dst, atomic32
 #pragma intrinsic(_InterlockedIncrement64)
 #pragma intrinsic(_InterlockedDecrement)
 #pragma intrinsic(_InterlockedDecrement64)
+#pragma intrinsic(_InterlockedOr)
+#pragma intrinsic(_ReadWriteBarrier)
 
 typedef unsigned int atomic32_t;
 typedef unsigned __int64 atomic64_t;
@@ -157,6 +202,35 @@ __inline atomic32_t __stdcall atomic_swap32 ( volatile atomic32_t* dst, atomic32
     return (atomic32_t)_InterlockedExchange(dst, swap);
 }
 
+__inline atomic32_t __stdcall atomic_or32 ( volatile atomic32_t* dst, atomic32_t val )
+{
+    return (atomic32_t)_InterlockedOr((volatile long*)dst, val);
+}
+
+__inline atomic32_t __stdcall atomic_load32 ( const volatile atomic32_t* src )
+{
+    return *src;
+}
+
+__inline void __stdcall atomic_rmb ( void )
+{
+    _ReadWriteBarrier();
+}
+
+__inline void __stdcall atomic_wmb ( void )
+{
+    _ReadWriteBarrier();
+}
+
+__inline void __stdcall atomic_cpu_relax ( void )
+{
+#if defined(_M_IX86) || defined(_M_X64)
+    _mm_pause();
+#else
+    _ReadWriteBarrier();
+#endif
+}
+
 #endif
 
 #endif //ATOMICOPS_H
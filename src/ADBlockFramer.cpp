@@ -0,0 +1,132 @@
+#include <string.h>
+
+#include <QTextCodec>
+
+#include "ADBlockFramer.h"
+
+/****************************************************************************/
+
+static const char s_lineEnd[] = "\r\n";
+static const char s_blockEnd[] = "\r\n\r\n";
+
+static int indexOf ( const char* buff, int from, int size,
+                     const char* pattern, int patternSize )
+{
+    while ( from + patternSize <= size ) {
+        const char* first = static_cast<const char*>(
+            ::memchr(buff + from, pattern[0], size - from - patternSize + 1) );
+        if ( first == 0 )
+            return -1;
+        if ( ::memcmp(first + 1, pattern + 1, patternSize - 1) == 0 )
+            return first - buff;
+        from = first - buff + 1;
+    }
+    return -1;
+}
+
+/****************************************************************************/
+
+ADBlockFramer::ADBlockFramer () :
+    m_codec(0),
+    m_scanPos(0)
+{}
+
+void ADBlockFramer::setCodec ( QTextCodec* codec )
+{
+    m_codec = codec;
+}
+
+void ADBlockFramer::clear ()
+{
+    m_buff.clear();
+    m_scanPos = 0;
+}
+
+void ADBlockFramer::append ( const char* data, int size )
+{
+    m_buff.append( data, size );
+}
+
+void ADBlockFramer::append ( const QByteArray& data )
+{
+    // Share, do not copy, if there is no pending tail
+    if ( m_buff.isEmpty() )
+        m_buff = data;
+    else
+        m_buff.append( data );
+}
+
+int ADBlockFramer::pendingSize () const
+{
+    return m_buff.size();
+}
+
+bool ADBlockFramer::takeBlocks ( QList<ADConnection::DataBlock>& blocks )
+{
+    const int lineEndSize = sizeof(s_lineEnd) - 1;
+    const int blockEndSize = sizeof(s_blockEnd) - 1;
+    const char* buff = m_buff.constData();
+    const int size = m_buff.size();
+    int blockBeg = 0;
+    int blockEnd = -1;
+    int count = 0;
+
+    while ( (blockEnd = indexOf(buff, qMax(blockBeg, m_scanPos), size,
+                                s_blockEnd, blockEndSize)) != -1 ) {
+        // Skip empty blocks
+        if ( blockEnd > blockBeg ) {
+            ADConnection::DataBlock block;
+            int nameEnd = indexOf( buff, blockBeg, blockEnd,
+                                   s_lineEnd, lineEndSize );
+            // Block with empty body
+            if ( nameEnd == -1 ) {
+                nameEnd = blockEnd;
+                block.dataOffset = blockEnd;
+            }
+            else
+                block.dataOffset = nameEnd + lineEndSize;
+
+            block.dataSize = blockEnd - block.dataOffset;
+            block.storage = m_buff;
+            if ( m_codec )
+                block.blockName = m_codec->toUnicode( buff + blockBeg,
+                                                      nameEnd - blockBeg );
+            else
+                block.blockName = QString::fromLatin1( buff + blockBeg,
+                                                       nameEnd - blockBeg );
+
+            // Classify stream by first '*tag*' of the name
+            const char* tagBeg = static_cast<const char*>(
+                ::memchr(buff + blockBeg, '*', nameEnd - blockBeg) );
+            const char* tagEnd = ( tagBeg == 0 ? 0 :
+                static_cast<const char*>(
+                    ::memchr(tagBeg + 1, '*', buff + nameEnd - tagBeg - 1)) );
+            if ( tagEnd ) {
+                int tagLen = tagEnd - tagBeg + 1;
+                block.streamTag = QString::fromLatin1( tagBeg, tagLen );
+                block.streamId = ADConnection::streamIdByTag( tagBeg, tagLen );
+            }
+            blocks.append( block );
+            ++count;
+        }
+        blockBeg = blockEnd + blockEndSize;
+    }
+
+    // Nothing is complete, next time continue search from the tail
+    if ( blockBeg == 0 ) {
+        m_scanPos = qMax( 0, size - blockEndSize + 1 );
+        return false;
+    }
+
+    // Move incomplete tail to the fresh chunk. Complete blocks keep
+    // the old one alive.
+    if ( blockBeg == size )
+        m_buff = QByteArray();
+    else
+        m_buff = QByteArray( buff + blockBeg, size - blockBeg );
+    m_scanPos = qMax( 0, m_buff.size() - blockEndSize + 1 );
+
+    return (count != 0);
+}
+
+/****************************************************************************/
@@ -0,0 +1,42 @@
+#ifndef ADBLOCKFRAMER_H
+#define ADBLOCKFRAMER_H
+
+#include <QByteArray>
+#include <QList>
+
+#include "ADConnection.h"
+
+/**
+ * Splits decoded AD stream into blocks ("name\r\nbody\r\n\r\n").
+ * Works on raw Windows-1251 bytes: received data is appended to
+ * growable chunk, every complete block is returned as a view
+ * (offset and size) into this chunk, which is shared between all
+ * blocks of one chunk by QByteArray refcounting. Block bodies are
+ * never copied, only incomplete tail is moved to the next chunk.
+ */
+class ADBlockFramer
+{
+public:
+    ADBlockFramer ();
+
+    /** Codec for block names. Bodies are kept raw. */
+    void setCodec ( class QTextCodec* );
+
+    void clear ();
+    void append ( const char* data, int size );
+    void append ( const QByteArray& data );
+
+    /** Returns size of buffered data, which is not a complete block yet */
+    int pendingSize () const;
+
+    /** Appends all complete blocks to the list, returns false if none */
+    bool takeBlocks ( QList<ADConnection::DataBlock>& blocks );
+
+private:
+    class QTextCodec* m_codec;
+    QByteArray m_buff;
+    // Offset to continue terminator search from
+    int m_scanPos;
+};
+
+#endif //ADBLOCKFRAMER_H
@@ -1,9 +1,16 @@
+#ifdef _WIN_
+  #include <windows.h>
+#else
+  #include <stdio.h>
+#endif
+
 #include <QString>
 #include <QDir>
 #include <QList>
 #include <QPair>
 #include <QFile>
 #include <QCoreApplication>
+#include <QMutex>
 
 #include "ADBootstrap.h"
 
@@ -26,9 +33,30 @@ static const QList<BootPair> s_bootBins = QList<BootPair>()
 #endif
        ;
 
+// Binaries are mapped by running (warm) servers, so they are not
+// rewritten after first successful bootstrap
+static QMutex s_bootstrapLock;
+static bool s_bootstrapped = false;
+
 /******************************************************************************/
 
-bool ADBootstrap::bootstrap ()
+// Atomically replaces dst with src, so there is no moment when
+// binary is missing for a server which is being started
+static bool replaceFile ( const QString& src, const QString& dst )
+{
+#ifdef _WIN_
+    return ::MoveFileExW( (LPCWSTR)QDir::toNativeSeparators(src).utf16(),
+                          (LPCWSTR)QDir::toNativeSeparators(dst).utf16(),
+                          MOVEFILE_REPLACE_EXISTING ) != 0;
+#else
+    return ::rename( QFile::encodeName(src).constData(),
+                     QFile::encodeName(dst).constData() ) == 0;
+#endif
+}
+
+/******************************************************************************/
+
+static bool doBootstrap ()
 {
     bool res = false;
 
@@ -56,19 +84,40 @@ bool ADBootstrap::bootstrap ()
             return res;
         }
 
-        QFile out( bootstrapDir.absolutePath() + "/" + bin.first );
-        res = out.open( QFile::WriteOnly );
+        QByteArray ba = in.readAll();
+        QString path = bootstrapDir.absolutePath() + "/" + bin.first;
+
+        // Skip binary if it is already up to date
+        QFile cur( path );
+        if ( cur.size() == ba.size() && cur.open(QFile::ReadOnly) &&
+             cur.readAll() == ba ) {
+            cur.close();
+            res = cur.setPermissions( bin.second );
+            if ( ! res ) {
+                qWarning("Setting executable permission for bootstrap bin '%s' failed",
+                         qPrintable(bin.first));
+                return res;
+            }
+            continue;
+        }
+        cur.close();
+
+        // Write to temp file and replace binary, so running servers
+        // keep mapping of old one
+        QFile out( path + ".tmp" );
+        res = out.open( QFile::WriteOnly | QFile::Truncate );
         if ( ! res ) {
             qWarning("Can't write bootstap bin '%s'",
                      qPrintable(bin.first));
             return res;
         }
 
-        QByteArray ba = in.readAll();
         qint64 size = out.write( ba );
+        out.close();
         if ( ba.size() != size ) {
             qWarning("Write to bootstrap bin '%s' failed",
                      qPrintable(bin.first));
+            out.remove();
             return false;
         }
 
@@ -77,6 +126,15 @@ bool ADBootstrap::bootstrap ()
         if ( ! res ) {
             qWarning("Setting executable permission for bootstrap bin '%s' failed",
                      qPrintable(bin.first));
+            out.remove();
+            return res;
+        }
+
+        res = replaceFile( out.fileName(), path );
+        if ( ! res ) {
+            qWarning("Can't replace bootstrap bin '%s'",
+                     qPrintable(bin.first));
+            out.remove();
             return res;
         }
     }
@@ -84,6 +142,14 @@ bool ADBootstrap::bootstrap ()
     return true;
 }
 
+bool ADBootstrap::bootstrap ()
+{
+    QMutexLocker locker( &s_bootstrapLock );
+    if ( ! s_bootstrapped )
+        s_bootstrapped = doBootstrap();
+    return s_bootstrapped;
+}
+
 const char* ADBootstrap::bootstrapDir ()
 {
     return s_bootstrapDir.constData();
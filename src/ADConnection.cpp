@@ -1,6 +1,5 @@
 #include <QUrl>
 #include <QMetaType>
-#include <QReadLocker>
 #include <QCoreApplication>
 #include <QSqlQuery>
 #include <QSqlError>
@@ -14,12 +13,19 @@
 #include <QNetworkReply>
 #include <QSslConfiguration>
 #include <QAuthenticator>
+#include <QSocketNotifier>
+
+#include <string.h>
 
 #include "ADConnection.h"
 #include "ADSubscription.h"
 #include "ADOrder.h"
 #include "ADBootstrap.h"
 #include "ADTemplateParser.h"
+#include "ADBlockFramer.h"
+#include "ADTextParser.h"
+#include "ADQuoteSnapshots.h"
+#include "ADPaperInterest.h"
 
 #ifdef _WIN_
  #include "ADLocalLibrary.h"
@@ -103,119 +109,327 @@ namespace
 namespace ADBlockName
 {
     // Server time
-    const char* SRV_TIME = "*st*";
+    const char SRV_TIME[] = "*st*";
 
     // Broker response
-    const char* MSG_ID = "*opmsgid*";
+    const char MSG_ID[] = "*opmsgid*";
 
     // Orders queue for refresh rate: 0 (max), 1 (low)
-    const char* ORDERS_QU_INIT = "*qinit*";
-    const char* ORDERS_QU_0 = "*qu*";
-    const char* ORDERS_QU_1 = "*q1*";
+    const char ORDERS_QU_INIT[] = "*qinit*";
+    const char ORDERS_QU_0[] = "*qu*";
+    const char ORDERS_QU_1[] = "*q1*";
 
     // Quote for refresh rate: 0 (max), 1, 2, 3 (low)
-    const char* QUOTE_INIT = "*finit*";
-    const char* QUOTE_0 = "*f0*";
-    const char* QUOTE_1 = "*f1*";
-    const char* QUOTE_2 = "*f2*";
-    const char* QUOTE_3 = "*f3*";
+    const char QUOTE_INIT[] = "*finit*";
+    const char QUOTE_0[] = "*f0*";
+    const char QUOTE_1[] = "*f1*";
+    const char QUOTE_2[] = "*f2*";
+    const char QUOTE_3[] = "*f3*";
 
     // Papers
-    const char* PAPERS  = "*pap*";
+    const char PAPERS [] = "*pap*";
 
     // All trades
-    const char* ALL_TRADES = "*at*";
+    const char ALL_TRADES[] = "*at*";
 
     // Only MY trades
-    const char* MY_TRADES = "*tr*";
+    const char MY_TRADES[] = "*tr*";
 
     // MY orders
-    const char* MY_ORDERS = "*rq*";
+    const char MY_ORDERS[] = "*rq*";
 
     // Balance (position)
-    const char* BALANCE = "*bl*";
+    const char BALANCE[] = "*bl*";
+
+    // Historical quotes (NOT documented API): *ti<timeframe>-<request id>*
+    const char HIST_QUOTES[] = "*ti";
 
-    // Historical quotes (NOT documented API)
-    QRegExp HIST_QUOTES( "\\*ti(\\d+)-(\\d+)\\*\\|\\d+" );
+    bool parseHistQuotesTag ( const QString& tag, int& timeFrame,
+                              ADConnection::RequestId& reqId )
+    {
+        int dash = tag.indexOf('-');
+        if ( ! tag.startsWith(HIST_QUOTES) || dash < 0 )
+            return false;
+        bool ok1 = false, ok2 = false;
+        timeFrame = tag.mid(3, dash - 3).toInt(&ok1);
+        reqId = tag.mid(dash + 1, tag.size() - dash - 2).toUInt(&ok2);
+        return ok1 && ok2;
+    }
 }
 
 /****************************************************************************/
 
+ADConnection::DataBlock::DataBlock () :
+    streamId(UnknownStream),
+    dataOffset(0),
+    dataSize(0)
+{}
+
+QString ADConnection::DataBlock::blockData () const
+{
+    static QTextCodec* codec = QTextCodec::codecForName("Windows-1251");
+    if ( dataSize == 0 )
+        return QString();
+    if ( codec == 0 )
+        return QString::fromLatin1( rawDataPtr(), dataSize );
+    return codec->toUnicode( rawDataPtr(), dataSize );
+}
+
+QByteArray ADConnection::DataBlock::rawData () const
+{
+    return QByteArray::fromRawData( rawDataPtr(), dataSize );
+}
+
+const char* ADConnection::DataBlock::rawDataPtr () const
+{
+    return storage.constData() + dataOffset;
+}
+
+int ADConnection::DataBlock::rawDataSize () const
+{
+    return dataSize;
+}
+
 ADConnection::BidOffer::BidOffer () :
-    price(0.0),
     buyersQty(0),
     sellersQty(0)
 {}
 
-ADConnection::BidOffer::BidOffer ( float p, int b, int s ) :
+ADConnection::BidOffer::BidOffer ( ADPrice p, int b, int s ) :
     price(p),
     buyersQty(b),
     sellersQty(s)
 {}
 
+ADConnection::BookSide::BookSide ( ADConnection::BookSide::Order order ) :
+    m_order(order)
+{}
+
+const ADConnection::BookSide::Level* ADConnection::BookSide::best () const
+{
+    return (m_levels.isEmpty() ? 0 : m_levels.constData());
+}
+
+int ADConnection::BookSide::lowerBound ( ADPrice price ) const
+{
+    // First level which is not better than price
+    const Level* levels = m_levels.constData();
+    const qint64 key = price.value();
+    int lo = 0, hi = m_levels.size();
+    while ( lo < hi ) {
+        int mid = (lo + hi) / 2;
+        qint64 midKey = levels[mid].price.value();
+        bool better = (m_order == Ascending ? midKey < key : midKey > key);
+        if ( better )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int ADConnection::BookSide::qty ( ADPrice price ) const
+{
+    int i = lowerBound( price );
+    if ( i < m_levels.size() && m_levels.at(i).price == price )
+        return m_levels.at(i).qty;
+    return 0;
+}
+
+void ADConnection::BookSide::set ( ADPrice price, int qty )
+{
+    int i = lowerBound( price );
+    bool exists = (i < m_levels.size() && m_levels.at(i).price == price);
+    if ( qty > 0 ) {
+        if ( exists )
+            m_levels[i].qty = qty;
+        else {
+            Level level = { price, qty };
+            m_levels.insert( i, level );
+        }
+    }
+    else if ( exists )
+        m_levels.remove( i );
+}
+
+void ADConnection::BookSide::clear ()
+{
+    m_levels.clear();
+}
+
 ADConnection::Quote::Quote () :
     paperNo(0),
-    lastPrice(0.0)
+    buyers(BookSide::Descending),
+    sellers(BookSide::Ascending)
 {}
 
-float ADConnection::Quote::getBestSeller () const
+ADPrice ADConnection::Quote::getBestSeller () const
 {
-    if ( sellers.size() != 0 )
-        return sellers.begin().key();
-    else
-        return 0.0f;
+    const BookSide::Level* level = sellers.best();
+    return (level ? level->price : ADPrice());
 }
 
-float ADConnection::Quote::getBestBuyer () const
+ADPrice ADConnection::Quote::getBestBuyer () const
 {
-    if ( buyers.size() != 0 )
-        return (buyers.end()-1).key();
-    else
-        return 0.0f;
+    const BookSide::Level* level = buyers.best();
+    return (level ? level->price : ADPrice());
 }
 
-QString ADConnection::Quote::toStringBestSellers ( quint32 num ) const
+static QString bookSideToString ( const ADConnection::BookSide& side,
+                                  quint32 num )
 {
-    if ( num == 0 || sellers.size() == 0 )
-        return QString();
-    if ( num > (quint32)sellers.size() )
-        num = sellers.size();
+    if ( num > (quint32)side.size() )
+        num = side.size();
     QString ret;
-    QMap<float, int>::ConstIterator it = sellers.begin();
-    for ( quint32 i = 0; i < num; ++i, ++it ) {
+    for ( quint32 i = 0; i < num; ++i ) {
         bool lastElem = (i == num - 1);
-        ret += QString("%1(%2)%3").arg(it.key()).arg(it.value()).arg(lastElem ? "" : ",");
+        ret += QString("%1(%2)%3").arg(side[i].price.toString()).arg(side[i].qty).
+            arg(lastElem ? "" : ",");
     }
     return ret;
 }
 
+QString ADConnection::Quote::toStringBestSellers ( quint32 num ) const
+{
+    return bookSideToString( sellers, num );
+}
+
 QString ADConnection::Quote::toStringBestBuyers ( quint32 num ) const
 {
-    if ( num == 0 || buyers.size() == 0 )
-        return QString();
-    if ( num > (quint32)buyers.size() )
-        num = buyers.size();
-    QString ret;
-    QMap<float, int>::ConstIterator it = buyers.end() - 1;
-    for ( quint32 i = 0; i < num && it != buyers.end(); ++i, --it ) {
-        bool lastElem = (i == num - 1);
-        ret += QString("%1(%2)%3").arg(it.key()).arg(it.value()).arg(lastElem ? "" : ",");
+    return bookSideToString( buyers, num );
+}
+
+QVector<ADConnection::BidOffer> ADConnection::Quote::getBidOffers () const
+{
+    QVector<BidOffer> offers;
+    offers.reserve( buyers.size() + sellers.size() );
+
+    // Buyers are descending, so walk them from the end
+    int b = buyers.size() - 1, s = 0;
+    while ( b >= 0 || s < sellers.size() ) {
+        if ( s == sellers.size() ||
+             (b >= 0 && buyers[b].price < sellers[s].price) ) {
+            offers.append( BidOffer(buyers[b].price, buyers[b].qty, 0) );
+            --b;
+        }
+        else if ( b < 0 || sellers[s].price < buyers[b].price ) {
+            offers.append( BidOffer(sellers[s].price, 0, sellers[s].qty) );
+            ++s;
+        }
+        else {
+            offers.append( BidOffer(buyers[b].price, buyers[b].qty,
+                                    sellers[s].qty) );
+            --b;
+            ++s;
+        }
     }
-    return ret;
+    return offers;
+}
+
+ADConnection::QuoteDelta::QuoteDelta () :
+    paperNo(0),
+    seq(0),
+    reset(false),
+    lastPriceChanged(false)
+{}
+
+ADConnection::DepthJournal::DepthJournal () :
+    seq(1),
+    resetSeq(1),
+    lastPriceSeq(0),
+    head(0),
+    num(0)
+{}
+
+void ADConnection::DepthJournal::append ( const ADConnection::BidOffer& level )
+{
+    if ( num == ring.size() ) {
+        if ( ring.size() < DepthJournalSize ) {
+            // Grow, ring is unwrapped
+            QVector<DepthChange> grown( qMax<int>(DepthJournalMin, ring.size() * 2) );
+            for ( int i = 0; i < num; ++i )
+                grown[i] = at(i);
+            ring = grown;
+            head = 0;
+        }
+        else {
+            // Oldest is overwritten, who did not take it gets reset
+            resetSeq = at(0).seq;
+            head = (head + 1) & (ring.size() - 1);
+            --num;
+        }
+    }
+    DepthChange& change = ring[ (head + num) & (ring.size() - 1) ];
+    change.seq = ++seq;
+    change.level = level;
+    ++num;
+}
+
+void ADConnection::DepthJournal::clear ()
+{
+    head = 0;
+    num = 0;
+}
+
+void ADConnection::DepthJournal::trim ()
+{
+    // New consumer starts with reset, so only known ones keep changes
+    quint64 minSeq = seq;
+    QHash<ADSubscriptionPrivate*, quint64>::ConstIterator it = consumers.constBegin();
+    for ( ; it != consumers.constEnd(); ++it )
+        minSeq = qMin( minSeq, it.value() );
+
+    int taken = lowerBound( minSeq );
+    head = (num ? (head + taken) & (ring.size() - 1) : 0);
+    num -= taken;
+
+    // Memory is not kept for consumers which are caught up
+    if ( num == 0 && ring.size() > DepthJournalMin ) {
+        ring = QVector<DepthChange>();
+        head = 0;
+    }
+}
+
+int ADConnection::DepthJournal::lowerBound ( quint64 sinceSeq ) const
+{
+    // Changes are sorted by sequence
+    int lo = 0, hi = num;
+    while ( lo < hi ) {
+        int mid = (lo + hi) / 2;
+        if ( at(mid).seq <= sinceSeq )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+ADConnection::QuoteSnapshot::QuoteSnapshot () :
+    paperNo(0),
+    version(0),
+    timeMark(0),
+    buyersNum(0),
+    sellersNum(0)
+{}
+
+ADPrice ADConnection::QuoteSnapshot::getBestSeller () const
+{
+    return (sellersNum > 0 ? sellers[0].price : ADPrice());
+}
+
+ADPrice ADConnection::QuoteSnapshot::getBestBuyer () const
+{
+    return (buyersNum > 0 ? buyers[0].price : ADPrice());
 }
 
 ADConnection::HistoricalQuote::HistoricalQuote () :
     paperNo(0),
-    open(0.0),
-    high(0.0),
-    low(0.0),
-    close(0.0),
     volume(0.0)
 {}
 
 ADConnection::HistoricalQuote::HistoricalQuote (
-                                                int paperNo_, float open_, float high_, float low_,
-                                                float close_, float volume_, const QDateTime& dt_ ) :
+                                                int paperNo_, ADPrice open_, ADPrice high_, ADPrice low_,
+                                                ADPrice close_, float volume_, const QDateTime& dt_ ) :
     paperNo(paperNo_),
     open(open_),
     high(high_),
@@ -249,6 +463,22 @@ bool ADConnection::Position::isMoney () const
     return paperCode == "money";
 }
 
+ADConnection::LockStatistics::LockStatistics () :
+    contended(0),
+    waitUsecs(0)
+{}
+
+ADConnection::StartupStatistics::StartupStatistics () :
+    bootstrap(0),
+    libLoad(0),
+    dbOpen(0),
+    https(0),
+    sessionInfo(0),
+    tcpAuth(0),
+    connected(0),
+    firstQuote(0)
+{}
+
 ADConnection::LogParam::LogParam ( bool updateType_, const QDateTime& nowDt_,
                                    const ADFutures& fut_, const ADConnection::Quote& futQuote_,
                                    const ADOption& opt_, const ADConnection::Quote& optQuote_,
@@ -361,6 +591,57 @@ static ADConnection::Error ADSendHttpsRequest (
 
 /****************************************************************************/
 
+// Stage of connection startup, is executed by own thread or in place
+class StartupStage : public QThread
+{
+public:
+    typedef ADConnection::Error (ADConnection::*Func) ( StartupStage& );
+
+    StartupStage ( ADConnection* conn, Func func ) :
+        err(ADConnection::NoError),
+        msecs(0),
+        m_conn(conn),
+        m_func(func),
+        m_next(0)
+    {}
+
+    // Next stage depends on this one, so is executed by the same thread
+    void setNext ( StartupStage* next )
+    {
+        m_next = next;
+    }
+
+    void execute ()
+    {
+        ADConnection::TimeMark start, end;
+        ADConnection::timeMark( start );
+        err = (m_conn->*m_func)( *this );
+        ADConnection::timeMark( end );
+        msecs = ADConnection::msecsDiffTimeMark( start, end );
+
+        if ( err == ADConnection::NoError && m_next )
+            m_next->execute();
+    }
+
+    ADConnection::Error err;
+    quint32 msecs;
+    // Output of HTTPS stage
+    QString response;
+
+protected:
+    void run ()
+    {
+        execute();
+    }
+
+private:
+    ADConnection* m_conn;
+    Func m_func;
+    StartupStage* m_next;
+};
+
+/****************************************************************************/
+
 TcpReceiver::TcpReceiver ( ADConnection* conn, QTcpSocket& sock ) :
     m_conn(conn),
     m_sock(sock)
@@ -392,6 +673,12 @@ void TcpReceiver::pingTimer ()
     m_conn->sendPing();
 }
 
+void TcpReceiver::decodeReady ()
+{
+    // Decoded data is handled the same way as received
+    m_conn->tcpReadyRead( m_sock );
+}
+
 /****************************************************************************/
 
 SQLReceiver::SQLReceiver ( ADConnection* conn ) :
@@ -440,7 +727,7 @@ void GenericReceiver::onCancelOrder ( ADConnection::Order::Operation op )
 }
 
 void GenericReceiver::onChangeOrder ( ADConnection::Order::Operation op,
-                                      quint32 pos, float price )
+                                      quint32 pos, ADPrice price )
 {
     m_conn->changeOrder( op, pos, price );
 }
@@ -578,6 +865,26 @@ bool ADConnection::Request::wait ( unsigned long timeout /* = ULONG_MAX */ )
 
 /****************************************************************************/
 
+void ADConnection::setServerPoolSize ( unsigned int size )
+{
+#ifdef _WIN_
+    // AD lib is loaded into own process
+    Q_UNUSED(size);
+#else
+    ADRemoteLibrary::setServerPoolSize( size );
+#endif
+}
+
+void ADConnection::setServerKeepWarm ( bool keepWarm )
+{
+#ifdef _WIN_
+    // AD lib is loaded into own process
+    Q_UNUSED(keepWarm);
+#else
+    ADRemoteLibrary::setServerKeepWarm( keepWarm );
+#endif
+}
+
 quint64 ADConnection::msecsFromEpoch ()
 {
 #ifdef _WIN_
@@ -677,6 +984,67 @@ bool ADConnection::stringToTimeFrame ( const QString& str, TimeFrame& ti )
     return true;
 }
 
+ADConnection::StreamId ADConnection::streamIdByTag ( const char* tag, int len )
+{
+#define TAG_IS(name) \
+    (len == (int)sizeof(name) - 1 && ::memcmp(tag, name, len) == 0)
+
+    if ( len < 3 || tag[0] != '*' || tag[len - 1] != '*' )
+        return UnknownStream;
+
+    // Switch on first tag char, then exact compare
+    switch ( tag[1] ) {
+    case 's':
+        if ( TAG_IS(ADBlockName::SRV_TIME) )
+            return ServerTimeStream;
+        break;
+    case 'o':
+        if ( TAG_IS(ADBlockName::MSG_ID) )
+            return BrokerMessageStream;
+        break;
+    case 'q':
+        if ( TAG_IS(ADBlockName::ORDERS_QU_0) || TAG_IS(ADBlockName::ORDERS_QU_1) )
+            return OrdersQueueStream;
+        else if ( TAG_IS(ADBlockName::ORDERS_QU_INIT) )
+            return OrdersQueueInitStream;
+        break;
+    case 'f':
+        if ( len == 4 && tag[2] >= '0' && tag[2] <= '3' )
+            return QuoteStream;
+        else if ( TAG_IS(ADBlockName::QUOTE_INIT) )
+            return QuoteInitStream;
+        break;
+    case 'p':
+        if ( TAG_IS(ADBlockName::PAPERS) )
+            return PapersStream;
+        break;
+    case 'a':
+        if ( TAG_IS(ADBlockName::ALL_TRADES) )
+            return AllTradesStream;
+        break;
+    case 't':
+        if ( TAG_IS(ADBlockName::MY_TRADES) )
+            return MyTradesStream;
+        else if ( tag[2] == 'i' && len > 6 &&
+                  ::memchr(tag + 3, '-', len - 4) != 0 )
+            return HistQuotesStream;
+        break;
+    case 'r':
+        if ( TAG_IS(ADBlockName::MY_ORDERS) )
+            return MyOrdersStream;
+        break;
+    case 'b':
+        if ( TAG_IS(ADBlockName::BALANCE) )
+            return BalanceStream;
+        break;
+    default:
+        break;
+    }
+    return UnknownStream;
+
+#undef TAG_IS
+}
+
 bool ADConnection::ADTimeToDateTime ( int lastUpdate, QDateTime& dt )
 {
     static const QDateTime dtFrom =
@@ -709,6 +1077,7 @@ ADConnection::ADConnection () :
     m_adLib( ADSmartPtr<ADLibrary>(new ADRemoteLibrary) ),
 #endif
     m_sock(0),
+    m_blockFramer( new ADBlockFramer ),
     m_authed(false),
     m_resendFilters(false),
     // Statistics
@@ -716,14 +1085,22 @@ ADConnection::ADConnection () :
     m_statTxNet(0),
     m_statRxDecoded(0),
     m_statTxEncoded(0),
+    m_startupMark(0),
+    m_tcpConnectMark(0),
     // Data
+    m_quoteSnapshots( new ADQuoteSnapshots ),
     m_ordersOperations( new QHash<RequestId, OrderOpWithPhase> ),
     m_requests( new QHash<RequestId, ADSmartPtr<RequestDataPrivate> > ),
     m_activeOrders( new QHash<Order::OrderId, ADSmartPtr<ADOrderPrivate> > ),
     m_inactiveOrders( new QHash<Order::OrderId, ADSmartPtr<ADOrderPrivate> > ),
     m_reqId(0),
-    m_subscriptions( new QList<ADSmartPtr<ADSubscriptionPrivate> > )
+    m_subscriptions( new QHash<ADSubscriptionPrivate*, ADSmartPtr<ADSubscriptionPrivate> > ),
+    m_paperInterest( new ADPaperInterest ),
+    m_askedPapers( new ADPaperInterest ),
+    m_deltaInterest( new ADPaperInterest )
 {
+    registerBlockHandlers();
+
 #ifdef DO_ALL_LOGGING
     m_mainLogFile = ADSmartPtr<QFile>( new QFile(QDir::currentPath() + "/dump.log") );
     if ( ! m_mainLogFile->open(QIODevice::WriteOnly | QIODevice::Append) ) {
@@ -734,6 +1111,7 @@ ADConnection::ADConnection () :
 
     qRegisterMetaType< ADConnection::DataBlock >( "ADConnection::DataBlock" );
     qRegisterMetaType< ADConnection::State >( "ADConnection::State" );
+    qRegisterMetaType< ADPrice >( "ADPrice" );
     qRegisterMetaType< ADConnection::Subscription::Type >( "ADConnection::Subscription::Type" );
     qRegisterMetaType< ADConnection::Order::OrderId >( "ADConnection::Order::OrderId" );
     qRegisterMetaType< ADConnection::RequestId >( "ADConnection::RequestId" );
@@ -754,7 +1132,8 @@ ADConnection::~ADConnection ()
     disconnect();
 
     // Drop subscriptions
-    QList<ADSmartPtr<ADSubscriptionPrivate> >::Iterator itSub = m_subscriptions->begin();
+    QHash<ADSubscriptionPrivate*, ADSmartPtr<ADSubscriptionPrivate> >::Iterator itSub =
+        m_subscriptions->begin();
     for ( ; itSub != m_subscriptions->end(); ++itSub ) {
         if ( (*itSub).countRefs() > 1 ) {
             qWarning("Connection is going to be destructed, but subscription is in use!");
@@ -763,10 +1142,15 @@ ADConnection::~ADConnection ()
     }
 
     delete m_subscriptions;
+    delete m_blockFramer;
     delete m_ordersOperations;
     delete m_requests;
     delete m_activeOrders;
     delete m_inactiveOrders;
+    delete m_quoteSnapshots;
+    delete m_paperInterest;
+    delete m_askedPapers;
+    delete m_deltaInterest;
 }
 
 bool ADConnection::connect ( const QString& login, const QString& passwd )
@@ -809,7 +1193,7 @@ bool ADConnection::serverTime ( QDateTime& srvTime ) const
         return false;
 
     // Lock
-    QReadLocker readLocker( &m_rwLock );
+    ADReadLocker readLocker( &m_rwLock );
     if ( ! m_srvTime.isValid() || ! m_srvTimeUpdate.isValid())
         return false;
 
@@ -844,13 +1228,77 @@ bool ADConnection::getNetworkStatistics (
     return true;
 }
 
+bool ADConnection::getStartupStatistics ( ADConnection::StartupStatistics& stats ) const
+{
+    if ( ! isConnected() )
+        return false;
+
+    // Lock
+    ADReadLocker rLocker( &m_rwLock );
+    stats = m_startupStats;
+
+    return true;
+}
+
+bool ADConnection::getLockStatistics ( ADConnection::LockDomain domain,
+                                       ADConnection::LockStatistics& stats ) const
+{
+    const ADStatRWLock* locks[ QuoteShards ];
+    int locksNum = 1;
+
+    switch ( domain ) {
+    case SubscriptionsLock:
+        locks[0] = &m_subscrLock;
+        break;
+    case OrdersLock:
+        locks[0] = &m_ordersLock;
+        break;
+    case PositionsLock:
+        locks[0] = &m_positionsLock;
+        break;
+    case QuotesLock:
+        // Sum of all shards
+        for ( int i = 0; i < QuoteShards; ++i )
+            locks[i] = &m_quoteShards[i].lock;
+        locksNum = QuoteShards;
+        break;
+    case GeneralLock:
+        locks[0] = &m_rwLock;
+        break;
+    default:
+        return false;
+    }
+
+    stats = LockStatistics();
+    for ( int i = 0; i < locksNum; ++i ) {
+        ADStatRWLock::Statistics st = locks[i]->statistics();
+        stats.contended += st.contended;
+        stats.waitUsecs += st.waitUsecs;
+    }
+
+    return true;
+}
+
+bool ADConnection::setStreamHandler ( ADConnection::StreamId id,
+                                      ADConnection::StreamHandler* handler )
+{
+    if ( id <= UnknownStream || id >= StreamIdCount )
+        return false;
+
+    // Lock
+    ADWriteLocker wLocker( &m_rwLock );
+    m_streamHandlers[ id ] = handler;
+
+    return true;
+}
+
 ADConnection::Subscription ADConnection::subscribeToQuotes (
                                                             const QList<ADConnection::Subscription::Options>& opts )
 {
     ADConnection::Subscription subscr;
 
     //Lock
-    QWriteLocker wLocker( &m_rwLock );
+    ADWriteLocker wLocker( &m_subscrLock );
 
     QSet<QString> filterKeysForAll;
 
@@ -881,22 +1329,101 @@ ADConnection::Subscription ADConnection::subscribeToQuotes (
         filterKeysForAll.unite( filterKeys );
     }
 
+    // Papers become interesting before filters are sent,
+    // so first lines after filters are not dropped
+    ADSmartPtr<ADSubscriptionPrivate> subscrPtr( new ADSubscriptionPrivate(this, opts) );
+    _indexSubscription( subscrPtr.getImpl() );
+
     bool sendRes = sendADFilters( QSet<QString>(), m_simpleFilter,
                                   filterKeysForAll, m_complexFilter );
     if ( ! sendRes ) {
         qWarning("Send AD filters failed!");
+        _unindexSubscription( subscrPtr.getImpl() );
         return subscr;
     }
 
-    ADSmartPtr<ADSubscriptionPrivate> subscrPtr( new ADSubscriptionPrivate(this, opts) );
     subscr.m_subscr = subscrPtr;
 
     // Append
-    m_subscriptions->append( subscrPtr );
+    m_subscriptions->insert( subscrPtr.getImpl(), subscrPtr );
 
     return subscr;
 }
 
+void ADConnection::_indexSubscription ( ADSubscriptionPrivate* subscr )
+{
+    // First options win for duplicated papers, as in subscription itself
+    QSet<int> indexed;
+    const QList<ADConnection::Subscription::Options>& opts = subscr->subscriptionOptions();
+    for ( int i = 0; i < opts.size(); ++i ) {
+        foreach ( int paperNo, opts[i].m_paperNos ) {
+            if ( indexed.contains(paperNo) )
+                continue;
+            indexed.insert(paperNo);
+
+            PaperSubscriber subscriber = { subscr, opts[i].m_subscrType };
+            PaperSubscribers& papers = m_paperSubscribers[paperNo];
+            if ( papers.subscribers.isEmpty() )
+                m_paperInterest->set( paperNo, true );
+            if ( (subscriber.subscrType & Subscription::DeltaSubscription) &&
+                 ! (papers.subscrTypeMask & Subscription::DeltaSubscription) ) {
+                // Lock
+                ADWriteLocker wLocker( &quoteShard(paperNo).lock );
+                m_deltaInterest->set( paperNo, true );
+            }
+            papers.subscrTypeMask |= subscriber.subscrType;
+            papers.subscribers.append( subscriber );
+        }
+    }
+}
+
+void ADConnection::_unindexSubscription ( ADSubscriptionPrivate* subscr )
+{
+    const QList<ADConnection::Subscription::Options>& opts = subscr->subscriptionOptions();
+    for ( int i = 0; i < opts.size(); ++i ) {
+        foreach ( int paperNo, opts[i].m_paperNos ) {
+            QHash<int, PaperSubscribers>::Iterator it = m_paperSubscribers.find(paperNo);
+            if ( it == m_paperSubscribers.end() )
+                continue;
+            PaperSubscribers& papers = *it;
+            quint32 removedType = 0;
+            // Rebuild mask from the rest
+            papers.subscrTypeMask = 0;
+            for ( int j = 0; j < papers.subscribers.size(); ) {
+                if ( papers.subscribers[j].subscr == subscr ) {
+                    removedType |= papers.subscribers[j].subscrType;
+                    papers.subscribers.remove(j);
+                }
+                else
+                    papers.subscrTypeMask |= papers.subscribers[j++].subscrType;
+            }
+            if ( removedType & Subscription::DeltaSubscription ) {
+                QuoteShard& shard = quoteShard(paperNo);
+                // Lock
+                ADWriteLocker wLocker( &shard.lock );
+                if ( ! (papers.subscrTypeMask & Subscription::DeltaSubscription) ) {
+                    // Journal is dropped, so it never misses changes
+                    // if paper is subscribed for deltas again
+                    m_deltaInterest->set( paperNo, false );
+                    shard.journals.remove( paperNo );
+                }
+                else {
+                    // Changes are not kept for gone consumer
+                    QHash<int, DepthJournal>::Iterator itJ = shard.journals.find( paperNo );
+                    if ( itJ != shard.journals.end() ) {
+                        itJ->consumers.remove( subscr );
+                        itJ->trim();
+                    }
+                }
+            }
+            if ( papers.subscribers.isEmpty() ) {
+                m_paperSubscribers.erase(it);
+                _updatePaperInterest( paperNo );
+            }
+        }
+    }
+}
+
 bool ADConnection::_unsubscribeToQuote ( const ADSmartPtr<ADSubscriptionPrivate>& subscr )
 {
     if ( ! subscr ) {
@@ -937,6 +1464,10 @@ bool ADConnection::_unsubscribeToQuote ( const ADSmartPtr<ADSubscriptionPrivate>
         filterKeysForAll.unite( filterKeys );
     }
 
+    // Filters are updated first, so papers which are left
+    // only in filters of this subscription become uninteresting
+    _unindexSubscription( subscr.getImpl() );
+
     return sendADFilters( QSet<QString>(), m_simpleFilter,
                           filterKeysForAll, m_complexFilter );
 }
@@ -1001,18 +1532,18 @@ bool ADConnection::requestHistoricalQuotes ( int paperNo,
     }
 
     // Lock
-    QWriteLocker wLocker( &m_rwLock );
+    ADWriteLocker wLocker( &m_ordersLock );
 
     // Iterate request
-    ++m_reqId;
+    RequestId reqId = ++m_reqId;
 
-    reqData->setRequestId(m_reqId);
+    reqData->setRequestId(reqId);
     req.m_reqData = reqData;
-    m_requests->insert(m_reqId, reqData);
+    m_requests->insert(reqId, reqData);
 
     QString cmd = QString("id=%1|ChartDataRequest\r\n"
                           "paper_no=%2&%3&from_date=%4&to_date=%5\r\n\r\n")
-        .arg(m_reqId)
+        .arg(reqId)
         .arg(paperNo)
         .arg(timeFrameStr)
         .arg(fromDt.toString("yyyy-MM-dd hh:ss"))
@@ -1024,17 +1555,31 @@ bool ADConnection::requestHistoricalQuotes ( int paperNo,
     // Write to server in latin1
     bool res = writeToSock( cmd.toLatin1() );
     if ( ! res ) {
-        m_requests->remove(m_reqId);
+        // Lock
+        wLocker.relock();
+        m_requests->remove(reqId);
     }
 
     return res;
 }
 
+int ADConnection::quoteShardIndex ( int paperNo )
+{
+    return static_cast<quint32>(paperNo) % QuoteShards;
+}
+
+ADConnection::QuoteShard& ADConnection::quoteShard ( int paperNo ) const
+{
+    return m_quoteShards[ quoteShardIndex(paperNo) ];
+}
+
 bool ADConnection::_getQuote ( int paperNo, ADConnection::Quote& quote ) const
 {
-    if ( ! m_quotes.contains(paperNo) )
+    const QHash<int, Quote>& quotes = quoteShard(paperNo).quotes;
+    QHash<int, Quote>::ConstIterator it = quotes.constFind( paperNo );
+    if ( it == quotes.constEnd() )
         return false;
-    quote = m_quotes[paperNo];
+    quote = *it;
     return true;
 }
 
@@ -1054,19 +1599,78 @@ bool ADConnection::_findOperationsByOrderId ( ADConnection::Order::OrderId order
     return ret;
 }
 
+void ADConnection::wantPaper ( int paperNo ) const
+{
+    // Fast path, paper was asked before
+    if ( m_askedPapers->test(paperNo) )
+        return;
+
+    // Lock
+    ADWriteLocker wLocker( &m_subscrLock );
+    m_askedPapers->set( paperNo, true );
+    m_paperInterest->set( paperNo, true );
+}
+
+void ADConnection::_updatePaperInterest ( int paperNo )
+{
+    QString key = QString("%1").arg(paperNo);
+    bool interested = m_paperSubscribers.contains(paperNo) ||
+                      m_askedPapers->test(paperNo) ||
+                      m_complexFilter.value("filter_q").contains(key) ||
+                      m_complexFilter.value("filter_f").contains(key);
+    m_paperInterest->set( paperNo, interested );
+}
+
 bool ADConnection::getQuote ( int paperNo, ADConnection::Quote& quote ) const
 {
+    wantPaper( paperNo );
+
     // Lock
-    QReadLocker readLocker( &m_rwLock );
+    ADReadLocker readLocker( &quoteShard(paperNo).lock );
     return _getQuote(paperNo, quote);
 }
 
+bool ADConnection::_getQuoteSnapshot ( int paperNo,
+                                       ADConnection::QuoteSnapshot& snapshot ) const
+{
+    // No locks, snapshots are seqlocked
+    return m_quoteSnapshots->read(paperNo, snapshot);
+}
+
+bool ADConnection::getQuoteSnapshot ( int paperNo,
+                                      ADConnection::QuoteSnapshot& snapshot ) const
+{
+    wantPaper( paperNo );
+    return _getQuoteSnapshot(paperNo, snapshot);
+}
+
+bool ADConnection::readDepth ( int paperNo, int depth,
+                               ADConnection::DepthHeader& header,
+                               ADConnection::BookSide::Level* buyers,
+                               ADConnection::BookSide::Level* sellers ) const
+{
+    wantPaper( paperNo );
+
+    // No locks, snapshots are seqlocked
+    return m_quoteSnapshots->readDepth(paperNo, depth, header, buyers, sellers);
+}
+
+void ADConnection::setKeepAllQuotes ( bool keepAll )
+{
+    m_paperInterest->setKeepAll( keepAll );
+}
+
+bool ADConnection::isKeepAllQuotes () const
+{
+    return m_paperInterest->isKeepAll();
+}
+
 bool ADConnection::getPosition ( const QString& accCode,
                                  int paperNo,
                                  Position& pos ) const
 {
     // Lock
-    QReadLocker readLocker( &m_rwLock );
+    ADReadLocker readLocker( &m_positionsLock );
     if ( ! m_positions.contains(accCode) ||
          ! m_positions[accCode].contains(paperNo) )
         return false;
@@ -1441,7 +2045,7 @@ bool ADConnection::_sqlFindActiveOrders (
         Order::OrderId orderNo = query.value(0).toInt();
         QString status = query.value(1).toString();
         QString b_s = query.value(2).toString();
-        float price = query.value(3).toDouble();
+        ADPrice price = ADPrice::fromDouble( query.value(3).toDouble() );
         int qty = query.value(4).toInt();
         QString paperCode = query.value(5).toString();
         QDateTime dropDt = query.value(6).toDateTime();
@@ -1559,25 +2163,91 @@ bool ADConnection::_sqlExecSelect (
     return true;
 }
 
-void ADConnection::lockForRead ()
+void ADConnection::lockQuotesForRead ( int paperNo )
 {
-    m_rwLock.lockForRead();
+    quoteShard(paperNo).lock.lockForRead();
 }
 
-void ADConnection::unlock ()
+void ADConnection::unlockQuotes ( int paperNo )
 {
-    m_rwLock.unlock();
+    quoteShard(paperNo).lock.unlock();
 }
 
-ADConnection::Order::Operation ADConnection::changeOrder ( ADConnection::Order order,
-                                                           quint32 qty, float price )
+bool ADConnection::takeQuoteDelta ( int paperNo, ADSubscriptionPrivate* consumer,
+                                    ADConnection::QuoteDelta& delta )
 {
-    if ( ! order.m_order.isValid() )
-        return ADConnection::Order::Operation();
+    QuoteShard& shard = quoteShard(paperNo);
 
-    // Lock
-    QWriteLocker wLocker( &m_rwLock );
-    // Check active orders
+    // Lock, journal is trimmed by consumers
+    ADWriteLocker wLocker( &shard.lock );
+    QHash<int, Quote>::ConstIterator itQ = shard.quotes.constFind( paperNo );
+    if ( itQ == shard.quotes.constEnd() )
+        return false;
+
+    const Quote& quote = *itQ;
+    delta.paperNo = paperNo;
+    delta.lastPrice = quote.lastPrice;
+
+    QHash<int, DepthJournal>::Iterator itJ = shard.journals.find( paperNo );
+    if ( itJ == shard.journals.end() ) {
+        // Nothing changed since subscription, journal is not started yet
+        delta.seq = 0;
+        delta.reset = true;
+        delta.lastPriceChanged = true;
+        delta.levels = quote.getBidOffers();
+        return true;
+    }
+
+    DepthJournal& journal = *itJ;
+    quint64 sinceSeq = journal.consumers.value( consumer, 0 );
+    delta.seq = journal.seq;
+    delta.reset = (sinceSeq < journal.resetSeq);
+    delta.lastPriceChanged = (delta.reset || sinceSeq < journal.lastPriceSeq);
+    if ( delta.reset )
+        delta.levels = quote.getBidOffers();
+    else {
+        int first = journal.lowerBound( sinceSeq );
+        delta.levels.resize( journal.num - first );
+        for ( int i = first; i < journal.num; ++i )
+            delta.levels[i - first] = journal.at(i).level;
+    }
+
+    journal.consumers[consumer] = journal.seq;
+    journal.trim();
+    return true;
+}
+
+ADPrice ADConnection::orderPrice ( int paperNo, double price ) const
+{
+    ADPrice orderPrice = ADPrice::fromFloat( price );
+
+    // Price step is taken from published quote, no locks.
+    // Cached steps of m_priceSteps belong to connection thread.
+    DepthHeader header;
+    if ( readDepth(paperNo, 0, header, 0, 0) && ! header.priceStep.isZero() )
+        orderPrice = ADPrice::fromTicks( orderPrice.ticks(header.priceStep),
+                                         header.priceStep );
+    return orderPrice;
+}
+
+ADConnection::Order::Operation ADConnection::changeOrder ( ADConnection::Order order,
+                                                           quint32 qty, double price )
+{
+    if ( ! order.m_order.isValid() )
+        return ADConnection::Order::Operation();
+    return changeOrder( order, qty,
+                        orderPrice(order.m_order->getOrderPaperNo(), price) );
+}
+
+ADConnection::Order::Operation ADConnection::changeOrder ( ADConnection::Order order,
+                                                           quint32 qty, ADPrice price )
+{
+    if ( ! order.m_order.isValid() )
+        return ADConnection::Order::Operation();
+
+    // Lock
+    ADWriteLocker wLocker( &m_ordersLock );
+    // Check active orders
     if ( ! m_activeOrders->contains(order.m_order->getOrderId()) )
         return ADConnection::Order::Operation();
 
@@ -1622,7 +2292,7 @@ ADConnection::Order::Operation ADConnection::changeOrder ( ADConnection::Order o
 }
 
 void ADConnection::changeOrder ( ADConnection::Order::Operation op,
-                                 quint32 newQty, float newPrice )
+                                 quint32 newQty, ADPrice newPrice )
 {
     Q_ASSERT(op.isValid());
     ADSmartPtr<ADOrderPrivate> order = op.m_op->getOrder();
@@ -1636,7 +2306,7 @@ void ADConnection::changeOrder ( ADConnection::Order::Operation op,
         qWarning("Error: can't get template '%s'!", qPrintable(editOrderName));
 
         // Lock
-        QWriteLocker wLocker( &m_rwLock );
+        ADWriteLocker wLocker( &m_ordersLock );
         Q_ASSERT(m_ordersOperations->contains(reqId));
         OrderOpWithPhase orderPhasePtr = m_ordersOperations->take(reqId);
         // Back to accepted
@@ -1670,8 +2340,8 @@ void ADConnection::changeOrder ( ADConnection::Order::Operation op,
                             QString::fromUtf8("купить") :
                             QString::fromUtf8("продать"));
     QString operationCh = (order->getOrderType() == Order::Buy ? "B" : "S");
-    int priceInt = (int)order->getOrderPrice();
-    int newPriceInt = (int)newPrice;
+    int priceInt = (int)order->getOrderPrice().toDouble();
+    int newPriceInt = (int)newPrice.toDouble();
     QString XXX_portfolio = "XXX-0000";
 
     editOrderDoc = editOrderDocStr.
@@ -1698,7 +2368,7 @@ void ADConnection::changeOrder ( ADConnection::Order::Operation op,
     if ( ! signRes || data == 0 || size == 0 ) {
         qWarning("Error while sign!");
         // Lock
-        QWriteLocker wLocker( &m_rwLock );
+        ADWriteLocker wLocker( &m_ordersLock );
         Q_ASSERT(m_ordersOperations->contains(reqId));
         OrderOpWithPhase orderPhasePtr = m_ordersOperations->take(reqId);
         // Back to accepted
@@ -1752,7 +2422,7 @@ void ADConnection::changeOrder ( ADConnection::Order::Operation op,
     if ( ! res ) {
         qWarning("send failed!");
         // Lock
-        QWriteLocker wLocker( &m_rwLock );
+        ADWriteLocker wLocker( &m_ordersLock );
         Q_ASSERT(m_ordersOperations->contains(reqId));
         OrderOpWithPhase orderPhasePtr = m_ordersOperations->take(reqId);
         // Back to accepted
@@ -1779,7 +2449,7 @@ ADConnection::Order::Operation ADConnection::cancelOrder ( ADConnection::Order o
         return ADConnection::Order::Operation();
 
     // Lock
-    QWriteLocker wLocker( &m_rwLock );
+    ADWriteLocker wLocker( &m_ordersLock );
     // Check active orders
     if ( ! m_activeOrders->contains(order.m_order->getOrderId()) )
         return ADConnection::Order::Operation();
@@ -1838,7 +2508,7 @@ void ADConnection::cancelOrder ( ADConnection::Order::Operation op )
         qWarning("Error: can't get template '%s'!", qPrintable(killOrderName));
 
         // Lock
-        QWriteLocker wLocker( &m_rwLock );
+        ADWriteLocker wLocker( &m_ordersLock );
         Q_ASSERT(m_ordersOperations->contains(reqId));
         OrderOpWithPhase orderPhasePtr = m_ordersOperations->take(reqId);
         // Back to accepted
@@ -1869,7 +2539,7 @@ void ADConnection::cancelOrder ( ADConnection::Order::Operation op )
     QString operationStr = (order->getOrderType() == Order::Buy ?
                             QString::fromUtf8("Покупка") :
                             QString::fromUtf8("Продажа"));
-    int priceInt = (int)order->getOrderPrice();
+    int priceInt = (int)order->getOrderPrice().toDouble();
     QString XXX_portfolio = "XXX-0000";
 
     killOrderDoc = killOrderDocStr.
@@ -1892,7 +2562,7 @@ void ADConnection::cancelOrder ( ADConnection::Order::Operation op )
     if ( ! signRes || data == 0 || size == 0 ) {
         qWarning("Error while sign!");
         // Lock
-        QWriteLocker wLocker( &m_rwLock );
+        ADWriteLocker wLocker( &m_ordersLock );
         Q_ASSERT(m_ordersOperations->contains(reqId));
         OrderOpWithPhase orderPhasePtr = m_ordersOperations->take(reqId);
         // Back to accepted
@@ -1933,7 +2603,7 @@ void ADConnection::cancelOrder ( ADConnection::Order::Operation op )
     if ( ! res ) {
         qWarning("send failed!");
         // Lock
-        QWriteLocker wLocker( &m_rwLock );
+        ADWriteLocker wLocker( &m_ordersLock );
         Q_ASSERT(m_ordersOperations->contains(reqId));
         OrderOpWithPhase orderPhasePtr = m_ordersOperations->take(reqId);
         // Back to accepted
@@ -1959,10 +2629,10 @@ ADConnection::Order::Operation ADConnection::tradePaper (
     const QString& accCode,
     ADConnection::Order::Type tradeType,
     int paperNo,
-    quint32 qty, float price )
+    quint32 qty, ADPrice price )
 {
     // Lock
-    QWriteLocker wLocker( &m_rwLock );
+    ADWriteLocker wLocker( &m_ordersLock );
 
     // Iterate request
     RequestId reqId = ++m_reqId;
@@ -2003,6 +2673,17 @@ ADConnection::Order::Operation ADConnection::tradePaper (
     return ADConnection::Order::Operation(op);
 }
 
+ADConnection::Order::Operation ADConnection::tradePaper (
+    ADConnection::Order& orderOut,
+    const QString& accCode,
+    ADConnection::Order::Type tradeType,
+    int paperNo,
+    quint32 qty, double price )
+{
+    return tradePaper( orderOut, accCode, tradeType, paperNo, qty,
+                       orderPrice(paperNo, price) );
+}
+
 void ADConnection::tradePaper ( ADConnection::Order::Operation op )
 {
     Q_ASSERT(op.isValid());
@@ -2059,7 +2740,7 @@ void ADConnection::tradePaper ( ADConnection::Order::Operation op )
     dp.addParam("limits_check", "Y");
     dp.addParam("drop_cond", "Y");
     dp.addParam("ch_drop_time", order->getOrderDropDateTime().toString("dd/MM/yyyy hh:mm"));
-    dp.addParam("price", QString("%1").arg(order->getOrderPrice()));
+    dp.addParam("price", order->getOrderPrice().toString());
     dp.addParam("paper_qty", QString("%1").arg(order->getOrderQty()));
 
     // Get papers
@@ -2266,7 +2947,7 @@ void ADConnection::tradePaper ( ADConnection::Order::Operation op )
 
 err:
     // Lock
-    QWriteLocker wLocker( &m_rwLock );
+    ADWriteLocker wLocker( &m_ordersLock );
 
     Q_ASSERT(m_ordersOperations->contains(reqId));
     OrderOpWithPhase orderPhasePtr = m_ordersOperations->take(reqId);
@@ -2323,9 +3004,9 @@ bool ADConnection::sqlLogQuote ( bool isFutUpdate, const QDateTime& nowDt,
     query.bindValue(":log_dt", nowDt);
     query.bindValue(":fut_no", fut.paperNo);
     query.bindValue(":fut_code", fut.paperCode);
-    query.bindValue(":fut_last_price", futQuote.lastPrice);
-    query.bindValue(":fut_best_sell_price", futQuote.getBestSeller());
-    query.bindValue(":fut_best_buy_price", futQuote.getBestBuyer());
+    query.bindValue(":fut_last_price", futQuote.lastPrice.toDouble());
+    query.bindValue(":fut_best_sell_price", futQuote.getBestSeller().toDouble());
+    query.bindValue(":fut_best_buy_price", futQuote.getBestBuyer().toDouble());
     query.bindValue(":fut_sellers", futQuote.toStringBestSellers(4));
     query.bindValue(":fut_buyers", futQuote.toStringBestBuyers(4));
     query.bindValue(":opt_no", opt.paperNo);
@@ -2333,9 +3014,9 @@ bool ADConnection::sqlLogQuote ( bool isFutUpdate, const QDateTime& nowDt,
     query.bindValue(":opt_type", (opt.type == ADOption::Call ? "C" : "P"));
     query.bindValue(":opt_strike", opt.strike);
     query.bindValue(":opt_mat_dt", opt.matDate);
-    query.bindValue(":opt_last_price", optQuote.lastPrice);
-    query.bindValue(":opt_best_sell_price", optQuote.getBestSeller());
-    query.bindValue(":opt_best_buy_price", optQuote.getBestBuyer());
+    query.bindValue(":opt_last_price", optQuote.lastPrice.toDouble());
+    query.bindValue(":opt_best_sell_price", optQuote.getBestSeller().toDouble());
+    query.bindValue(":opt_best_buy_price", optQuote.getBestBuyer().toDouble());
     query.bindValue(":opt_sellers", optQuote.toStringBestSellers(4));
     query.bindValue(":opt_buyers", optQuote.toStringBestBuyers(4));
     query.bindValue(":opt_impl_vol", impl_vol);
@@ -2419,7 +3100,7 @@ bool ADConnection::getCachedTemplateDocument ( const QString& docName,
                                                QByteArray& doc )
 {
     // Lock
-    QReadLocker rdLocker( &m_rwLock );
+    ADReadLocker rdLocker( &m_rwLock );
     bool docExists = m_docTemplates.contains(docName);
     if ( docExists ) {
         doc = m_docTemplates[docName];
@@ -2448,7 +3129,7 @@ bool ADConnection::getCachedTemplateDocument ( const QString& docName,
     if ( query.next() ) {
         doc = query.value(0).toByteArray();
         // Lock
-        QWriteLocker wrLocker( &m_rwLock );
+        ADWriteLocker wrLocker( &m_rwLock );
         if ( m_docTemplates.contains(docName) )
             qWarning("Document template '%s' already stored!",
                      qPrintable(docName));
@@ -2547,7 +3228,7 @@ bool ADConnection::updateSessionInfo ( const QString& infoStr )
 
     // Set server time
     {
-        QWriteLocker wLocker( &m_rwLock );
+        ADWriteLocker wLocker( &m_rwLock );
         m_srvTime = info.serverTime;
         m_srvTimeUpdate = QDateTime::currentDateTime();
     }
@@ -2555,177 +3236,215 @@ bool ADConnection::updateSessionInfo ( const QString& infoStr )
     return true;
 }
 
-void ADConnection::run ()
+ADConnection::Error ADConnection::startupBootstrap ( StartupStage& )
 {
-    bool res = false;
-
-    QString login = m_login;
-    QString passwd = m_password;
+    bool res = ADBootstrap::bootstrap();
+    if ( ! res ) {
+        qWarning("bootstraping failed!");
+        return BootstrapError;
+    }
+    return NoError;
+}
 
-    // Drop states and flags
-    m_lastError = NoError;
-    m_state = DisconnectedState;
-    m_authed = false;
-    m_sockBuffer.clear();
-    m_sockEncBuffer.clear();
-    m_sessInfo = ADSessionInfo();
-    m_adDB = QSqlDatabase();
-    m_win1251Codec = QTextCodec::codecForName("Windows-1251");
+ADConnection::Error ADConnection::startupLoadLib ( StartupStage& )
+{
+    bool res = m_adLib->load();
+    if ( ! res ) {
+        qWarning("can't load dll!");
+        return DynamicLibLoadError;
+    }
+    m_adLib->resetDecodeStream();
 
-    // Check encoding support
-    if ( !m_win1251Codec ) {
-        qWarning("Error: can't find Windows-1251 encoding");
-        m_lastError = Windows1251DoesNotExistError;
-        goto clean;
+    char protoVer[ 256 ] = {0};
+    int size = sizeof(protoVer);
+    res = m_adLib->getProtocolVersion( protoVer, &size );
+    if ( ! res ) {
+        qWarning("call getProtoVersion returned false!");
+        return DynamicLibCallError;
     }
+    return NoError;
+}
 
-    // Do bootstraping
-    {
-        res = ADBootstrap::bootstrap();
-        if ( ! res ) {
-            qWarning("bootstraping failed!");
-            m_lastError = BootstrapError;
-            goto clean;
-        }
+ADConnection::Error ADConnection::startupOpenDB ( StartupStage& )
+{
+    // Default driver name
+    const QString DriverName = "QSQLITE";
+    QString dbResource;
+    QString dbPath;
+    bool dbShouldBeCreated = false;
+    bool res = false;
+
+    if ( DriverName == "QMYSQL" ) {
+        m_adDB = QSqlDatabase::addDatabase( DriverName );
+        m_adDB.setUserName( "root" );
+        m_adDB.setPassword( "" );
+        m_adDB.setDatabaseName( "ad");
+
+        dbResource = ":AD.mysql.sql";
     }
+    else {
+        // Create DB directory
+        QDir dbDir( QCoreApplication::applicationDirPath() + "/db" );
+        if ( ! dbDir.exists() ) {
+            res = dbDir.mkpath(dbDir.absolutePath());
+            if ( ! res ) {
+                qWarning("Can't create DB dir '%s'",
+                         qPrintable(dbDir.absolutePath()));
+                return SQLConnectError;
+            }
+        }
 
-    // Load library
-    {
-        res = m_adLib->load();
-        if ( ! res ) {
-            qWarning("can't load dll!");
-            m_lastError = DynamicLibLoadError;
-            goto clean;
+        if ( DriverName == "QSQLITE" ) {
+            dbPath = dbDir.absolutePath() + "/AD.db";
+            dbResource = ":AD.sqlite.sql";
         }
+        else if ( DriverName == "QIBASE" ) {
+            dbPath = dbDir.absolutePath() + "/AD.fdb";
+            dbResource = ":AD.firebird.sql";
+        }
+        else
+            Q_ASSERT(0);
+
+        dbShouldBeCreated = ! QFileInfo(dbPath).exists();
+
+        // Setup DB
+        m_adDB = QSqlDatabase::addDatabase( DriverName );
+        m_adDB.setDatabaseName( dbPath );
+
+        if ( DriverName == "QIBASE" )
+            m_adDB.setConnectOptions("ISC_DPB_LC_CTYPE=UTF-8");
     }
 
-    // Connect to DB
-    {
-        // Default driver name
-        const QString DriverName = "QSQLITE";
-        QString dbResource;
-        QString dbPath;
-        bool dbShouldBeCreated = false;
-
-        if ( DriverName == "QMYSQL" ) {
-            m_adDB = QSqlDatabase::addDatabase( DriverName );
-            m_adDB.setUserName( "root" );
-            m_adDB.setPassword( "" );
-            m_adDB.setDatabaseName( "ad");
-
-            dbResource = ":AD.mysql.sql";
+    // Try to fill DB
+    if ( dbShouldBeCreated ) {
+        //XXX For now we do not support DB population
+        //XXX with batch SQL statements, so return error
+        {
+            qWarning("DB '%s' does not exist!", qPrintable(dbPath));
+            return SQLConnectError;
         }
-        else {
-            // Create DB directory
-            QDir dbDir( QCoreApplication::applicationDirPath() + "/db" );
-            if ( ! dbDir.exists() ) {
-                res = dbDir.mkpath(dbDir.absolutePath());
-                if ( ! res ) {
-                    qWarning("Can't create DB dir '%s'",
-                             qPrintable(dbDir.absolutePath()));
-                    m_lastError = SQLConnectError;
-                    goto clean;
-                }
-            }
 
-            if ( DriverName == "QSQLITE" ) {
-                dbPath = dbDir.absolutePath() + "/AD.db";
-                dbResource = ":AD.sqlite.sql";
-            }
-            else if ( DriverName == "QIBASE" ) {
-                dbPath = dbDir.absolutePath() + "/AD.fdb";
-                dbResource = ":AD.firebird.sql";
-            }
-            else
-                Q_ASSERT(0);
+        QFile sqlFile( dbResource );
+        if ( ! sqlFile.open(QFile::ReadOnly) ) {
+            qWarning("Can't open SQL resource '%s' for DB creation!",
+                     qPrintable(dbResource));
+            return SQLConnectError;
+        }
+        QByteArray sqlData = sqlFile.readAll();
+        if ( sqlData.isEmpty() ) {
+            qWarning("Can't read SQL resource '%s' for DB creation!",
+                     qPrintable(dbResource));
+            return SQLConnectError;
+        }
 
-            dbShouldBeCreated = ! QFileInfo(dbPath).exists();
+        //XXX DB open should be made before any SQL execution
+    }
 
-            // Setup DB
-            m_adDB = QSqlDatabase::addDatabase( DriverName );
-            m_adDB.setDatabaseName( dbPath );
+    if ( ! m_adDB.open() ) {
+        qWarning("Can't open DB!");
+        return SQLConnectError;
+    }
 
-            if ( DriverName == "QIBASE" )
-                m_adDB.setConnectOptions("ISC_DPB_LC_CTYPE=UTF-8");
+    if ( m_adDB.driverName() == "QMYSQL" ) {
+        QSqlQuery ansiModeQuery( m_adDB );
+        if ( ! ansiModeQuery.exec("SET sql_mode='ANSI_QUOTES'") ) {
+            qWarning("SQL ERROR: %s %s", __FUNCTION__,
+                     qPrintable(ansiModeQuery.lastError().text()));
+            return SQLConnectError;
         }
+    }
 
-        // Try to fill DB
-        if ( dbShouldBeCreated ) {
-            //XXX For now we do not support DB population
-            //XXX with batch SQL statements, so return error
-            {
-                qWarning("DB '%s' does not exist!", qPrintable(dbPath));
-                m_lastError = SQLConnectError;
-                goto clean;
-            }
+    return NoError;
+}
 
-            QFile sqlFile( dbResource );
-            if ( ! sqlFile.open(QFile::ReadOnly) ) {
-                qWarning("Can't open SQL resource '%s' for DB creation!",
-                         qPrintable(dbResource));
-                m_lastError = SQLConnectError;
-                goto clean;
-            }
-            QByteArray sqlData = sqlFile.readAll();
-            if ( sqlData.isEmpty() ) {
-                qWarning("Can't read SQL resource '%s' for DB creation!",
-                         qPrintable(dbResource));
-                m_lastError = SQLConnectError;
-                goto clean;
-            }
+ADConnection::Error ADConnection::startupHttps ( StartupStage& stage )
+{
+    QString url("https://www.alfadirect.ru/ads/connect.idc?"
+                // Url from API doc.
+                //"vers=%1&cpcsp_eval=0&cpcsp_ver=3.6").arg(protoVer) );
+                //"vers=3.1.1.8&cpcsp_eval=0&cpcsp_ver=2.0.1.2089") );
+
+                //Url from AD terminal.
+                "vers=3.5.1.5&cpcsp_eval=0&cpcsp_ver=3.6");
+    // Send https request
+    return ADSendHttpsRequest(url, m_login, m_password, stage.response);
+}
 
-            //XXX DB open should be made before any SQL execution
-        }
+void ADConnection::run ()
+{
+    bool res = false;
 
-        if ( ! m_adDB.open() ) {
-            qWarning("Can't open DB!");
-            m_lastError = SQLConnectError;
-            goto clean;
-        }
+    QString login = m_login;
+    QString passwd = m_password;
 
-        if ( m_adDB.driverName() == "QMYSQL" ) {
-            QSqlQuery ansiModeQuery( m_adDB );
-            if ( ! ansiModeQuery.exec("SET sql_mode='ANSI_QUOTES'") ) {
-                qWarning("SQL ERROR: %s %s", __FUNCTION__,
-                         qPrintable(ansiModeQuery.lastError().text()));
-                goto clean;
-            }
-        }
+    timeMark( m_startupMark );
+    {
+        ADWriteLocker wLocker( &m_rwLock );
+        m_startupStats = StartupStatistics();
     }
 
-    // Get session info through HTTPS
-    {
-        char protoVer[ 256 ] = {0};
-        int size = sizeof(protoVer);
-        res = m_adLib->getProtocolVersion( protoVer, &size );
-        if ( ! res ) {
-            qWarning("call getProtoVersion returned false!");
-            m_lastError = DynamicLibCallError;
-            goto clean;
-        }
+    // Drop states and flags
+    m_lastError = NoError;
+    m_state = DisconnectedState;
+    m_authed = false;
+    m_blockFramer->clear();
+    m_sessInfo = ADSessionInfo();
+    m_adDB = QSqlDatabase();
+    m_win1251Codec = QTextCodec::codecForName("Windows-1251");
+    m_blockFramer->setCodec( m_win1251Codec );
 
-        QString url("https://www.alfadirect.ru/ads/connect.idc?"
-                    // Url from API doc.
-                    //"vers=%1&cpcsp_eval=0&cpcsp_ver=3.6").arg(protoVer) );
-                    //"vers=3.1.1.8&cpcsp_eval=0&cpcsp_ver=2.0.1.2089") );
+    // Check encoding support
+    if ( !m_win1251Codec ) {
+        qWarning("Error: can't find Windows-1251 encoding");
+        m_lastError = Windows1251DoesNotExistError;
+        goto clean;
+    }
 
-                    //Url from AD terminal.
-                    "vers=3.5.1.5&cpcsp_eval=0&cpcsp_ver=3.6");
-        // Send https request
-        QString response;
-        Error err = ADSendHttpsRequest(url, m_login, m_password, response);
-        if ( err != NoError ) {
-            m_lastError = err;
+    // Startup stages: library, DB and HTTPS do not depend on each other,
+    // so are executed concurrently. DB connection can be used only by the
+    // thread which has opened it, so DB stage is executed in place.
+    {
+        StartupStage bootstrapStage( this, &ADConnection::startupBootstrap );
+        StartupStage libStage( this, &ADConnection::startupLoadLib );
+        StartupStage dbStage( this, &ADConnection::startupOpenDB );
+        StartupStage httpsStage( this, &ADConnection::startupHttps );
+
+        bootstrapStage.setNext( &libStage );
+        bootstrapStage.start();
+        httpsStage.start();
+        dbStage.execute();
+        bootstrapStage.wait();
+        httpsStage.wait();
+
+        if ( bootstrapStage.err != NoError )
+            m_lastError = bootstrapStage.err;
+        else if ( libStage.err != NoError )
+            m_lastError = libStage.err;
+        else if ( dbStage.err != NoError )
+            m_lastError = dbStage.err;
+        else if ( httpsStage.err != NoError )
+            m_lastError = httpsStage.err;
+        if ( m_lastError != NoError )
             goto clean;
-        }
 
-        // Parse data
-        res = updateSessionInfo( response );
+        // Parse data, certificate is loaded by the library
+        TimeMark start, end;
+        timeMark( start );
+        res = updateSessionInfo( httpsStage.response );
         if ( ! res ) {
             m_lastError = ParseHTTPDataError;
             qWarning("HTTP response is invalid!");
             goto clean;
         }
+        timeMark( end );
+
+        // Lock
+        ADWriteLocker wLocker( &m_rwLock );
+        m_startupStats.bootstrap = bootstrapStage.msecs;
+        m_startupStats.libLoad = libStage.msecs;
+        m_startupStats.dbOpen = dbStage.msecs;
+        m_startupStats.https = httpsStage.msecs;
+        m_startupStats.sessionInfo = msecsDiffTimeMark( start, end );
     }
 
     // Connect to AD server
@@ -2764,10 +3483,10 @@ void ADConnection::run ()
                           Qt::BlockingQueuedConnection );
         QObject::connect( this,
                           SIGNAL(onChangeOrder(ADConnection::Order::Operation,
-                                               quint32, float)),
+                                               quint32, ADPrice)),
                           &genericReceiver,
                           SLOT(onChangeOrder(ADConnection::Order::Operation,
-                                             quint32, float)),
+                                             quint32, ADPrice)),
                           Qt::BlockingQueuedConnection );
 
 
@@ -2800,15 +3519,28 @@ void ADConnection::run ()
                           SLOT(tcpWriteToSock(QByteArray)),
                           Qt::QueuedConnection );
 
+        // Decoded chunks can be ready after socket read
+        QSocketNotifier* decodeNotifier = 0;
+        if ( m_adLib->decodeStreamNotifier() >= 0 ) {
+            decodeNotifier = new QSocketNotifier( m_adLib->decodeStreamNotifier(),
+                                                  QSocketNotifier::Read );
+            QObject::connect(decodeNotifier,
+                             SIGNAL(activated(int)),
+                             &tcpReceiver,
+                             SLOT(decodeReady()));
+        }
+
         // Start ping timer
         pingTimer.start( 5 * 1000 );
 
         // Connect
+        timeMark( m_tcpConnectMark );
         m_sock->connectToHost( m_sessInfo.serverHost, m_sessInfo.serverPort );
 
         // Run into loop
         QThread::exec();
 
+        delete decodeNotifier;
         delete m_sock;
         m_sock = 0;
     }
@@ -2817,12 +3549,17 @@ void ADConnection::run ()
     // Wake up subscribers
     {
         // Lock
-        QReadLocker rLocker( &m_rwLock );
+        ADReadLocker rLocker( &m_subscrLock );
 
-        QList<ADSmartPtr<ADSubscriptionPrivate> >::ConstIterator itSub = m_subscriptions->begin();
+        QHash<ADSubscriptionPrivate*, ADSmartPtr<ADSubscriptionPrivate> >::ConstIterator itSub =
+            m_subscriptions->begin();
         for ( ; itSub != m_subscriptions->end(); ++itSub ) {
             //XXX NOT IMPLEMENTED itSub->wakeupAll();
         }
+    }
+    {
+        // Lock
+        ADReadLocker rLocker( &m_ordersLock );
 
         QHash<RequestId, OrderOpWithPhase>::ConstIterator itOrdOp;
         itOrdOp = m_ordersOperations->begin();
@@ -2873,6 +3610,26 @@ void ADConnection::run ()
 // Tcp callbacks
 //
 
+void ADConnection::registerBlockHandlers ()
+{
+    for ( int i = 0; i < StreamIdCount; ++i ) {
+        m_blockHandlers[ i ] = 0;
+        m_streamHandlers[ i ] = 0;
+    }
+
+    m_blockHandlers[ ServerTimeStream ]      = &ADConnection::handleServerTime;
+    m_blockHandlers[ BrokerMessageStream ]   = &ADConnection::handleBrokerMessage;
+    m_blockHandlers[ OrdersQueueInitStream ] = &ADConnection::handleOrdersQueue;
+    m_blockHandlers[ OrdersQueueStream ]     = &ADConnection::handleOrdersQueue;
+    m_blockHandlers[ QuoteInitStream ]       = &ADConnection::handleQuotes;
+    m_blockHandlers[ QuoteStream ]           = &ADConnection::handleQuotes;
+    m_blockHandlers[ MyTradesStream ]        = &ADConnection::handleMyTrades;
+    m_blockHandlers[ MyOrdersStream ]        = &ADConnection::handleMyOrders;
+    m_blockHandlers[ BalanceStream ]         = &ADConnection::handleBalance;
+    m_blockHandlers[ HistQuotesStream ]      = &ADConnection::handleHistQuotes;
+    m_blockHandlers[ PapersStream ]          = &ADConnection::handlePapers;
+}
+
 void ADConnection::tcpReadyRead ( QTcpSocket& )
 {
     QList<DataBlock> recv;
@@ -2909,6 +3666,35 @@ void ADConnection::tcpReadyRead ( QTcpSocket& )
 
         m_authed = true;
         m_state = ConnectedState;
+
+        // Startup timings
+        {
+            TimeMark now;
+            timeMark( now );
+
+            // Lock
+            ADWriteLocker wLocker( &m_rwLock );
+            m_startupStats.tcpAuth = msecsDiffTimeMark( m_tcpConnectMark, now );
+            m_startupStats.connected = msecsDiffTimeMark( m_startupMark, now );
+
+#ifdef DO_ALL_LOGGING
+            if ( m_mainLogFile ) {
+                QString str( QString("=== Startup: bootstrap %1ms, lib %2ms, "
+                                     "db %3ms, https %4ms, session %5ms, "
+                                     "tcp+auth %6ms, connected %7ms\n\n").
+                             arg(m_startupStats.bootstrap).
+                             arg(m_startupStats.libLoad).
+                             arg(m_startupStats.dbOpen).
+                             arg(m_startupStats.https).
+                             arg(m_startupStats.sessionInfo).
+                             arg(m_startupStats.tcpAuth).
+                             arg(m_startupStats.connected) );
+                m_mainLogFile->write( str.toLocal8Bit() );
+                m_mainLogFile->flush();
+            }
+#endif
+        }
+
         emit onStateChanged( ConnectedState );
 
         // Find active orders and insert them
@@ -2916,7 +3702,7 @@ void ADConnection::tcpReadyRead ( QTcpSocket& )
         if ( _sqlFindActiveOrders(activeOrders) ) {
             foreach ( const ADSmartPtr<ADOrderPrivate>& order, activeOrders ) {
                 // Lock
-                QWriteLocker wLocker( &m_rwLock );
+                ADWriteLocker wLocker( &m_ordersLock );
                 Order::OrderId orderId = order->getOrderId();
                 Q_ASSERT(!m_activeOrders->contains(orderId));
                 m_activeOrders->insert(orderId, order);
@@ -2934,7 +3720,7 @@ void ADConnection::tcpReadyRead ( QTcpSocket& )
         if ( _sqlGetCurrentPositions(positions) ) {
             foreach ( const Position& pos, positions ) {
                 // Lock
-                QWriteLocker wLocker( &m_rwLock );
+                ADWriteLocker wLocker( &m_positionsLock );
                 m_positions[pos.accCode][pos.paperNo] = pos;
                 // Unlock
                 wLocker.unlock();
@@ -2950,911 +3736,1067 @@ void ADConnection::tcpReadyRead ( QTcpSocket& )
 
     QList<DataBlock>::Iterator it = recv.begin();
     for ( ; it != recv.end(); ++it ) {
-        /// Parse server time
-        if ( it->blockName.contains(ADBlockName::SRV_TIME) ) {
-            bool ok = false;
-            QDateTime dt;
-            int adTime = it->blockData.toInt(&ok);
-            if ( ! ok || ! ADTimeToDateTime(adTime, dt) ) {
-                qWarning("Wrong block: %s", ADBlockName::SRV_TIME);
-                continue;
-            }
-            // Lock
-            QWriteLocker wLocker( &m_rwLock );
-            m_srvTime = dt;
-            m_srvTimeUpdate = QDateTime::currentDateTime();
-        }
-        /// Parse orders queue: {paper_no, price, buy_qty, sell_qty, i_last_update, yield}
-        else if ( it->blockName.contains(ADBlockName::ORDERS_QU_INIT) ||
-                  it->blockName.contains(ADBlockName::ORDERS_QU_0) ||
-                  it->blockName.contains(ADBlockName::ORDERS_QU_1) ) {
-
-            bool initQueue = it->blockName.contains(ADBlockName::ORDERS_QU_INIT);
-            QSet<int> updates;
-
-            QStringList lines = it->blockData.split("\n", QString::SkipEmptyParts);
-            for ( QStringList::Iterator it = lines.begin();
-                  it != lines.end(); ++it ) {
-                QString& line = *it;
-                QStringList cols = line.split("|");
-
-                bool ok = (cols.size() >= 4);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse queue line!");
-                    continue;
-                }
-
-                int paperNo = cols[0].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse queue paper no!");
-                    continue;
-                }
-                float price = cols[1].toFloat(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse queue price!");
-                    continue;
-                }
-                int buyQty = cols[2].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse queue buy qty!");
-                    continue;
-                }
-                int sellQty = cols[3].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse queue sell qty!");
-                    continue;
-                }
-
-                // Lock
-                QWriteLocker wLocker( &m_rwLock );
-                Quote& quote = m_quotes[paperNo];
-                if ( initQueue && ! updates.contains(paperNo) ) {
-                    quote.buyers.clear();
-                    quote.sellers.clear();
-                    quote.bidOffers.clear();
-                }
-                quote.paperNo = paperNo;
-
-                // Mark as updated
-                updates.insert(paperNo);
+        const DataBlock& block = *it;
 
-                // Fill buyers
-                if ( buyQty > 0 )
-                    quote.buyers[price] = buyQty;
-                else
-                    quote.buyers.remove(price);
+        BlockHandler handler = m_blockHandlers[ block.streamId ];
+        if ( handler && ! (this->*handler)( block ) )
+            continue;
 
-                // Fill sellers
-                if ( sellQty > 0 )
-                    quote.sellers[price] = sellQty;
-                else
-                    quote.sellers.remove(price);
+        // Lock
+        ADReadLocker rLocker( &m_rwLock );
+        StreamHandler* custom = m_streamHandlers[ block.streamId ];
+        // Unlock
+        rLocker.unlock();
+        if ( custom )
+            custom->handleBlock( block );
 
-                // Fill bid/offer
-                if ( buyQty > 0 || sellQty > 0 )
-                    quote.bidOffers[price] = BidOffer(price, buyQty, sellQty);
-                else
-                    quote.bidOffers.remove(price);
-
-                // Update subscriptions
-                QList<ADSmartPtr<ADSubscriptionPrivate> >::Iterator itSub =
-                    m_subscriptions->begin();
-                while ( itSub != m_subscriptions->end() ) {
-                    if ( (*itSub).countRefs() > 1 ) {
-                        (*itSub)->update(paperNo, Subscription::QueueSubscription);
-                        ++itSub;
-                    }
-                    else {
-                        // Unsubscribe and drop subscription
-                        _unsubscribeToQuote( *itSub );
-                        itSub = m_subscriptions->erase( itSub );
-                    }
-                }
-            }
+        emit onDataReceived( block );
+    }
+}
 
-            foreach ( int paperNo, updates )
-                emit onQuoteReceived( paperNo, Subscription::QueueSubscription );
-        }
-        /// Parse quotes: {paper_no, open_price, last_price, ...}
-        else if ( it->blockName.contains(ADBlockName::QUOTE_INIT) ||
-                  it->blockName.contains(ADBlockName::QUOTE_0) ||
-                  it->blockName.contains(ADBlockName::QUOTE_1) ||
-                  it->blockName.contains(ADBlockName::QUOTE_2) ||
-                  it->blockName.contains(ADBlockName::QUOTE_3) ) {
-
-            QSet<int> updates;
-
-            QStringList lines = it->blockData.split("\n", QString::SkipEmptyParts);
-            for ( QStringList::Iterator it = lines.begin();
-                  it != lines.end(); ++it ) {
-                QString& line = *it;
-                QStringList cols = line.split("|");
-
-                bool ok = (cols.size() >= 3);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse quote line!");
-                    continue;
-                }
+// Parse server time
+bool ADConnection::handleServerTime ( const DataBlock& block )
+{
+    bool ok = false;
+    QDateTime dt;
+    int adTime = block.rawData().toInt(&ok);
+    if ( ! ok || ! ADTimeToDateTime(adTime, dt) ) {
+        qWarning("Wrong block: %s", ADBlockName::SRV_TIME);
+        return false;
+    }
+    // Lock
+    ADWriteLocker wLocker( &m_rwLock );
+    m_srvTime = dt;
+    m_srvTimeUpdate = QDateTime::currentDateTime();
 
-                int paperNo = cols[0].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse quote paper no!");
-                    continue;
-                }
-                bool lastPriceNotZero = false;
-                float lastPrice = cols[2].toFloat(&lastPriceNotZero);
-                if ( ! lastPriceNotZero ) {
-                    continue;
-                }
+    return true;
+}
 
-                // Lock
-                QWriteLocker wLocker( &m_rwLock );
-                Quote& quote = m_quotes[paperNo];
-                quote.paperNo = paperNo;
-                quote.lastPrice = lastPrice;
-
-                // Update subscriptions
-                QList<ADSmartPtr<ADSubscriptionPrivate> >::Iterator itSub =
-                    m_subscriptions->begin();
-                while ( itSub != m_subscriptions->end() ) {
-                    if ( (*itSub).countRefs() > 1 ) {
-                        (*itSub)->update(paperNo, Subscription::QuoteSubscription);
-                        ++itSub;
-                    }
-                    else {
-                        // Unsubscribe and drop subscription
-                        _unsubscribeToQuote( *itSub );
-                        itSub = m_subscriptions->erase( itSub );
-                    }
-                }
+// Parse orders queue: {paper_no, price, buy_qty, sell_qty, i_last_update, yield}
+bool ADConnection::handleOrdersQueue ( const DataBlock& block )
+{
+    ADBlockIndex index( block.rawDataPtr(), block.rawDataSize() );
+    ADColumnTokenizer cols;
 
-                // Unlock
-                wLocker.unlock();
+    // Queue line has 6 columns
+    QVector<QuoteLine> lines;
+    lines.reserve( index.separators().size() / 6 + 1 );
+    while ( index.next(cols) ) {
 
-                // Mark as updated
-                updates.insert(paperNo);
-            }
+        bool ok = (cols.size() >= 4);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse queue line!");
+            continue;
+        }
 
-            foreach ( int paperNo, updates )
-                emit onQuoteReceived( paperNo, Subscription::QuoteSubscription );
+        QuoteLine line;
+        line.paperNo = ADTextParser::toInt(cols[0], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse queue paper no!");
+            continue;
         }
-        /// Parse system responses
-        else if ( it->blockName.contains(ADBlockName::MSG_ID) ) {
-            QStringList cols = it->blockData.split("|");
-            if ( cols.size() < 2 ) {
-                qWarning("Wrong block '%s': block data is wrong!", qPrintable(it->blockName));
-                continue;
-            }
-            bool ok = false;
-            RequestId id = cols[0].toInt(&ok);
-            if ( ! ok ) {
-                qWarning("Wrong block '%s': can't parse request id!", qPrintable(it->blockName));
-                continue;
-            }
+        // Nobody is interested, skip line before parsing the rest
+        if ( ! m_paperInterest->test(line.paperNo) )
+            continue;
+        line.price = ADTextParser::toPrice(cols[1], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse queue price!");
+            continue;
+        }
+        line.buyQty = ADTextParser::toInt(cols[2], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse queue buy qty!");
+            continue;
+        }
+        line.sellQty = ADTextParser::toInt(cols[3], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse queue sell qty!");
+            continue;
+        }
+        line.priceStep = paperPriceStep( line.paperNo );
+        lines.append( line );
+    }
 
-            // Lock
-            QWriteLocker wLocker( &m_rwLock );
+    QSet<int> updates;
+    applyQuoteLines( lines, Subscription::QueueSubscription,
+                     block.streamId == OrdersQueueInitStream, updates );
 
-            // Check id
-            if ( ! m_ordersOperations->contains(id) )
-                continue;
+    foreach ( int paperNo, updates )
+        emit onQuoteReceived( paperNo, Subscription::QueueSubscription );
 
-            // Get
-            OrderOpWithPhase& orderPhasePtr = m_ordersOperations->operator[](id);
+    return true;
+}
 
-            // Check order creation
-            if ( orderPhasePtr.first->getOperationType() == Order::CreateOrder ) {
+void ADConnection::applyQuoteLines ( const QVector<QuoteLine>& lines,
+                                     ADConnection::Subscription::Type type,
+                                     bool initQueue, QSet<int>& updates )
+{
+    if ( lines.isEmpty() ) {
+        // Dead subscriptions are reaped on every block,
+        // even if all its lines were dropped
+        updateSubscriptions( updates, type );
+        return;
+    }
 
-                QRegExp phase1("^OK$");
-                QRegExp phase2(
-                    QString::fromUtf8("^Заявка принята к исполнению$"));
-                QRegExp phase3(
-                    QString::fromUtf8("принята Системой.$|"
-                                      "^Установка тестовой сделки по заявке № (\\d+)"));
+    // Shards touched by block
+    quint32 shardsMask = 0;
+    for ( int i = 0; i < lines.size(); ++i )
+        shardsMask |= 1u << quoteShardIndex( lines[i].paperNo );
 
-                // Handle broker sucess response for 0 phase
-                if ( orderPhasePtr.second == 0 &&
-                     cols[1].contains(phase1) ) {
-                    orderPhasePtr.second = 1;
-#ifdef DEBUG_ORDERS
-                    qWarning("Order creation #%d, price %.2f is in phase 1, '%s'",
-                             id, orderPhasePtr.first->getOrder()->getOrderPrice(),
-                             qPrintable(cols[1]));
-#endif
-                    continue;
-                }
-                // Handle broker sucess response for 1 phase
-                else if ( orderPhasePtr.second == 1 &&
-                          cols[1].contains(phase2) ) {
-                    orderPhasePtr.second = 2;
-#ifdef DEBUG_ORDERS
-                    qWarning("Order creation #%d is in phase 2, '%s'",
-                             id, qPrintable(cols[1]));
-#endif
-                    continue;
-                }
-                // Handle exchange sucess response for 2 phase
-                else if ( orderPhasePtr.second == 2 &&
-                          cols[1].contains(phase3) ) {
-#ifdef DEBUG_ORDERS
-                    qWarning("Order creation #%d in accept state, '%s'",
-                             id, qPrintable(cols[1]));
-#endif
-                    Order::OrderId orderId;
-
-                    // Check real order
-                    if ( 0 == phase3.captureCount() ) {
-                        if ( cols.size() < 5 ) {
-                            qWarning("Error: response on request id '%d' is wrong!",
-                                     id);
-                            goto create_order_error;
-                        }
-                        orderId = cols[4].toInt(&ok);
-                    }
-                    // Demo order
-                    else
-                        orderId = phase3.cap(1).toInt(&ok);
+    // Every touched shard is locked once, every changed
+    // paper is published once, after its last line
+    TimeMark nowMark = 0;
+    timeMark( nowMark );
+    QVector<int> papers;
+    for ( int s = 0; s < QuoteShards; ++s ) {
+        if ( ! (shardsMask & (1u << s)) )
+            continue;
 
-                    if ( ! ok ) {
-                        qWarning("Error: response on request id '%d' is wrong, "
-                                 "can't convert order id to int", id);
-                        goto create_order_error;
-                    }
+        QuoteShard& shard = m_quoteShards[ s ];
+        papers.resize( 0 );
 
+        // Lock
+        ADWriteLocker wLocker( &shard.lock );
+        for ( int i = 0; i < lines.size(); ++i ) {
+            const QuoteLine& line = lines[i];
+            if ( quoteShardIndex(line.paperNo) != s )
+                continue;
 
-                    // Accepted
-                    ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
-                    ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
-                    m_ordersOperations->take(id);
-                    bool inActive = m_activeOrders->contains(orderId);
-                    Order::State oldState = Order::UnknownState;
-                    // Check if already handled by statuses.
-                    if ( ! inActive ) {
-                        m_activeOrders->insert(orderId, order);
-                        oldState = order->getOrderState();
-                        order->setOrderState( Order::AcceptedState, orderId );
+            Quote& quote = shard.quotes[line.paperNo];
+            DepthJournal* journal = 0;
+            if ( m_deltaInterest->test(line.paperNo) )
+                journal = &shard.journals[line.paperNo];
+            if ( ! updates.contains(line.paperNo) ) {
+                updates.insert( line.paperNo );
+                papers.append( line.paperNo );
+                if ( initQueue ) {
+                    quote.buyers.clear();
+                    quote.sellers.clear();
+                    if ( journal ) {
+                        journal->resetSeq = ++journal->seq;
+                        journal->clear();
                     }
-                    orderOpPtr->wakeUpAll( Order::SuccessResult );
-                    // Unlock
-                    wLocker.unlock();
-                    if ( ! inActive )
-                        emit onOrderStateChanged( ADConnection::Order(order),
-                                                  oldState,
-                                                  Order::AcceptedState );
-                    emit onOrderOperationResult( ADConnection::Order(order),
-                                                 ADConnection::Order::Operation(orderOpPtr),
-                                                 Order::SuccessResult );
                 }
-                // Handle broker other responses (assume errors)
-                else {
-                create_order_error:
-
-#ifdef DEBUG_ORDERS
-                    qWarning("Order #%d in unknown msg, '%s'",
-                             id, qPrintable(cols[1]));
-#endif
+                quote.paperNo = line.paperNo;
+            }
+            quote.priceStep = line.priceStep;
+
+            if ( type == Subscription::QueueSubscription ) {
+                // Fill buyers and sellers, zero qty removes level
+                quote.buyers.set( line.price, line.buyQty );
+                quote.sellers.set( line.price, line.sellQty );
+                if ( journal )
+                    journal->append( BidOffer(line.price, line.buyQty, line.sellQty) );
+            }
+            else {
+                if ( journal && quote.lastPrice != line.price )
+                    journal->lastPriceSeq = ++journal->seq;
+                quote.lastPrice = line.price;
+            }
+        }
+        for ( int i = 0; i < papers.size(); ++i )
+            m_quoteSnapshots->publish( shard.quotes[papers[i]], nowMark );
+    }
 
-                    ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
-                    ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
-                    m_ordersOperations->take(id);
-                    Order::State oldState = order->getOrderState();
-                    order->setOrderState( Order::CancelledState );
-                    orderOpPtr->wakeUpAll( Order::ErrorResult );
-                    // Unlock
-                    wLocker.unlock();
-                    emit onOrderStateChanged( ADConnection::Order(order),
-                                              oldState,
-                                              Order::CancelledState );
-                    emit onOrderOperationResult( ADConnection::Order(order),
-                                                 ADConnection::Order::Operation(orderOpPtr),
-                                                 Order::ErrorResult );
-                }
+    markFirstQuote();
+    updateSubscriptions( updates, type );
+}
 
-            }
-            // Check change orders requests
-            else if ( orderPhasePtr.first->getOperationType() == Order::ChangeOrder ) {
-                // Handle broker sucess response for 0 phase
-                if ( orderPhasePtr.second == 0 &&
-                     cols[1].contains(QRegExp("^OK$")) ) {
-                    orderPhasePtr.second = 1;
-                    continue;
-                }
-                // Handle broker sucess response for 1 phase
-                else if ( orderPhasePtr.second == 1 &&
-                          cols[1].contains(QRegExp(QString::fromUtf8("^Заявка принята к изменению$"))) ) {
-                    orderPhasePtr.second = 2;
-                    continue;
-                }
-                // Handle exchange sucess response for 2 phase
-                else if ( orderPhasePtr.second == 2 &&
-                          cols[1].contains(QRegExp(QString::fromUtf8("успешно изменена,"))) ) {
-                    if ( cols.size() < 5 ) {
-                        qWarning("!!!! Response on request id '%d' is wrong!", id);
-                        //XXX I don't know what to do in this case!
-                        goto change_order_error;
-                    }
-                    Order::OrderId newOrderId = cols[4].toInt(&ok);
-                    if ( ! ok ) {
-                        qWarning("!!!! Response on request id '%d' is wrong!", id);
-                        //XXX I really don't know what to do in this case!
-                        goto change_order_error;
-                    }
+void ADConnection::markFirstQuote ()
+{
+    // Startup statistics are written by connection thread only
+    if ( m_startupStats.firstQuote != 0 )
+        return;
 
-                    if ( m_activeOrders->contains(newOrderId) ) {
-                        qWarning("!!!! New order id '%d' on request id '%d' is wrong!",
-                                 newOrderId, id);
-                        //XXX I really don't know what to do in this case!
-                        goto change_order_error;
-                    }
+    TimeMark now;
+    timeMark( now );
 
-                    // Change
-                    ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
-                    ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
-                    m_ordersOperations->take(id);
-                    Order::State oldState = order->getOrderState();
-                    quint32 qty = 0;
-                    float price = 0.0;
-                    order->getPresaveValues(qty, price);
-                    // Save new order id, qty and price
-                    order->setOrderState( Order::AcceptedState, newOrderId, qty, price );
-                    orderOpPtr->wakeUpAll( Order::SuccessResult );
-                    // Unlock
-                    wLocker.unlock();
-                    emit onOrderStateChanged( ADConnection::Order(order),
-                                              oldState,
-                                              Order::AcceptedState );
-                    emit onOrderOperationResult( ADConnection::Order(order),
-                                                 ADConnection::Order::Operation(orderOpPtr),
-                                                 Order::SuccessResult );
-                }
-                // Handle broker other responses (assume errors)
-                else {
-                change_order_error:
-                    ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
-                    ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
-                    m_ordersOperations->take(id);
-                    Order::State oldState = order->getOrderState();
-                    // Set status again to accepted because cancellation failed!
-                    order->setOrderState( Order::AcceptedState );
-                    orderOpPtr->wakeUpAll( Order::ErrorResult );
-                    // Unlock
-                    wLocker.unlock();
-                    emit onOrderStateChanged( ADConnection::Order(order),
-                                              oldState,
-                                              Order::AcceptedState );
-                    emit onOrderOperationResult( ADConnection::Order(order),
-                                                 ADConnection::Order::Operation(orderOpPtr),
-                                                 Order::ErrorResult );
-                }
-            }
-            // Check drop orders requests
-            else if ( orderPhasePtr.first->getOperationType() == Order::CancelOrder ) {
-                // Handle broker sucess response for 0 phase
-                if ( orderPhasePtr.second == 0 &&
-                     cols[1].contains(QRegExp("^OK$")) ) {
-                    orderPhasePtr.second = 1;
-                    continue;
-                }
-                // Handle broker sucess response for 1 phase
-                else if ( orderPhasePtr.second == 1 &&
-                          cols[1].contains(QRegExp(QString::fromUtf8("^Заявка принята к удалению$"))) ) {
-                    orderPhasePtr.second = 2;
-                    continue;
-                }
-                // Handle exchange sucess response for 2 phase
-                else if ( orderPhasePtr.second == 2 &&
-                          (cols[1].contains(QRegExp(QString::fromUtf8("помечена к удалению.$"))) ||
-                           cols[1].contains(QRegExp(QString::fromUtf8("уже удалена.$")))) ) {
-                    if ( cols.size() < 5 ) {
-                        qWarning("!!!! Response on request id '%d' is wrong!", id);
-                        //XXX I don't know what to do in this case!
-                        goto drop_order_error;
-                    }
-                    Order::OrderId orderId = cols[4].toInt(&ok);
-                    if ( ! ok ) {
-                        qWarning("!!!! Response on request id '%d' is wrong!", id);
-                        //XXX I really don't know what to do in this case!
-                        goto drop_order_error;
-                    }
+    // Lock
+    ADWriteLocker wLocker( &m_rwLock );
+    m_startupStats.firstQuote =
+        qMax( 1u, msecsDiffTimeMark(m_startupMark, now) );
+}
 
-                    if ( ! m_activeOrders->contains(orderId) ) {
-                        qWarning("!!!! Order id '%d' on request id '%d' is wrong!",
-                                 orderId, id);
-                        //XXX I really don't know what to do in this case!
-                        goto drop_order_error;
-                    }
+void ADConnection::updateSubscriptions ( const QSet<int>& paperNos,
+                                         ADConnection::Subscription::Type type )
+{
+    // Lock
+    ADWriteLocker wLocker( &m_subscrLock );
+
+    // Drop subscriptions nobody holds, whatever papers are updated,
+    // so quiet papers do not keep filters, interest and journals
+    QHash<ADSubscriptionPrivate*, ADSmartPtr<ADSubscriptionPrivate> >::Iterator itSub =
+        m_subscriptions->begin();
+    while ( itSub != m_subscriptions->end() ) {
+        if ( (*itSub).countRefs() > 1 )
+            ++itSub;
+        else {
+            // Unsubscribe and drop subscription
+            _unsubscribeToQuote( *itSub );
+            itSub = m_subscriptions->erase( itSub );
+        }
+    }
 
-                    // Remove
-                    ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
-                    ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
-                    m_ordersOperations->take(id);
-                    m_activeOrders->take(orderId);
-                    m_inactiveOrders->insert(orderId, order);
-                    Order::State oldState = order->getOrderState();
-                    order->setOrderState( Order::CancelledState );
-                    orderOpPtr->wakeUpAll( Order::SuccessResult );
-                    // Unlock
-                    wLocker.unlock();
-                    emit onOrderStateChanged( ADConnection::Order(order),
-                                              oldState,
-                                              Order::CancelledState );
-                    emit onOrderOperationResult( ADConnection::Order(order),
-                                                 ADConnection::Order::Operation(orderOpPtr),
-                                                 Order::SuccessResult );
-                }
-                // Handle broker other responses (assume errors)
-                else {
-                drop_order_error:
-                    ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
-                    ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
-                    m_ordersOperations->take(id);
-                    Order::State oldState = order->getOrderState();
-                    // Set status again to accepted because cancellation failed!
-                    order->setOrderState( Order::AcceptedState );
-                    orderOpPtr->wakeUpAll( Order::ErrorResult );
-                    // Unlock
-                    wLocker.unlock();
-                    emit onOrderStateChanged( ADConnection::Order(order),
-                                              oldState,
-                                              Order::AcceptedState );
-                    emit onOrderOperationResult( ADConnection::Order(order),
-                                                 ADConnection::Order::Operation(orderOpPtr),
-                                                 Order::ErrorResult );
-                }
-            }
+    // Group updated papers by interested subscriptions
+    QHash<ADSubscriptionPrivate*, QSet<int> > fanOut;
+    foreach ( int paperNo, paperNos ) {
+        QHash<int, PaperSubscribers>::ConstIterator it =
+            m_paperSubscribers.find(paperNo);
+        if ( it == m_paperSubscribers.end() || ! (it->subscrTypeMask & type) )
+            continue;
+        const QVector<PaperSubscriber>& subscribers = it->subscribers;
+        for ( int i = 0; i < subscribers.size(); ++i ) {
+            if ( subscribers[i].subscrType & type )
+                fanOut[ subscribers[i].subscr ].insert(paperNo);
         }
-        // All trades
-        else if ( it->blockName.contains(ADBlockName::ALL_TRADES) ) {
+    }
+
+    QHash<ADSubscriptionPrivate*, QSet<int> >::ConstIterator itFan = fanOut.begin();
+    for ( ; itFan != fanOut.end(); ++itFan )
+        itFan.key()->update(itFan.value(), type);
+}
+
+// Parse quotes: {paper_no, open_price, last_price, ...}
+bool ADConnection::handleQuotes ( const DataBlock& block )
+{
+    ADBlockIndex index( block.rawDataPtr(), block.rawDataSize() );
+    ADColumnTokenizer cols;
+    QVector<QuoteLine> lines;
+    while ( index.next(cols) ) {
+
+        bool ok = (cols.size() >= 3);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse quote line!");
+            continue;
         }
-        // My orders
-        else if ( it->blockName.contains(ADBlockName::MY_ORDERS) ) {
-            QStringList lines = it->blockData.split("\n", QString::SkipEmptyParts);
-            for ( QStringList::Iterator it = lines.begin();
-                  it != lines.end(); ++it ) {
-                QString& line = *it;
-                QStringList cols = line.split("|");
-
-                bool ok = (cols.size() >= 29);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse my_orders line!");
-                    continue;
-                }
 
-                Order::OrderId orderId = cols[0].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse orderId of my_orders line!");
-                    continue;
-                }
+        QuoteLine line;
+        line.paperNo = ADTextParser::toInt(cols[0], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse quote paper no!");
+            continue;
+        }
+        // Nobody is interested, skip line before parsing the rest
+        if ( ! m_paperInterest->test(line.paperNo) )
+            continue;
+        bool lastPriceNotZero = false;
+        line.price = ADTextParser::toPrice(cols[2], &lastPriceNotZero);
+        if ( ! lastPriceNotZero ) {
+            continue;
+        }
+        line.buyQty = 0;
+        line.sellQty = 0;
+        line.priceStep = paperPriceStep( line.paperNo );
+        lines.append( line );
+    }
 
-                QString accCode = cols[1];
-                QString status = cols[3];
-                QString b_s = cols[4];
-                float price = cols[5].toDouble(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse price of my_orders line!");
-                    continue;
-                }
-                int qty = cols[6].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse qty of my_orders line!");
-                    continue;
-                }
+    QSet<int> updates;
+    applyQuoteLines( lines, Subscription::QuoteSubscription, false, updates );
 
-                bool restQtyOk = false;
-                int restQty = cols[8].toInt(&restQtyOk);
-                if ( restQtyOk && restQty > qty ) {
-                    qWarning("Wrong block line: can't parse restQty of my_orders line!");
-                    continue;
-                }
+    foreach ( int paperNo, updates )
+        emit onQuoteReceived( paperNo, Subscription::QuoteSubscription );
 
-                QString market = cols[13];
-                QString paperCode = cols[14];
-                QDateTime dropDt = QDateTime::fromString( cols[28], "dd/MM/yyyy hh:mm:ss" );
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse dropDt of my_orders line!");
-                    continue;
-                }
-                Order::Type orderBS = (b_s == "S" ? Order::Sell : Order::Buy);
-
-                // Get paper no
-                QSqlQuery query;
-                QMap<QString, QVariant> where;
-                where.insert("p_code", paperCode);
-                where.insert("place_code", market);
-                if ( !_sqlExecSelect("AD_PAPERS", where, query) || !query.next() ) {
-                    qWarning("Error: new order failed! can't find paper by "
-                             "p_code '%s' and place_code '%s'",
-                             qPrintable(paperCode),
-                             qPrintable(market));
-                    continue;
-                }
-                int paperNo = query.record().value("paper_no").toInt();
+    return true;
+}
 
-                // Lock
-                QWriteLocker wLocker( &m_rwLock );
-
-                //
-                // Create order if is not created yet
-                //
-                if ( (status == "O" || status == "X" || status == "N") &&
-                     ! m_inactiveOrders->contains(orderId) ) {
-                    ADSmartPtr<ADOrderPrivate> order;
-                    bool newlyAccepted = false;
-                    quint32 trades = 0;
-                    // If order newly created
-                    if ( ! m_activeOrders->contains(orderId) ) {
-                        newlyAccepted = true;
-                        order = ADSmartPtr<ADOrderPrivate>(
-                            new ADOrderPrivate(accCode, market, orderBS, paperNo,
-                                               paperCode, qty, price, dropDt,
-                                               orderId) );
-                        m_activeOrders->insert(orderId, order);
-                        order->setOrderState( Order::AcceptedState );
-                    }
-                    // If exists
-                    else {
-                        order = m_activeOrders->value( orderId );
-                    }
+// Parse system responses
+bool ADConnection::handleBrokerMessage ( const DataBlock& block )
+{
+    QStringList cols = block.blockData().split("|");
+    if ( cols.size() < 2 ) {
+        qWarning("Wrong block '%s': block data is wrong!", qPrintable(block.blockName));
+        return false;
+    }
+    bool ok = false;
+    RequestId id = cols[0].toInt(&ok);
+    if ( ! ok ) {
+        qWarning("Wrong block '%s': can't parse request id!", qPrintable(block.blockName));
+        return false;
+    }
 
-                    // Check rest qty
-                    if ( restQtyOk ) {
-                        trades = order->updateRestQty( restQty );
-                    }
+    // Lock
+    ADWriteLocker wLocker( &m_ordersLock );
 
-                    // Unlock
-                    wLocker.unlock();
+    // Check id
+    if ( ! m_ordersOperations->contains(id) )
+        return false;
 
-                    if ( newlyAccepted )
-                        emit onOrderStateChanged( ADConnection::Order(order),
-                                                  Order::UnknownState,
-                                                  Order::AcceptedState );
-                    if ( trades > 0 )
-                        emit onTrade( ADConnection::Order(order), trades );
-                }
-                //
-                // Check if order is executed
-                //
-                else if ( status == "M" ) {
-                    ADSmartPtr<ADOrderPrivate> orderPtr;
-                    QList< ADSmartPtr<ADOrderOperationPrivate> > orderOps;
-                    Order::State oldState = Order::UnknownState;
-                    quint32 trades = 0;
-                    // Mark active order as executed
-                    if ( m_activeOrders->contains(orderId) ) {
-                        // Remove
-                        orderPtr = m_activeOrders->take(orderId);
-                        m_inactiveOrders->insert(orderId, orderPtr);
-
-                        // Set status
-                        oldState = orderPtr->getOrderState();
-                        trades = orderPtr->updateRestQty( 0 );
-                        orderPtr->setOrderState( Order::ExecutedState, orderId );
-                    }
+    // Get
+    OrderOpWithPhase& orderPhasePtr = m_ordersOperations->operator[](id);
 
-                    // Try to find pended operations
-                    _findOperationsByOrderId(orderId, orderOps);
-                    // Wake up all operations id exist
-                    QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
-                    for ( ; it != orderOps.end(); ++it ) {
-                        ADSmartPtr<ADOrderOperationPrivate>& op = *it;
-                        op->wakeUpAll( Order::ErrorResult );
-                        m_ordersOperations->remove(op->getRequestId());
-                    }
+    // Check order creation
+    if ( orderPhasePtr.first->getOperationType() == Order::CreateOrder ) {
 
-                    // Unlock
-                    wLocker.unlock();
-
-                    // Emit signal for order
-                    if ( orderPtr.isValid() ) {
-                        emit onOrderStateChanged( ADConnection::Order(orderPtr),
-                                                  oldState,
-                                                  Order::ExecutedState );
-
-                        // Iterate over other operations and emit signals
-                        QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
-                        for ( ; it != orderOps.end(); ++it ) {
-                            ADSmartPtr<ADOrderOperationPrivate>& op = *it;
-                            emit onOrderOperationResult( ADConnection::Order(orderPtr),
-                                                         ADConnection::Order::Operation(op),
-                                                         Order::ErrorResult );
-                        }
-
-                        // Emit trades
-                        if ( trades > 0 ) {
-                            emit onTrade( ADConnection::Order(orderPtr), trades );
-                        }
-                    }
+        QRegExp phase1("^OK$");
+        QRegExp phase2(
+            QString::fromUtf8("^Заявка принята к исполнению$"));
+        QRegExp phase3(
+            QString::fromUtf8("принята Системой.$|"
+                              "^Установка тестовой сделки по заявке № (\\d+)"));
+
+        // Handle broker sucess response for 0 phase
+        if ( orderPhasePtr.second == 0 &&
+             cols[1].contains(phase1) ) {
+            orderPhasePtr.second = 1;
+#ifdef DEBUG_ORDERS
+            qWarning("Order creation #%d, price %s is in phase 1, '%s'",
+                     id, qPrintable(orderPhasePtr.first->getOrder()->getOrderPrice().toString()),
+                     qPrintable(cols[1]));
+#endif
+            return false;
+        }
+        // Handle broker sucess response for 1 phase
+        else if ( orderPhasePtr.second == 1 &&
+                  cols[1].contains(phase2) ) {
+            orderPhasePtr.second = 2;
+#ifdef DEBUG_ORDERS
+            qWarning("Order creation #%d is in phase 2, '%s'",
+                     id, qPrintable(cols[1]));
+#endif
+            return false;
+        }
+        // Handle exchange sucess response for 2 phase
+        else if ( orderPhasePtr.second == 2 &&
+                  cols[1].contains(phase3) ) {
+#ifdef DEBUG_ORDERS
+            qWarning("Order creation #%d in accept state, '%s'",
+                     id, qPrintable(cols[1]));
+#endif
+            Order::OrderId orderId;
+
+            // Check real order
+            if ( 0 == phase3.captureCount() ) {
+                if ( cols.size() < 5 ) {
+                    qWarning("Error: response on request id '%d' is wrong!",
+                             id);
+                    goto create_order_error;
                 }
-                //
-                // Check if order is dropped
-                //
-                else if ( status == "W" ) {
-                    ADSmartPtr<ADOrderPrivate> orderPtr;
-                    QList< ADSmartPtr<ADOrderOperationPrivate> > orderOps;
-                    // Mark active order as executed
-                    if ( m_activeOrders->contains(orderId) ) {
-                        // Remove
-                        orderPtr = m_activeOrders->take(orderId);
-                        m_inactiveOrders->insert(orderId, orderPtr);
-                    }
+                orderId = cols[4].toInt(&ok);
+            }
+            // Demo order
+            else
+                orderId = phase3.cap(1).toInt(&ok);
 
-                    Order::State oldState = Order::UnknownState;
+            if ( ! ok ) {
+                qWarning("Error: response on request id '%d' is wrong, "
+                         "can't convert order id to int", id);
+                goto create_order_error;
+            }
 
-                    // Set status
-                    if ( orderPtr.isValid() ) {
-                        oldState = orderPtr->getOrderState();
-                        orderPtr->setOrderState( Order::CancelledState, orderId );
-                    }
 
-                    // Try to find pended operations
-                    _findOperationsByOrderId(orderId, orderOps);
-                    // Wake up all operations id exist
-                    QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
-                    for ( ; it != orderOps.end(); ++it ) {
-                        ADSmartPtr<ADOrderOperationPrivate>& op = *it;
-                        if ( op->getOperationType() == Order::CancelOrder )
-                            op->wakeUpAll( Order::SuccessResult );
-                        else
-                            op->wakeUpAll( Order::ErrorResult );
-                        m_ordersOperations->remove(op->getRequestId());
-                    }
+            // Accepted
+            ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
+            ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
+            m_ordersOperations->take(id);
+            bool inActive = m_activeOrders->contains(orderId);
+            Order::State oldState = Order::UnknownState;
+            // Check if already handled by statuses.
+            if ( ! inActive ) {
+                m_activeOrders->insert(orderId, order);
+                oldState = order->getOrderState();
+                order->setOrderState( Order::AcceptedState, orderId );
+            }
+            orderOpPtr->wakeUpAll( Order::SuccessResult );
+            // Unlock
+            wLocker.unlock();
+            if ( ! inActive )
+                emit onOrderStateChanged( ADConnection::Order(order),
+                                          oldState,
+                                          Order::AcceptedState );
+            emit onOrderOperationResult( ADConnection::Order(order),
+                                         ADConnection::Order::Operation(orderOpPtr),
+                                         Order::SuccessResult );
+        }
+        // Handle broker other responses (assume errors)
+        else {
+        create_order_error:
 
-                    // Unlock
-                    wLocker.unlock();
-
-                    // Emit signal for order
-                    if ( orderPtr.isValid() ) {
-                        emit onOrderStateChanged( ADConnection::Order(orderPtr),
-                                                  oldState,
-                                                  Order::CancelledState );
-
-                        // Iterate over other operations and emit signals
-                        QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
-                        for ( ; it != orderOps.end(); ++it ) {
-                            ADSmartPtr<ADOrderOperationPrivate>& op = *it;
-                            if ( op->getOperationType() == Order::CancelOrder )
-                                emit onOrderOperationResult( ADConnection::Order(orderPtr),
-                                                             ADConnection::Order::Operation(op),
-                                                             Order::SuccessResult );
-                            else
-                                emit onOrderOperationResult( ADConnection::Order(orderPtr),
-                                                             ADConnection::Order::Operation(op),
-                                                             Order::ErrorResult );
-                        }
-                    }
+#ifdef DEBUG_ORDERS
+            qWarning("Order #%d in unknown msg, '%s'",
+                     id, qPrintable(cols[1]));
+#endif
 
-                }
-                else {
-                    // Unknown status!
-                }
+            ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
+            ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
+            m_ordersOperations->take(id);
+            Order::State oldState = order->getOrderState();
+            order->setOrderState( Order::CancelledState );
+            orderOpPtr->wakeUpAll( Order::ErrorResult );
+            // Unlock
+            wLocker.unlock();
+            emit onOrderStateChanged( ADConnection::Order(order),
+                                      oldState,
+                                      Order::CancelledState );
+            emit onOrderOperationResult( ADConnection::Order(order),
+                                         ADConnection::Order::Operation(orderOpPtr),
+                                         Order::ErrorResult );
+        }
+
+    }
+    // Check change orders requests
+    else if ( orderPhasePtr.first->getOperationType() == Order::ChangeOrder ) {
+        // Handle broker sucess response for 0 phase
+        if ( orderPhasePtr.second == 0 &&
+             cols[1].contains(QRegExp("^OK$")) ) {
+            orderPhasePtr.second = 1;
+            return false;
+        }
+        // Handle broker sucess response for 1 phase
+        else if ( orderPhasePtr.second == 1 &&
+                  cols[1].contains(QRegExp(QString::fromUtf8("^Заявка принята к изменению$"))) ) {
+            orderPhasePtr.second = 2;
+            return false;
+        }
+        // Handle exchange sucess response for 2 phase
+        else if ( orderPhasePtr.second == 2 &&
+                  cols[1].contains(QRegExp(QString::fromUtf8("успешно изменена,"))) ) {
+            if ( cols.size() < 5 ) {
+                qWarning("!!!! Response on request id '%d' is wrong!", id);
+                //XXX I don't know what to do in this case!
+                goto change_order_error;
+            }
+            Order::OrderId newOrderId = cols[4].toInt(&ok);
+            if ( ! ok ) {
+                qWarning("!!!! Response on request id '%d' is wrong!", id);
+                //XXX I really don't know what to do in this case!
+                goto change_order_error;
             }
+
+            if ( m_activeOrders->contains(newOrderId) ) {
+                qWarning("!!!! New order id '%d' on request id '%d' is wrong!",
+                         newOrderId, id);
+                //XXX I really don't know what to do in this case!
+                goto change_order_error;
+            }
+
+            // Change
+            ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
+            ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
+            m_ordersOperations->take(id);
+            Order::State oldState = order->getOrderState();
+            quint32 qty = 0;
+            ADPrice price;
+            order->getPresaveValues(qty, price);
+            // Save new order id, qty and price
+            order->setOrderState( Order::AcceptedState, newOrderId, qty, price );
+            orderOpPtr->wakeUpAll( Order::SuccessResult );
+            // Unlock
+            wLocker.unlock();
+            emit onOrderStateChanged( ADConnection::Order(order),
+                                      oldState,
+                                      Order::AcceptedState );
+            emit onOrderOperationResult( ADConnection::Order(order),
+                                         ADConnection::Order::Operation(orderOpPtr),
+                                         Order::SuccessResult );
         }
-        // My trades
-        else if ( it->blockName.contains(ADBlockName::MY_TRADES) ) {
-            QStringList lines = it->blockData.split("\n", QString::SkipEmptyParts);
-            for ( QStringList::Iterator it = lines.begin();
-                  it != lines.end(); ++it ) {
-                QString& line = *it;
-                QStringList cols = line.split("|");
-
-                bool ok = (cols.size() >= 7);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse my_trades line!");
-                    continue;
-                }
+        // Handle broker other responses (assume errors)
+        else {
+        change_order_error:
+            ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
+            ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
+            m_ordersOperations->take(id);
+            Order::State oldState = order->getOrderState();
+            // Set status again to accepted because cancellation failed!
+            order->setOrderState( Order::AcceptedState );
+            orderOpPtr->wakeUpAll( Order::ErrorResult );
+            // Unlock
+            wLocker.unlock();
+            emit onOrderStateChanged( ADConnection::Order(order),
+                                      oldState,
+                                      Order::AcceptedState );
+            emit onOrderOperationResult( ADConnection::Order(order),
+                                         ADConnection::Order::Operation(orderOpPtr),
+                                         Order::ErrorResult );
+        }
+    }
+    // Check drop orders requests
+    else if ( orderPhasePtr.first->getOperationType() == Order::CancelOrder ) {
+        // Handle broker sucess response for 0 phase
+        if ( orderPhasePtr.second == 0 &&
+             cols[1].contains(QRegExp("^OK$")) ) {
+            orderPhasePtr.second = 1;
+            return false;
+        }
+        // Handle broker sucess response for 1 phase
+        else if ( orderPhasePtr.second == 1 &&
+                  cols[1].contains(QRegExp(QString::fromUtf8("^Заявка принята к удалению$"))) ) {
+            orderPhasePtr.second = 2;
+            return false;
+        }
+        // Handle exchange sucess response for 2 phase
+        else if ( orderPhasePtr.second == 2 &&
+                  (cols[1].contains(QRegExp(QString::fromUtf8("помечена к удалению.$"))) ||
+                   cols[1].contains(QRegExp(QString::fromUtf8("уже удалена.$")))) ) {
+            if ( cols.size() < 5 ) {
+                qWarning("!!!! Response on request id '%d' is wrong!", id);
+                //XXX I don't know what to do in this case!
+                goto drop_order_error;
+            }
+            Order::OrderId orderId = cols[4].toInt(&ok);
+            if ( ! ok ) {
+                qWarning("!!!! Response on request id '%d' is wrong!", id);
+                //XXX I really don't know what to do in this case!
+                goto drop_order_error;
+            }
 
-                Order::OrderId orderId = cols[1].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse orderId of my_trades line!");
-                    continue;
-                }
+            if ( ! m_activeOrders->contains(orderId) ) {
+                qWarning("!!!! Order id '%d' on request id '%d' is wrong!",
+                         orderId, id);
+                //XXX I really don't know what to do in this case!
+                goto drop_order_error;
+            }
 
-                int tradesQty = cols[6].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse tradesQty of my_trades line!");
-                    continue;
-                }
+            // Remove
+            ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
+            ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
+            m_ordersOperations->take(id);
+            m_activeOrders->take(orderId);
+            m_inactiveOrders->insert(orderId, order);
+            Order::State oldState = order->getOrderState();
+            order->setOrderState( Order::CancelledState );
+            orderOpPtr->wakeUpAll( Order::SuccessResult );
+            // Unlock
+            wLocker.unlock();
+            emit onOrderStateChanged( ADConnection::Order(order),
+                                      oldState,
+                                      Order::CancelledState );
+            emit onOrderOperationResult( ADConnection::Order(order),
+                                         ADConnection::Order::Operation(orderOpPtr),
+                                         Order::SuccessResult );
+        }
+        // Handle broker other responses (assume errors)
+        else {
+        drop_order_error:
+            ADSmartPtr<ADOrderOperationPrivate> orderOpPtr = orderPhasePtr.first;
+            ADSmartPtr<ADOrderPrivate> order = orderOpPtr->getOrder();
+            m_ordersOperations->take(id);
+            Order::State oldState = order->getOrderState();
+            // Set status again to accepted because cancellation failed!
+            order->setOrderState( Order::AcceptedState );
+            orderOpPtr->wakeUpAll( Order::ErrorResult );
+            // Unlock
+            wLocker.unlock();
+            emit onOrderStateChanged( ADConnection::Order(order),
+                                      oldState,
+                                      Order::AcceptedState );
+            emit onOrderOperationResult( ADConnection::Order(order),
+                                         ADConnection::Order::Operation(orderOpPtr),
+                                         Order::ErrorResult );
+        }
+    }
 
-                ADSmartPtr<ADOrderPrivate> orderPtr;
+    return true;
+}
 
-                // Lock
-                QWriteLocker wLocker( &m_rwLock );
-                // Check orders operations by order id
-                QList< ADSmartPtr<ADOrderOperationPrivate> > orderOps;
-                if ( _findOperationsByOrderId(orderId, orderOps) ) {
-                    // Wake up all operations
-                    QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
-                    for ( ; it != orderOps.end(); ++it ) {
-                        ADSmartPtr<ADOrderOperationPrivate>& op = *it;
-                        op->wakeUpAll( Order::ErrorResult );
-                        m_ordersOperations->remove(op->getRequestId());
-                    }
-                }
-                Order::State oldState = Order::UnknownState;
-                quint32 trades = 0;
-
-                // Check active orders
-                if ( m_activeOrders->contains(orderId) ) {
-                    // Get order
-                    orderPtr = m_activeOrders->value(orderId);
-
-                    // Set status
-                    oldState = orderPtr->getOrderState();
-                    trades = orderPtr->updateTradesQty( tradesQty );
-                    // Check if fully executed
-                    if ( orderPtr->isExecutedQty() ) {
-                        m_inactiveOrders->insert(orderId, orderPtr);
-                        orderPtr->setOrderState( Order::ExecutedState, orderId );
-                    }
-                }
+// My orders
+bool ADConnection::handleMyOrders ( const DataBlock& block )
+{
+    ADBlockIndex index( block.rawDataPtr(), block.rawDataSize() );
+    ADColumnTokenizer cols;
+    while ( index.next(cols) ) {
 
-                // Unlock
-                wLocker.unlock();
+        bool ok = (cols.size() >= 29);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse my_orders line!");
+            continue;
+        }
 
-                // Emit signal for order
-                if ( orderPtr.isValid() ) {
-                    if ( orderPtr->isExecutedQty() ) {
-                        emit onOrderStateChanged( ADConnection::Order(orderPtr),
-                                                  oldState,
-                                                  Order::ExecutedState );
-
-                        // Iterate over other operations and emit signals
-                        QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
-                        for ( ; it != orderOps.end(); ++it ) {
-                            ADSmartPtr<ADOrderOperationPrivate>& op = *it;
-                            emit onOrderOperationResult( ADConnection::Order(orderPtr),
-                                                         ADConnection::Order::Operation(op),
-                                                         Order::ErrorResult );
-                        }
-                    }
+        Order::OrderId orderId = ADTextParser::toInt(cols[0], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse orderId of my_orders line!");
+            continue;
+        }
 
-                    if ( trades > 0 )
-                        emit onTrade( ADConnection::Order(orderPtr), trades );
-                }
-            }
+        QString accCode = cols[1].toString( m_win1251Codec );
+        QString status = cols[3].toString( m_win1251Codec );
+        QString b_s = cols[4].toString( m_win1251Codec );
+        ADPrice price = ADTextParser::toPrice(cols[5], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse price of my_orders line!");
+            continue;
+        }
+        int qty = ADTextParser::toInt(cols[6], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse qty of my_orders line!");
+            continue;
         }
-        // Balance (position)
-        else if ( it->blockName.contains(ADBlockName::BALANCE) ) {
-            QStringList lines = it->blockData.split("\n", QString::SkipEmptyParts);
-            for ( QStringList::Iterator it = lines.begin();
-                  it != lines.end(); ++it ) {
-                QString& line = *it;
-                QStringList cols = line.split("|");
-
-                bool ok = (cols.size() >= 35);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse balance line!");
-                    continue;
-                }
 
-                QString accCode = cols[0];
-                QString paperCode = cols[1];
-                QString market = cols[2];
-                float realRest = cols[4].toDouble(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse realRest from balance line!");
-                    continue;
-                }
-                float balancePrice = cols[8].toDouble(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse balancePrice from balance line!");
-                    continue;
-                }
-                int paperNo = cols[9].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse paperNo from balance line!");
-                    continue;
-                }
-                float varMargin = cols[34].toDouble(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse varMargin from balance line!");
-                    continue;
-                }
+        bool restQtyOk = false;
+        int restQty = ADTextParser::toInt(cols[8], &restQtyOk);
+        if ( restQtyOk && restQty > qty ) {
+            qWarning("Wrong block line: can't parse restQty of my_orders line!");
+            continue;
+        }
 
-                Position position(accCode, market, paperNo, paperCode,
-                                  static_cast<int>(realRest),
-                                  balancePrice, varMargin);
+        QString market = cols[13].toString( m_win1251Codec );
+        QString paperCode = cols[14].toString( m_win1251Codec );
+        QDateTime dropDt = ADTextParser::toDateTime( cols[28], ADTextParser::DayMonthYear );
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse dropDt of my_orders line!");
+            continue;
+        }
+        Order::Type orderBS = (b_s == "S" ? Order::Sell : Order::Buy);
 
-                // Lock
-                QWriteLocker wLocker( &m_rwLock );
-                m_positions[accCode][paperNo] = position;
-                // Unlock
-                wLocker.unlock();
-                emit onPositionChanged( position.accCode, position.paperNo );
+        // Get paper no
+        QSqlQuery query;
+        QMap<QString, QVariant> where;
+        where.insert("p_code", paperCode);
+        where.insert("place_code", market);
+        if ( !_sqlExecSelect("AD_PAPERS", where, query) || !query.next() ) {
+            qWarning("Error: new order failed! can't find paper by "
+                     "p_code '%s' and place_code '%s'",
+                     qPrintable(paperCode),
+                     qPrintable(market));
+            continue;
+        }
+        int paperNo = query.record().value("paper_no").toInt();
+
+        // Lock
+        ADWriteLocker wLocker( &m_ordersLock );
+
+        //
+        // Create order if is not created yet
+        //
+        if ( (status == "O" || status == "X" || status == "N") &&
+             ! m_inactiveOrders->contains(orderId) ) {
+            ADSmartPtr<ADOrderPrivate> order;
+            bool newlyAccepted = false;
+            quint32 trades = 0;
+            // If order newly created
+            if ( ! m_activeOrders->contains(orderId) ) {
+                newlyAccepted = true;
+                order = ADSmartPtr<ADOrderPrivate>(
+                    new ADOrderPrivate(accCode, market, orderBS, paperNo,
+                                       paperCode, qty, price, dropDt,
+                                       orderId) );
+                m_activeOrders->insert(orderId, order);
+                order->setOrderState( Order::AcceptedState );
             }
+            // If exists
+            else {
+                order = m_activeOrders->value( orderId );
+            }
+
+            // Check rest qty
+            if ( restQtyOk ) {
+                trades = order->updateRestQty( restQty );
+            }
+
+            // Unlock
+            wLocker.unlock();
+
+            if ( newlyAccepted )
+                emit onOrderStateChanged( ADConnection::Order(order),
+                                          Order::UnknownState,
+                                          Order::AcceptedState );
+            if ( trades > 0 )
+                emit onTrade( ADConnection::Order(order), trades );
         }
-        // Historical quotes
-        else if ( it->blockName.contains(ADBlockName::HIST_QUOTES) ) {
-            bool ok = false;
-            RequestId reqId = ADBlockName::HIST_QUOTES.cap(2).toInt(&ok);
-            if ( ! ok ) {
-                qWarning("Wrong block: can't parse request id from historical quotes" );
-                continue;
+        //
+        // Check if order is executed
+        //
+        else if ( status == "M" ) {
+            ADSmartPtr<ADOrderPrivate> orderPtr;
+            QList< ADSmartPtr<ADOrderOperationPrivate> > orderOps;
+            Order::State oldState = Order::UnknownState;
+            quint32 trades = 0;
+            // Mark active order as executed
+            if ( m_activeOrders->contains(orderId) ) {
+                // Remove
+                orderPtr = m_activeOrders->take(orderId);
+                m_inactiveOrders->insert(orderId, orderPtr);
+
+                // Set status
+                oldState = orderPtr->getOrderState();
+                trades = orderPtr->updateRestQty( 0 );
+                orderPtr->setOrderState( Order::ExecutedState, orderId );
             }
 
-            // Write lock
-            QWriteLocker locker( &m_rwLock );
-            if ( ! m_requests->contains(reqId) ) {
-                qWarning("Can't find registered historical request: %d", reqId);
-                continue;
+            // Try to find pended operations
+            _findOperationsByOrderId(orderId, orderOps);
+            // Wake up all operations id exist
+            QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
+            for ( ; it != orderOps.end(); ++it ) {
+                ADSmartPtr<ADOrderOperationPrivate>& op = *it;
+                op->wakeUpAll( Order::ErrorResult );
+                m_ordersOperations->remove(op->getRequestId());
             }
-            ADSmartPtr<RequestDataPrivate> reqData = m_requests->take(reqId);
 
             // Unlock
-            locker.unlock();
-
-            QStringList lines = it->blockData.split("\n", QString::SkipEmptyParts);
-            QVector<HistoricalQuote> quotes;
-            quotes.reserve( lines.size() ) ;
-            for ( QStringList::Iterator it = lines.begin();
-                  it != lines.end(); ++it ) {
-                QString& line = *it;
-                QStringList cols = line.split("|");
-
-                ok = (cols.size() >= 7);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse historical quotes line!");
-                    continue;
+            wLocker.unlock();
+
+            // Emit signal for order
+            if ( orderPtr.isValid() ) {
+                emit onOrderStateChanged( ADConnection::Order(orderPtr),
+                                          oldState,
+                                          Order::ExecutedState );
+
+                // Iterate over other operations and emit signals
+                QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
+                for ( ; it != orderOps.end(); ++it ) {
+                    ADSmartPtr<ADOrderOperationPrivate>& op = *it;
+                    emit onOrderOperationResult( ADConnection::Order(orderPtr),
+                                                 ADConnection::Order::Operation(op),
+                                                 Order::ErrorResult );
                 }
 
-                int paperNo = cols[0].toInt(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse paperNo from historical quotes line!");
-                    continue;
+                // Emit trades
+                if ( trades > 0 ) {
+                    emit onTrade( ADConnection::Order(orderPtr), trades );
                 }
+            }
+        }
+        //
+        // Check if order is dropped
+        //
+        else if ( status == "W" ) {
+            ADSmartPtr<ADOrderPrivate> orderPtr;
+            QList< ADSmartPtr<ADOrderOperationPrivate> > orderOps;
+            // Mark active order as executed
+            if ( m_activeOrders->contains(orderId) ) {
+                // Remove
+                orderPtr = m_activeOrders->take(orderId);
+                m_inactiveOrders->insert(orderId, orderPtr);
+            }
 
-                QDateTime dt = QDateTime::fromString(cols[1], "MM/dd/yyyy hh:mm:ss");
-                if ( ! ok || ! dt.isValid() ) {
-                    qWarning("Wrong block line: can't parse datetime from historical quotes line!");
-                    continue;
-                }
+            Order::State oldState = Order::UnknownState;
 
-                float open = cols[2].toDouble(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse open from historical quotes line!");
-                    continue;
-                }
+            // Set status
+            if ( orderPtr.isValid() ) {
+                oldState = orderPtr->getOrderState();
+                orderPtr->setOrderState( Order::CancelledState, orderId );
+            }
 
-                float high = cols[3].toDouble(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse high from historical quotes line!");
-                    continue;
-                }
+            // Try to find pended operations
+            _findOperationsByOrderId(orderId, orderOps);
+            // Wake up all operations id exist
+            QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
+            for ( ; it != orderOps.end(); ++it ) {
+                ADSmartPtr<ADOrderOperationPrivate>& op = *it;
+                if ( op->getOperationType() == Order::CancelOrder )
+                    op->wakeUpAll( Order::SuccessResult );
+                else
+                    op->wakeUpAll( Order::ErrorResult );
+                m_ordersOperations->remove(op->getRequestId());
+            }
 
-                float low = cols[4].toDouble(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse low from historical quotes line!");
-                    continue;
+            // Unlock
+            wLocker.unlock();
+
+            // Emit signal for order
+            if ( orderPtr.isValid() ) {
+                emit onOrderStateChanged( ADConnection::Order(orderPtr),
+                                          oldState,
+                                          Order::CancelledState );
+
+                // Iterate over other operations and emit signals
+                QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
+                for ( ; it != orderOps.end(); ++it ) {
+                    ADSmartPtr<ADOrderOperationPrivate>& op = *it;
+                    if ( op->getOperationType() == Order::CancelOrder )
+                        emit onOrderOperationResult( ADConnection::Order(orderPtr),
+                                                     ADConnection::Order::Operation(op),
+                                                     Order::SuccessResult );
+                    else
+                        emit onOrderOperationResult( ADConnection::Order(orderPtr),
+                                                     ADConnection::Order::Operation(op),
+                                                     Order::ErrorResult );
                 }
+            }
 
-                float close = cols[5].toDouble(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse close from historical quotes line!");
-                    continue;
-                }
+        }
+        else {
+            // Unknown status!
+        }
+    }
 
-                float volume = cols[6].toDouble(&ok);
-                if ( ! ok ) {
-                    qWarning("Wrong block line: can't parse volume from historical quotes line!");
-                    continue;
-                }
+    return true;
+}
+
+// My trades
+bool ADConnection::handleMyTrades ( const DataBlock& block )
+{
+    ADBlockIndex index( block.rawDataPtr(), block.rawDataSize() );
+    ADColumnTokenizer cols;
+    while ( index.next(cols) ) {
+
+        bool ok = (cols.size() >= 7);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse my_trades line!");
+            continue;
+        }
+
+        Order::OrderId orderId = ADTextParser::toInt(cols[1], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse orderId of my_trades line!");
+            continue;
+        }
 
-                HistoricalQuote quote( paperNo, open, high, low, close, volume, dt);
-                quotes.append(quote);
+        int tradesQty = ADTextParser::toInt(cols[6], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse tradesQty of my_trades line!");
+            continue;
+        }
+
+        ADSmartPtr<ADOrderPrivate> orderPtr;
+
+        // Lock
+        ADWriteLocker wLocker( &m_ordersLock );
+        // Check orders operations by order id
+        QList< ADSmartPtr<ADOrderOperationPrivate> > orderOps;
+        if ( _findOperationsByOrderId(orderId, orderOps) ) {
+            // Wake up all operations
+            QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
+            for ( ; it != orderOps.end(); ++it ) {
+                ADSmartPtr<ADOrderOperationPrivate>& op = *it;
+                op->wakeUpAll( Order::ErrorResult );
+                m_ordersOperations->remove(op->getRequestId());
+            }
+        }
+        Order::State oldState = Order::UnknownState;
+        quint32 trades = 0;
+
+        // Check active orders
+        if ( m_activeOrders->contains(orderId) ) {
+            // Get order
+            orderPtr = m_activeOrders->value(orderId);
+
+            // Set status
+            oldState = orderPtr->getOrderState();
+            trades = orderPtr->updateTradesQty( tradesQty );
+            // Check if fully executed
+            if ( orderPtr->isExecutedQty() ) {
+                m_inactiveOrders->insert(orderId, orderPtr);
+                orderPtr->setOrderState( Order::ExecutedState, orderId );
             }
+        }
 
-            reqData->setState( Request::RequestCompleted );
-            Request req;
-            req.m_reqData = reqData;
+        // Unlock
+        wLocker.unlock();
 
-            emit onHistoricalQuotesReceived( req, quotes );
+        // Emit signal for order
+        if ( orderPtr.isValid() ) {
+            if ( orderPtr->isExecutedQty() ) {
+                emit onOrderStateChanged( ADConnection::Order(orderPtr),
+                                          oldState,
+                                          Order::ExecutedState );
+
+                // Iterate over other operations and emit signals
+                QList< ADSmartPtr<ADOrderOperationPrivate> >::Iterator it = orderOps.begin();
+                for ( ; it != orderOps.end(); ++it ) {
+                    ADSmartPtr<ADOrderOperationPrivate>& op = *it;
+                    emit onOrderOperationResult( ADConnection::Order(orderPtr),
+                                                 ADConnection::Order::Operation(op),
+                                                 Order::ErrorResult );
+                }
+            }
+
+            if ( trades > 0 )
+                emit onTrade( ADConnection::Order(orderPtr), trades );
         }
-        // Others
-        else {
+    }
+
+    return true;
+}
+
+// Balance (position)
+bool ADConnection::handleBalance ( const DataBlock& block )
+{
+    ADBlockIndex index( block.rawDataPtr(), block.rawDataSize() );
+    ADColumnTokenizer cols;
+    while ( index.next(cols) ) {
+
+        bool ok = (cols.size() >= 35);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse balance line!");
+            continue;
+        }
+
+        QString accCode = cols[0].toString( m_win1251Codec );
+        QString paperCode = cols[1].toString( m_win1251Codec );
+        QString market = cols[2].toString( m_win1251Codec );
+        float realRest = ADTextParser::toDouble(cols[4], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse realRest from balance line!");
+            continue;
+        }
+        float balancePrice = ADTextParser::toDouble(cols[8], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse balancePrice from balance line!");
+            continue;
+        }
+        int paperNo = ADTextParser::toInt(cols[9], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse paperNo from balance line!");
+            continue;
+        }
+        float varMargin = ADTextParser::toDouble(cols[34], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse varMargin from balance line!");
+            continue;
+        }
+
+        Position position(accCode, market, paperNo, paperCode,
+                          static_cast<int>(realRest),
+                          balancePrice, varMargin);
+
+        // Lock
+        ADWriteLocker wLocker( &m_positionsLock );
+        m_positions[accCode][paperNo] = position;
+        // Unlock
+        wLocker.unlock();
+        emit onPositionChanged( position.accCode, position.paperNo );
+    }
+
+    return true;
+}
+
+// Historical quotes
+bool ADConnection::handleHistQuotes ( const DataBlock& block )
+{
+    int timeFrame = 0;
+    RequestId reqId = InvalidRequestId;
+    if ( ! ADBlockName::parseHistQuotesTag(block.streamTag, timeFrame, reqId) ) {
+        qWarning("Wrong block: can't parse request id from historical quotes" );
+        return false;
+    }
+
+    // Write lock
+    ADWriteLocker locker( &m_ordersLock );
+    if ( ! m_requests->contains(reqId) ) {
+        qWarning("Can't find registered historical request: %d", reqId);
+        return false;
+    }
+    ADSmartPtr<RequestDataPrivate> reqData = m_requests->take(reqId);
+
+    // Unlock
+    locker.unlock();
+
+    ADBlockIndex index( block.rawDataPtr(), block.rawDataSize() );
+    ADColumnTokenizer cols;
+    QVector<HistoricalQuote> quotes;
+    while ( index.next(cols) ) {
+
+        bool ok = (cols.size() >= 7);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse historical quotes line!");
+            continue;
+        }
+
+        int paperNo = ADTextParser::toInt(cols[0], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse paperNo from historical quotes line!");
+            continue;
         }
 
-        emit onDataReceived( *it );
+        QDateTime dt = ADTextParser::toDateTime( cols[1], ADTextParser::MonthDayYear );
+        if ( ! ok || ! dt.isValid() ) {
+            qWarning("Wrong block line: can't parse datetime from historical quotes line!");
+            continue;
+        }
+
+        ADPrice open = ADTextParser::toPrice(cols[2], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse open from historical quotes line!");
+            continue;
+        }
+
+        ADPrice high = ADTextParser::toPrice(cols[3], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse high from historical quotes line!");
+            continue;
+        }
+
+        ADPrice low = ADTextParser::toPrice(cols[4], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse low from historical quotes line!");
+            continue;
+        }
+
+        ADPrice close = ADTextParser::toPrice(cols[5], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse close from historical quotes line!");
+            continue;
+        }
+
+        float volume = ADTextParser::toDouble(cols[6], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse volume from historical quotes line!");
+            continue;
+        }
+
+        HistoricalQuote quote( paperNo, open, high, low, close, volume, dt);
+        quotes.append(quote);
+    }
+
+    reqData->setState( Request::RequestCompleted );
+    Request req;
+    req.m_reqData = reqData;
+
+    emit onHistoricalQuotesReceived( req, quotes );
+
+    return true;
+}
+
+// Parse papers: {paper_no, p_code, ..., price_step (25), ...}
+bool ADConnection::handlePapers ( const DataBlock& block )
+{
+    ADBlockIndex index( block.rawDataPtr(), block.rawDataSize() );
+    ADColumnTokenizer cols;
+    while ( index.next(cols) ) {
+
+        bool ok = (cols.size() >= 26);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse papers line!");
+            continue;
+        }
+
+        int paperNo = ADTextParser::toInt(cols[0], &ok);
+        if ( ! ok ) {
+            qWarning("Wrong block line: can't parse paper no of papers line!");
+            continue;
+        }
+        ADPrice priceStep = ADTextParser::toPrice(cols[25], &ok);
+        if ( ! ok )
+            continue;
+
+        m_priceSteps.insert( paperNo, priceStep );
+
+        QuoteShard& shard = quoteShard( paperNo );
+
+        // Lock
+        ADWriteLocker wLocker( &shard.lock );
+        QHash<int, Quote>::Iterator it = shard.quotes.find( paperNo );
+        if ( it != shard.quotes.end() ) {
+            it->priceStep = priceStep;
+            TimeMark nowMark = 0;
+            timeMark( nowMark );
+            m_quoteSnapshots->publish( *it, nowMark );
+        }
     }
+
+    return true;
+}
+
+ADPrice ADConnection::paperPriceStep ( int paperNo )
+{
+    QHash<int, ADPrice>::ConstIterator it = m_priceSteps.constFind( paperNo );
+    if ( it != m_priceSteps.constEnd() )
+        return *it;
+
+    ADPrice priceStep;
+    if ( m_adDB.isOpen() ) {
+        QSqlQuery query;
+        QMap<QString, QVariant> where;
+        where.insert("paper_no", paperNo);
+        if ( _sqlExecSelect("AD_PAPERS", where, query) && query.next() )
+            priceStep = ADPrice::fromDouble(
+                query.record().value("price_step").toDouble() );
+    }
+
+    // Unknown paper is cached as zero step, papers stream will update it
+    m_priceSteps.insert( paperNo, priceStep );
+    return priceStep;
 }
 
 void ADConnection::storeDataIntoDB ( const QList<DataBlock>& recv )
@@ -3865,13 +4807,10 @@ void ADConnection::storeDataIntoDB ( const QList<DataBlock>& recv )
     QList<DataBlock>::ConstIterator it = recv.begin();
     for ( ; it != recv.end(); ++it ) {
         // For now we do not support empty blocks
-        if ( it->blockData.isEmpty() )
+        if ( it->dataSize == 0 )
             continue;
 
-        QString blockName = it->blockName;
-        QRegExp rx("(\\*.*\\*)");
-        int rxRes = rx.indexIn(blockName);
-        blockName = (rxRes != -1 ? rx.cap(1) : blockName);
+        const QString& blockName = it->streamTag;
 
         QString filterName;
         QString tableName;
@@ -3886,13 +4825,14 @@ void ADConnection::storeDataIntoDB ( const QList<DataBlock>& recv )
             tableName = AD_DB_PREFIX + filterName.toUpper();
         }
         // For historical quotes we get timeframe from block name
-        else if ( it->blockName.contains(ADBlockName::HIST_QUOTES) ) {
+        else if ( it->streamId == HistQuotesStream ) {
             isHistQuotesStream = true;
             filterName = "historical_quotes";
             tableName = AD_DB_PREFIX + filterName.toUpper();
-            bool ok = false;
-            histQuotes_timeFrameVal = ADBlockName::HIST_QUOTES.cap(1).toInt(&ok);
-            if ( ! ok ) {
+            RequestId reqId = InvalidRequestId;
+            if ( ! ADBlockName::parseHistQuotesTag(it->streamTag,
+                                                   histQuotes_timeFrameVal,
+                                                   reqId) ) {
                 qWarning("Block name is incorrect!");
                 return;
             }
@@ -3900,8 +4840,6 @@ void ADConnection::storeDataIntoDB ( const QList<DataBlock>& recv )
         else
             return;
 
-        QStringList lines = it->blockData.split("\r\n");
-
         // Cache DB schema
         if ( m_dbSchema.size() == 0 && ! _sqlGetDBSchema(m_dbSchema) ) {
             qWarning("Can't get DB schema!");
@@ -3916,10 +4854,11 @@ void ADConnection::storeDataIntoDB ( const QList<DataBlock>& recv )
 
         QStringList& tableFields = m_dbSchema[tableName];
 
-        foreach ( QString line, lines ) {
-            QStringList cols = line.split("|");
-            // Remove last column, because of trailing |
-            cols.removeLast();
+        ADBlockIndex index( it->rawDataPtr(), it->rawDataSize() );
+        ADColumnTokenizer cols;
+        while ( index.next(cols) ) {
+            // Skip last column, because of trailing |
+            const int colsNum = cols.size() - 1;
             QStringList placeHolders;
             QStringList colsNames;
             QStringList colsNamesEsc;
@@ -3927,17 +4866,17 @@ void ADConnection::storeDataIntoDB ( const QList<DataBlock>& recv )
 
             // Strange AD behaviour
             // Sometimes on connect it sends some streams with single column
-            if ( cols.size() == 1 )
+            if ( colsNum == 1 )
                 continue;
 
-            for ( int i = 0, j = 0; j < cols.size() && i < tableFields.size(); ++i ) {
+            for ( int i = 0, j = 0; j < colsNum && i < tableFields.size(); ++i ) {
                 if ( isHistQuotesStream && tableFields[i] == histQuotes_timeFrameKey )
                     colsValues.append(QString("%1").arg(histQuotes_timeFrameVal));
                 else {
                     int idx = j++;
                     if ( cols[idx].isEmpty() )
                         continue;
-                    colsValues.append(cols[idx]);
+                    colsValues.append(cols[idx].toString( m_win1251Codec ));
                 }
 
                 placeHolders.append("?");
@@ -3974,22 +4913,17 @@ void ADConnection::storeDataIntoDB ( const QList<DataBlock>& recv )
                 // Timestamp
                 if ( s_tablesTimestamps.contains(filterName) &&
                      s_tablesTimestamps[filterName].contains(colsNames[i]) ) {
-                    QString& timestampVal = colsValues[i];
-
-                    QRegExp dateTime1Rx("^(\\d+\\/\\d+\\/\\d+ \\d+:\\d+:\\d+)$");
-                    QRegExp dateTime2Rx("^(\\d+\\/\\d+\\/\\d+ \\d+:\\d+)$");
-                    QRegExp dateRx("^(\\d+\\/\\d+\\/\\d+)$");
-
-                    if ( timestampVal.contains(dateTime1Rx) ) {
-                        if ( isHistQuotesStream )
-                            var = QDateTime::fromString(timestampVal, "MM/dd/yyyy hh:mm:ss");
-                        else
-                            var = QDateTime::fromString(timestampVal, "dd/MM/yyyy hh:mm:ss");
-                    }
-                    else if ( timestampVal.contains(dateTime2Rx) )
-                        var = QDateTime::fromString(timestampVal, "dd/MM/yyyy hh:mm");
-                    else if ( timestampVal.contains(dateRx) )
-                        var = QDateTime::fromString(timestampVal, "dd/MM/yyyy");
+                    QByteArray timestampVal = colsValues[i].toLatin1();
+                    ADTextRange timestampRange( timestampVal.constData(),
+                                                timestampVal.constData() +
+                                                timestampVal.size() );
+
+                    QDateTime dt = ADTextParser::toDateTime(
+                        timestampRange,
+                        isHistQuotesStream ? ADTextParser::MonthDayYear :
+                                             ADTextParser::DayMonthYear );
+                    if ( dt.isValid() )
+                        var = dt;
                     else
                         qWarning("Field '%d' for table '%s' is not TIMESTAMP", i,
                                  qPrintable(tableName));
@@ -4009,7 +4943,7 @@ void ADConnection::storeDataIntoDB ( const QList<DataBlock>& recv )
                          qPrintable(query.lastError().text()));
                 qWarning("SQL QUERY (block name=%s, cols size=%d): #%s#\n",
                          qPrintable(blockName),
-                         cols.size(),
+                         colsNum,
                          qPrintable(sql));
             }
 
@@ -4070,12 +5004,28 @@ bool ADConnection::setADFilters (
                                  const QHash<QString, QHash<QString, int> >& complexFilter )
 {
     //Lock
-    QWriteLocker wLocker( &m_rwLock );
+    ADWriteLocker wLocker( &m_subscrLock );
+
+    // Papers of old and new quote filters
+    QSet<QString> paperKeys;
+    const char* quoteFilters[] = { "filter_q", "filter_f" };
+    for ( int i = 0; i < 2; ++i ) {
+        paperKeys.unite( QSet<QString>::fromList(m_complexFilter.value(quoteFilters[i]).keys()) );
+        paperKeys.unite( QSet<QString>::fromList(complexFilter.value(quoteFilters[i]).keys()) );
+    }
 
     // Set filters
     m_simpleFilter = simpleFilter;
     m_complexFilter = complexFilter;
 
+    // Papers become interesting before filters are sent
+    foreach ( const QString& key, paperKeys ) {
+        bool ok = false;
+        int paperNo = key.toInt( &ok );
+        if ( ok )
+            _updatePaperInterest( paperNo );
+    }
+
     return sendADFilters( QSet<QString>::fromList(s_simpleFilters.values()), m_simpleFilter,
                           s_complexFilters, m_complexFilter );
 }
@@ -4083,7 +5033,7 @@ bool ADConnection::setADFilters (
 bool ADConnection::resendADFilters ()
 {
     //Lock
-    QWriteLocker wLocker( &m_rwLock );
+    ADWriteLocker wLocker( &m_subscrLock );
 
     return sendADFilters( QSet<QString>::fromList(s_simpleFilters.values()), m_simpleFilter,
                           s_complexFilters, m_complexFilter );
@@ -4091,53 +5041,16 @@ bool ADConnection::resendADFilters ()
 
 bool ADConnection::parseReceivedData ( QList<DataBlock>& outRecv )
 {
-    QString endBlock( "\r\n\r\n" );
-
-    QString decodedData;
-    bool res = readFromSock( decodedData );
+    bool res = readFromSock();
     if ( ! res )
         return false;
 
-    m_sockBuffer += decodedData;
-
-    int lastIndx = m_sockBuffer.lastIndexOf( endBlock );
-    if ( lastIndx == -1 )
-        return false;
-
-    QStringList recv;
-
-    if ( m_sockBuffer.size() - lastIndx  == endBlock.size() ) {
-        recv = m_sockBuffer.split( endBlock, QString::SkipEmptyParts );
-        m_sockBuffer.clear();
-    }
-    else {
-        int lastStrIndx = m_sockBuffer.size() - lastIndx - endBlock.size();
-        recv = m_sockBuffer.left( lastIndx ).split( endBlock );
-        m_sockBuffer = m_sockBuffer.right( lastStrIndx );
-    }
-
-    if ( recv.size() == 0 ) {
-        qWarning("empty data list!");
-        return false;
-    }
-
     // Clear
     outRecv.clear();
 
-    for ( int i = 0; i < recv.size(); ++i ) {
-        const QString& block = recv[i];
-        int indx = block.indexOf( "\r\n" );
-        DataBlock adBlock;
-        // Block with empty body
-        if ( indx == -1 )
-            adBlock.blockName = block;
-        else {
-            int dataIndx = block.size() - indx - 2;
-            adBlock.blockName = block.left(indx);
-            adBlock.blockData = block.right(dataIndx);
-        }
-        outRecv.append( adBlock );
-    }
+    // Split on raw bytes, bodies are not copied
+    if ( ! m_blockFramer->takeBlocks(outRecv) )
+        return false;
 
 #ifdef DO_ALL_LOGGING
     // Log everything
@@ -4152,7 +5065,7 @@ bool ADConnection::parseReceivedData ( QList<DataBlock>& outRecv )
             DataBlock& db = *it;
             m_mainLogFile->write( db.blockName.toLocal8Bit() );
             m_mainLogFile->write( "\n" );
-            m_mainLogFile->write( db.blockData.toLocal8Bit() );
+            m_mainLogFile->write( db.blockData().toLocal8Bit() );
             m_mainLogFile->write( "\n\n" );
         }
         m_mainLogFile->flush();
@@ -4188,7 +5101,7 @@ bool ADConnection::parseAuthResponse ( const ADConnection::DataBlock& block )
         return false;
     }
 
-    QStringList authResp = block.blockData.split("|");
+    QStringList authResp = block.blockData().split("|");
     if ( authResp.size() < 4 ) {
         qWarning("wrong auth block data!");
         return false;
@@ -4270,12 +5183,15 @@ void ADConnection::tcpWriteToSock ( const QByteArray& ba, bool& ret )
     return;
 }
 
-bool ADConnection::readFromSock ( QString& data )
+bool ADConnection::readFromSock ()
 {
     Q_ASSERT(QThread::currentThread() == this && m_sock);
 
     QByteArray ba = m_sock->readAll();
     if ( ba.size() == 0 ) {
+        // Woken up by decoder
+        if ( m_adLib->decodeStreamNotifier() >= 0 )
+            return takeDecodedStream();
         qWarning("socket buff is empty!");
         return false;
     }
@@ -4287,48 +5203,64 @@ bool ADConnection::readFromSock ( QString& data )
     if ( m_sessInfo.encType.size() == 0 ) {
         // Feel decoded statistics
         atomic_add64(&m_statRxDecoded, ba.size());
-        data = m_win1251Codec->toUnicode(ba);
+        m_blockFramer->append( ba );
         return true;
     }
 
-    // Concat encoded data
-    m_sockEncBuffer += ba;
-
-    char* ptr = 0;
-    unsigned int sz = 0;
-    unsigned int parsed = 0;
-    bool res = m_adLib->decode( m_sessInfo.encType.data(), m_sessInfo.encType.size(),
-                                m_sessInfo.sessionKey.data(), m_sockEncBuffer.data(),
-                                m_sockEncBuffer.size(), &ptr, &sz, &parsed );
+    // Feed only new bytes, not parsed tail is kept by the library.
+    // Do not wait for decode: network reads and encodes of outgoing
+    // requests go on, decoded chunks are taken when ready.
+    bool res = m_adLib->submitDecodeStream( m_sessInfo.encType.data(), m_sessInfo.encType.size(),
+                                            m_sessInfo.sessionKey.data(), ba.data(), ba.size() );
     if ( ! res ) {
         qWarning("decode failed!");
-        goto error;
-    }
-    else if ( ptr == 0 ) {
-        // Is not enough to decode. Will try next read
+        m_lastError = DynamicLibCallError;
+        m_adLib->resetDecodeStream();
+        QThread::quit();
         return false;
     }
-    else if ( parsed > (unsigned int)m_sockEncBuffer.size() ) {
-        qWarning("decode failed: wrong parsed size: %d", parsed);
-        goto error;
-    }
 
-    // Feel decoded statistics
-    atomic_add64(&m_statRxDecoded, sz);
+    return takeDecodedStream();
+}
+
+bool ADConnection::takeDecodedStream ()
+{
+    bool appended = false;
+    // Without notifier result can't be taken later
+    bool wait = ( m_adLib->decodeStreamNotifier() < 0 );
+
+    // Take at least once, notifier is acknowledged even if nothing is pending
+    do {
+        char* ptr = 0;
+        unsigned int sz = 0;
+        bool taken = false;
+        bool res = m_adLib->takeDecodeStream( wait, &taken, &ptr, &sz );
+        if ( ! res ) {
+            qWarning("decode failed!");
+            goto error;
+        }
+        else if ( ! taken ) {
+            // Not decoded yet, notifier will wake us up
+            break;
+        }
+        else if ( ptr == 0 ) {
+            // Is not enough to decode. Will try next read
+            continue;
+        }
 
-    // Remove already parsed data
-    m_sockEncBuffer = m_sockEncBuffer.right( m_sockEncBuffer.size() - parsed );
+        // Feel decoded statistics
+        atomic_add64(&m_statRxDecoded, sz);
 
-    data = m_win1251Codec->toUnicode(ptr, sz);
-    m_adLib->freeMemory( ptr );
+        m_blockFramer->append( ptr, sz );
+        m_adLib->freeMemory( ptr );
+        appended = true;
+    } while ( m_adLib->pendingDecodeStream() );
 
-    return true;
+    return appended;
 
  error:
     m_lastError = DynamicLibCallError;
-    m_sockEncBuffer.clear();
-    if ( ptr )
-        m_adLib->freeMemory( ptr );
+    m_adLib->resetDecodeStream();
     QThread::quit();
     return false;
 }
@@ -3,6 +3,7 @@
 
 #include <QTcpSocket>
 #include <QHash>
+#include <QVector>
 #include <QFile>
 #include <QString>
 #include <QDateTime>
@@ -17,6 +18,8 @@
 
 #include "ADSmartPtr.h"
 #include "ADLibrary.h"
+#include "ADPrice.h"
+#include "ADStatLock.h"
 #include "ADOption.h"
 
 struct ADSessionInfo
@@ -154,8 +157,8 @@ public:
         /** Returns order qty */
         quint32 getOrderQty () const;
 
-        /** Returns order price */
-        float getOrderPrice () const;
+        /** Returns order price, use toDouble() for floating point value */
+        ADPrice getOrderPrice () const;
 
         /** Returns order paper code */
         QString getOrderPaperCode () const;
@@ -176,22 +179,119 @@ public:
         ADSmartPtr<class ADOrderPrivate> m_order;
     };
 
+    /**
+     * AD streams, are classified by block '*tag*' once on receive.
+     * Streams without special handling are UnknownStream.
+     */
+    enum StreamId
+    {
+        UnknownStream = 0,
+        ServerTimeStream,      // *st*
+        BrokerMessageStream,   // *opmsgid*
+        OrdersQueueInitStream, // *qinit*
+        OrdersQueueStream,     // *qu*, *q1*
+        QuoteInitStream,       // *finit*
+        QuoteStream,           // *f0*, *f1*, *f2*, *f3*
+        PapersStream,          // *pap*
+        AllTradesStream,       // *at*
+        MyTradesStream,        // *tr*
+        MyOrdersStream,        // *rq*
+        BalanceStream,         // *bl*
+        HistQuotesStream,      // *ti<timeframe>-<request id>*
+
+        StreamIdCount
+    };
+
     struct DataBlock
     {
+        DataBlock ();
+
+        /** Returns body decoded from Windows-1251. Decodes on every call! */
+        QString blockData () const;
+
+        /**
+         * Returns raw Windows-1251 body without copying.
+         * Result is valid while this block is alive.
+         */
+        QByteArray rawData () const;
+        const char* rawDataPtr () const;
+        int rawDataSize () const;
+
         QString blockName;
-        QString blockData;
+        // First '*tag*' of block name and its stream
+        QString streamTag;
+        StreamId streamId;
+
+        // Body is a view into shared received chunk
+        QByteArray storage;
+        int dataOffset;
+        int dataSize;
+    };
+
+    /**
+     * Custom stream handler, is called from connection thread for
+     * every block of the stream after built-in handling.
+     */
+    class StreamHandler
+    {
+    public:
+        virtual ~StreamHandler () {}
+        virtual void handleBlock ( const ADConnection::DataBlock& ) = 0;
     };
 
     struct BidOffer
     {
         BidOffer ();
-        BidOffer ( float p, int b, int s );
+        BidOffer ( ADPrice p, int b, int s );
 
-        float price;
+        ADPrice price;
         int buyersQty;
         int sellersQty;
     };
 
+    /**
+     * One side of order book. Levels are kept sorted from the best price
+     * (descending for buyers, ascending for sellers) in contiguous memory:
+     * best level is the first one, update is a binary search and a move
+     * of the tail, which is short near the best price.
+     */
+    class BookSide
+    {
+    public:
+        enum Order
+        {
+            Ascending = 0,
+            Descending
+        };
+
+        struct Level
+        {
+            ADPrice price;
+            int qty;
+        };
+
+        BookSide ( Order order = Ascending );
+
+        int size () const { return m_levels.size(); }
+        bool isEmpty () const { return m_levels.isEmpty(); }
+        /** Level by depth, 0 is the best */
+        const Level& operator[] ( int i ) const { return m_levels.at(i); }
+        /** Best level or 0 if side is empty */
+        const Level* best () const;
+        /** Quantity at price, 0 if there is no such level */
+        int qty ( ADPrice price ) const;
+
+        /** Sets quantity at price, non positive quantity removes level */
+        void set ( ADPrice price, int qty );
+        void clear ();
+
+    private:
+        int lowerBound ( ADPrice price ) const;
+
+        Order m_order;
+        QVector<Level> m_levels;
+    };
+
     struct Quote
     {
         Quote ();
@@ -199,29 +299,115 @@ public:
         int paperNo;
         QString paperCode;
         QString market;
-        float lastPrice;
+        ADPrice lastPrice;
+        /** Instrument price step from papers reference data, zero if unknown */
+        ADPrice priceStep;
 
-        float getBestSeller () const;
-        float getBestBuyer () const;
+        ADPrice getBestSeller () const;
+        ADPrice getBestBuyer () const;
 
         QString toStringBestSellers ( quint32 num ) const;
         QString toStringBestBuyers ( quint32 num ) const;
 
-        QMap<float, int> buyers;
-        QMap<float, int> sellers;
-        QMap<float, BidOffer> bidOffers;
+        /** Both sides merged by price, ascending */
+        QVector<BidOffer> getBidOffers () const;
+
+        BookSide buyers;
+        BookSide sellers;
+    };
+
+    /**
+     * Fixed size copy of quote with top MaxDepth levels of each book
+     * side. Is published by connection thread on every quote change
+     * and is read without any locks, see getQuoteSnapshot.
+     */
+    struct QuoteSnapshot
+    {
+        enum { MaxDepth = 16 };
+
+        QuoteSnapshot ();
+
+        ADPrice getBestSeller () const;
+        ADPrice getBestBuyer () const;
+
+        int paperNo;
+        /** Grows on every publication of this paper */
+        quint32 version;
+        /** Time of publication, see timeMark */
+        quint64 timeMark;
+        ADPrice lastPrice;
+        ADPrice priceStep;
+        int buyersNum;
+        int sellersNum;
+        /** Best levels first */
+        BookSide::Level buyers[ MaxDepth ];
+        BookSide::Level sellers[ MaxDepth ];
+    };
+
+    /** Fields of DepthSnapshot which do not depend on depth */
+    struct DepthHeader
+    {
+        int paperNo;
+        /** Version of quote snapshot, zero if quote was not received */
+        quint32 version;
+        /** Time of publication, see timeMark */
+        quint64 timeMark;
+        ADPrice lastPrice;
+        ADPrice priceStep;
+        int buyersNum;
+        int sellersNum;
+    };
+
+    /**
+     * Top N levels of quote snapshot, N is not greater than
+     * QuoteSnapshot::MaxDepth. Has fixed size and is filled by
+     * getDepth without locks and heap allocations.
+     */
+    template <int N>
+    struct DepthSnapshot : public DepthHeader
+    {
+        enum { Depth = N };
+
+        ADPrice getBestSeller () const
+        { return (sellersNum > 0 ? sellers[0].price : ADPrice()); }
+        ADPrice getBestBuyer () const
+        { return (buyersNum > 0 ? buyers[0].price : ADPrice()); }
+
+        /** Best levels first */
+        BookSide::Level buyers[ N ];
+        BookSide::Level sellers[ N ];
+    };
+
+    /**
+     * Quote changes since previous delta, see Subscription::takeDelta.
+     * Levels are in order of arrival, non positive qty removes level
+     * of that side. If reset is set, book was replaced or changes were
+     * already dropped: levels are the whole current book (ascending)
+     * and local book must be cleared before they are applied.
+     */
+    struct QuoteDelta
+    {
+        QuoteDelta ();
+
+        int paperNo;
+        /** Sequence of the last change of paper, grows on every change */
+        quint64 seq;
+        bool reset;
+        bool lastPriceChanged;
+        ADPrice lastPrice;
+        QVector<BidOffer> levels;
     };
 
     struct HistoricalQuote
     {
         HistoricalQuote ();
-        HistoricalQuote ( int, float, float, float, float, float, const QDateTime& );
+        HistoricalQuote ( int, ADPrice, ADPrice, ADPrice, ADPrice, float, const QDateTime& );
 
         int paperNo;
-        float open;
-        float high;
-        float low;
-        float close;
+        ADPrice open;
+        ADPrice high;
+        ADPrice low;
+        ADPrice close;
         float volume;
         QDateTime dt;
     };
@@ -249,14 +435,18 @@ public:
     public:
         enum Type {
             QuoteSubscription = 1<<0,
-            QueueSubscription = 1<<1
+            QueueSubscription = 1<<1,
+            // Keep quote changes of papers for takeDelta,
+            // implies QueueSubscription (to be notified of changes)
+            DeltaSubscription = 1<<2
         };
 
         enum ResultType {
             SuccessResult = 0,
             InterruptResult,
             NotInitedResult,
-            WrongThreadResult
+            WrongThreadResult,
+            TimeoutResult
         };
 
         struct Result {
@@ -264,11 +454,19 @@ public:
             int paperNo;
         };
 
+        /**
+         * Paper is given not more often than once per delay. Delay is
+         * minDelay, or adapts between minDelay and maxDelay if maxDelay
+         * is greater: it grows while consumer picks papers up late and
+         * relaxes while consumer keeps up, so slow consumer gets
+         * conflated current data instead of growing backlog.
+         */
         class Options {
         public:
             Options ( const QSet<int>&, quint32 subscrType,
                       quint32 subscrTypeReceive,
-                      quint32 minDelay = 0 );
+                      quint32 minDelay = 0,
+                      quint32 maxDelay = 0 );
 
         private:
             friend class ADSubscriptionPrivate;
@@ -277,10 +475,64 @@ public:
             quint32 m_subscrType;
             quint32 m_subscrTypeReceive;
             quint32 m_minDelay;
+            quint32 m_maxDelay;
+        };
+
+        struct PaperStatistics
+        {
+            int paperNo;
+            // Current delay of paper
+            quint32 delay;
+            // Time between paper became ready and was taken last time
+            quint32 lastLag;
+            // Updates merged into already pending ones
+            quint64 conflated;
+            // Times paper was taken
+            quint64 delivered;
         };
 
         Result waitForUpdate ();
+        /**
+         * Takes up to max (at least one) ready papers of one wake-up.
+         * If snapshots are given, they are filled in the same order as
+         * results (zero version if quote was not received yet).
+         * Zero msecs waits forever.
+         */
+        ResultType waitForUpdates ( QVector<Result>& out, int max,
+                                    quint32 msecs = 0,
+                                    QVector<QuoteSnapshot>* snapshots = 0 );
+        /**
+         * File descriptor for epoll/select loops, is readable while
+         * updates are pending (delayed updates included), take them
+         * with pollUpdates. Returns -1 if platform does not support it.
+         * Descriptor is owned by subscription.
+         */
+        int eventFd ();
+        /** As waitForUpdates, but never blocks and can be called from any thread */
+        ResultType pollUpdates ( QVector<Result>& out, int max,
+                                 QVector<QuoteSnapshot>* snapshots = 0 );
+        /**
+         * Worker pool mode: ready papers are spread between per worker
+         * queues, idle worker steals from others. Every worker (any
+         * thread, worker is 0..workersNum-1) takes papers with takeUpdate
+         * and must release each of them with releaseUpdate. Paper is never
+         * given to two workers at once, its updates which come while it is
+         * taken are given after release, so per paper order is kept.
+         * Must be set before workers start, do not mix with other waits.
+         */
+        bool setWorkers ( int workersNum );
+        Result takeUpdate ( int worker, quint32 msecs = 0 );
+        void releaseUpdate ( int paperNo );
+        bool getStatistics ( QVector<PaperStatistics>& );
         bool peekQuote ( int paperNo, Quote& );
+        /** As peekQuote, but without locking the connection */
+        bool peekQuoteSnapshot ( int paperNo, QuoteSnapshot& );
+        /**
+         * Changes of paper since previous call, paper must be subscribed
+         * with DeltaSubscription. The first delta is a reset with the
+         * whole book. Pending update of paper is not cancelled.
+         */
+        bool takeDelta ( int paperNo, QuoteDelta& );
         bool isValid () const;
         operator bool () const;
 
@@ -307,6 +559,51 @@ public:
                    float impl_vol, float sell_impl_vol, float buy_impl_vol );
     };
 
+    /**
+     * Startup timing breakdown, msecs. Bootstrap with library load,
+     * DB open and HTTPS request are executed concurrently.
+     */
+    struct StartupStatistics
+    {
+        quint32 bootstrap;
+        quint32 libLoad;
+        quint32 dbOpen;
+        quint32 https;
+        quint32 sessionInfo;
+        // From TCP connect till auth response
+        quint32 tcpAuth;
+        // From start till connected state
+        quint32 connected;
+        // From start till first quote update, 0 if no quotes yet
+        quint32 firstQuote;
+
+        StartupStatistics ();
+    };
+
+    /**
+     * Independently locked parts of connection state.
+     * Locks are taken in this order, never in reverse.
+     */
+    enum LockDomain
+    {
+        SubscriptionsLock = 0, // Subscriptions and AD filters
+        OrdersLock,            // Orders, order operations and requests
+        PositionsLock,         // Positions
+        QuotesLock,            // Quotes, sharded by paper number
+        GeneralLock,           // Server time, statistics, templates
+        LockDomainCount
+    };
+
+    struct LockStatistics
+    {
+        // Blocked lock acquisitions
+        quint64 contended;
+        // Total time of waiting for blocked acquisitions
+        quint64 waitUsecs;
+
+        LockStatistics ();
+    };
+
     /**
      * Time frame values. Synced with AD stream responses,
      * i.e. do not change them!
@@ -358,6 +655,12 @@ public:
     ADConnection::Error error () const;
     bool getNetworkStatistics ( quint64& rxNet, quint64& txNet,
                                 quint64& rxDecoded, quint64& txEncoded ) const;
+    bool getStartupStatistics ( StartupStatistics& ) const;
+    bool getLockStatistics ( LockDomain, LockStatistics& ) const;
+
+    /// Sets custom handler of the stream (0 removes it). Handler is not
+    /// owned and must not be destroyed while connection is running.
+    bool setStreamHandler ( StreamId, StreamHandler* );
 
     /// Quote info and subscription
     Subscription subscribeToQuotes ( const QList<Subscription::Options>& opts );
@@ -368,6 +671,31 @@ public:
                                    Request& request );
 
     bool getQuote ( int paperNo, Quote& quote ) const;
+    /**
+     * Lock free, never blocks connection thread. Only the first call
+     * for a paper takes subscriptions lock to mark paper interesting.
+     */
+    bool getQuoteSnapshot ( int paperNo, QuoteSnapshot& snapshot ) const;
+    /** Lock free as getQuoteSnapshot, but copies only top N levels */
+    template <int N>
+    bool getDepth ( int paperNo, DepthSnapshot<N>& depth ) const
+    {
+        // Deeper levels are not published
+        typedef char DepthIsTooLarge[ (N > 0 && N <= QuoteSnapshot::MaxDepth) ? 1 : -1 ];
+        (void)sizeof(DepthIsTooLarge);
+        return readDepth( paperNo, N, depth, depth.buyers, depth.sellers );
+    }
+    /**
+     * Quote lines of papers nobody is interested in are dropped right
+     * after paper number is parsed. Paper is interesting if it is in
+     * a subscription or in quote filters of setADFilters, or if it was
+     * asked once by getQuote, getQuoteSnapshot or getDepth (first call
+     * for a paper returns nothing, its lines are kept from then on).
+     * Keep all to fill quotes of every received paper (already dropped
+     * lines are not restored).
+     */
+    void setKeepAllQuotes ( bool keepAll );
+    bool isKeepAllQuotes () const;
     bool getPositions ( QList<Position>& ) const;
     bool getPosition ( const QString& accCode, int paperNo, Position& ) const;
     bool findFutures ( const QString& market,
@@ -377,9 +705,17 @@ public:
 
     /// Trade operations
     Order::Operation tradePaper ( Order&, const QString& accCode,
-                                  Order::Type, int paperNo, quint32 qty, float price );
+                                  Order::Type, int paperNo, quint32 qty, ADPrice price );
     Order::Operation cancelOrder ( Order );
-    Order::Operation changeOrder ( Order, quint32 qty, float price );
+    Order::Operation changeOrder ( Order, quint32 qty, ADPrice price );
+
+    /**
+     * Floating point price is taken with float precision and snapped
+     * to the price step of the paper, if step is already known
+     */
+    Order::Operation tradePaper ( Order&, const QString& accCode,
+                                  Order::Type, int paperNo, quint32 qty, double price );
+    Order::Operation changeOrder ( Order, quint32 qty, double price );
 
     // DB operations
     bool logQuote ( bool updateType, const QDateTime& nowDt,
@@ -387,6 +723,13 @@ public:
                     const ADOption& opt, const ADConnection::Quote& optQuote,
                     float impl_vol, float sell_impl_vol, float buy_impl_vol );
 
+    /// Number of AD API server processes shared by connections (Linux only).
+    /// Zero means number of CPUs, applied to processes started later.
+    static void setServerPoolSize ( unsigned int size );
+    /// Keep AD API servers running between connects and spawn standby
+    /// server in background right away (Linux only).
+    static void setServerKeepWarm ( bool keepWarm );
+
     /// Static helper methods
     typedef quint64 TimeMark;
 
@@ -395,6 +738,7 @@ public:
     static quint32 msecsDiffTimeMark ( const TimeMark&, const TimeMark& );
     static TimeMark timeMarkAppendMsecs ( const TimeMark&, quint32 msecs );
     static bool stringToTimeFrame ( const QString&, TimeFrame& );
+    static StreamId streamIdByTag ( const char* tag, int len );
 
     static bool ADTimeToDateTime ( int lastUpdate, QDateTime& dt );
     static bool dateTimeToADTime ( const QDateTime& dt, int& adTime );
@@ -420,7 +764,7 @@ signals:
     void onTradePaper ( ADConnection::Order::Operation op );
     void onCancelOrder ( ADConnection::Order::Operation op );
     void onChangeOrder ( ADConnection::Order::Operation op,
-                         quint32 qty, float price );
+                         quint32 qty, ADPrice price );
 
     void onLogQuote ( ADSmartPtr<ADConnection::LogParam> );
 
@@ -429,9 +773,27 @@ private:
     void storeDataIntoDB ( const QList<DataBlock>& recv );
 
     bool updateSessionInfo ( const QString& );
+
+    // Startup stages
+    Error startupBootstrap ( class StartupStage& );
+    Error startupLoadLib ( class StartupStage& );
+    Error startupOpenDB ( class StartupStage& );
+    Error startupHttps ( class StartupStage& );
     // Do not lock anything!
     bool _getQuote ( int paperNo, Quote& quote ) const;
+    // Lock free, copies not more than depth levels of each side
+    bool readDepth ( int paperNo, int depth, DepthHeader&,
+                     BookSide::Level* buyers, BookSide::Level* sellers ) const;
+    // Do not lock anything! Snapshot read, paper interest is not touched
+    bool _getQuoteSnapshot ( int paperNo, QuoteSnapshot& snapshot ) const;
+    // Lock free if paper was asked before, otherwise locks subscriptions
+    void wantPaper ( int paperNo ) const;
+    void _updatePaperInterest ( int paperNo );
+    // Lock free, price of user API on price step of the paper
+    ADPrice orderPrice ( int paperNo, double price ) const;
     bool _unsubscribeToQuote ( const ADSmartPtr<ADSubscriptionPrivate>& );
+    void _indexSubscription ( ADSubscriptionPrivate* );
+    void _unindexSubscription ( ADSubscriptionPrivate* );
     bool _findOperationsByOrderId ( ADConnection::Order::OrderId,
                                     QList< ADSmartPtr<ADOrderOperationPrivate> >& ) const;
 
@@ -440,7 +802,8 @@ private:
     void sendAuthRequest ();
     bool parseAuthResponse ( const DataBlock& block );
     bool writeToSock ( const QByteArray& );
-    bool readFromSock ( QString& );
+    bool readFromSock ();
+    bool takeDecodedStream ();
     bool sendPing ();
     bool resendADFilters ();
     bool sendADFilters ( const QSet<QString>& simpleUpdateKeys,
@@ -448,6 +811,38 @@ private:
                          const QSet<QString>& complexUpdateKeys,
                          const QHash<QString, QHash<QString, int> >& complexFilter );
 
+    // Stream handlers, return false if block is dropped
+    typedef bool (ADConnection::*BlockHandler) ( const DataBlock& );
+
+    void registerBlockHandlers ();
+    bool handleServerTime ( const DataBlock& );
+    bool handleOrdersQueue ( const DataBlock& );
+    bool handleQuotes ( const DataBlock& );
+    bool handleBrokerMessage ( const DataBlock& );
+    bool handleMyOrders ( const DataBlock& );
+    bool handleMyTrades ( const DataBlock& );
+    bool handleBalance ( const DataBlock& );
+    bool handleHistQuotes ( const DataBlock& );
+    bool handlePapers ( const DataBlock& );
+    // Parsed line of queue or quotes block
+    struct QuoteLine
+    {
+        int paperNo;
+        ADPrice price;
+        ADPrice priceStep;
+        int buyQty;
+        int sellQty;
+    };
+    // Applies block lines as one batch: shard is locked once,
+    // each subscription is notified once with all changed papers
+    void applyQuoteLines ( const QVector<QuoteLine>&, Subscription::Type,
+                           bool initQueue, QSet<int>& updates );
+    void markFirstQuote ();
+    void updateSubscriptions ( const QSet<int>& paperNos, Subscription::Type );
+
+    // Price step of paper from cache or DB
+    ADPrice paperPriceStep ( int paperNo );
+
     // Tcp callbacks
     void tcpReadyRead ( QTcpSocket& );
     void tcpError ( QTcpSocket&, QAbstractSocket::SocketError err );
@@ -491,21 +886,25 @@ private:
     void cancelOrder ( ADConnection::Order::Operation op );
 
     void changeOrder ( ADConnection::Order::Operation op,
-                       quint32 qty, float price );
+                       quint32 qty, ADPrice price );
 
     bool getCachedTemplateDocument ( const QString& docName,
                                      QByteArray& doc );
 
 
-    // For subscription usage
-    void lockForRead ();
-    void unlock ();
+    // For subscription usage, lock quotes shard of paper
+    void lockQuotesForRead ( int paperNo );
+    void unlockQuotes ( int paperNo );
+    // Changes since previous take of consumer, journal is trimmed
+    bool takeQuoteDelta ( int paperNo, ADSubscriptionPrivate* consumer,
+                          QuoteDelta& );
 
 private:
     friend class TcpReceiver;
     friend class SQLReceiver;
     friend class GenericReceiver;
     friend class ADSubscriptionPrivate;
+    friend class StartupStage;
 
     volatile Error m_lastError;
     volatile State m_state;
@@ -520,8 +919,10 @@ private:
     ADSessionInfo m_sessInfo;
     QString m_login;
     QString m_password;
-    QString m_sockBuffer;
-    QByteArray m_sockEncBuffer;
+    class ADBlockFramer* m_blockFramer;
+    // Dispatch tables, indexed by stream id
+    BlockHandler m_blockHandlers[ StreamIdCount ];
+    StreamHandler* m_streamHandlers[ StreamIdCount ]; // saved by general lock
     bool m_authed;
     bool m_resendFilters;
     // Statistics
@@ -529,13 +930,70 @@ private:
     volatile atomic64_t m_statTxNet;
     volatile atomic64_t m_statRxDecoded;
     volatile atomic64_t m_statTxEncoded;
+    // Startup statistics (saved by general lock)
+    TimeMark m_startupMark;
+    TimeMark m_tcpConnectMark;
+    StartupStatistics m_startupStats;
 
     /// Data
-    mutable QReadWriteLock m_rwLock;
+    /// (saved by general lock)
+    mutable ADStatRWLock m_rwLock;
     QDateTime m_srvTime;
     QDateTime m_srvTimeUpdate;
-    QHash<int, Quote> m_quotes;
+
+    /// Quotes (saved by lock of shard)
+    enum { QuoteShards = 16 };
+    // Changes kept for delta subscribers: ring grows by powers of two
+    // up to DepthJournalSize, then the oldest change is overwritten
+    enum { DepthJournalMin = 16, DepthJournalSize = 4096 };
+    struct DepthChange
+    {
+        quint64 seq;
+        BidOffer level;
+    };
+    struct DepthJournal
+    {
+        // Journal starts with reset, so the first delta is the whole book
+        DepthJournal ();
+
+        void append ( const BidOffer& );
+        void clear ();
+        // Drops changes taken by every consumer
+        void trim ();
+        // Index of the first change after seq
+        int lowerBound ( quint64 seq ) const;
+        const DepthChange& at ( int i ) const
+        { return ring.at( (head + i) & (ring.size() - 1) ); }
+
+        quint64 seq;
+        // Book was cleared or changes were dropped at this sequence
+        quint64 resetSeq;
+        quint64 lastPriceSeq;
+        QVector<DepthChange> ring;
+        int head;
+        int num;
+        // Subscription -> sequence of the last taken delta
+        QHash<ADSubscriptionPrivate*, quint64> consumers;
+    };
+    struct QuoteShard
+    {
+        ADStatRWLock lock;
+        QHash<int, Quote> quotes;
+        // Only papers with delta subscribers
+        QHash<int, DepthJournal> journals;
+    };
+    static int quoteShardIndex ( int paperNo );
+    QuoteShard& quoteShard ( int paperNo ) const;
+    mutable QuoteShard m_quoteShards[ QuoteShards ];
+    // Lock free copies of quotes
+    class ADQuoteSnapshots* m_quoteSnapshots;
+
+    /// Positions (saved by positions lock)
+    mutable ADStatRWLock m_positionsLock;
     QHash<QString, QHash<int, Position> > m_positions;
+
+    /// Orders, operations and requests (saved by orders lock)
+    mutable ADStatRWLock m_ordersLock;
     typedef QPair<ADSmartPtr<ADOrderOperationPrivate>, int> OrderOpWithPhase;
     QHash<RequestId, OrderOpWithPhase>* m_ordersOperations;
     QHash<RequestId, ADSmartPtr<RequestDataPrivate> >* m_requests;
@@ -551,17 +1009,46 @@ private:
     RequestId m_reqId;
 
     /// Filters and subscriptions
-    /// (also saved by RW lock)
-    QList<ADSmartPtr<ADSubscriptionPrivate> >* m_subscriptions;
+    /// (saved by subscriptions lock)
+    mutable ADStatRWLock m_subscrLock;
+    QHash<ADSubscriptionPrivate*, ADSmartPtr<ADSubscriptionPrivate> >* m_subscriptions;
+    // Subscription interested in paper, pointer is owned by m_subscriptions
+    struct PaperSubscriber
+    {
+        ADSubscriptionPrivate* subscr;
+        quint32 subscrType;
+    };
+    struct PaperSubscribers
+    {
+        PaperSubscribers () : subscrTypeMask(0) {}
+        // Union of subscribers' types
+        quint32 subscrTypeMask;
+        QVector<PaperSubscriber> subscribers;
+    };
+    // paper_no -> interested subscriptions
+    QHash<int, PaperSubscribers> m_paperSubscribers;
+    // Papers of m_paperSubscribers, quote filters and asked papers,
+    // tested without locks
+    class ADPaperInterest* m_paperInterest;
+    // Papers asked by getQuote callers, never cleared
+    class ADPaperInterest* m_askedPapers;
+    // Papers with delta subscribers, tested under quotes shard lock
+    class ADPaperInterest* m_deltaInterest;
     // filter_name -> i_last_update
     QHash<QString, int> m_simpleFilter;
     // filter_name -> {code	-> i_last_update}
     QHash<QString, QHash<QString, int> > m_complexFilter;
 
-    // Documents' templates
+    // Documents' templates (saved by general lock)
     QHash<QString, QByteArray> m_docTemplates;
+
+    // paper_no -> price_step (connection thread only)
+    QHash<int, ADPrice> m_priceSteps;
 };
 
+// Book levels are moved with memmove on insert/remove
+Q_DECLARE_TYPEINFO(ADConnection::BookSide::Level, Q_PRIMITIVE_TYPE);
+
 ////////////////////////////////////////////////////////////////////////////
 // Helpers
 ////////////////////////////////////////////////////////////////////////////
@@ -574,6 +1061,7 @@ public:
 
 public slots:
     void pingTimer ();
+    void decodeReady ();
     void tcpReadyRead ();
     void tcpError ( QAbstractSocket::SocketError err );
     void tcpStateChanged ( QAbstractSocket::SocketState st );
@@ -609,7 +1097,7 @@ public slots:
     void onTradePaper ( ADConnection::Order::Operation op );
     void onCancelOrder ( ADConnection::Order::Operation op );
     void onChangeOrder ( ADConnection::Order::Operation op,
-                         quint32 qty, float price );
+                         quint32 qty, ADPrice price );
 
 private:
     class ADConnection* m_conn;
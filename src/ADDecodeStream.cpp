@@ -0,0 +1,73 @@
+#include "ADDecodeStream.h"
+
+/****************************************************************************/
+
+ADDecodeStream::ADDecodeStream ( ADAPIInterface& lib ) :
+    m_lib(lib)
+{}
+
+bool ADDecodeStream::decode ( const char* encType,
+                              unsigned int encTypeSz,
+                              const char* key,
+                              const char* data,
+                              unsigned int dataSz,
+                              char** resData,
+                              unsigned int* resSz )
+{
+    if ( resData == 0 || resSz == 0 )
+        return false;
+
+    *resData = 0;
+    *resSz = 0;
+
+    // Decode directly from the caller buffer if there is no tail
+    if ( ! m_tail.empty() ) {
+        if ( data && dataSz )
+            m_tail.insert( m_tail.end(), data, data + dataSz );
+        data = &m_tail[0];
+        dataSz = m_tail.size();
+    }
+
+    if ( data == 0 || dataSz == 0 )
+        return true;
+
+    unsigned int parsed = 0;
+    bool res = m_lib.decode( encType, encTypeSz, key, data, dataSz,
+                             resData, resSz, &parsed );
+    if ( ! res ) {
+        reset();
+        return false;
+    }
+    // Is not enough to decode, keep everything
+    else if ( *resData == 0 )
+        parsed = 0;
+    else if ( parsed > dataSz ) {
+        m_lib.freeMemory( *resData );
+        *resData = 0;
+        *resSz = 0;
+        reset();
+        return false;
+    }
+
+    // Keep not parsed tail
+    if ( m_tail.empty() ) {
+        if ( parsed < dataSz )
+            m_tail.assign( data + parsed, data + dataSz );
+    }
+    else
+        m_tail.erase( m_tail.begin(), m_tail.begin() + parsed );
+
+    return true;
+}
+
+void ADDecodeStream::reset ()
+{
+    m_tail.clear();
+}
+
+unsigned int ADDecodeStream::pendingSize () const
+{
+    return m_tail.size();
+}
+
+/****************************************************************************/
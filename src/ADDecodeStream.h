@@ -0,0 +1,35 @@
+#ifndef ADDECODESTREAM_H
+#define ADDECODESTREAM_H
+
+#include <vector>
+
+#include "ADAPIInterface.h"
+
+/**
+ * Stateful decode on top of ADAPI 'Decode' call.
+ * Caller feeds only newly received bytes, stream keeps not yet
+ * parsed encoded tail itself and prepends it to the next portion.
+ */
+class ADDecodeStream
+{
+public:
+    ADDecodeStream ( ADAPIInterface& lib );
+
+    /**
+     * Returns false on decode error (stream is reset in this case).
+     * Returns true and *pResultData == 0 if more data is needed.
+     * Result must be freed with 'freeMemory' of the library.
+     */
+    bool decode ( const char* pEncodingType, unsigned int cEncodingTypeSize,
+                  const char* pKey, const char* pData, unsigned int cDataSize,
+                  char** pResultData, unsigned int* pcResultSize );
+
+    void reset ();
+    unsigned int pendingSize () const;
+
+private:
+    ADAPIInterface& m_lib;
+    std::vector<char> m_tail;
+};
+
+#endif //ADDECODESTREAM_H
@@ -11,6 +11,22 @@ public:
     virtual bool load () = 0;
     virtual void unload () = 0;
     virtual bool isLoaded () const = 0;
+
+    // Stateful decode: only newly received bytes should be passed,
+    // not parsed tail is kept by the library (see ADDecodeStream).
+    virtual bool decodeStream ( const char* pEncodingType, unsigned int cEncodingTypeSize, const char* pKey, const char* pData, unsigned int cDataSize, char** pResultData, unsigned int* pcResultSize ) = 0;
+    virtual void resetDecodeStream () = 0;
+
+    // Pipelined stateful decode: chunks are submitted without waiting for
+    // decode, results are taken in submission order. If 'wait' is false and
+    // next result is not ready, *pTaken is false. Taken result can be empty
+    // if more bytes are needed. Do not mix with 'decodeStream'.
+    virtual bool submitDecodeStream ( const char* pEncodingType, unsigned int cEncodingTypeSize, const char* pKey, const char* pData, unsigned int cDataSize ) = 0;
+    virtual bool takeDecodeStream ( bool wait, bool* pTaken, char** pResultData, unsigned int* pcResultSize ) = 0;
+    virtual unsigned int pendingDecodeStream () const = 0;
+    // Descriptor, which becomes readable when results can be taken.
+    // -1 if results are ready right after submit.
+    virtual int decodeStreamNotifier () const = 0;
 };
 
 #endif //ADLIBRARY_H
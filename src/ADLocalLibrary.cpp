@@ -56,7 +56,8 @@ ADLocalLibrary::ADLocalLibrary () :
 #else // Wine
     m_adLib("ADAPI"),
 #endif
-    m_syms(new ADLibrarySyms)
+    m_syms(new ADLibrarySyms),
+    m_decodeStream(*this)
 {
     ::memset(m_syms, 0, sizeof(*m_syms));
 }
@@ -164,6 +165,8 @@ bool ADLocalLibrary::load ()
 
 void ADLocalLibrary::unload ()
 {
+    // Frees decoded chunks, so before lib unload
+    resetDecodeStream();
     if ( m_adLib.isLoaded() )
         m_adLib.unload();
 }
@@ -304,4 +307,75 @@ bool ADLocalLibrary::freeMemory ( char* data )
     return !!m_syms->freeMemory( reinterpret_cast<BYTE*>(data) );
 }
 
+bool ADLocalLibrary::decodeStream ( const char* encType,
+                                    unsigned int encTypeSz,
+                                    const char* key,
+                                    const char* data,
+                                    unsigned int dataSz,
+                                    char** resData,
+                                    unsigned int* resSz )
+{
+    if ( ! m_adLib.isLoaded() )
+        return false;
+
+    return m_decodeStream.decode( encType, encTypeSz, key, data, dataSz,
+                                  resData, resSz );
+}
+
+void ADLocalLibrary::resetDecodeStream ()
+{
+    m_decodeStream.reset();
+    while ( ! m_decodedChunks.empty() ) {
+        if ( m_decodedChunks.front().first )
+            freeMemory( m_decodedChunks.front().first );
+        m_decodedChunks.pop_front();
+    }
+}
+
+bool ADLocalLibrary::submitDecodeStream ( const char* encType,
+                                          unsigned int encTypeSz,
+                                          const char* key,
+                                          const char* data,
+                                          unsigned int dataSz )
+{
+    char* resData = 0;
+    unsigned int resSz = 0;
+
+    // Nothing to pipeline with, decode right away
+    if ( ! decodeStream(encType, encTypeSz, key, data, dataSz,
+                        &resData, &resSz) )
+        return false;
+    m_decodedChunks.push_back( std::make_pair(resData, resSz) );
+    return true;
+}
+
+bool ADLocalLibrary::takeDecodeStream ( bool,
+                                        bool* taken,
+                                        char** resData,
+                                        unsigned int* resSz )
+{
+    if ( taken == 0 || resData == 0 || resSz == 0 )
+        return false;
+
+    *taken = ! m_decodedChunks.empty();
+    *resData = 0;
+    *resSz = 0;
+    if ( *taken ) {
+        *resData = m_decodedChunks.front().first;
+        *resSz = m_decodedChunks.front().second;
+        m_decodedChunks.pop_front();
+    }
+    return true;
+}
+
+unsigned int ADLocalLibrary::pendingDecodeStream () const
+{
+    return m_decodedChunks.size();
+}
+
+int ADLocalLibrary::decodeStreamNotifier () const
+{
+    return -1;
+}
+
 /****************************************************************************/
@@ -1,8 +1,11 @@
 #ifndef ADLOCALLIBRARY_H
 #define ADLOCALLIBRARY_H
 
+#include <deque>
+
 #include "ADLibrary.h"
 #include "ADDynaLoader.h"
+#include "ADDecodeStream.h"
 
 class ADLocalLibrary : public ADLibrary
 {
@@ -25,9 +28,19 @@ public:
     virtual bool getConnectionType ( char* szData, int* pcSize );
     virtual bool freeMemory ( char* pData );
 
+    virtual bool decodeStream ( const char* pEncodingType, unsigned int cEncodingTypeSize, const char* pKey, const char* pData, unsigned int cDataSize, char** pResultData, unsigned int* pcResultSize );
+    virtual void resetDecodeStream ();
+    virtual bool submitDecodeStream ( const char* pEncodingType, unsigned int cEncodingTypeSize, const char* pKey, const char* pData, unsigned int cDataSize );
+    virtual bool takeDecodeStream ( bool wait, bool* pTaken, char** pResultData, unsigned int* pcResultSize );
+    virtual unsigned int pendingDecodeStream () const;
+    virtual int decodeStreamNotifier () const;
+
 private:
     ADDynaLoader m_adLib;
     struct ADLibrarySyms* m_syms;
+    ADDecodeStream m_decodeStream;
+    // Results of submitted chunks, decoded in place
+    std::deque<std::pair<char*, unsigned int> > m_decodedChunks;
 };
 
 #endif //ADLOCALLIBRARY_H
@@ -8,10 +8,8 @@ ADOrderPrivate::ADOrderPrivate () :
     m_state(ADConnection::Order::UnknownState),
     m_type(ADConnection::Order::UnknownType),
     m_qty(0),
-    m_price(0.0),
     m_paperNo(0),
     m_preQty(0),
-    m_prePrice(0.0),
     m_tradesQty(0),
     m_restQty(0)
 {}
@@ -21,7 +19,7 @@ ADOrderPrivate::ADOrderPrivate ( const QString& accCode,
                                  ADConnection::Order::Type t,
                                  int paperNo, const QString& paperCode,
                                  quint32 qty,
-                                 float price, const QDateTime& dropDt,
+                                 ADPrice price, const QDateTime& dropDt,
                                  ADConnection::Order::OrderId orderId ) :
     m_orderId(orderId),
     m_state(ADConnection::Order::UnknownState),
@@ -34,7 +32,6 @@ ADOrderPrivate::ADOrderPrivate ( const QString& accCode,
     m_paperNo(paperNo),
     m_dropDt(dropDt),
     m_preQty(0),
-    m_prePrice(0.0),
     m_tradesQty(0),
     m_restQty(qty)
 {
@@ -61,7 +58,7 @@ void ADOrderPrivate::setOrderState ( ADConnection::Order::State state,
 
 void ADOrderPrivate::setOrderState ( ADConnection::Order::State state,
                                      ADConnection::Order::OrderId orderId,
-                                     quint32 qty, float price )
+                                     quint32 qty, ADPrice price )
 {
     //Lock
     QMutexLocker locker( &m_mutex );
@@ -79,7 +76,7 @@ void ADOrderPrivate::setOrderState ( ADConnection::Order::State state )
     m_state = state;
 }
 
-void ADOrderPrivate::setPresaveValues ( quint32 qty, float price )
+void ADOrderPrivate::setPresaveValues ( quint32 qty, ADPrice price )
 {
     //Lock
     QMutexLocker locker( &m_mutex );
@@ -87,7 +84,7 @@ void ADOrderPrivate::setPresaveValues ( quint32 qty, float price )
     m_prePrice = price;
 }
 
-void ADOrderPrivate::getPresaveValues ( quint32& qty, float& price )
+void ADOrderPrivate::getPresaveValues ( quint32& qty, ADPrice& price )
 {
     //Lock
     QMutexLocker locker( &m_mutex );
@@ -173,7 +170,7 @@ quint32 ADOrderPrivate::getOrderQty () const
     return m_qty;
 }
 
-float ADOrderPrivate::getOrderPrice () const
+ADPrice ADOrderPrivate::getOrderPrice () const
 {
     //Lock
     QMutexLocker locker( &m_mutex );
@@ -319,11 +316,11 @@ quint32 ADConnection::Order::getOrderQty () const
     return 0;
 }
 
-float ADConnection::Order::getOrderPrice () const
+ADPrice ADConnection::Order::getOrderPrice () const
 {
     if ( m_order.isValid() )
         return m_order->getOrderPrice();
-    return 0.0;
+    return ADPrice();
 }
 
 QString ADConnection::Order::getOrderPaperCode () const
@@ -18,7 +18,7 @@ public:
                      const QString& market,
                      ADConnection::Order::Type,
                      int paperNo, const QString& paperCode,
-                     quint32 qty, float price,
+                     quint32 qty, ADPrice price,
                      const QDateTime& dropDt = QDateTime(),
                      ADConnection::Order::OrderId orderId = 0);
 
@@ -27,11 +27,11 @@ public:
                           ADConnection::Order::OrderId orderId );
     void setOrderState ( ADConnection::Order::State state,
                          ADConnection::Order::OrderId orderId,
-                         quint32, float );
+                         quint32, ADPrice );
     void setOrderState ( ADConnection::Order::State state );
 
-    void setPresaveValues ( quint32, float );
-    void getPresaveValues ( quint32&, float& );
+    void setPresaveValues ( quint32, ADPrice );
+    void getPresaveValues ( quint32&, ADPrice& );
 
     bool isExecutedQty () const;
     quint32 getExecutedQty () const;
@@ -43,7 +43,7 @@ public:
     ADConnection::Order::State getOrderState () const;
     ADConnection::Order::Type getOrderType () const;
     quint32 getOrderQty () const;
-    float getOrderPrice () const;
+    ADPrice getOrderPrice () const;
     QString getOrderPaperCode () const;
     int getOrderPaperNo () const;
     QDateTime getOrderDropDateTime () const;
@@ -62,12 +62,12 @@ private:
     QString m_accCode;
     QString m_market;
     quint32 m_qty;
-    float m_price;
+    ADPrice m_price;
     QString m_paperCode;
     int m_paperNo;
     QDateTime m_dropDt;
     quint32 m_preQty;
-    float m_prePrice;
+    ADPrice m_prePrice;
     quint32 m_tradesQty;
     quint32 m_restQty;
 };
@@ -0,0 +1,45 @@
+#include "ADPaperInterest.h"
+
+/****************************************************************************/
+
+ADPaperInterest::ADPaperInterest () :
+    m_keepAll(0)
+{
+    for ( int i = 0; i < PagesNum; ++i )
+        m_pages[i] = 0;
+}
+
+ADPaperInterest::~ADPaperInterest ()
+{
+    for ( int i = 0; i < PagesNum; ++i )
+        delete [] m_pages[i];
+}
+
+void ADPaperInterest::set ( int paperNo, bool interested )
+{
+    quint32 bit = static_cast<quint32>(paperNo);
+    if ( bit >= quint32(PageBits) * PagesNum )
+        return;
+
+    volatile atomic32_t* page = m_pages[ bit / PageBits ];
+    if ( page == 0 ) {
+        if ( ! interested )
+            return;
+        // Page is zeroed before it becomes visible
+        page = new atomic32_t[ WordsPerPage ];
+        for ( int i = 0; i < WordsPerPage; ++i )
+            page[i] = 0;
+        atomic_wmb();
+        m_pages[ bit / PageBits ] = page;
+    }
+
+    // Single writer: plain read-modify-write of the word
+    bit %= PageBits;
+    atomic32_t mask = 1u << (bit % 32);
+    if ( interested )
+        page[bit / 32] = page[bit / 32] | mask;
+    else
+        page[bit / 32] = page[bit / 32] & ~mask;
+}
+
+/****************************************************************************/
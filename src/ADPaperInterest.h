@@ -0,0 +1,66 @@
+#ifndef ADPAPERINTEREST_H
+#define ADPAPERINTEREST_H
+
+#include <QtGlobal>
+
+#include "ADAtomicOps.h"
+
+/**
+ * Bitmap of papers somebody is interested in. Is changed by one writer
+ * at a time (under subscriptions lock) and is tested by connection
+ * thread without any locks for every received quote line.
+ *
+ * Bits live in lazily allocated pages, which are never freed while
+ * bitmap is alive. Papers out of bitmap range are always interesting.
+ */
+class ADPaperInterest
+{
+public:
+    enum {
+        PageBits = 1 << 16,
+        PagesNum = 1 << 8,
+        WordsPerPage = PageBits / 32
+    };
+
+    ADPaperInterest ();
+    ~ADPaperInterest ();
+
+    /** Writer side, callers must be serialized */
+    void set ( int paperNo, bool interested );
+
+    /** Every paper is interesting, bitmap is not consulted */
+    void setKeepAll ( bool keepAll )
+    {
+        m_keepAll = keepAll;
+    }
+
+    bool isKeepAll () const
+    {
+        return m_keepAll != 0;
+    }
+
+    /** Reader side, lock free */
+    bool test ( int paperNo ) const
+    {
+        if ( m_keepAll )
+            return true;
+        quint32 bit = static_cast<quint32>(paperNo);
+        if ( bit >= quint32(PageBits) * PagesNum )
+            return true;
+        const volatile atomic32_t* page = m_pages[ bit / PageBits ];
+        if ( page == 0 )
+            return false;
+        atomic_rmb();
+        bit %= PageBits;
+        return (atomic_load32(&page[bit / 32]) >> (bit % 32)) & 1;
+    }
+
+private:
+    ADPaperInterest ( const ADPaperInterest& );
+    ADPaperInterest& operator= ( const ADPaperInterest& );
+
+    volatile atomic32_t* volatile m_pages[ PagesNum ];
+    volatile atomic32_t m_keepAll;
+};
+
+#endif //ADPAPERINTEREST_H
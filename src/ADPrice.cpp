@@ -0,0 +1,78 @@
+#include <math.h>
+
+#include "ADPrice.h"
+
+/****************************************************************************/
+
+ADPrice ADPrice::fromDouble ( double price )
+{
+    // Out of range and NaN are zero
+    const double limit = double(Q_INT64_C(0x7fffffffffffffff) / Scale);
+    if ( ! (price > -limit && price < limit) )
+        return ADPrice();
+
+    double units = price * Scale;
+    return fromValue( static_cast<qint64>(units < 0 ? ceil(units - 0.5) :
+                                                      floor(units + 0.5)) );
+}
+
+ADPrice ADPrice::fromFloat ( double price )
+{
+    if ( price == 0 || price != price )
+        return ADPrice();
+
+    // Decimals left after 7 significant digits
+    int decimals = 6 - static_cast<int>( floor(log10(fabs(price))) );
+    if ( decimals >= Decimals )
+        return fromDouble( price );
+
+    double scale = pow( 10.0, decimals );
+    double rounded = price * scale;
+    rounded = (rounded < 0 ? ceil(rounded - 0.5) : floor(rounded + 0.5));
+    return fromDouble( rounded / scale );
+}
+
+qint64 ADPrice::ticks ( const ADPrice& step ) const
+{
+    if ( step.m_value <= 0 )
+        return m_value;
+
+    // Round half away from zero
+    qint64 half = step.m_value / 2;
+    return (m_value < 0 ? (m_value - half) / step.m_value :
+                          (m_value + half) / step.m_value);
+}
+
+QString ADPrice::toString () const
+{
+    char buf[32];
+    char* p = buf + sizeof(buf);
+    quint64 v = (m_value < 0 ? quint64(0) - quint64(m_value) : quint64(m_value));
+    quint64 intPart = v / Scale;
+    quint64 frac = v % Scale;
+
+    *--p = '\0';
+    if ( frac ) {
+        int digits = Decimals;
+        // Cut trailing zeroes
+        while ( frac % 10 == 0 ) {
+            frac /= 10;
+            --digits;
+        }
+        while ( digits-- ) {
+            *--p = static_cast<char>('0' + frac % 10);
+            frac /= 10;
+        }
+        *--p = '.';
+    }
+    do {
+        *--p = static_cast<char>('0' + intPart % 10);
+        intPart /= 10;
+    } while ( intPart );
+    if ( m_value < 0 )
+        *--p = '-';
+
+    return QString::fromLatin1( p );
+}
+
+/****************************************************************************/
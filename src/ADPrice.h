@@ -0,0 +1,71 @@
+#ifndef ADPRICE_H
+#define ADPRICE_H
+
+#include <QtGlobal>
+#include <QString>
+
+/**
+ * Fixed-point price: integer number of 10^-Decimals units.
+ * Every decimal AD price (and instrument price step) is represented
+ * exactly, so equal prices are equal keys. Ticks are counted in
+ * instrument price step, which is taken from papers reference data.
+ * Conversion to and from double is done only at the edges: user API,
+ * DB and text of requests.
+ */
+class ADPrice
+{
+public:
+    enum { Decimals = 6 };
+    static const qint64 Scale = Q_INT64_C(1000000);
+
+    ADPrice () : m_value(0) {}
+
+    /** From raw units */
+    static ADPrice fromValue ( qint64 value )
+    { ADPrice p; p.m_value = value; return p; }
+
+    /** Nearest representable price */
+    static ADPrice fromDouble ( double price );
+
+    /**
+     * Nearest price of 7 significant digits (precision of float),
+     * so binary error of float is not taken: 123.45f is '123.45',
+     * not '123.449997'
+     */
+    static ADPrice fromFloat ( double price );
+
+    /** Ticks of price step, step is used as one unit if zero */
+    static ADPrice fromTicks ( qint64 ticks, const ADPrice& step )
+    { return fromValue( step.m_value > 0 ? ticks * step.m_value : ticks ); }
+
+    /** Raw units */
+    qint64 value () const { return m_value; }
+
+    bool isZero () const { return m_value == 0; }
+
+    /** Number of price steps, rounded to the nearest. Raw units if step is zero */
+    qint64 ticks ( const ADPrice& step ) const;
+
+    double toDouble () const { return double(m_value) / Scale; }
+    float toFloat () const { return static_cast<float>( toDouble() ); }
+
+    /** Exact decimal, trailing zeroes are cut: '123.45', '-0.5', '100' */
+    QString toString () const;
+
+    ADPrice operator+ ( const ADPrice& p ) const { return fromValue(m_value + p.m_value); }
+    ADPrice operator- ( const ADPrice& p ) const { return fromValue(m_value - p.m_value); }
+
+    bool operator== ( const ADPrice& p ) const { return m_value == p.m_value; }
+    bool operator!= ( const ADPrice& p ) const { return m_value != p.m_value; }
+    bool operator<  ( const ADPrice& p ) const { return m_value <  p.m_value; }
+    bool operator<= ( const ADPrice& p ) const { return m_value <= p.m_value; }
+    bool operator>  ( const ADPrice& p ) const { return m_value >  p.m_value; }
+    bool operator>= ( const ADPrice& p ) const { return m_value >= p.m_value; }
+
+private:
+    qint64 m_value;
+};
+
+Q_DECLARE_TYPEINFO(ADPrice, Q_PRIMITIVE_TYPE);
+
+#endif //ADPRICE_H
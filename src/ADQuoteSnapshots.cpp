@@ -0,0 +1,206 @@
+#include "ADQuoteSnapshots.h"
+
+/****************************************************************************/
+
+ADQuoteSnapshots::ADQuoteSnapshots () :
+    m_table( createTable(InitialCapacity, 0) ),
+    m_size(0)
+{}
+
+ADQuoteSnapshots::~ADQuoteSnapshots ()
+{
+    // Slots are shared by all tables, the last one has every slot
+    Table* table = m_table;
+    for ( int i = 0; i < table->capacity; ++i )
+        delete table->entries[i].slot;
+    while ( table ) {
+        Table* prev = table->prev;
+        delete [] table->entries;
+        delete table;
+        table = prev;
+    }
+}
+
+ADQuoteSnapshots::Table* ADQuoteSnapshots::createTable ( int capacity, Table* prev )
+{
+    Table* table = new Table;
+    table->capacity = capacity;
+    table->entries = new Entry[capacity];
+    table->prev = prev;
+    for ( int i = 0; i < capacity; ++i ) {
+        table->entries[i].paperNo = 0;
+        table->entries[i].slot = 0;
+    }
+    return table;
+}
+
+quint32 ADQuoteSnapshots::hash ( int paperNo, int capacity )
+{
+    // Knuth multiplicative hash, paper numbers are mostly sequential
+    return (static_cast<quint32>(paperNo) * 2654435761u) & (capacity - 1);
+}
+
+ADQuoteSnapshots::Entry& ADQuoteSnapshots::insertEntry ( Table* table, int paperNo )
+{
+    // Table is never full, so probing always stops
+    const int mask = table->capacity - 1;
+    quint32 i = hash( paperNo, table->capacity );
+    while ( table->entries[i].slot != 0 )
+        i = (i + 1) & mask;
+    return table->entries[i];
+}
+
+void ADQuoteSnapshots::grow ()
+{
+    Table* table = m_table;
+    Table* grown = createTable( table->capacity * 2, table );
+    for ( int i = 0; i < table->capacity; ++i ) {
+        const Entry& entry = table->entries[i];
+        if ( entry.slot == 0 )
+            continue;
+        Entry& moved = insertEntry( grown, entry.paperNo );
+        moved.paperNo = entry.paperNo;
+        moved.slot = entry.slot;
+    }
+    // Entries are visible before table
+    atomic_wmb();
+    m_table = grown;
+}
+
+void ADQuoteSnapshots::write ( Slot* slot, const ADConnection::Quote& quote,
+                               ADConnection::TimeMark timeMark )
+{
+    // Odd sequence: write is in progress
+    atomic32_t seq = slot->seq;
+    slot->seq = seq + 1;
+    atomic_wmb();
+
+    ADConnection::QuoteSnapshot& data = slot->data;
+    data.paperNo = quote.paperNo;
+    data.version = (seq + 2) / 2;
+    data.timeMark = timeMark;
+    data.lastPrice = quote.lastPrice;
+    data.priceStep = quote.priceStep;
+    data.buyersNum = qMin<int>( quote.buyers.size(),
+                                ADConnection::QuoteSnapshot::MaxDepth );
+    data.sellersNum = qMin<int>( quote.sellers.size(),
+                                 ADConnection::QuoteSnapshot::MaxDepth );
+    for ( int i = 0; i < data.buyersNum; ++i )
+        data.buyers[i] = quote.buyers[i];
+    for ( int i = 0; i < data.sellersNum; ++i )
+        data.sellers[i] = quote.sellers[i];
+
+    atomic_wmb();
+    slot->seq = seq + 2;
+}
+
+bool ADQuoteSnapshots::publish ( const ADConnection::Quote& quote,
+                                 ADConnection::TimeMark timeMark )
+{
+    // Writer is the only one who changes the table
+    Slot* found = const_cast<Slot*>( find(quote.paperNo) );
+    if ( found ) {
+        write( found, quote, timeMark );
+        return true;
+    }
+
+    // Keep table at most half full, so probing stays short
+    if ( (m_size + 1) * 2 > m_table->capacity )
+        grow();
+
+    // New slot is filled before it becomes visible,
+    // paperNo is visible before slot
+    Slot* slot = new Slot;
+    slot->seq = 0;
+    write( slot, quote, timeMark );
+    Entry& entry = insertEntry( m_table, quote.paperNo );
+    entry.paperNo = quote.paperNo;
+    atomic_wmb();
+    entry.slot = slot;
+    ++m_size;
+
+    return true;
+}
+
+const ADQuoteSnapshots::Slot* ADQuoteSnapshots::find ( int paperNo ) const
+{
+    const Table* table = m_table;
+    atomic_rmb();
+    const int mask = table->capacity - 1;
+    quint32 i = hash( paperNo, table->capacity );
+    for ( int probe = 0; probe < table->capacity; ++probe, i = (i + 1) & mask ) {
+        const Entry& entry = table->entries[i];
+        const Slot* s = entry.slot;
+        if ( s == 0 )
+            return 0;
+        atomic_rmb();
+        if ( entry.paperNo == paperNo )
+            return s;
+    }
+    return 0;
+}
+
+bool ADQuoteSnapshots::read ( int paperNo,
+                              ADConnection::QuoteSnapshot& snapshot ) const
+{
+    const Slot* slot = find( paperNo );
+    if ( slot == 0 )
+        return false;
+
+    for (;;) {
+        atomic32_t seq = atomic_load32( &slot->seq );
+        if ( seq & 1 ) {
+            // Writer is in progress, retry
+            atomic_cpu_relax();
+            continue;
+        }
+        atomic_rmb();
+        snapshot = slot->data;
+        atomic_rmb();
+        if ( atomic_load32(&slot->seq) == seq )
+            break;
+    }
+
+    return true;
+}
+
+bool ADQuoteSnapshots::readDepth ( int paperNo, int depth,
+                                   ADConnection::DepthHeader& header,
+                                   ADConnection::BookSide::Level* buyers,
+                                   ADConnection::BookSide::Level* sellers ) const
+{
+    const Slot* slot = find( paperNo );
+    if ( slot == 0 )
+        return false;
+
+    const ADConnection::QuoteSnapshot& data = slot->data;
+    for (;;) {
+        atomic32_t seq = atomic_load32( &slot->seq );
+        if ( seq & 1 ) {
+            // Writer is in progress, retry
+            atomic_cpu_relax();
+            continue;
+        }
+        atomic_rmb();
+        header.paperNo = data.paperNo;
+        header.version = data.version;
+        header.timeMark = data.timeMark;
+        header.lastPrice = data.lastPrice;
+        header.priceStep = data.priceStep;
+        // Only requested levels are copied, counts are bounded,
+        // because torn read is detected by sequence only after copying
+        header.buyersNum = qBound( 0, data.buyersNum, depth );
+        header.sellersNum = qBound( 0, data.sellersNum, depth );
+        for ( int i = 0; i < header.buyersNum; ++i )
+            buyers[i] = data.buyers[i];
+        for ( int i = 0; i < header.sellersNum; ++i )
+            sellers[i] = data.sellers[i];
+        atomic_rmb();
+        if ( atomic_load32(&slot->seq) == seq )
+            break;
+    }
+
+    return true;
+}
+
+/****************************************************************************/
@@ -0,0 +1,75 @@
+#ifndef ADQUOTESNAPSHOTS_H
+#define ADQUOTESNAPSHOTS_H
+
+#include "ADConnection.h"
+#include "ADAtomicOps.h"
+
+/**
+ * Per paper quote snapshots with one writer (connection thread) and
+ * lock free readers. Every slot is a seqlock: writer makes sequence odd,
+ * copies quote, makes it even again; reader retries if sequence was odd
+ * or changed while copying. Readers never write shared memory, so they
+ * do not contend with each other and never delay the writer.
+ *
+ * Slots are found by open addressing, are inserted only by writer and
+ * are never removed, so lookup is lock free too. Table is grown by
+ * writer when it is half full: slots are moved to a new table, which
+ * is published by pointer swap. Old tables are kept till destruction,
+ * because readers can still probe them.
+ */
+class ADQuoteSnapshots
+{
+public:
+    enum { InitialCapacity = 8192 };
+
+    ADQuoteSnapshots ();
+    ~ADQuoteSnapshots ();
+
+    /** Writer side */
+    bool publish ( const ADConnection::Quote&, ADConnection::TimeMark );
+
+    /** Reader side. False if quote was never published */
+    bool read ( int paperNo, ADConnection::QuoteSnapshot& ) const;
+    /** As read, but copies not more than depth levels of each side */
+    bool readDepth ( int paperNo, int depth, ADConnection::DepthHeader&,
+                     ADConnection::BookSide::Level* buyers,
+                     ADConnection::BookSide::Level* sellers ) const;
+
+private:
+    ADQuoteSnapshots ( const ADQuoteSnapshots& );
+    ADQuoteSnapshots& operator= ( const ADQuoteSnapshots& );
+
+    struct Slot
+    {
+        volatile atomic32_t seq;
+        ADConnection::QuoteSnapshot data;
+    };
+
+    struct Entry
+    {
+        int paperNo;
+        Slot* volatile slot;
+    };
+
+    struct Table
+    {
+        // Power of two
+        int capacity;
+        Entry* entries;
+        // Previous, smaller table
+        Table* prev;
+    };
+
+    static Table* createTable ( int capacity, Table* prev );
+    static quint32 hash ( int paperNo, int capacity );
+    static void write ( Slot*, const ADConnection::Quote&, ADConnection::TimeMark );
+    // Writer side, returns free entry for paper
+    static Entry& insertEntry ( Table*, int paperNo );
+    void grow ();
+    const Slot* find ( int paperNo ) const;
+
+    Table* volatile m_table;
+    int m_size;
+};
+
+#endif //ADQUOTESNAPSHOTS_H
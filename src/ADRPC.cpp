@@ -1,51 +1,84 @@
 #include "ADRPC.h"
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
 
+// Size of value header on the wire: type and size
+#define VALUE_HEADER_SIZE (2 * sizeof(uint32_t))
+
+// Max descriptors which can be received with one message
+#define MAX_RECV_FDS 8
+
+// Internal call, which passes shm region to server
+#define SHM_ATTACH_METHOD "rpc.attachShm"
+
+// Internal call, which passes channel socket to server
+#define CHANNEL_OPEN_METHOD "rpc.openChannel"
+
 /******************************************************************************/
 
+const unsigned char* ADRPC::value::data() const
+{
+    if (type & REFERENCE) {
+        const unsigned char* ptr;
+        ::memcpy(&ptr, val, sizeof(ptr));
+        return ptr;
+    }
+    return val;
+}
+
 bool ADRPC::value::to_bytearray(std::vector<unsigned char>& out) const
 {
-    if (type != BYTEARRAY)
+    if ((type & TYPE_MASK) != BYTEARRAY)
         return false;
-    out = std::vector<unsigned char>((const unsigned char*)val,
-                                     (const unsigned char*)val + size);
+    out = std::vector<unsigned char>(data(), data() + size);
     return true;
 }
 
 bool ADRPC::value::to_bytearray_ptr(const unsigned char*& ptr, uint32_t& sz) const
 {
-    if (type != BYTEARRAY)
+    if ((type & TYPE_MASK) != BYTEARRAY)
         return false;
-    ptr = (const unsigned char*)val;
+    ptr = data();
     sz = size;
     return true;
 }
 
 bool ADRPC::value::to_uint32(uint32_t& out) const
 {
-    if (type != UINT32 || size != 4)
+    if ((type & TYPE_MASK) != UINT32 || size != 4)
         return false;
-    uint32_t* ptr = (uint32_t*)val;
-    out = *ptr;
+    ::memcpy(&out, data(), sizeof(out));
     out = ntohl(out);
     return true;
 }
 
 ADRPC::value* ADRPC::value::create_value(const std::vector<unsigned char>& in)
+{
+    return create_value(in.size() ? &in[0] : 0, in.size());
+}
+
+ADRPC::value* ADRPC::value::create_value(const void* data, uint32_t size)
 {
     // Allocate mem for header and for string
-    value* val = (value*)::malloc(sizeof(ADRPC::value) + in.size() - 2);
+    value* val = (value*)::malloc(sizeof(ADRPC::value) + size);
     if (!val)
         return 0;
     val->type = BYTEARRAY;
-    val->size = in.size();
-    if (val->size)
-        ::memcpy(val->val, in.data(), in.size());
+    val->size = size;
+    if (size)
+        ::memcpy(val->val, data, size);
 
     return val;
 }
@@ -53,7 +86,7 @@ ADRPC::value* ADRPC::value::create_value(const std::vector<unsigned char>& in)
 ADRPC::value* ADRPC::value::create_value(uint32_t in)
 {
     // Allocate mem for header and for string
-    value* val = (value*)::malloc(sizeof(ADRPC::value) + sizeof(in) - 2);
+    value* val = (value*)::malloc(sizeof(ADRPC::value) + sizeof(in));
     if (!val)
         return 0;
     val->type = UINT32;
@@ -64,34 +97,682 @@ ADRPC::value* ADRPC::value::create_value(uint32_t in)
     return val;
 }
 
+ADRPC::value* ADRPC::value::copy(const value* from)
+{
+    value* val = create_value(from->data(), from->size);
+    if (!val)
+        return 0;
+    val->type = from->type & TYPE_MASK;
+
+    return val;
+}
+
+ADRPC::value* ADRPC::value::create_value_ref(const void* data, uint32_t size)
+{
+    value* val = (value*)::malloc(sizeof(ADRPC::value) + sizeof(data));
+    if (!val)
+        return 0;
+    val->type = BYTEARRAY | REFERENCE;
+    val->size = size;
+    ::memcpy(val->val, &data, sizeof(data));
+
+    return val;
+}
+
 /******************************************************************************/
 
+/*
+ * Shared memory transport.
+ *
+ * Region consists of control page and two rings of equal power of two size:
+ * first is for client->server messages, second is for server->client.
+ * Each ring has exactly one producer and one consumer. Producer reserves
+ * contiguous frame, serializes message directly into the ring and publishes
+ * new head. Consumer parses values in place and releases frame on next read.
+ *
+ * Frame is 8 byte aligned: uint32_t word (length and flags) + message.
+ * If frame does not fit the end of the ring, padding frame is written and
+ * message is placed at the ring start. Messages bigger than quarter of the
+ * ring are sent through the socket, ring then carries only SOCK marker,
+ * thus the order of messages is preserved.
+ *
+ * Values are 4 byte aligned inside the frame to be accessed in place.
+ *
+ * Sides spin for a while, then sleep on own eventfd: one for data in rx
+ * ring and one for space in tx ring, since server reader and lanes wait
+ * for different things. Peer writes to eventfd only if waiting flag is
+ * set, so no syscalls are made while both sides are busy.
+ */
+
+#define SHM_MAGIC       0x41445348 // "ADSH"
+#define SHM_CTRL_SIZE   4096
+#define SHM_MIN_RING    (64 << 10)
+#define SHM_SPIN_COUNT  4096
+
+#define FRAME_PAD       (1u << 31)
+#define FRAME_SOCK      (1u << 30)
+#define FRAME_LEN_MASK  (FRAME_SOCK - 1)
+#define FRAME_ALIGN(sz) (((sz) + sizeof(uint32_t) + 7) & ~7u)
+#define VALUE_ALIGN(sz) (((sz) + 3) & ~3u)
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __sync_synchronize()
+#endif
+
+struct shm_ring
+{
+    // Producer and consumer positions are free running,
+    // each on own cache line
+    volatile uint32_t head;
+    char pad0[60];
+    volatile uint32_t tail;
+    char pad1[60];
+    volatile uint32_t producer_waiting;
+    volatile uint32_t consumer_waiting;
+    char pad2[56];
+};
+
+struct shm_region
+{
+    uint32_t magic;
+    uint32_t ring_size;
+    char pad[56];
+    shm_ring rings[2];
+};
+
+struct shm_transport
+{
+    void* map;
+    size_t map_size;
+    int mem_fd;
+
+    shm_ring* tx;
+    unsigned char* tx_data;
+    shm_ring* rx;
+    unsigned char* rx_data;
+    uint32_t ring_size;
+    uint32_t max_msg;
+    // Spinning makes sense only if peer runs on another cpu
+    uint32_t spin_count;
+
+    // This side sleeps on data_fd and space_fd,
+    // peer is woken up with peer_data_fd and peer_space_fd
+    int data_fd;
+    int space_fd;
+    int peer_data_fd;
+    int peer_space_fd;
+
+    // Size of rx frame, which is parsed in place
+    uint32_t rx_held;
+};
+
+static int shm_create_fd(size_t size)
+{
+    int fd = -1;
+
+#ifdef SYS_memfd_create
+    // MFD_CLOEXEC
+    fd = ::syscall(SYS_memfd_create, "adrpc", 1u);
+#endif
+    if (fd < 0) {
+        char name[64];
+        static volatile uint32_t s_num = 0;
+        ::snprintf(name, sizeof(name), "/adrpc.%d.%u", (int)::getpid(),
+                   __sync_fetch_and_add(&s_num, 1));
+        fd = ::shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            return -1;
+        ::shm_unlink(name);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    if (::ftruncate(fd, size) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static size_t shm_map_size(uint32_t ring_size)
+{
+    return SHM_CTRL_SIZE + 2 * (size_t)ring_size;
+}
+
+static bool shm_valid_ring_size(uint32_t ring_size)
+{
+    return ring_size >= SHM_MIN_RING && ring_size <= FRAME_LEN_MASK &&
+        (ring_size & (ring_size - 1)) == 0;
+}
+
+// Event fds: client data, client space, server data, server space
+bool ADRPC::shm_map(int mem_fd, const int* efds,
+                    uint32_t ring_size, bool client)
+{
+    if (!shm_valid_ring_size(ring_size))
+        return false;
+
+    size_t size = shm_map_size(ring_size);
+    void* map = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+
+    shm_region* region = (shm_region*)map;
+    if (client) {
+        ::memset(region, 0, sizeof(*region));
+        region->magic = SHM_MAGIC;
+        region->ring_size = ring_size;
+    }
+    else if (region->magic != SHM_MAGIC || region->ring_size != ring_size) {
+        ::munmap(map, size);
+        return false;
+    }
+
+    unsigned char* data = (unsigned char*)map + SHM_CTRL_SIZE;
+    shm_transport* shm = new shm_transport;
+    shm->map = map;
+    shm->map_size = size;
+    shm->mem_fd = mem_fd;
+    shm->tx = &region->rings[client ? 0 : 1];
+    shm->tx_data = data + (client ? 0 : ring_size);
+    shm->rx = &region->rings[client ? 1 : 0];
+    shm->rx_data = data + (client ? ring_size : 0);
+    shm->ring_size = ring_size;
+    shm->max_msg = ring_size / 4 - sizeof(uint32_t);
+    shm->spin_count = (::sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_COUNT : 0);
+    shm->data_fd = efds[client ? 0 : 2];
+    shm->space_fd = efds[client ? 1 : 3];
+    shm->peer_data_fd = efds[client ? 2 : 0];
+    shm->peer_space_fd = efds[client ? 3 : 1];
+    shm->rx_held = 0;
+
+    m_shm = shm;
+    return true;
+}
+
+void ADRPC::detach_shm()
+{
+    if (!m_shm)
+        return;
+    ::munmap(m_shm->map, m_shm->map_size);
+    ::close(m_shm->mem_fd);
+    ::close(m_shm->data_fd);
+    ::close(m_shm->space_fd);
+    ::close(m_shm->peer_data_fd);
+    ::close(m_shm->peer_space_fd);
+    delete m_shm;
+    m_shm = 0;
+}
+
+bool ADRPC::is_shm_attached() const
+{
+    return m_shm != 0;
+}
+
+bool ADRPC::open_channel(int sock)
+{
+    if (m_sock < 0 || m_shm || sock < 0)
+        return false;
+
+    // Zero is invalid id
+    if (++m_call_id == 0)
+        ++m_call_id;
+    uint32_t call_id = m_call_id;
+
+    // Descriptor can be passed only through the socket
+    std::vector<ADRPC::value*> params;
+    pthread_mutex_lock(&m_send_lock);
+    bool res = send_sock(CHANNEL_OPEN_METHOD, call_id, params, &sock, 1);
+    pthread_mutex_unlock(&m_send_lock);
+    if (!res)
+        return false;
+
+    uint32_t ok = 0;
+    std::vector<ADRPC::value*> retvals;
+    res = (wait(call_id, retvals) && retvals.size() == 1 &&
+           retvals[0]->to_uint32(ok) && ok);
+    ADRPC::free(retvals);
+
+    return res;
+}
+
+bool ADRPC::attach_shm(uint32_t ring_size)
+{
+    if (m_sock < 0 || m_shm)
+        return false;
+
+    uint32_t sz = SHM_MIN_RING;
+    while (sz < ring_size && sz <= FRAME_LEN_MASK / 2)
+        sz <<= 1;
+    ring_size = sz;
+
+    bool res = false;
+    uint32_t ok = 0;
+    int fds[5] = {-1, -1, -1, -1, -1};
+    std::vector<ADRPC::value*> params;
+    std::vector<ADRPC::value*> retvals;
+    std::string method_ret;
+    uint32_t call_id = 0;
+
+    // Region and event fds
+    fds[0] = shm_create_fd(shm_map_size(ring_size));
+    if (fds[0] < 0)
+        goto exit;
+    for (int i = 1; i < 5; ++i) {
+        fds[i] = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fds[i] < 0)
+            goto exit;
+    }
+
+    if (!shm_map(fds[0], fds + 1, ring_size, true))
+        goto exit;
+
+    // Handshake goes through the socket, switch to shm after reply
+    params.push_back(ADRPC::value::create_value(ring_size));
+    {
+        shm_transport* shm = m_shm;
+        m_shm = 0;
+        if (send_sock(SHM_ATTACH_METHOD, 0, params, fds, 5) &&
+            read_sock(method_ret, call_id, retvals) &&
+            retvals.size() == 1 && retvals[0]->to_uint32(ok) && ok)
+            res = true;
+        m_shm = shm;
+    }
+
+exit:
+    ADRPC::free(params);
+    ADRPC::free(retvals);
+    if (!res) {
+        if (m_shm)
+            // Closes descriptors
+            detach_shm();
+        else
+            for (int i = 0; i < 5; ++i)
+                if (fds[i] >= 0)
+                    ::close(fds[i]);
+    }
+    return res;
+}
+
+bool ADRPC::shm_attach_server(const std::vector<ADRPC::value*>& params)
+{
+    uint32_t ring_size = 0;
+    bool res = false;
+
+    if (m_shm == 0 && m_recv_fds.size() == 5 && params.size() == 1 &&
+        params[0]->to_uint32(ring_size)) {
+        res = shm_map(m_recv_fds[0], &m_recv_fds[1], ring_size, false);
+        if (res)
+            m_recv_fds.clear();
+    }
+    close_recv_fds();
+
+    return res;
+}
+
+void ADRPC::close_recv_fds()
+{
+    for (size_t i = 0; i < m_recv_fds.size(); ++i)
+        ::close(m_recv_fds[i]);
+    m_recv_fds.clear();
+}
+
+// Sleeps on own eventfds (second is optional).
+// Returns false if peer is dead.
+bool ADRPC::shm_sleep(int fd1, int fd2)
+{
+    struct pollfd fds[3];
+    fds[0].fd = m_sock;
+    fds[0].events = POLLRDHUP;
+    fds[1].fd = fd1;
+    fds[1].events = POLLIN;
+    fds[2].fd = fd2;
+    fds[2].events = POLLIN;
+
+again:
+    fds[0].revents = fds[1].revents = fds[2].revents = 0;
+    int res = ::poll(fds, (fd2 < 0 ? 2 : 3), -1);
+    if (res < 0 && errno == EINTR)
+        goto again;
+    else if (res < 0)
+        return false;
+
+    if (fds[0].revents)
+        return false;
+
+    uint64_t cnt;
+    for (int i = 1; i < 3; ++i)
+        if (fds[i].revents)
+            while (::read(fds[i].fd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+                ;
+    return true;
+}
+
+void ADRPC::shm_wake(int fd)
+{
+    uint64_t cnt = 1;
+    while (::write(fd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+        ;
+}
+
+bool ADRPC::shm_send(const std::string& method, uint32_t call_id,
+                     const std::vector<ADRPC::value*>& vals,
+                     uint32_t msg_size, bool& use_sock)
+{
+    shm_ring* ring = m_shm->tx;
+    const uint32_t mask = m_shm->ring_size - 1;
+    const uint32_t head = ring->head;
+
+    use_sock = (msg_size > m_shm->max_msg);
+    const uint32_t frame = FRAME_ALIGN(use_sock ? 0 : msg_size);
+    const uint32_t to_end = m_shm->ring_size - (head & mask);
+    const uint32_t pad = (to_end < frame ? to_end : 0);
+
+    // Wait for free space
+    for (uint32_t spin = 0; ; ++spin) {
+        if (m_shm->ring_size - (head - ring->tail) >= pad + frame)
+            break;
+        if (spin < m_shm->spin_count) {
+            cpu_relax();
+            continue;
+        }
+        // Server can be blocked on full reply ring, so take replies
+        // out while waiting, otherwise both sides wait for each other
+        if (!m_server) {
+            if (!drain_replies())
+                return false;
+            if (m_shm->ring_size - (head - ring->tail) >= pad + frame)
+                break;
+        }
+        ring->producer_waiting = 1;
+        __sync_synchronize();
+        if (m_shm->ring_size - (head - ring->tail) >= pad + frame) {
+            ring->producer_waiting = 0;
+            break;
+        }
+        bool alive = shm_sleep(m_shm->space_fd,
+                               (m_server ? -1 : m_shm->data_fd));
+        ring->producer_waiting = 0;
+        if (!alive)
+            return false;
+    }
+    // Do not write till consumer has released the space
+    __sync_synchronize();
+
+    unsigned char* p = m_shm->tx_data + (head & mask);
+    if (pad) {
+        *(uint32_t*)p = FRAME_PAD;
+        p = m_shm->tx_data;
+    }
+
+    if (use_sock)
+        *(uint32_t*)p = FRAME_SOCK;
+    else {
+        unsigned char* msg = p + sizeof(uint32_t);
+        ADRPC::rpc_header header = {(uint16_t)method.length(),
+                                    (uint16_t)vals.size(), call_id};
+        ::memcpy(msg, &header, sizeof(header));
+        ::memcpy(msg + sizeof(header), method.data(), method.length());
+        msg += VALUE_ALIGN(sizeof(header) + method.length());
+        for (std::vector<ADRPC::value*>::const_iterator it = vals.begin();
+             it != vals.end(); ++it) {
+            const ADRPC::value* val = *it;
+            uint32_t hdr[2] = {val->type & ADRPC::value::TYPE_MASK, val->size};
+            ::memcpy(msg, hdr, VALUE_HEADER_SIZE);
+            if (val->size)
+                ::memcpy(msg + VALUE_HEADER_SIZE, val->data(), val->size);
+            msg += VALUE_HEADER_SIZE + VALUE_ALIGN(val->size);
+        }
+        *(uint32_t*)p = msg_size;
+    }
+
+    // Publish
+    __sync_synchronize();
+    ring->head = head + pad + frame;
+    __sync_synchronize();
+    if (ring->consumer_waiting)
+        shm_wake(m_shm->peer_data_fd);
+
+    return true;
+}
+
+// Releases frame, which was parsed in place
+void ADRPC::shm_release()
+{
+    shm_ring* ring = m_shm->rx;
+
+    if (m_shm->rx_held == 0)
+        return;
+    __sync_synchronize();
+    ring->tail = ring->tail + m_shm->rx_held;
+    m_shm->rx_held = 0;
+    __sync_synchronize();
+    if (ring->producer_waiting)
+        shm_wake(m_shm->peer_space_fd);
+}
+
+// Checks for the next message without blocking. If there is nothing,
+// asks peer to wake us up through eventfd.
+bool ADRPC::shm_readable(bool& avail)
+{
+    shm_ring* ring = m_shm->rx;
+    const uint32_t mask = m_shm->ring_size - 1;
+    uint64_t cnt;
+
+    shm_release();
+
+    // Drain notifications, we are going to check ring anyway
+    while (::read(m_shm->data_fd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+        ;
+
+    for (int armed = 0; ; ) {
+        uint32_t tail = ring->tail;
+        if (ring->head != tail) {
+            __sync_synchronize();
+            uint32_t word = *(const uint32_t*)(m_shm->rx_data + (tail & mask));
+            if (word & FRAME_PAD) {
+                ring->tail = tail + m_shm->ring_size - (tail & mask);
+                continue;
+            }
+            ring->consumer_waiting = 0;
+            avail = true;
+            return true;
+        }
+        if (armed)
+            break;
+        ring->consumer_waiting = 1;
+        __sync_synchronize();
+        armed = 1;
+    }
+
+    // Check that peer is alive
+    struct pollfd fd;
+    fd.fd = m_sock;
+    fd.events = POLLRDHUP;
+    fd.revents = 0;
+    if (::poll(&fd, 1, 0) > 0)
+        return false;
+
+    avail = false;
+    return true;
+}
+
+bool ADRPC::shm_read(std::string& method_str, uint32_t& call_id,
+                     std::vector<ADRPC::value*>& vals,
+                     bool& use_sock)
+{
+    shm_ring* ring = m_shm->rx;
+    const uint32_t mask = m_shm->ring_size - 1;
+
+    use_sock = false;
+
+    shm_release();
+    uint32_t tail = ring->tail;
+    // Flag can be armed for notify fd, keep it
+    const uint32_t armed = ring->consumer_waiting;
+
+    while (1) {
+        // Wait for data
+        for (uint32_t spin = 0; ; ++spin) {
+            if (ring->head != tail)
+                break;
+            if (spin < m_shm->spin_count) {
+                cpu_relax();
+                continue;
+            }
+            ring->consumer_waiting = 1;
+            __sync_synchronize();
+            if (ring->head != tail) {
+                ring->consumer_waiting = armed;
+                break;
+            }
+            bool alive = shm_sleep(m_shm->data_fd, -1);
+            ring->consumer_waiting = armed;
+            if (!alive)
+                return false;
+        }
+        // Do not read frame before head
+        __sync_synchronize();
+
+        const unsigned char* p = m_shm->rx_data + (tail & mask);
+        uint32_t word = *(const uint32_t*)p;
+        if (word & FRAME_PAD) {
+            tail += m_shm->ring_size - (tail & mask);
+            ring->tail = tail;
+            continue;
+        }
+        else if (word & FRAME_SOCK) {
+            // Message follows in socket, release marker right away
+            ring->tail = tail + FRAME_ALIGN(0);
+            __sync_synchronize();
+            if (ring->producer_waiting)
+                shm_wake(m_shm->peer_space_fd);
+            use_sock = true;
+            return true;
+        }
+
+        // Parse in place
+        const uint32_t msg_size = word & FRAME_LEN_MASK;
+        const unsigned char* msg = p + sizeof(uint32_t);
+        const unsigned char* end = msg + msg_size;
+        ADRPC::rpc_header header;
+
+        if (msg_size > m_shm->max_msg || msg_size < sizeof(header))
+            return false;
+        ::memcpy(&header, msg, sizeof(header));
+        if (header.method_size == 0 ||
+            msg_size < VALUE_ALIGN(sizeof(header) + header.method_size))
+            return false;
+        method_str = std::string((const char*)msg + sizeof(header),
+                                 header.method_size);
+        call_id = header.call_id;
+        msg += VALUE_ALIGN(sizeof(header) + header.method_size);
+
+        for (uint32_t i = 0; i < header.values_num; ++i) {
+            ADRPC::value* val = (ADRPC::value*)msg;
+            if (end - msg < (long)VALUE_HEADER_SIZE ||
+                (uint32_t)(end - msg) - VALUE_HEADER_SIZE < val->size) {
+                vals.clear();
+                return false;
+            }
+            // Frame belongs to consumer till release, so mark in place
+            val->type |= ADRPC::value::BORROWED;
+            vals.push_back(val);
+            msg += VALUE_HEADER_SIZE + VALUE_ALIGN(val->size);
+        }
+
+        m_shm->rx_held = FRAME_ALIGN(msg_size);
+        return true;
+    }
+}
+
+/******************************************************************************/
+
+static bool pthread_spawn(void* (*fn)(void*), void* arg)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int res = pthread_create(&thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    return res == 0;
+}
+
 ADRPC::ADRPC() :
-    m_sock(-1)
-{}
+    m_sock(-1),
+    m_shm(0),
+    m_call_id(0),
+    m_server(false),
+    m_spawn(pthread_spawn),
+    m_channel(0),
+    m_channel_param(0)
+{
+    pthread_mutex_init(&m_send_lock, 0);
+}
+
+ADRPC::~ADRPC()
+{
+    set_fd(-1);
+    pthread_mutex_destroy(&m_send_lock);
+}
 
 void ADRPC::set_fd(int sock)
 {
+    std::map<uint32_t, std::vector<ADRPC::value*> >::iterator it;
+    for (it = m_replies.begin(); it != m_replies.end(); ++it)
+        free(it->second);
+    m_replies.clear();
+
+    detach_shm();
+    close_recv_fds();
     m_sock = sock;
 }
 
 bool ADRPC::register_call(const std::string& method,
                           ADRPC::adrpc_call cb,
-                          void* param)
+                          void* param,
+                          uint32_t lane)
 {
     if (cb == 0 || m_calls.find(method) != m_calls.end())
         return false;
-    m_calls.insert(std::pair<std::string, std::pair<adrpc_call, void*> >(
-                       method, std::pair<adrpc_call, void*>(cb, param)));
+    rpc_call call = {cb, param, lane};
+    m_calls.insert(std::make_pair(method, call));
     return true;
 }
 
+void ADRPC::set_spawn(ADRPC::adrpc_spawn spawn)
+{
+    m_spawn = spawn;
+}
+
+void ADRPC::set_channel_handler(ADRPC::adrpc_channel handler, void* param)
+{
+    m_channel = handler;
+    m_channel_param = param;
+}
+
 bool ADRPC::read(void* b, uint32_t size)
 {
     char* buff = (char*)b;
     ssize_t rb  = 0;
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_RECV_FDS)];
+    } cmsg_buf;
+
 again:
-    rb = ::read(m_sock, buff, size);
+    iov.iov_base = buff;
+    iov.iov_len = size;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf.buf;
+    msg.msg_controllen = sizeof(cmsg_buf.buf);
+
+    rb = ::recvmsg(m_sock, &msg, MSG_CMSG_CLOEXEC);
     if (rb == 0) {
         // gracefull shutdown
         return false;
@@ -105,6 +786,19 @@ again:
         return false;
     }
 
+    // Keep received descriptors
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < num; ++i) {
+            int fd;
+            ::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+            m_recv_fds.push_back(fd);
+        }
+    }
+
     // Iterate
     buff += rb;
     size -= rb;
@@ -115,8 +809,43 @@ again:
     return true;
 }
 
-bool ADRPC::read(std::string& method_str,
+bool ADRPC::read(std::string& method_str, uint32_t& call_id,
                  std::vector<ADRPC::value*>& vals)
+{
+    if (m_shm) {
+        bool use_sock = false;
+        if (!shm_read(method_str, call_id, vals, use_sock))
+            return false;
+        if (!use_sock)
+            return true;
+    }
+    return read_sock(method_str, call_id, vals);
+}
+
+bool ADRPC::readable(bool& avail)
+{
+    if (m_shm)
+        return shm_readable(avail);
+
+    struct pollfd fd;
+    fd.fd = m_sock;
+    fd.events = POLLIN;
+    fd.revents = 0;
+
+again:
+    int res = ::poll(&fd, 1, 0);
+    if (res < 0 && errno == EINTR)
+        goto again;
+    else if (res < 0)
+        return false;
+
+    // Read will fail if peer is dead
+    avail = (res > 0);
+    return true;
+}
+
+bool ADRPC::read_sock(std::string& method_str, uint32_t& call_id,
+                      std::vector<ADRPC::value*>& vals)
 {
     ADRPC::rpc_header header;
     char* method = 0;
@@ -136,23 +865,25 @@ bool ADRPC::read(std::string& method_str,
 
     // Set out method string
     method_str = std::string(method, header.method_size);
+    call_id = header.call_id;
 
     // Read params in loop
     for (uint32_t i = 0; i < header.values_num; ++i) {
-        ADRPC::value val_header;
+        uint32_t val_header[2];
 
         // Read value header
-        if (!read(&val_header, sizeof(val_header) - 2))
+        if (!read(val_header, VALUE_HEADER_SIZE))
             goto exit;
 
         // Allocate value
         ADRPC::value* val = (ADRPC::value*)::malloc(sizeof(ADRPC::value) +
-                                                    val_header.size - 2);
+                                                    val_header[1]);
         if (!val)
             goto exit;
 
         // Copy real header
-        ::memcpy(val, &val_header, sizeof(ADRPC::value) - 2);
+        val->type = val_header[0] & ADRPC::value::TYPE_MASK;
+        val->size = val_header[1];
 
         // Add to params vector
         vals.push_back(val);
@@ -172,12 +903,36 @@ exit:
     return res;
 }
 
-bool ADRPC::send(const void* b, uint32_t size)
+bool ADRPC::send_iov(struct iovec* iov, int iov_num,
+                     const int* fds, int fds_num)
 {
-    const char* buff = (const char*)b;
     ssize_t wb  = 0;
+    struct msghdr msg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_RECV_FDS)];
+    } cmsg_buf;
+
+    assert(fds_num <= MAX_RECV_FDS);
+
 again:
-    wb = ::write(m_sock, buff, size);
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_num;
+
+    // Descriptors go with the first chunk only
+    if (fds_num) {
+        struct cmsghdr* cmsg;
+        msg.msg_control = cmsg_buf.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds_num);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_num);
+        ::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fds_num);
+    }
+
+    wb = ::sendmsg(m_sock, &msg, 0);
     if (wb == 0) {
         // Peer was closed
         return false;
@@ -190,76 +945,334 @@ again:
         // Write failed
         return false;
     }
+    fds_num = 0;
 
     // Iterate
-    buff += wb;
-    size -= wb;
-
-    if (size != 0)
+    while (iov_num && (size_t)wb >= iov->iov_len) {
+        wb -= iov->iov_len;
+        ++iov;
+        --iov_num;
+    }
+    if (iov_num) {
+        iov->iov_base = (char*)iov->iov_base + wb;
+        iov->iov_len -= wb;
         goto again;
+    }
 
     return true;
 }
 
-bool ADRPC::send(const std::string& method,
+bool ADRPC::send_sock(const std::string& method, uint32_t call_id,
+                      const std::vector<ADRPC::value*>& vals,
+                      const int* fds, int fds_num)
+{
+    ADRPC::rpc_header header = {(uint16_t)method.length(),
+                                (uint16_t)vals.size(), call_id};
+    std::vector<uint32_t> val_headers(vals.size() * 2);
+    std::vector<struct iovec> iov;
+    iov.reserve(2 + vals.size() * 2);
+
+    struct iovec v;
+    v.iov_base = &header;
+    v.iov_len = sizeof(header);
+    iov.push_back(v);
+    v.iov_base = (void*)method.data();
+    v.iov_len = method.length();
+    iov.push_back(v);
+
+    // Header and data of values, all with one syscall
+    for (size_t i = 0; i < vals.size(); ++i) {
+        const ADRPC::value* val = vals[i];
+        val_headers[i * 2] = val->type & ADRPC::value::TYPE_MASK;
+        val_headers[i * 2 + 1] = val->size;
+        v.iov_base = &val_headers[i * 2];
+        v.iov_len = VALUE_HEADER_SIZE;
+        iov.push_back(v);
+        if (val->size) {
+            v.iov_base = (void*)val->data();
+            v.iov_len = val->size;
+            iov.push_back(v);
+        }
+    }
+
+    return send_iov(&iov[0], iov.size(), fds, fds_num);
+}
+
+bool ADRPC::send(const std::string& method, uint32_t call_id,
                  const std::vector<ADRPC::value*>& vals)
 {
     if (method.length() == 0)
         return false;
 
+    // Lanes reply concurrently
+    pthread_mutex_lock(&m_send_lock);
+
     bool res = false;
-    ADRPC::rpc_header header = {method.length(), vals.size()};
+    if (m_shm) {
+        // Values are aligned in frame
+        uint32_t msg_size = VALUE_ALIGN(sizeof(ADRPC::rpc_header) +
+                                        method.length());
+        for (std::vector<ADRPC::value*>::const_iterator it = vals.begin();
+             it != vals.end(); ++it)
+            msg_size += VALUE_HEADER_SIZE + VALUE_ALIGN((*it)->size);
 
-    // Send header
-    if (!send(&header, sizeof(header)))
-        goto exit;
+        bool use_sock = false;
+        res = shm_send(method, call_id, vals, msg_size, use_sock);
+        if (res && use_sock)
+            res = send_sock(method, call_id, vals, 0, 0);
+    }
+    else
+        res = send_sock(method, call_id, vals, 0, 0);
 
-    // Send method
-    if (!send(method.data(), method.length()))
-        goto exit;
+    pthread_mutex_unlock(&m_send_lock);
 
-    // Send params in loop
-    for (std::vector<ADRPC::value*>::const_iterator it = vals.begin();
-         it != vals.end(); ++it) {
-        const ADRPC::value* val = *it;
-        if (!send((void*)val, sizeof(*val) + val->size - 2))
-            goto exit;
+    return res;
+}
+
+/******************************************************************************/
+
+struct rpc_request
+{
+    std::string method;
+    uint32_t call_id;
+    std::vector<ADRPC::value*> params;
+    // Channel socket of channel open request, -1 otherwise
+    int sock;
+};
+
+struct rpc_lane
+{
+    ADRPC* rpc;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::vector<rpc_request*> queue;
+    bool stop;
+    bool running;
+};
+
+void* ADRPC::lane_thread(void* arg)
+{
+    rpc_lane* lane = (rpc_lane*)arg;
+
+    pthread_mutex_lock(&lane->lock);
+    while (1) {
+        while (lane->queue.empty() && !lane->stop)
+            pthread_cond_wait(&lane->cond, &lane->lock);
+        if (lane->queue.empty())
+            break;
+
+        // Take everything queued, execute in order
+        std::vector<rpc_request*> reqs;
+        reqs.swap(lane->queue);
+        pthread_mutex_unlock(&lane->lock);
+
+        for (size_t i = 0; i < reqs.size(); ++i) {
+            rpc_request* req = reqs[i];
+            if (req->method == CHANNEL_OPEN_METHOD)
+                lane->rpc->exec_channel_open(req->method, req->call_id,
+                                             req->sock);
+            else {
+                std::map<std::string, rpc_call>::const_iterator it =
+                    lane->rpc->m_calls.find(req->method);
+                lane->rpc->exec_call(it->second, req->method, req->call_id,
+                                     req->params);
+            }
+            delete req;
+        }
+
+        pthread_mutex_lock(&lane->lock);
     }
+    lane->running = false;
+    pthread_cond_broadcast(&lane->cond);
+    pthread_mutex_unlock(&lane->lock);
 
-    // Success
-    res = true;
+    return 0;
+}
 
-exit:
-    return res;
+bool ADRPC::start_lane(uint32_t num)
+{
+    if (m_lanes.find(num) != m_lanes.end())
+        return true;
+
+    rpc_lane* lane = new rpc_lane;
+    lane->rpc = this;
+    pthread_mutex_init(&lane->lock, 0);
+    pthread_cond_init(&lane->cond, 0);
+    lane->stop = false;
+    lane->running = true;
+    if (!m_spawn(lane_thread, lane)) {
+        pthread_cond_destroy(&lane->cond);
+        pthread_mutex_destroy(&lane->lock);
+        delete lane;
+        return false;
+    }
+    m_lanes[num] = lane;
+    return true;
+}
+
+bool ADRPC::start_lanes()
+{
+    // Lane 0 always exists, built-in calls are executed there
+    if (!start_lane(0))
+        return false;
+
+    std::map<std::string, rpc_call>::const_iterator it;
+    for (it = m_calls.begin(); it != m_calls.end(); ++it) {
+        if (!start_lane(it->second.lane))
+            return false;
+    }
+    return true;
+}
+
+void ADRPC::stop_lanes()
+{
+    std::map<uint32_t, rpc_lane*>::iterator it;
+    for (it = m_lanes.begin(); it != m_lanes.end(); ++it) {
+        rpc_lane* lane = it->second;
+
+        // Lane finishes queued calls and exits
+        pthread_mutex_lock(&lane->lock);
+        lane->stop = true;
+        pthread_cond_broadcast(&lane->cond);
+        while (lane->running)
+            pthread_cond_wait(&lane->cond, &lane->lock);
+        pthread_mutex_unlock(&lane->lock);
+
+        pthread_cond_destroy(&lane->cond);
+        pthread_mutex_destroy(&lane->lock);
+        delete lane;
+    }
+    m_lanes.clear();
+}
+
+void ADRPC::exec_call(const rpc_call& call, const std::string& method,
+                      uint32_t call_id, std::vector<ADRPC::value*>& params)
+{
+    std::vector<ADRPC::value*> retvals;
+
+    // Do call
+    call.cb(call.param, params, retvals);
+
+    // Send retvals. If peer is dead, loop will notice that on read.
+    send(method, call_id, retvals);
+
+    // Free values vector
+    free(params);
+    free(retvals);
+}
+
+void ADRPC::exec_channel_open(const std::string& method, uint32_t call_id,
+                              int sock)
+{
+    std::vector<ADRPC::value*> retvals;
+
+    // Handler owns socket on success
+    bool res = false;
+    if (m_channel && sock >= 0)
+        res = m_channel(m_channel_param, sock);
+    if (!res && sock >= 0)
+        ::close(sock);
+
+    // If peer is dead, loop will notice that on read
+    retvals.push_back(ADRPC::value::create_value((uint32_t)res));
+    send(method, call_id, retvals);
+    free(retvals);
 }
 
 bool ADRPC::exec_loop()
 {
+    m_server = true;
+    if (!start_lanes()) {
+        stop_lanes();
+        return false;
+    }
+
     while (1) {
         // Vector for in/out values
         std::vector<ADRPC::value*> params;
         std::vector<ADRPC::value*> retvals;
-        std::map<std::string, std::pair<adrpc_call, void*> >::iterator it;
+        std::map<std::string, rpc_call>::iterator it;
+        std::map<uint32_t, rpc_lane*>::iterator itLane;
+        rpc_request* req = 0;
+        rpc_lane* lane = 0;
 
         // Read call with params
         std::string method;
-        if (!read(method, params))
+        uint32_t call_id = 0;
+        if (!read(method, call_id, params))
             goto exit;
 
-        // Check if method was registered
-        if ((it = m_calls.find(method)) == m_calls.end())
-            goto exit;
+        // Client passes shm region, reply goes through the socket.
+        // Lanes send under the same lock, so they see transport switched.
+        if (method == SHM_ATTACH_METHOD) {
+            pthread_mutex_lock(&m_send_lock);
+            bool res = shm_attach_server(params);
+            retvals.push_back(ADRPC::value::create_value((uint32_t)res));
+            shm_transport* shm = m_shm;
+            m_shm = 0;
+            bool sent = send_sock(method, call_id, retvals, 0, 0);
+            m_shm = shm;
+            pthread_mutex_unlock(&m_send_lock);
+            if (!sent)
+                goto exit;
+            free(params);
+            free(retvals);
+            continue;
+        }
+
+        // Client passes channel socket, which is served on lane 0,
+        // as reply must not be sent by reader
+        if (method == CHANNEL_OPEN_METHOD) {
+            req = new rpc_request;
+            req->method = method;
+            req->call_id = call_id;
+            req->sock = -1;
+            if (m_recv_fds.size() == 1) {
+                req->sock = m_recv_fds[0];
+                m_recv_fds.clear();
+            }
+            close_recv_fds();
+            free(params);
 
-        // Do call
-        it->second.first(it->second.second, params, retvals);
+            lane = m_lanes[0];
+            pthread_mutex_lock(&lane->lock);
+            lane->queue.push_back(req);
+            pthread_cond_signal(&lane->cond);
+            pthread_mutex_unlock(&lane->lock);
+            continue;
+        }
 
-        // Send retvals
-        if (!send(method, retvals))
+        // Check if method was registered, every registered lane is started
+        if ((it = m_calls.find(method)) == m_calls.end() ||
+            (itLane = m_lanes.find(it->second.lane)) == m_lanes.end())
             goto exit;
 
-        // Free values vector
-        free(params);
-        free(retvals);
+        // Pass to lane. Ring frame is released on next read,
+        // so borrowed params are copied.
+        req = new rpc_request;
+        req->method = method;
+        req->call_id = call_id;
+        req->sock = -1;
+        for (size_t i = 0; i < params.size(); ++i) {
+            if (params[i]->type & ADRPC::value::BORROWED) {
+                ADRPC::value* val = ADRPC::value::copy(params[i]);
+                if (!val) {
+                    free(req->params);
+                    delete req;
+                    goto exit;
+                }
+                req->params.push_back(val);
+            }
+            else
+                req->params.push_back(params[i]);
+        }
+        params.clear();
+
+        lane = itLane->second;
+        pthread_mutex_lock(&lane->lock);
+        lane->queue.push_back(req);
+        pthread_cond_signal(&lane->cond);
+        pthread_mutex_unlock(&lane->lock);
 
         continue;
 
@@ -267,22 +1280,159 @@ bool ADRPC::exec_loop()
         // Free vectors
         free(params);
         free(retvals);
+        stop_lanes();
+        m_server = false;
         return false;
     }
 }
 
+/******************************************************************************/
+
 bool ADRPC::call(const std::string& method,
                  const std::vector<ADRPC::value*>& params,
                  std::vector<ADRPC::value*>& retvals)
 {
-    // Send request
-    if (!send(method, params))
+    uint32_t call_id = call_async(method, params);
+    if (call_id == 0)
         return false;
-    // Read retvals
-    std::string method_ret;
-    if (!read(method_ret, retvals))
+    return wait(call_id, retvals);
+}
+
+uint32_t ADRPC::call_async(const std::string& method,
+                           const std::vector<ADRPC::value*>& params)
+{
+    // Zero is invalid id
+    if (++m_call_id == 0)
+        ++m_call_id;
+    uint32_t call_id = m_call_id;
+
+    if (!send(method, call_id, params))
+        return 0;
+    // Replies could be stashed while waiting for ring space
+    notify_stashed();
+    return call_id;
+}
+
+bool ADRPC::wait(uint32_t call_id, std::vector<ADRPC::value*>& retvals)
+{
+    if (take_reply(call_id, retvals))
+        return true;
+
+    while (1) {
+        std::string method;
+        uint32_t reply_id = 0;
+        std::vector<ADRPC::value*> vals;
+        if (!read(method, reply_id, vals))
+            return false;
+        if (reply_id == call_id) {
+            retvals.insert(retvals.end(), vals.begin(), vals.end());
+            notify_stashed();
+            return true;
+        }
+        stash_reply(reply_id, vals);
+    }
+}
+
+bool ADRPC::try_wait(uint32_t call_id, std::vector<ADRPC::value*>& retvals,
+                     bool& done)
+{
+    done = take_reply(call_id, retvals);
+    if (done)
+        return true;
+
+    while (1) {
+        bool avail = false;
+        if (!readable(avail))
+            return false;
+        if (!avail)
+            return true;
+
+        std::string method;
+        uint32_t reply_id = 0;
+        std::vector<ADRPC::value*> vals;
+        if (!read(method, reply_id, vals))
+            return false;
+        if (reply_id == call_id) {
+            retvals.insert(retvals.end(), vals.begin(), vals.end());
+            done = true;
+            return true;
+        }
+        stash_reply(reply_id, vals);
+    }
+}
+
+int ADRPC::notify_fd() const
+{
+    // Socket can't be signaled for stashed replies
+    return (m_shm ? m_shm->data_fd : -1);
+}
+
+void ADRPC::ack_notify()
+{
+    uint64_t cnt;
+
+    if (!m_shm || !m_replies.empty())
+        return;
+    // Blocking waits arm the flag themselves
+    m_shm->rx->consumer_waiting = 0;
+    __sync_synchronize();
+    while (::read(m_shm->data_fd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+        ;
+}
+
+// Notify fd was drained while waiting, so signal it for stashed replies
+void ADRPC::notify_stashed()
+{
+    if (m_shm && !m_replies.empty())
+        shm_wake(m_shm->data_fd);
+}
+
+void ADRPC::stash_reply(uint32_t call_id, std::vector<ADRPC::value*>& vals)
+{
+    std::vector<ADRPC::value*>& stashed = m_replies[call_id];
+    for (size_t i = 0; i < vals.size(); ++i) {
+        if (vals[i]->type & ADRPC::value::BORROWED) {
+            ADRPC::value* val = ADRPC::value::copy(vals[i]);
+            // Caller will get wrong retvals size
+            if (val)
+                stashed.push_back(val);
+        }
+        else
+            stashed.push_back(vals[i]);
+    }
+    vals.clear();
+}
+
+bool ADRPC::take_reply(uint32_t call_id, std::vector<ADRPC::value*>& retvals)
+{
+    std::map<uint32_t, std::vector<ADRPC::value*> >::iterator it =
+        m_replies.find(call_id);
+    if (it == m_replies.end())
         return false;
-    assert(method == method_ret);
+    retvals.insert(retvals.end(), it->second.begin(), it->second.end());
+    m_replies.erase(it);
+    return true;
+}
+
+// Reads all received replies without blocking
+bool ADRPC::drain_replies()
+{
+    while (1) {
+        bool avail = false;
+        if (!readable(avail))
+            return false;
+        if (!avail)
+            break;
+
+        std::string method;
+        uint32_t reply_id = 0;
+        std::vector<ADRPC::value*> vals;
+        if (!read(method, reply_id, vals))
+            return false;
+        stash_reply(reply_id, vals);
+    }
+    if (m_shm)
+        shm_release();
     return true;
 }
 
@@ -290,7 +1440,9 @@ void ADRPC::free(std::vector<ADRPC::value*>& vec)
 {
     std::vector<ADRPC::value*>::iterator it = vec.begin();
     while (it != vec.end()) {
-        ::free(*it);
+        // Borrowed values are released with the ring frame
+        if (!((*it)->type & ADRPC::value::BORROWED))
+            ::free(*it);
         it = vec.erase(it);
     }
 }
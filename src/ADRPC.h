@@ -3,6 +3,7 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <vector>
 #include <map>
 #include <string>
@@ -18,65 +19,195 @@ public:
         bool to_uint32(uint32_t&) const;
 
         static value* create_value(const std::vector<unsigned char>&);
+        static value* create_value(const void* data, uint32_t size);
         static value* create_value(uint32_t);
 
+        // Value references data, which is not copied and must be alive
+        // till value is sent
+        static value* create_value_ref(const void* data, uint32_t size);
+
     private:
         friend class ADRPC;
 
         // Supported types of values
-        enum type
+        enum value_type
         {
             BYTEARRAY = 0,
-            UINT32    = 1
+            UINT32    = 1,
+
+            TYPE_MASK = 0xffff,
+
+            // Local flags, never sent
+            REFERENCE = 0x40000000, // val keeps pointer to data
+            BORROWED  = 0x80000000  // value lives in shm ring, is not freed
         };
-        type type;
-        uint16_t size;
-        unsigned char val[2];
+
+        const unsigned char* data() const;
+        static value* copy(const value*);
+
+        uint32_t type;
+        uint32_t size;
+        unsigned char val[4];
     };
 
     typedef void (*adrpc_call) (void* param,
                                 const std::vector<ADRPC::value*>&,
                                 std::vector<ADRPC::value*>& retvals);
 
+    // Starts detached thread, server lanes are run in such threads
+    typedef bool (*adrpc_spawn) (void* (*fn)(void*), void* arg);
+
+    // Serves channel socket opened by client, takes ownership of socket
+    typedef bool (*adrpc_channel) (void* param, int sock);
+
     // Default ctr
     ADRPC();
+    ~ADRPC();
 
-    // Set sock descriptor
+    // Set sock descriptor, detaches shm transport
     void set_fd(int sock);
 
-    // Register callback by method name
-    bool register_call(const std::string& method, adrpc_call cb, void* param);
+    // Register callback by method name. Every lane (0 included) gets own
+    // thread, so calls of different lanes do not wait for each other.
+    // Loop only reads calls and never sends their replies, so it keeps
+    // reading while client is blocked on sending a large request.
+    bool register_call(const std::string& method, adrpc_call cb, void* param,
+                       uint32_t lane = 0);
+
+    // Set thread spawner for lanes, pthread is used by default
+    void set_spawn(adrpc_spawn spawn);
+
+    // Set handler of channels, which are opened by client. Without
+    // handler server refuses to open channels.
+    void set_channel_handler(adrpc_channel handler, void* param);
 
     // Enters main server loop
     bool exec_loop();
 
-    // Calls method
+    // Calls method. Retvals can be borrowed from shm ring and
+    // stay valid till next call.
     bool call(const std::string& method,
               const std::vector<ADRPC::value*>& params,
               std::vector<ADRPC::value*>& retvals);
 
+    // Sends request and returns call id without waiting for reply,
+    // returns 0 on failure. Params can be freed right after return.
+    uint32_t call_async(const std::string& method,
+                        const std::vector<ADRPC::value*>& params);
+
+    // Blocks till reply of async call is received
+    bool wait(uint32_t call_id, std::vector<ADRPC::value*>& retvals);
+
+    // Takes reply of async call if it has been received, never blocks.
+    // Returns false on transport error.
+    bool try_wait(uint32_t call_id, std::vector<ADRPC::value*>& retvals,
+                  bool& done);
+
+    // Descriptor, which becomes readable when replies arrive, -1 if
+    // transport does not support it (socket). Valid till 'set_fd' or
+    // 'detach_shm', call 'try_wait' when readable.
+    int notify_fd() const;
+
+    // Acknowledges notify fd, when no more replies are expected
+    void ack_notify();
+
+    // Passes connected socket to the server, which serves it as another
+    // independent connection. Caller closes own copy of socket.
+    // Client side only, shm must not be attached.
+    bool open_channel(int sock);
+
+    // Creates shared memory region with two rings (one for each direction)
+    // and passes it to the server. Messages which do not fit ring are
+    // still sent through the socket. Client side only.
+    bool attach_shm(uint32_t ring_size);
+    void detach_shm();
+    bool is_shm_attached() const;
+
     // Frees vector of values
     static void free(std::vector<ADRPC::value*>&);
 
 private:
+    struct rpc_call
+    {
+        adrpc_call cb;
+        void* param;
+        uint32_t lane;
+    };
+
     bool read(void* b, uint32_t size);
-    bool read(std::string& method_str,
+    bool read(std::string& method_str, uint32_t& call_id,
               std::vector<ADRPC::value*>& vals);
-    bool send(const void* b, uint32_t size);
-    bool send(const std::string& method,
+    bool readable(bool& avail);
+    bool send(const std::string& method, uint32_t call_id,
               const std::vector<ADRPC::value*>& vals);
+    bool send_iov(struct iovec* iov, int iov_num,
+                  const int* fds, int fds_num);
+
+    bool read_sock(std::string& method_str, uint32_t& call_id,
+                   std::vector<ADRPC::value*>& vals);
+    bool send_sock(const std::string& method, uint32_t call_id,
+                   const std::vector<ADRPC::value*>& vals,
+                   const int* fds, int fds_num);
+
+    // Replies of other calls, which were read while waiting
+    void stash_reply(uint32_t call_id, std::vector<ADRPC::value*>& vals);
+    bool take_reply(uint32_t call_id, std::vector<ADRPC::value*>& retvals);
+    bool drain_replies();
+    void notify_stashed();
+
+    // Server lanes
+    bool start_lane(uint32_t num);
+    bool start_lanes();
+    void stop_lanes();
+    static void* lane_thread(void* arg);
+    void exec_call(const rpc_call& call, const std::string& method,
+                   uint32_t call_id, std::vector<ADRPC::value*>& params);
+    void exec_channel_open(const std::string& method, uint32_t call_id,
+                           int sock);
+
+    // Shared memory transport
+    bool shm_map(int mem_fd, const int* efds,
+                 uint32_t ring_size, bool client);
+    bool shm_attach_server(const std::vector<ADRPC::value*>& params);
+    bool shm_read(std::string& method_str, uint32_t& call_id,
+                  std::vector<ADRPC::value*>& vals,
+                  bool& use_sock);
+    bool shm_readable(bool& avail);
+    void shm_release();
+    bool shm_send(const std::string& method, uint32_t call_id,
+                  const std::vector<ADRPC::value*>& vals,
+                  uint32_t msg_size, bool& use_sock);
+    bool shm_sleep(int fd1, int fd2);
+    void shm_wake(int fd);
+    void close_recv_fds();
 
 private:
     struct rpc_header
     {
         uint16_t method_size;
         uint16_t values_num;
+        uint32_t call_id;
         // method name will follow
         // values will follow
     };
 
-    std::map<std::string, std::pair<adrpc_call, void*> > m_calls;
+    std::map<std::string, rpc_call> m_calls;
     int m_sock;
+    // Descriptors received with SCM_RIGHTS
+    std::vector<int> m_recv_fds;
+    struct shm_transport* m_shm;
+
+    // Client side
+    uint32_t m_call_id;
+    std::map<uint32_t, std::vector<ADRPC::value*> > m_replies;
+
+    // Server side
+    bool m_server;
+    adrpc_spawn m_spawn;
+    adrpc_channel m_channel;
+    void* m_channel_param;
+    std::map<uint32_t, struct rpc_lane*> m_lanes;
+    pthread_mutex_t m_send_lock;
 };
 
 #endif //_ADRPC_
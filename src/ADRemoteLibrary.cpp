@@ -1,74 +1,626 @@
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <deque>
 
 #include <QCoreApplication>
-#include <QProcess>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QFile>
 #include <QDir>
 
 #include "ADRemoteLibrary.h"
 #include "ADBootstrap.h"
 #include "ADCryptoAPI.h"
+#include "ADAtomicOps.h"
 #include "ADRPC.h"
 
 #ifndef _LIN_
 #error Unsupported platform
 #endif
 
+// Pass encode/decode payloads through shared memory rings instead of the
+// socket. Comment out to use socket only.
+#define RPC_SHM_RING_SIZE (4 << 20)
+
+// Max number of ADAPIServer processes if pool size was not set
+#define SERVER_POOL_DEFAULT_MAX 4
+
+// Delay before next try if standby process can't be started
+#define STANDBY_RETRY_MSECS 5000
+
+// Time given to server to exit on SIGTERM before it is killed
+#define TERMINATE_GRACE_MSECS 500
+
 /******************************************************************************/
 
-class WineProcess : public QProcess
+// Processes are shared by connection threads, so QProcess (which is bound
+// to the thread where it was created) is not used
+class WineProcess
 {
 public:
-    WineProcess ( int fd ) :
-        m_fd(fd)
+    WineProcess () :
+        m_pid(-1)
+    {}
+
+    ~WineProcess ()
     {
+        terminate();
+    }
+
+    // Starts server with fd as stdin, fails if exec failed
+    bool start ( const QString& binPath, int fd )
+    {
+        QByteArray bin = QFile::encodeName( binPath );
 #ifdef REDIRECT_STDOUT_STDERR
-            setStandardErrorFile( QCoreApplication::applicationDirPath() + "/adapi_server_err" );
-            setStandardOutputFile( QCoreApplication::applicationDirPath() + "/adapi_server_out" );
+        QByteArray errPath = QFile::encodeName(
+            QCoreApplication::applicationDirPath() + "/adapi_server_err" );
+        QByteArray outPath = QFile::encodeName(
+            QCoreApplication::applicationDirPath() + "/adapi_server_out" );
 #endif
+        // Child writes errno to the pipe if exec fails
+        int pipeFds[2];
+        if ( ::pipe2(pipeFds, O_CLOEXEC) < 0 )
+            return false;
+
+        pid_t pid = ::fork();
+        if ( pid < 0 ) {
+            ::close( pipeFds[0] );
+            ::close( pipeFds[1] );
+            return false;
+        }
+        else if ( pid == 0 ) {
+            // Only async-signal-safe calls till exec
+            ::close( pipeFds[0] );
+            ::dup2( fd, STDIN_FILENO );
+#ifdef REDIRECT_STDOUT_STDERR
+            int errFd = ::open( errPath.constData(),
+                                O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+            int outFd = ::open( outPath.constData(),
+                                O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+            if ( errFd >= 0 )
+                ::dup2( errFd, STDERR_FILENO );
+            if ( outFd >= 0 )
+                ::dup2( outFd, STDOUT_FILENO );
+#endif
+            ::execl( bin.constData(), bin.constData(), (char*)0 );
+            int err = errno;
+            ssize_t wr = ::write( pipeFds[1], &err, sizeof(err) );
+            (void)wr;
+            ::_exit( 127 );
+        }
+
+        ::close( pipeFds[1] );
+        int err = 0;
+        ssize_t rd;
+        while ( (rd = ::read(pipeFds[0], &err, sizeof(err))) < 0 &&
+                errno == EINTR )
+            ;
+        ::close( pipeFds[0] );
+
+        m_pid = pid;
+        if ( rd > 0 ) {
+            // Exec failed, reap child
+            terminate();
+            return false;
         }
+        return true;
+    }
+
+    // Hung server may ignore SIGTERM, so it is killed after grace period
+    void terminate ()
+    {
+        if ( m_pid < 0 )
+            return;
+        ::kill( m_pid, SIGTERM );
+        for ( int msecs = 0; msecs < TERMINATE_GRACE_MSECS; msecs += 10 ) {
+            pid_t res = ::waitpid( m_pid, 0, WNOHANG );
+            if ( res == m_pid || (res < 0 && errno != EINTR) ) {
+                m_pid = -1;
+                return;
+            }
+            ::usleep( 10000 );
+        }
+        ::kill( m_pid, SIGKILL );
+        while ( ::waitpid(m_pid, 0, 0) < 0 && errno == EINTR )
+            ;
+        m_pid = -1;
+    }
 
+private:
+    pid_t m_pid;
+};
+
+/******************************************************************************/
+
+// ADAPIServer process of the pool
+struct ServerProcess
+{
+    ServerProcess () :
+        sock(-1),
+        busy(0),
+        failed(0),
+        sessions(0)
+    {}
+
+    ~ServerProcess ()
+    {
+        // Server exits when control channel is closed
+        rpc.set_fd(-1);
+        if ( sock != -1 )
+            ::close(sock);
+        wineProcess.terminate();
+    }
+
+    WineProcess wineProcess;
+    // Control channel: opens session channels and takes stateless calls
+    // of sessions pinned to other processes
+    QMutex rpcLock;
+    ADRPC rpc;
+    int sock;
+    // Calls in flight
+    volatile atomic32_t busy;
+    // Control channel call failed, process is not used for new calls
+    volatile atomic32_t failed;
+    // Sessions pinned to the process, protected by pool lock
+    unsigned int sessions;
+};
+
+// Spawns standby process in background
+class StandbyStarter : public QThread
+{
 protected:
-    void setupChildProcess ()
+    void run ();
+};
+
+// Process-wide pool of ADAPIServer processes. Session is pinned to the
+// process with fewest sessions (decode stream state lives there), new
+// process is started only if every running process has sessions.
+// Processes are stopped when the last session is released, unless pool
+// is kept warm: then processes are reused by next sessions and a standby
+// process is kept started, so new or crashed one is replaced at once.
+// Processes are taken out of the pool under pool lock, but are stopped
+// after it is released, so hung process never blocks calls of others.
+// Pool is never destructed, it is stopped by QCoreApplication post routine.
+class ServerPool
+{
+public:
+    static ServerPool& instance ()
+    {
+        static ServerPool* pool = new ServerPool;
+        return *pool;
+    }
+
+    static void shutdown ()
+    {
+        instance().stop();
+    }
+
+    void stop ()
+    {
+        QList<ServerProcess*> dead;
+        {
+            QMutexLocker locker( &m_lock );
+            m_stopStarter = true;
+            m_keepWarm = false;
+            m_standbyCond.wakeAll();
+        }
+        m_starter.wait();
+        {
+            QMutexLocker locker( &m_lock );
+            stopAll( dead );
+        }
+        destroy( dead );
+    }
+
+    void setSize ( unsigned int size )
+    {
+        QMutexLocker locker( &m_lock );
+        m_size = size;
+    }
+
+    unsigned int size () const
+    {
+        QMutexLocker locker( &m_lock );
+        return poolSize();
+    }
+
+    void setKeepWarm ( bool keepWarm )
+    {
+        QList<ServerProcess*> dead;
+        {
+            QMutexLocker locker( &m_lock );
+            if ( m_stopStarter )
+                return;
+            m_keepWarm = keepWarm;
+            m_standbyCond.wakeAll();
+            if ( keepWarm ) {
+                if ( ! m_starter.isRunning() )
+                    m_starter.start();
+            }
+            else if ( m_sessions == 0 )
+                stopAll( dead );
+            else if ( m_standby ) {
+                dead.append( m_standby );
+                m_standby = 0;
+            }
+        }
+        destroy( dead );
+    }
+
+    bool keepWarm () const
+    {
+        QMutexLocker locker( &m_lock );
+        return m_keepWarm;
+    }
+
+    ServerProcess* acquire ()
+    {
+        bool canStart = true;
+
+        // Process is started and pinged without pool lock, so calls of
+        // other sessions are dispatched meanwhile
+        for ( int attempt = 0; attempt < 3; ++attempt ) {
+            ServerProcess* proc = 0;
+            bool isNew = false;
+            QList<ServerProcess*> dead;
+            {
+                QMutexLocker locker( &m_lock );
+                removeFailed( dead );
+
+                unsigned int running = m_starting;
+                foreach ( ServerProcess* p, m_procs ) {
+                    if ( atomic_read32(&p->failed) )
+                        continue;
+                    ++running;
+                    if ( proc == 0 || p->sessions < proc->sessions )
+                        proc = p;
+                }
+                if ( canStart && (proc == 0 || proc->sessions > 0) &&
+                     running < poolSize() ) {
+                    proc = takeStandby();
+                    isNew = true;
+                    ++m_starting;
+                }
+                else if ( proc == 0 ) {
+                    locker.unlock();
+                    destroy( dead );
+                    return 0;
+                }
+                else
+                    // Session is counted before ping, so process is
+                    // not stopped meanwhile
+                    ++proc->sessions;
+                ++m_sessions;
+            }
+            destroy( dead );
+
+            if ( isNew && proc == 0 )
+                proc = startProcess();
+
+            // Warm process could die while it was idle
+            bool alive = ( proc != 0 && ping(proc) );
+
+            {
+                QMutexLocker locker( &m_lock );
+                if ( isNew ) {
+                    --m_starting;
+                    if ( alive ) {
+                        m_procs.append( proc );
+                        ++proc->sessions;
+                    }
+                    else
+                        canStart = ( proc != 0 );
+                }
+                else if ( ! alive ) {
+                    --proc->sessions;
+                    atomic_write32( &proc->failed, 1 );
+                }
+                if ( alive )
+                    return proc;
+                --m_sessions;
+            }
+            // New process is not in the pool, so nobody else sees it
+            if ( isNew )
+                delete proc;
+        }
+
+        return 0;
+    }
+
+    void release ( ServerProcess* proc )
     {
-            ::dup2(m_fd, STDIN_FILENO);
+        QList<ServerProcess*> dead;
+        {
+            QMutexLocker locker( &m_lock );
+
+            Q_ASSERT(proc->sessions > 0 && m_sessions > 0);
+            --proc->sessions;
+            --m_sessions;
+            if ( m_sessions == 0 && ! m_keepWarm )
+                stopAll( dead );
+            else
+                removeFailed( dead );
+        }
+        destroy( dead );
+    }
+
+    // Process for stateless call, pinned one is preferred on equal load.
+    // Busy counter is increased under lock, so process is not deleted
+    // till the call is done.
+    ServerProcess* acquireCall ( ServerProcess* pinned )
+    {
+        QMutexLocker locker( &m_lock );
+
+        ServerProcess* proc = pinned;
+        atomic32_t minBusy = atomic_read32( &pinned->busy );
+        foreach ( ServerProcess* p, m_procs ) {
+            if ( minBusy == 0 )
+                break;
+            if ( p == pinned || atomic_read32(&p->failed) )
+                continue;
+            atomic32_t busy = atomic_read32( &p->busy );
+            if ( busy < minBusy ) {
+                minBusy = busy;
+                proc = p;
+            }
+        }
+        atomic_inc32( &proc->busy );
+        return proc;
+    }
+
+    // Executed by standby starter thread
+    void standbyLoop ()
+    {
+        QMutexLocker locker( &m_lock );
+        while ( ! m_stopStarter ) {
+            if ( ! m_keepWarm || m_standby ) {
+                m_standbyCond.wait( &m_lock );
+                continue;
+            }
+
+            // Started process is ready when it replies to ping
+            locker.unlock();
+            ServerProcess* proc = 0;
+            if ( ADBootstrap::bootstrap() )
+                proc = startProcess();
+            if ( proc && ! ping(proc) ) {
+                delete proc;
+                proc = 0;
+            }
+            locker.relock();
+
+            if ( proc == 0 ) {
+                qWarning("Can't start standby ADAPIServer process");
+                m_standbyCond.wait( &m_lock, STANDBY_RETRY_MSECS );
+            }
+            else if ( ! m_keepWarm || m_stopStarter || m_standby ) {
+                locker.unlock();
+                delete proc;
+                locker.relock();
+            }
+            else
+                m_standby = proc;
+        }
     }
 
 private:
-    int m_fd;
+    ServerPool () :
+        m_standby(0),
+        m_size(0),
+        m_sessions(0),
+        m_starting(0),
+        m_keepWarm(false),
+        m_stopStarter(false)
+    {
+        // Starter thread and processes are stopped while application
+        // still exists, not by destructors of statics
+        qAddPostRoutine( ServerPool::shutdown );
+    }
+
+    unsigned int poolSize () const
+    {
+        if ( m_size )
+            return m_size;
+        int size = QThread::idealThreadCount();
+        if ( size > SERVER_POOL_DEFAULT_MAX )
+            size = SERVER_POOL_DEFAULT_MAX;
+        return ( size > 0 ? size : 1 );
+    }
+
+    ServerProcess* takeStandby ()
+    {
+        ServerProcess* proc = m_standby;
+        m_standby = 0;
+        // Start next one
+        m_standbyCond.wakeAll();
+        return proc;
+    }
+
+    // Takes failed processes out of the pool, must be called under
+    // pool lock, taken processes are destroyed after unlock
+    void removeFailed ( QList<ServerProcess*>& dead )
+    {
+        QList<ServerProcess*>::Iterator it = m_procs.begin();
+        while ( it != m_procs.end() ) {
+            ServerProcess* p = *it;
+            if ( atomic_read32(&p->failed) && p->sessions == 0 &&
+                 atomic_read32(&p->busy) == 0 ) {
+                it = m_procs.erase( it );
+                dead.append( p );
+            }
+            else
+                ++it;
+        }
+    }
+
+    // Stops processes, must be called without pool lock
+    static void destroy ( QList<ServerProcess*>& dead )
+    {
+        foreach ( ServerProcess* p, dead )
+            delete p;
+        dead.clear();
+    }
+
+    static bool ping ( ServerProcess* proc )
+    {
+        uint32_t ok = 0;
+        std::vector<ADRPC::value*> params;
+        std::vector<ADRPC::value*> retvals;
+
+        QMutexLocker locker( &proc->rpcLock );
+        bool res = ( proc->rpc.call("adapi.ping", params, retvals) &&
+                     retvals.size() == 1 && retvals[0]->to_uint32(ok) && ok );
+        ADRPC::free(retvals);
+        return res;
+    }
+
+    static ServerProcess* startProcess ()
+    {
+        int socks[2] = { -1, -1 };
+        QString serverBinPath;
+        QString bootstrapDir = QString::fromLatin1( ADBootstrap::bootstrapDir() );
+        QDir cp( QCoreApplication::applicationDirPath() );
+        ServerProcess* proc = 0;
+
+        if ( cp.exists(bootstrapDir + "/ADAPIServer.exe") )
+            serverBinPath = cp.absoluteFilePath(bootstrapDir + "/ADAPIServer.exe");
+        else
+            return 0;
+
+        // It's a good idea to disable SIGPIPE signals; if client closes his end
+        // of the pipe/socket, we'd rather see a failure to send a response than
+        // get killed by the OS.
+        signal(SIGPIPE, SIG_IGN);
+
+        // Create socket. Close on exec, i.e. prevent inheritance by other
+        // servers, dup2 clears the flag for stdin of own server.
+        if ( ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) < 0 )
+            return 0;
+
+        proc = new ServerProcess;
+        bool started = proc->wineProcess.start( serverBinPath, socks[1] );
+
+        // Close fd on this side
+        ::close( socks[1] );
+
+        if ( ! started ) {
+            ::close( socks[0] );
+            delete proc;
+            return 0;
+        }
+
+        // Control channel is used under lock and stays on the socket
+        proc->sock = socks[0];
+        proc->rpc.set_fd( socks[0] );
+
+        return proc;
+    }
+
+    // Takes all processes out of the pool, see removeFailed
+    void stopAll ( QList<ServerProcess*>& dead )
+    {
+        dead += m_procs;
+        m_procs.clear();
+        if ( m_standby )
+            dead.append( m_standby );
+        m_standby = 0;
+    }
+
+private:
+    mutable QMutex m_lock;
+    QList<ServerProcess*> m_procs;
+    ServerProcess* m_standby;
+    unsigned int m_size;
+    unsigned int m_sessions;
+    unsigned int m_starting;
+    bool m_keepWarm;
+    bool m_stopStarter;
+    QWaitCondition m_standbyCond;
+    StandbyStarter m_starter;
 };
 
+void StandbyStarter::run ()
+{
+    ServerPool::instance().standbyLoop();
+}
+
 /******************************************************************************/
 
+// Decode streams are kept on server side by id
+static volatile atomic32_t s_decodeStreamId = 0;
+
 struct RemoteData
 {
     RemoteData () :
-        wineProcess(0)
-    {
-        socks[0] = socks[1] = -1;
-    }
+        sock(-1),
+        proc(0),
+        decodeStreamId(atomic_inc32(&s_decodeStreamId) + 1)
+    {}
 
-    void closeSocks ()
+    void closeSock ()
     {
         rpc.set_fd(-1);
-
-        if ( socks[0] != -1 ) {
-            ::close(socks[0]);
-            socks[0] = -1;
+        while ( ! decodeCalls.empty() ) {
+            atomic_dec32(&proc->busy);
+            decodeCalls.pop_front();
         }
-        if ( socks[1] != -1 ) {
-            ::close(socks[1]);
-            socks[1] = -1;
+
+        if ( sock != -1 ) {
+            ::close(sock);
+            sock = -1;
         }
     }
 
+    // Own channel to the pinned process
     ADRPC rpc;
-    int socks[2];
-    WineProcess* wineProcess;
+    // Submitted, not taken decode stream calls
+    std::deque<uint32_t> decodeCalls;
+    int sock;
+    ServerProcess* proc;
+    uint32_t decodeStreamId;
+};
+
+// Stateless call is executed by the least busy process: by own channel or
+// by control channel of other process, which is locked till retvals are
+// parsed (retvals can be borrowed from shm ring)
+class DispatchedCall
+{
+public:
+    DispatchedCall ( RemoteData* data ) :
+        m_proc( ServerPool::instance().acquireCall(data->proc) ),
+        m_shared( m_proc != data->proc ),
+        m_rpc( m_shared ? m_proc->rpc : data->rpc ),
+        m_locker( m_shared ? &m_proc->rpcLock : 0 )
+    {}
+
+    ~DispatchedCall ()
+    {
+        atomic_dec32(&m_proc->busy);
+    }
+
+    bool call ( const std::string& method,
+                const std::vector<ADRPC::value*>& params,
+                std::vector<ADRPC::value*>& retvals )
+    {
+        bool res = m_rpc.call(method, params, retvals);
+        if ( ! res && m_shared )
+            atomic_write32(&m_proc->failed, 1);
+        return res;
+    }
+
+private:
+    ServerProcess* m_proc;
+    bool m_shared;
+    ADRPC& m_rpc;
+    QMutexLocker m_locker;
 };
 
 /******************************************************************************/
@@ -83,56 +635,67 @@ ADRemoteLibrary::~ADRemoteLibrary ()
     delete m_data;
 }
 
-bool ADRemoteLibrary::load ()
+void ADRemoteLibrary::setServerPoolSize ( unsigned int size )
 {
-    unload();
+    ServerPool::instance().setSize( size );
+}
 
-    int fd = -1;
-    int res = -1;
-    int flags = 0;
-    QString serverBinPath;
-    QString bootstrapDir = QString::fromLatin1( ADBootstrap::bootstrapDir() );
-    QDir cp( QCoreApplication::applicationDirPath() );
+unsigned int ADRemoteLibrary::serverPoolSize ()
+{
+    return ServerPool::instance().size();
+}
 
-    if ( cp.exists(bootstrapDir + "/ADAPIServer.exe") )
-        serverBinPath = cp.absoluteFilePath(bootstrapDir + "/ADAPIServer.exe");
-    else
-        goto error;
+void ADRemoteLibrary::setServerKeepWarm ( bool keepWarm )
+{
+    ServerPool::instance().setKeepWarm( keepWarm );
+}
 
-    // It's a good idea to disable SIGPIPE signals; if client closes his end
-    // of the pipe/socket, we'd rather see a failure to send a response than
-    // get killed by the OS.
-    signal(SIGPIPE, SIG_IGN);
+bool ADRemoteLibrary::serverKeepWarm ()
+{
+    return ServerPool::instance().keepWarm();
+}
 
-    // Create socket
-    res = ::socketpair( AF_UNIX, SOCK_STREAM, 0, m_data->socks );
-    if ( res < 0 ) {
-        goto error;
-    }
+bool ADRemoteLibrary::load ()
+{
+    // Process which failed is not chosen again, so retry once
+    if ( openSession() )
+        return true;
+    return openSession();
+}
 
-    // Set close on exec, i.e. prevent inheritance
+bool ADRemoteLibrary::openSession ()
+{
+    unload();
+
+    int socks[2] = { -1, -1 };
+    bool res = false;
 
-    fd = m_data->socks[0];
-    flags = ::fcntl( fd, F_GETFD, 0 );
-    if ( flags < 0 ) {
+    // Session is pinned to one process of the pool
+    m_data->proc = ServerPool::instance().acquire();
+    if ( m_data->proc == 0 )
         goto error;
-    }
-    else if ( flags & FD_CLOEXEC ) {
-    }
-    else if ( ::fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0 ) {
+
+    // Own channel, so sessions of one process do not wait for each other
+    if ( ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) < 0 )
         goto error;
+    {
+        QMutexLocker locker( &m_data->proc->rpcLock );
+        res = m_data->proc->rpc.open_channel( socks[1] );
     }
-
-    m_data->wineProcess = new WineProcess( m_data->socks[1] );
-    m_data->wineProcess->start( serverBinPath );
-    if ( ! m_data->wineProcess->waitForStarted() )
+    ::close( socks[1] );
+    m_data->sock = socks[0];
+    if ( ! res ) {
+        atomic_write32(&m_data->proc->failed, 1);
         goto error;
-
-    // Close fd on this side
-    ::close( m_data->socks[1] );
+    }
 
     // Set fd
-    m_data->rpc.set_fd(fd);
+    m_data->rpc.set_fd( m_data->sock );
+
+#ifdef RPC_SHM_RING_SIZE
+    if ( ! m_data->rpc.attach_shm(RPC_SHM_RING_SIZE) )
+        qWarning("Can't attach shm transport, socket will be used");
+#endif
 
     return true;
 
@@ -143,19 +706,21 @@ bool ADRemoteLibrary::load ()
 
 void ADRemoteLibrary::unload ()
 {
-    m_data->closeSocks();
+    if ( m_data->proc == 0 )
+        return;
 
-    if ( m_data->wineProcess ) {
-        m_data->wineProcess->terminate();
-        m_data->wineProcess->waitForFinished();
-        delete m_data->wineProcess;
-        m_data->wineProcess = 0;
-    }
+    // Process outlives the session, so drop stream state on server side
+    if ( m_data->sock != -1 && ! atomic_read32(&m_data->proc->failed) )
+        resetDecodeStream();
+
+    m_data->closeSock();
+    ServerPool::instance().release( m_data->proc );
+    m_data->proc = 0;
 }
 
 bool ADRemoteLibrary::isLoaded () const
 {
-    return m_data->wineProcess != 0;
+    return m_data->proc != 0;
 }
 
 bool ADRemoteLibrary::encode ( const char* pEncodingType,
@@ -170,27 +735,19 @@ bool ADRemoteLibrary::encode ( const char* pEncodingType,
     if (pResultData == 0 || pcResultSize == 0)
         return false;
 
-    std::vector<unsigned char> encType;
-    if (pEncodingType && cEncodingTypeSize)
-        encType = std::vector<unsigned char>(pEncodingType,
-                                             pEncodingType + cEncodingTypeSize);
-
-    std::vector<unsigned char> data;
-    if (pData && cDataSize)
-        data = std::vector<unsigned char>(pData, pData + cDataSize);
-
-    std::vector<unsigned char> key;
-    if (pKey)
-        key = std::vector<unsigned char>(pKey, pKey + 16);
-
+    // Params reference caller buffers, data is copied only once on send
     uint32_t resOut = 0;
+    const unsigned char* data = 0;
+    uint32_t dataSize = 0;
     std::vector<ADRPC::value*> params;
-    params.push_back(ADRPC::value::create_value(encType));
-    params.push_back(ADRPC::value::create_value(key));
-    params.push_back(ADRPC::value::create_value(data));
+    params.push_back(ADRPC::value::create_value_ref(
+                         pEncodingType, (pEncodingType ? cEncodingTypeSize : 0)));
+    params.push_back(ADRPC::value::create_value_ref(pKey, (pKey ? 16 : 0)));
+    params.push_back(ADRPC::value::create_value_ref(pData, (pData ? cDataSize : 0)));
 
     std::vector<ADRPC::value*> retvals;
-    if (!m_data->rpc.call("adapi.encode", params, retvals)) {
+    DispatchedCall dispatched(m_data);
+    if (!dispatched.call("adapi.encode", params, retvals)) {
         qWarning("Call 'adapi.encode' failed");
         goto exit;
     }
@@ -205,17 +762,20 @@ bool ADRemoteLibrary::encode ( const char* pEncodingType,
         goto exit;
     }
 
-    if (!retvals[1]->to_bytearray(data)) {
+    if (!retvals[1]->to_bytearray_ptr(data, dataSize)) {
         qWarning("Can't parse data for 'adapi.encode' call");
+        resOut = 0;
         goto exit;
     }
 
-    if (data.size() > 0) {
-        *pcResultSize = data.size();
-        *pResultData = reinterpret_cast<char*>(::malloc(*pcResultSize));
-        if (*pResultData == 0)
-            return false;
-        std::copy(data.begin(), data.end(), *pResultData);
+    if (dataSize > 0) {
+        *pResultData = reinterpret_cast<char*>(::malloc(dataSize));
+        if (*pResultData == 0) {
+            resOut = 0;
+            goto exit;
+        }
+        *pcResultSize = dataSize;
+        ::memcpy(*pResultData, data, dataSize);
     }
 
 exit:
@@ -240,28 +800,19 @@ bool ADRemoteLibrary::decode ( const char* pEncodingType,
     if (pData == 0 || cDataSize == 0)
         return false;
 
-    std::vector<unsigned char> encType;
-    if (pEncodingType && cEncodingTypeSize)
-        encType = std::vector<unsigned char>(pEncodingType,
-                                             pEncodingType + cEncodingTypeSize);
-
-    std::vector<unsigned char> data;
-    if ( pData && cDataSize )
-        data = std::vector<unsigned char>(pData, pData + cDataSize);
-
-    std::vector<unsigned char> key;
-    if ( pKey )
-        key = std::vector<unsigned char>(pKey, pKey + 16);
-
     uint32_t resOut = 0;
     uint32_t parsedSize = 0;
+    const unsigned char* data = 0;
+    uint32_t dataSize = 0;
     std::vector<ADRPC::value*> params;
-    params.push_back(ADRPC::value::create_value(encType));
-    params.push_back(ADRPC::value::create_value(key));
-    params.push_back(ADRPC::value::create_value(data));
+    params.push_back(ADRPC::value::create_value_ref(
+                         pEncodingType, (pEncodingType ? cEncodingTypeSize : 0)));
+    params.push_back(ADRPC::value::create_value_ref(pKey, (pKey ? 16 : 0)));
+    params.push_back(ADRPC::value::create_value_ref(pData, cDataSize));
 
     std::vector<ADRPC::value*> retvals;
-    if (!m_data->rpc.call("adapi.decode", params, retvals)) {
+    DispatchedCall dispatched(m_data);
+    if (!dispatched.call("adapi.decode", params, retvals)) {
         qWarning("Call 'adapi.decode' failed");
         goto exit;
     }
@@ -276,22 +827,26 @@ bool ADRemoteLibrary::decode ( const char* pEncodingType,
         goto exit;
     }
 
-    if (!retvals[1]->to_bytearray(data)) {
+    if (!retvals[1]->to_bytearray_ptr(data, dataSize)) {
         qWarning("Can't parse data for 'adapi.decode' call");
+        resOut = 0;
         goto exit;
     }
 
     if (!retvals[2]->to_uint32(parsedSize)) {
         qWarning("Can't parse data for 'adapi.decode' call");
+        resOut = 0;
         goto exit;
     }
 
-    if (data.size() > 0) {
-        *pcResultSize = data.size();
-        *pResultData = reinterpret_cast<char*>(::malloc(*pcResultSize));
-        if (*pResultData == 0)
-            return false;
-        std::copy(data.begin(), data.end(), *pResultData);
+    if (dataSize > 0) {
+        *pResultData = reinterpret_cast<char*>(::malloc(dataSize));
+        if (*pResultData == 0) {
+            resOut = 0;
+            goto exit;
+        }
+        *pcResultSize = dataSize;
+        ::memcpy(*pResultData, data, dataSize);
     }
     *pcParsedSize = parsedSize;
 
@@ -301,6 +856,202 @@ exit:
     return !!resOut;
 }
 
+// Retvals: int,bytestring. Data is copied out, because retvals
+// can live in shm ring.
+static bool parseDecodeStreamRetvals ( const std::vector<ADRPC::value*>& retvals,
+                                       char** pResultData,
+                                       unsigned int* pcResultSize )
+{
+    uint32_t resOut = 0;
+    const unsigned char* data = 0;
+    uint32_t dataSize = 0;
+
+    *pResultData = 0;
+    *pcResultSize = 0;
+
+    if (retvals.size() != 2) {
+        qWarning("Wrong retval size for 'adapi.decodeStream' call");
+        return false;
+    }
+
+    if (!retvals[0]->to_uint32(resOut)) {
+        qWarning("Can't parse result for 'adapi.decodeStream' call");
+        return false;
+    }
+
+    if (!retvals[1]->to_bytearray_ptr(data, dataSize)) {
+        qWarning("Can't parse data for 'adapi.decodeStream' call");
+        return false;
+    }
+
+    // Empty data means more bytes are needed
+    if (resOut && dataSize > 0) {
+        *pResultData = reinterpret_cast<char*>(::malloc(dataSize));
+        if (*pResultData == 0)
+            return false;
+        *pcResultSize = dataSize;
+        ::memcpy(*pResultData, data, dataSize);
+    }
+
+    return !!resOut;
+}
+
+// Params: int,bytestring,bytestring,bytestring
+static void createDecodeStreamParams ( uint32_t streamId,
+                                       const char* pEncodingType,
+                                       unsigned int cEncodingTypeSize,
+                                       const char* pKey, const char* pData,
+                                       unsigned int cDataSize,
+                                       std::vector<ADRPC::value*>& params )
+{
+    // Only new bytes, tail is kept by server
+    params.push_back(ADRPC::value::create_value(streamId));
+    params.push_back(ADRPC::value::create_value_ref(
+                         pEncodingType, (pEncodingType ? cEncodingTypeSize : 0)));
+    params.push_back(ADRPC::value::create_value_ref(pKey, (pKey ? 16 : 0)));
+    params.push_back(ADRPC::value::create_value_ref(pData, (pData ? cDataSize : 0)));
+}
+
+bool ADRemoteLibrary::decodeStream ( const char* pEncodingType,
+                                     unsigned int cEncodingTypeSize,
+                                     const char* pKey, const char* pData,
+                                     unsigned int cDataSize, char** pResultData,
+                                     unsigned int* pcResultSize )
+{
+    if (!isLoaded())
+        return false;
+
+    if (pResultData == 0 || pcResultSize == 0)
+        return false;
+
+    *pResultData = 0;
+    *pcResultSize = 0;
+
+    bool res = false;
+    std::vector<ADRPC::value*> params;
+    createDecodeStreamParams(m_data->decodeStreamId, pEncodingType,
+                             cEncodingTypeSize, pKey, pData, cDataSize,
+                             params);
+
+    std::vector<ADRPC::value*> retvals;
+    if (!m_data->rpc.call("adapi.decodeStream", params, retvals))
+        qWarning("Call 'adapi.decodeStream' failed");
+    else
+        res = parseDecodeStreamRetvals(retvals, pResultData, pcResultSize);
+
+    ADRPC::free(params);
+    ADRPC::free(retvals);
+    return res;
+}
+
+void ADRemoteLibrary::resetDecodeStream ()
+{
+    if (!isLoaded())
+        return;
+
+    // Results of submitted chunks are not needed anymore
+    while (!m_data->decodeCalls.empty()) {
+        std::vector<ADRPC::value*> retvals;
+        m_data->rpc.wait(m_data->decodeCalls.front(), retvals);
+        m_data->decodeCalls.pop_front();
+        atomic_dec32(&m_data->proc->busy);
+        ADRPC::free(retvals);
+    }
+
+    std::vector<ADRPC::value*> params;
+    std::vector<ADRPC::value*> retvals;
+    params.push_back(ADRPC::value::create_value(m_data->decodeStreamId));
+    if (!m_data->rpc.call("adapi.resetDecodeStream", params, retvals))
+        qWarning("Call 'adapi.resetDecodeStream' failed");
+
+    ADRPC::free(params);
+    ADRPC::free(retvals);
+}
+
+bool ADRemoteLibrary::submitDecodeStream ( const char* pEncodingType,
+                                           unsigned int cEncodingTypeSize,
+                                           const char* pKey, const char* pData,
+                                           unsigned int cDataSize )
+{
+    if (!isLoaded())
+        return false;
+
+    std::vector<ADRPC::value*> params;
+    createDecodeStreamParams(m_data->decodeStreamId, pEncodingType,
+                             cEncodingTypeSize, pKey, pData, cDataSize,
+                             params);
+
+    // Server decodes chunks of one stream in order
+    uint32_t callId = m_data->rpc.call_async("adapi.decodeStream", params);
+    ADRPC::free(params);
+    if (callId == 0) {
+        qWarning("Call 'adapi.decodeStream' failed");
+        return false;
+    }
+    m_data->decodeCalls.push_back(callId);
+    atomic_inc32(&m_data->proc->busy);
+
+    return true;
+}
+
+bool ADRemoteLibrary::takeDecodeStream ( bool wait, bool* pTaken,
+                                         char** pResultData,
+                                         unsigned int* pcResultSize )
+{
+    if (!isLoaded())
+        return false;
+
+    if (pTaken == 0 || pResultData == 0 || pcResultSize == 0)
+        return false;
+
+    *pTaken = false;
+    *pResultData = 0;
+    *pcResultSize = 0;
+
+    // Nothing is expected, but notifier can be woken up
+    if (m_data->decodeCalls.empty()) {
+        m_data->rpc.ack_notify();
+        return true;
+    }
+
+    bool res = false;
+    std::vector<ADRPC::value*> retvals;
+    if (wait)
+        res = m_data->rpc.wait(m_data->decodeCalls.front(), retvals);
+    else
+        res = m_data->rpc.try_wait(m_data->decodeCalls.front(), retvals,
+                                   *pTaken);
+    if (!res) {
+        qWarning("Call 'adapi.decodeStream' failed");
+        goto exit;
+    }
+    if (wait)
+        *pTaken = true;
+    if (!*pTaken)
+        goto exit;
+
+    m_data->decodeCalls.pop_front();
+    atomic_dec32(&m_data->proc->busy);
+    res = parseDecodeStreamRetvals(retvals, pResultData, pcResultSize);
+
+exit:
+    ADRPC::free(retvals);
+    return res;
+}
+
+unsigned int ADRemoteLibrary::pendingDecodeStream () const
+{
+    return m_data->decodeCalls.size();
+}
+
+int ADRemoteLibrary::decodeStreamNotifier () const
+{
+    if (!isLoaded())
+        return -1;
+    // Without shm results are taken with waiting
+    return m_data->rpc.notify_fd();
+}
+
 bool ADRemoteLibrary::loadCertificate ( const char* pCertData,
                                         int cCertDataSize,
                                         void** ppCertContext )
@@ -9,6 +9,18 @@ public:
     ADRemoteLibrary ();
     virtual ~ADRemoteLibrary ();
 
+    // Number of ADAPIServer processes shared by all instances, zero means
+    // number of CPUs (but not more than 4). Sessions are spread among
+    // processes, stateless calls go to the least busy process.
+    static void setServerPoolSize ( unsigned int size );
+    static unsigned int serverPoolSize ();
+
+    // Keep processes running after the last session is closed and keep
+    // a standby process started, which replaces crashed one. Standby is
+    // spawned in background right after the call.
+    static void setServerKeepWarm ( bool keepWarm );
+    static bool serverKeepWarm ();
+
     virtual bool load ();
     virtual void unload ();
     virtual bool isLoaded () const;
@@ -24,6 +36,16 @@ public:
     virtual bool getConnectionType ( char* szData, int* pcSize );
     virtual bool freeMemory ( char* pData );
 
+    virtual bool decodeStream ( const char* pEncodingType, unsigned int cEncodingTypeSize, const char* pKey, const char* pData, unsigned int cDataSize, char** pResultData, unsigned int* pcResultSize );
+    virtual void resetDecodeStream ();
+    virtual bool submitDecodeStream ( const char* pEncodingType, unsigned int cEncodingTypeSize, const char* pKey, const char* pData, unsigned int cDataSize );
+    virtual bool takeDecodeStream ( bool wait, bool* pTaken, char** pResultData, unsigned int* pcResultSize );
+    virtual unsigned int pendingDecodeStream () const;
+    virtual int decodeStreamNotifier () const;
+
+private:
+    bool openSession ();
+
 private:
     struct RemoteData* m_data;
 };
@@ -0,0 +1,38 @@
+#include <QElapsedTimer>
+
+#include "ADStatLock.h"
+
+/****************************************************************************/
+
+ADStatRWLock::ADStatRWLock () :
+    m_contended(0),
+    m_waitNsecs(0)
+{}
+
+void ADStatRWLock::waitForRead ()
+{
+    QElapsedTimer timer;
+    timer.start();
+    m_lock.lockForRead();
+    atomic_inc64( &m_contended );
+    atomic_add64( &m_waitNsecs, timer.nsecsElapsed() );
+}
+
+void ADStatRWLock::waitForWrite ()
+{
+    QElapsedTimer timer;
+    timer.start();
+    m_lock.lockForWrite();
+    atomic_inc64( &m_contended );
+    atomic_add64( &m_waitNsecs, timer.nsecsElapsed() );
+}
+
+ADStatRWLock::Statistics ADStatRWLock::statistics () const
+{
+    Statistics stats;
+    stats.contended = atomic_read64( &m_contended );
+    stats.waitUsecs = atomic_read64( &m_waitNsecs ) / 1000;
+    return stats;
+}
+
+/****************************************************************************/
@@ -0,0 +1,128 @@
+#ifndef ADSTATLOCK_H
+#define ADSTATLOCK_H
+
+#include <QReadWriteLock>
+
+#include "ADAtomicOps.h"
+
+/**
+ * Read-write lock which accounts contention. Lock is tried first,
+ * only blocked acquisitions are counted and timed, so uncontended
+ * lock costs the same as plain QReadWriteLock and readers do not
+ * write shared counters.
+ */
+class ADStatRWLock
+{
+public:
+    struct Statistics
+    {
+        // Blocked acquisitions
+        quint64 contended;
+        // Total time of waiting for blocked acquisitions
+        quint64 waitUsecs;
+    };
+
+    ADStatRWLock ();
+
+    void lockForRead ()
+    {
+        if ( ! m_lock.tryLockForRead() )
+            waitForRead();
+    }
+
+    void lockForWrite ()
+    {
+        if ( ! m_lock.tryLockForWrite() )
+            waitForWrite();
+    }
+
+    void unlock ()
+    {
+        m_lock.unlock();
+    }
+
+    Statistics statistics () const;
+
+private:
+    ADStatRWLock ( const ADStatRWLock& );
+    ADStatRWLock& operator= ( const ADStatRWLock& );
+
+    void waitForRead ();
+    void waitForWrite ();
+
+    QReadWriteLock m_lock;
+    volatile atomic64_t m_contended;
+    volatile atomic64_t m_waitNsecs;
+};
+
+/** QReadLocker for ADStatRWLock */
+class ADReadLocker
+{
+public:
+    explicit ADReadLocker ( ADStatRWLock* lock ) :
+        m_lock(lock), m_locked(false)
+    { relock(); }
+
+    ~ADReadLocker ()
+    { unlock(); }
+
+    void unlock ()
+    {
+        if ( m_locked ) {
+            m_lock->unlock();
+            m_locked = false;
+        }
+    }
+
+    void relock ()
+    {
+        if ( ! m_locked ) {
+            m_lock->lockForRead();
+            m_locked = true;
+        }
+    }
+
+private:
+    ADReadLocker ( const ADReadLocker& );
+    ADReadLocker& operator= ( const ADReadLocker& );
+
+    ADStatRWLock* m_lock;
+    bool m_locked;
+};
+
+/** QWriteLocker for ADStatRWLock */
+class ADWriteLocker
+{
+public:
+    explicit ADWriteLocker ( ADStatRWLock* lock ) :
+        m_lock(lock), m_locked(false)
+    { relock(); }
+
+    ~ADWriteLocker ()
+    { unlock(); }
+
+    void unlock ()
+    {
+        if ( m_locked ) {
+            m_lock->unlock();
+            m_locked = false;
+        }
+    }
+
+    void relock ()
+    {
+        if ( ! m_locked ) {
+            m_lock->lockForWrite();
+            m_locked = true;
+        }
+    }
+
+private:
+    ADWriteLocker ( const ADWriteLocker& );
+    ADWriteLocker& operator= ( const ADWriteLocker& );
+
+    ADStatRWLock* m_lock;
+    bool m_locked;
+};
+
+#endif //ADSTATLOCK_H
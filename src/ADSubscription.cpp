@@ -1,3 +1,13 @@
+#include <algorithm>
+
+#ifdef _LIN_
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
 #include "ADConnection.h"
 #include "ADSubscription.h"
 
@@ -7,12 +17,16 @@ ADConnection::Subscription::Options::Options (
     const QSet<int>& paperNos,
     quint32 subscrType,
     quint32 subscrTypeReceive,
-    quint32 minDelay ) :
+    quint32 minDelay,
+    quint32 maxDelay ) :
 
     m_paperNos(paperNos),
-    m_subscrType(subscrType),
-    m_subscrTypeReceive(subscrTypeReceive),
-    m_minDelay(minDelay)
+    m_subscrType(subscrType & DeltaSubscription ?
+                 subscrType | QueueSubscription : subscrType),
+    m_subscrTypeReceive(subscrType & DeltaSubscription ?
+                        subscrTypeReceive | QueueSubscription : subscrTypeReceive),
+    m_minDelay(minDelay),
+    m_maxDelay(maxDelay)
 {}
 
 /****************************************************************************/
@@ -26,6 +40,71 @@ ADConnection::Subscription::Result ADConnection::Subscription::waitForUpdate ()
     return res;
 }
 
+ADConnection::Subscription::ResultType ADConnection::Subscription::waitForUpdates (
+    QVector<ADConnection::Subscription::Result>& out, int max,
+    quint32 msecs, QVector<ADConnection::QuoteSnapshot>* snapshots )
+{
+    if ( m_subscr )
+        return m_subscr->waitForUpdates( out, max, msecs, snapshots );
+    qWarning("Invalid subscription!");
+    out.clear();
+    return NotInitedResult;
+}
+
+int ADConnection::Subscription::eventFd ()
+{
+    if ( m_subscr )
+        return m_subscr->eventFd();
+    qWarning("Invalid subscription!");
+    return -1;
+}
+
+ADConnection::Subscription::ResultType ADConnection::Subscription::pollUpdates (
+    QVector<ADConnection::Subscription::Result>& out, int max,
+    QVector<ADConnection::QuoteSnapshot>* snapshots )
+{
+    if ( m_subscr )
+        return m_subscr->pollUpdates( out, max, snapshots );
+    qWarning("Invalid subscription!");
+    out.clear();
+    return NotInitedResult;
+}
+
+bool ADConnection::Subscription::setWorkers ( int workersNum )
+{
+    if ( m_subscr )
+        return m_subscr->setWorkers( workersNum );
+    qWarning("Invalid subscription!");
+    return false;
+}
+
+ADConnection::Subscription::Result ADConnection::Subscription::takeUpdate (
+    int worker, quint32 msecs )
+{
+    if ( m_subscr )
+        return m_subscr->takeUpdate( worker, msecs );
+    qWarning("Invalid subscription!");
+    ADConnection::Subscription::Result res = { NotInitedResult, 0 };
+    return res;
+}
+
+void ADConnection::Subscription::releaseUpdate ( int paperNo )
+{
+    if ( m_subscr )
+        m_subscr->releaseUpdate( paperNo );
+    else
+        qWarning("Invalid subscription!");
+}
+
+bool ADConnection::Subscription::getStatistics (
+    QVector<ADConnection::Subscription::PaperStatistics>& stats )
+{
+    if ( m_subscr )
+        return m_subscr->getStatistics( stats );
+    qWarning("Invalid subscription!");
+    return false;
+}
+
 bool ADConnection::Subscription::peekQuote ( int paperNo, ADConnection::Quote& quote )
 {
     if ( m_subscr )
@@ -34,6 +113,24 @@ bool ADConnection::Subscription::peekQuote ( int paperNo, ADConnection::Quote& q
     return false;
 }
 
+bool ADConnection::Subscription::peekQuoteSnapshot ( int paperNo,
+                                                     ADConnection::QuoteSnapshot& snapshot )
+{
+    if ( m_subscr )
+        return m_subscr->peekQuoteSnapshot( paperNo, snapshot );
+    qWarning("Invalid subscription!");
+    return false;
+}
+
+bool ADConnection::Subscription::takeDelta ( int paperNo,
+                                             ADConnection::QuoteDelta& delta )
+{
+    if ( m_subscr )
+        return m_subscr->takeDelta( paperNo, delta );
+    qWarning("Invalid subscription!");
+    return false;
+}
+
 bool ADConnection::Subscription::isValid () const
 {
     return m_subscr.isValid();
@@ -52,6 +149,24 @@ ADSubscriptionPrivate::ADSubscriptionPrivate (
     const QList<ADConnection::Subscription::Options>& opts ) :
     m_adConnection(adConn),
     m_opts(opts),
+    m_events(0),
+    m_eventsSize(0),
+    m_eventsHead(0),
+    m_eventsTail(0),
+    m_pending(0),
+    m_pendingMarks(0),
+    m_merged(0),
+    m_parked(0),
+    m_eventFd(-1),
+    m_timerFd(-1),
+    m_pollFd(-1),
+    m_fdSignaled(0),
+    m_jobsHead(0),
+    m_jobsNum(0),
+    m_timersNum(0),
+    m_workers(0),
+    m_workersNum(0),
+    m_queuedWork(0),
     m_threadCreator(QThread::currentThread())
 {
     ADConnection::TimeMark nowMark = 0;
@@ -65,62 +180,506 @@ ADSubscriptionPrivate::ADSubscriptionPrivate (
             SubscriptionState& subscr = m_vals[paperNo];
             ::memset(&subscr, 0, sizeof(subscr));
             subscr.subscrType = opts[i].m_subscrType;
+            subscr.maxDelay = qMax(opts[i].m_minDelay, opts[i].m_maxDelay);
+            subscr.delay = opts[i].m_minDelay;
             if ( opts[i].m_minDelay > 0 ) {
                 subscr.minDelay = opts[i].m_minDelay;
                 subscr.wakeupTime = ADConnection::timeMarkAppendMsecs(nowMark, subscr.minDelay);
-                qWarning("v=%d, MIN DELAY=%d\n", paperNo, subscr.minDelay);
             }
         }
     }
+
+    // Dense indexes of papers for the producer
+    QMap<int, SubscriptionState>::ConstIterator it = m_vals.constBegin();
+    for ( ; it != m_vals.constEnd(); ++it ) {
+        m_paperIndex[it.key()] = m_paperNos.size();
+        m_paperNos.append( it.key() );
+        m_paperTypes.append( it->subscrType );
+    }
+
+    // Never reallocated: paper is in every of them at most once
+    m_eventsSize = m_vals.size();
+    m_events = new int[ qMax(1, m_eventsSize) ];
+    m_pending = new atomic32_t[ qMax(1, m_eventsSize) ];
+    m_pendingMarks = new ADConnection::TimeMark[ qMax(1, m_eventsSize) ];
+    m_merged = new atomic32_t[ qMax(1, m_eventsSize) ];
+    for ( int i = 0; i < m_eventsSize; ++i ) {
+        m_pending[i] = 0;
+        m_pendingMarks[i] = 0;
+        m_merged[i] = 0;
+    }
+    m_jobs.resize( m_vals.size() );
+    m_timers.resize( m_vals.size() );
+}
+
+ADSubscriptionPrivate::~ADSubscriptionPrivate ()
+{
+    delete [] m_events;
+    delete [] m_pending;
+    delete [] m_pendingMarks;
+    delete [] m_merged;
+    delete [] m_workers;
+#ifdef _LIN_
+    if ( m_pollFd >= 0 ) {
+        ::close(m_pollFd);
+        ::close(m_timerFd);
+        ::close(m_eventFd);
+    }
+#endif
 }
 
 ADConnection::Subscription::Result ADSubscriptionPrivate::waitForUpdate ()
 {
-    ADConnection::Subscription::Result res;
+    ADConnection::Subscription::Result res = { ADConnection::Subscription::SuccessResult, 0 };
+    int num = 0;
+    ADConnection::Subscription::ResultType resCode = waitForJobs( &res, 1, num, 0 );
+    if ( resCode != ADConnection::Subscription::SuccessResult )
+        res.resultCode = resCode;
+    return res;
+}
+
+ADConnection::Subscription::ResultType ADSubscriptionPrivate::waitForUpdates (
+    QVector<ADConnection::Subscription::Result>& out, int max,
+    quint32 msecs, QVector<ADConnection::QuoteSnapshot>* snapshots )
+{
+    // At least one update is taken
+    max = qMax(1, max);
+    // Capacity of reused vector is kept, so steady state does not allocate
+    out.resize( max );
+    int num = 0;
+    ADConnection::Subscription::ResultType resCode =
+        waitForJobs( out.data(), max, num, msecs );
+    out.resize( num );
+    if ( resCode == ADConnection::Subscription::SuccessResult && snapshots )
+        fillSnapshots( out, *snapshots );
+
+    return resCode;
+}
+
+ADConnection::Subscription::ResultType ADSubscriptionPrivate::pollUpdates (
+    QVector<ADConnection::Subscription::Result>& out, int max,
+    QVector<ADConnection::QuoteSnapshot>* snapshots )
+{
+    // At least one update is taken
+    max = qMax(1, max);
+    out.resize( max );
+    int num = 0;
+    {
+        // Lock
+        QMutexLocker locker(&m_mutex);
+        _clearFd();
+        ADConnection::TimeMark nowMark = 0;
+        ADConnection::timeMark(nowMark);
+        _drainEvents(nowMark);
+        _expireTimers(nowMark);
+        _takeJobs(out.data(), max, num, nowMark);
+        _rearmFd(nowMark);
+    }
+    out.resize( num );
+    if ( snapshots )
+        fillSnapshots( out, *snapshots );
+
+    return ADConnection::Subscription::SuccessResult;
+}
+
+void ADSubscriptionPrivate::fillSnapshots (
+    const QVector<ADConnection::Subscription::Result>& results,
+    QVector<ADConnection::QuoteSnapshot>& snapshots )
+{
+    snapshots.resize( results.size() );
+
+    // Lock
+    QReadLocker rConnLocker( &m_rwConnLock );
+    if ( m_adConnection == 0 ) {
+        qWarning("Subscription without connection is incredible!");
+        return;
+    }
+    // Snapshots are read lock free
+    for ( int i = 0; i < results.size(); ++i ) {
+        if ( ! m_adConnection->_getQuoteSnapshot(results[i].paperNo, snapshots[i]) )
+            snapshots[i] = ADConnection::QuoteSnapshot();
+    }
+}
+
+ADConnection::Subscription::ResultType ADSubscriptionPrivate::waitForJobs (
+    ADConnection::Subscription::Result* out, int max, int& num,
+    quint32 msecs )
+{
+    num = 0;
     if ( QThread::currentThread() != m_threadCreator ) {
         qWarning("Subscription must be used from thread, "
                  "where it was created!");
-        res.resultCode = ADConnection::Subscription::WrongThreadResult;
-        return res;
+        return ADConnection::Subscription::WrongThreadResult;
+    }
+
+    ADConnection::TimeMark deadlineMark = 0;
+    if ( msecs != 0 ) {
+        ADConnection::timeMark(deadlineMark);
+        deadlineMark = ADConnection::timeMarkAppendMsecs(deadlineMark, msecs);
     }
+
     // Lock
     QMutexLocker locker(&m_mutex);
-iterate:
-    unsigned long minWait = ULONG_MAX;
-    ADConnection::TimeMark nowMark = 0;
-    ADConnection::timeMark(nowMark);
-    foreach ( int v, m_vals.keys() ) {
-        if ( m_vals[v].wakeupTime <= nowMark ) {
-            if ( m_vals[v].updated && ! m_vals[v].appended ) {
-                m_vals[v].appended = true;
-                m_jobs.append(v);
+    for (;;) {
+        ADConnection::TimeMark nowMark = 0;
+        ADConnection::timeMark(nowMark);
+        _drainEvents(nowMark);
+        _expireTimers(nowMark);
+        _takeJobs(out, max, num, nowMark);
+        if ( num > 0 )
+            return ADConnection::Subscription::SuccessResult;
+
+        // Park till update, till the earliest delayed update or till deadline
+        unsigned long minWait = ULONG_MAX;
+        if ( m_timersNum > 0 )
+            minWait = ADConnection::msecsDiffTimeMark(nowMark, m_timers[0].wakeupTime);
+        if ( msecs != 0 ) {
+            if ( deadlineMark <= nowMark )
+                return ADConnection::Subscription::TimeoutResult;
+            minWait = qMin<unsigned long>( minWait,
+                          ADConnection::msecsDiffTimeMark(nowMark, deadlineMark) );
+        }
+        // Unlock
+        locker.unlock();
+        park(minWait);
+        // Lock
+        locker.relock();
+    }
+}
+
+void ADSubscriptionPrivate::_takeJobs (
+    ADConnection::Subscription::Result* out, int max, int& num,
+    ADConnection::TimeMark nowMark )
+{
+    while ( m_jobsNum > 0 && num < max ) {
+        int v = _popJob();
+        SubscriptionState& state = *m_vals.find(v);
+        state.queued = false;
+        // Cancelled by peek
+        if ( ! state.appended )
+            continue;
+        _takeJob(state, nowMark);
+
+        out[num].resultCode = ADConnection::Subscription::SuccessResult;
+        out[num].paperNo = v;
+        ++num;
+    }
+}
+
+int ADSubscriptionPrivate::eventFd ()
+{
+#ifdef _LIN_
+    // Lock
+    QMutexLocker locker(&m_mutex);
+    if ( m_pollFd >= 0 )
+        return m_pollFd;
+
+    int evFd = -1, tmFd = -1, pollFd = -1;
+    epoll_event ev;
+
+    evFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( evFd < 0 ) {
+        qWarning("Can't create eventfd!");
+        goto error;
+    }
+    tmFd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ( tmFd < 0 ) {
+        qWarning("Can't create timerfd!");
+        goto error;
+    }
+    pollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    if ( pollFd < 0 ) {
+        qWarning("Can't create epoll fd!");
+        goto error;
+    }
+    ::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = evFd;
+    if ( ::epoll_ctl(pollFd, EPOLL_CTL_ADD, evFd, &ev) < 0 ) {
+        qWarning("Can't add eventfd to epoll!");
+        goto error;
+    }
+    ev.data.fd = tmFd;
+    if ( ::epoll_ctl(pollFd, EPOLL_CTL_ADD, tmFd, &ev) < 0 ) {
+        qWarning("Can't add timerfd to epoll!");
+        goto error;
+    }
+
+    m_timerFd = tmFd;
+    m_pollFd = pollFd;
+    atomic_wmb();
+    m_eventFd = evFd;
+    // Events could be pushed before eventfd was published
+    m_fdSignaled = 0;
+    signalFd();
+
+    return m_pollFd;
+
+error:
+    if ( pollFd >= 0 )
+        ::close(pollFd);
+    if ( tmFd >= 0 )
+        ::close(tmFd);
+    if ( evFd >= 0 )
+        ::close(evFd);
+    return -1;
+#else
+    qWarning("Pollable subscriptions are not supported on this platform!");
+    return -1;
+#endif
+}
+
+void ADSubscriptionPrivate::signalFd ()
+{
+#ifdef _LIN_
+    int fd = m_eventFd;
+    if ( fd < 0 )
+        return;
+    // Already signaled, consumer has not cleared it yet
+    if ( atomic_swap32(&m_fdSignaled, 1) != 0 )
+        return;
+    quint64 one = 1;
+    if ( ::write(fd, &one, sizeof(one)) != sizeof(one) )
+        qWarning("Can't write eventfd!");
+#endif
+}
+
+void ADSubscriptionPrivate::_clearFd ()
+{
+#ifdef _LIN_
+    if ( m_eventFd < 0 )
+        return;
+    // Flag is cleared first: producer, which signals after
+    // this point, makes descriptor readable again
+    atomic_write32(&m_fdSignaled, 0);
+    quint64 value;
+    if ( ::read(m_eventFd, &value, sizeof(value)) < 0 && errno != EAGAIN )
+        qWarning("Can't read eventfd!");
+    if ( ::read(m_timerFd, &value, sizeof(value)) < 0 && errno != EAGAIN )
+        qWarning("Can't read timerfd!");
+#endif
+}
+
+void ADSubscriptionPrivate::_rearmFd ( ADConnection::TimeMark nowMark )
+{
+#ifdef _LIN_
+    if ( m_eventFd < 0 )
+        return;
+    // Not all jobs were taken
+    if ( m_jobsNum > 0 ) {
+        signalFd();
+        return;
+    }
+    // Earliest delayed update or disarm
+    itimerspec its;
+    ::memset(&its, 0, sizeof(its));
+    if ( m_timersNum > 0 ) {
+        quint32 msecs = qMax(1u, ADConnection::msecsDiffTimeMark(nowMark, m_timers[0].wakeupTime));
+        its.it_value.tv_sec = msecs / 1000;
+        its.it_value.tv_nsec = (msecs % 1000) * 1000000;
+    }
+    if ( ::timerfd_settime(m_timerFd, 0, &its, 0) < 0 )
+        qWarning("Can't set timerfd!");
+#else
+    Q_UNUSED(nowMark);
+#endif
+}
+
+bool ADSubscriptionPrivate::hasEvents () const
+{
+    return atomic_load32(&m_eventsTail) != atomic_load32(&m_eventsHead);
+}
+
+bool ADSubscriptionPrivate::park ( unsigned long msecs )
+{
+    // Updates come in bursts, spinning is cheaper than sleeping
+    for ( int i = 0; i < SpinCount; ++i ) {
+        if ( hasEvents() || hasWork() )
+            return true;
+    }
+
+    // Lock
+    QMutexLocker locker(&m_parkMutex);
+    // Locked instructions are full barriers: either producer (or
+    // dispatching worker) sees parked waiter, or waiter sees its work
+    atomic_inc32(&m_parked);
+    bool res = (atomic_read32(&m_eventsTail) != atomic_read32(&m_eventsHead) ||
+                atomic_read32(&m_queuedWork) != 0);
+    if ( ! res )
+        res = m_parkWait.wait(&m_parkMutex, msecs);
+    atomic_dec32(&m_parked);
+
+    return res;
+}
+
+bool ADSubscriptionPrivate::hasWork () const
+{
+    return atomic_load32(&m_queuedWork) != 0;
+}
+
+void ADSubscriptionPrivate::wakeWorkers ()
+{
+    if ( atomic_read32(&m_parked) == 0 )
+        return;
+    // Lock
+    QMutexLocker locker(&m_parkMutex);
+    m_parkWait.wakeAll();
+}
+
+bool ADSubscriptionPrivate::setWorkers ( int workersNum )
+{
+    if ( workersNum <= 0 ) {
+        qWarning("Wrong number of workers!");
+        return false;
+    }
+    // Lock
+    QMutexLocker locker(&m_mutex);
+    if ( m_workers != 0 ) {
+        qWarning("Workers are already set!");
+        return false;
+    }
+    m_workers = new WorkerQueue[ workersNum ];
+    m_workersNum = workersNum;
+    return true;
+}
+
+bool ADSubscriptionPrivate::takeWork ( int worker, int& paperNo )
+{
+    if ( ! hasWork() )
+        return false;
+
+    // Own queue from back: the most recent paper is hot in cache
+    {
+        WorkerQueue& queue = m_workers[worker];
+        // Lock
+        QMutexLocker locker(&queue.mutex);
+        if ( ! queue.jobs.isEmpty() ) {
+            paperNo = queue.jobs.takeLast();
+            atomic_dec32(&m_queuedWork);
+            return true;
+        }
+    }
+    // Steal from front of others
+    for ( int i = 1; i < m_workersNum; ++i ) {
+        WorkerQueue& queue = m_workers[(worker + i) % m_workersNum];
+        // Lock
+        QMutexLocker locker(&queue.mutex);
+        if ( ! queue.jobs.isEmpty() ) {
+            paperNo = queue.jobs.takeFirst();
+            atomic_dec32(&m_queuedWork);
+            return true;
+        }
+    }
+    return false;
+}
+
+ADConnection::Subscription::Result ADSubscriptionPrivate::takeUpdate (
+    int worker, quint32 msecs )
+{
+    ADConnection::Subscription::Result res = { ADConnection::Subscription::SuccessResult, 0 };
+    if ( m_workers == 0 || worker < 0 || worker >= m_workersNum ) {
+        qWarning("Workers are not set or worker is wrong!");
+        res.resultCode = ADConnection::Subscription::NotInitedResult;
+        return res;
+    }
+
+    ADConnection::TimeMark deadlineMark = 0;
+    if ( msecs != 0 ) {
+        ADConnection::timeMark(deadlineMark);
+        deadlineMark = ADConnection::timeMarkAppendMsecs(deadlineMark, msecs);
+    }
+
+    for (;;) {
+        if ( takeWork(worker, res.paperNo) )
+            return res;
+
+        ADConnection::TimeMark nowMark = 0;
+        unsigned long minWait = ULONG_MAX;
+        int dispatched = 0;
+        {
+            // Lock
+            QMutexLocker locker(&m_mutex);
+            ADConnection::timeMark(nowMark);
+            _drainEvents(nowMark);
+            _expireTimers(nowMark);
+            dispatched = _dispatchJobs(nowMark);
+            if ( m_timersNum > 0 )
+                minWait = ADConnection::msecsDiffTimeMark(nowMark, m_timers[0].wakeupTime);
+        }
+        if ( dispatched > 0 ) {
+            // This worker takes one, others take the rest
+            if ( dispatched > 1 )
+                wakeWorkers();
+            continue;
+        }
+
+        if ( msecs != 0 ) {
+            if ( deadlineMark <= nowMark ) {
+                res.resultCode = ADConnection::Subscription::TimeoutResult;
+                return res;
             }
+            minWait = qMin<unsigned long>( minWait,
+                          ADConnection::msecsDiffTimeMark(nowMark, deadlineMark) );
         }
-        else {
-            quint32 elapsed = ADConnection::msecsDiffTimeMark(nowMark, m_vals[v].wakeupTime);
-            minWait = (elapsed < minWait ? elapsed : minWait);
+        park(minWait);
+    }
+}
+
+void ADSubscriptionPrivate::releaseUpdate ( int paperNo )
+{
+    int dispatched = 0;
+    {
+        // Lock
+        QMutexLocker locker(&m_mutex);
+        QMap<int, SubscriptionState>::Iterator it = m_vals.find(paperNo);
+        if ( it == m_vals.end() || ! it->busy ) {
+            qWarning("PaperNo '%d' was not taken!", paperNo);
+            return;
         }
+        ADConnection::TimeMark nowMark = 0;
+        ADConnection::timeMark(nowMark);
+        // Updates which came while paper was taken
+        it->busy = false;
+        _enqueue(paperNo, *it, nowMark);
+        dispatched = _dispatchJobs(nowMark);
     }
+    if ( dispatched > 0 )
+        wakeWorkers();
+}
+
+int ADSubscriptionPrivate::_dispatchJobs ( ADConnection::TimeMark nowMark )
+{
+    int dispatched = 0;
+    while ( m_jobsNum > 0 ) {
+        int v = _popJob();
+        SubscriptionState& state = *m_vals.find(v);
+        state.queued = false;
+        // Cancelled by peek
+        if ( ! state.appended )
+            continue;
+        _takeJob(state, nowMark);
+        state.busy = true;
 
-    if ( m_jobs.size() == 0 ) {
-        //XXX static int count = 0;
-        //XXX printf("#%d WAIT FOR %d\n", ++count, minWait);
-        m_wait.wait( &m_mutex, minWait );
-        goto iterate;
+        // Paper prefers the same worker, its data is hot in that cache
+        WorkerQueue& queue = m_workers[ static_cast<quint32>(v) % m_workersNum ];
+        {
+            // Lock
+            QMutexLocker locker(&queue.mutex);
+            queue.jobs.append(v);
+        }
+        atomic_inc32(&m_queuedWork);
+        ++dispatched;
     }
+    return dispatched;
+}
 
-    ADConnection::timeMark(nowMark);
-    int v = m_jobs.takeFirst();
-    Q_ASSERT(m_vals.contains(v));
-    m_vals[v].updated = false;
-    m_vals[v].appended = false;
-    if ( m_vals[v].minDelay != 0 )
-        m_vals[v].wakeupTime = ADConnection::timeMarkAppendMsecs(nowMark, m_vals[v].minDelay);
-    //XXX	lastUpdate = nowMark - m_vals[v].lastUpdate;
-
-    res.resultCode = ADConnection::Subscription::SuccessResult;
-    res.paperNo = v;
-    return res;
+void ADSubscriptionPrivate::unpark ()
+{
+    if ( atomic_read32(&m_parked) == 0 )
+        return;
+    // Lock
+    QMutexLocker locker(&m_parkMutex);
+    m_parkWait.wakeOne();
 }
 
 bool ADSubscriptionPrivate::peekQuote ( int paperNo, ADConnection::Quote& quote )
@@ -133,8 +692,8 @@ bool ADSubscriptionPrivate::peekQuote ( int paperNo, ADConnection::Quote& quote
     }
 
     bool res = false;
-    // Lock connection
-    m_adConnection->lockForRead();
+    // Lock quotes shard of connection
+    m_adConnection->lockQuotesForRead( paperNo );
     {
         // Lock
         QMutexLocker locker(&m_mutex);
@@ -142,19 +701,79 @@ bool ADSubscriptionPrivate::peekQuote ( int paperNo, ADConnection::Quote& quote
             qWarning("Unknown paperNo '%d' for this subcription!", paperNo);
             goto done;
         }
-        m_jobs.removeOne(paperNo);
+        // Take updates which came before this point
+        ADConnection::TimeMark nowMark = 0;
+        ADConnection::timeMark(nowMark);
+        _drainEvents(nowMark);
+        // Cancelled job stays in FIFO and is skipped by waiter
         m_vals[paperNo].updated = false;
         m_vals[paperNo].appended = false;
         // Get quote without any locks
         res = m_adConnection->_getQuote( paperNo, quote );
     }
 done:
-    // Unlock connection
-    m_adConnection->unlock();
+    // Unlock quotes shard of connection
+    m_adConnection->unlockQuotes( paperNo );
 
     return res;
 }
 
+bool ADSubscriptionPrivate::peekQuoteSnapshot ( int paperNo,
+                                                ADConnection::QuoteSnapshot& snapshot )
+{
+    // Lock
+    QReadLocker rConnLocker( &m_rwConnLock );
+    if ( m_adConnection == 0 ) {
+        qWarning("Subscription without connection is incredible!");
+        return false;
+    }
+
+    {
+        // Lock
+        QMutexLocker locker(&m_mutex);
+        if ( ! m_vals.contains(paperNo) ) {
+            qWarning("Unknown paperNo '%d' for this subcription!", paperNo);
+            return false;
+        }
+        // Take updates which came before this point,
+        // update which comes after this point will be marked again,
+        // cancelled job stays in FIFO and is skipped by waiter
+        ADConnection::TimeMark nowMark = 0;
+        ADConnection::timeMark(nowMark);
+        _drainEvents(nowMark);
+        m_vals[paperNo].updated = false;
+        m_vals[paperNo].appended = false;
+    }
+
+    // Connection is not locked, snapshot is read lock free
+    return m_adConnection->_getQuoteSnapshot( paperNo, snapshot );
+}
+
+bool ADSubscriptionPrivate::takeDelta ( int paperNo,
+                                        ADConnection::QuoteDelta& delta )
+{
+    // Lock
+    QReadLocker rConnLocker( &m_rwConnLock );
+    if ( m_adConnection == 0 ) {
+        qWarning("Subscription without connection is incredible!");
+        return false;
+    }
+
+    // Types of papers are immutable
+    QHash<int, int>::ConstIterator it = m_paperIndex.constFind(paperNo);
+    if ( it == m_paperIndex.constEnd() ) {
+        qWarning("Unknown paperNo '%d' for this subcription!", paperNo);
+        return false;
+    }
+    if ( ! (m_paperTypes.at(*it) & ADConnection::Subscription::DeltaSubscription) ) {
+        qWarning("PaperNo '%d' is not subscribed for deltas!", paperNo);
+        return false;
+    }
+
+    // Taken sequence is kept by journal of connection
+    return m_adConnection->takeQuoteDelta( paperNo, this, delta );
+}
+
 void ADSubscriptionPrivate::zeroConnectionMember ()
 {
     // Lock
@@ -165,24 +784,215 @@ void ADSubscriptionPrivate::zeroConnectionMember ()
 void ADSubscriptionPrivate::update (
     int paperNo,
     ADConnection::Subscription::Type subscrType )
+{
+    ADConnection::TimeMark nowMark = 0;
+    ADConnection::timeMark(nowMark);
+    if ( pushEvent(paperNo, subscrType, nowMark) ) {
+        unpark();
+        signalFd();
+    }
+}
+
+void ADSubscriptionPrivate::update (
+    const QSet<int>& paperNos,
+    ADConnection::Subscription::Type subscrType )
+{
+    ADConnection::TimeMark nowMark = 0;
+    ADConnection::timeMark(nowMark);
+    bool pushed = false;
+    foreach ( int paperNo, paperNos )
+        pushed |= pushEvent(paperNo, subscrType, nowMark);
+    if ( pushed ) {
+        unpark();
+        signalFd();
+    }
+}
+
+bool ADSubscriptionPrivate::pushEvent ( int paperNo, quint32 subscrTypes,
+                                        ADConnection::TimeMark nowMark )
+{
+    QHash<int, int>::ConstIterator it = m_paperIndex.constFind(paperNo);
+    if ( it == m_paperIndex.constEnd() )
+        return false;
+    int index = *it;
+    subscrTypes &= m_paperTypes.at(index);
+    if ( subscrTypes == 0 )
+        return false;
+
+    // Paper is already in the ring, consumer will take new types too
+    if ( atomic_or32(&m_pending[index], subscrTypes) != 0 ) {
+        atomic_inc32(&m_merged[index]);
+        return false;
+    }
+    m_pendingMarks[index] = nowMark;
+
+    atomic32_t tail = m_eventsTail;
+    Q_ASSERT(tail - atomic_load32(&m_eventsHead) < (atomic32_t)m_eventsSize);
+    m_events[tail % m_eventsSize] = index;
+    atomic_wmb();
+    m_eventsTail = tail + 1;
+
+    return true;
+}
+
+void ADSubscriptionPrivate::_drainEvents ( ADConnection::TimeMark nowMark )
+{
+    atomic32_t head = m_eventsHead;
+    atomic32_t tail = atomic_load32(&m_eventsTail);
+    atomic_rmb();
+    for ( ; head != tail; ++head ) {
+        int index = m_events[head % m_eventsSize];
+        // Mark is not changed until types are taken
+        ADConnection::TimeMark eventMark = m_pendingMarks[index];
+        // Slot is free before types are taken, so producer,
+        // which sees zero types, always has free slot
+        atomic_write32(&m_eventsHead, head + 1);
+        quint32 subscrTypes = atomic_swap32(&m_pending[index], 0);
+        quint32 merged = atomic_swap32(&m_merged[index], 0);
+        _update(m_paperNos.at(index), subscrTypes, eventMark, merged, nowMark);
+    }
+}
+
+void ADSubscriptionPrivate::_update (
+    int paperNo,
+    quint32 subscrTypes,
+    ADConnection::TimeMark eventMark,
+    quint32 merged,
+    ADConnection::TimeMark nowMark )
+{
+    QMap<int, SubscriptionState>::Iterator it = m_vals.find(paperNo);
+    if ( it == m_vals.end() )
+        return;
+    SubscriptionState& state = *it;
+    if ( ! (state.subscrType & subscrTypes) )
+        return;
+
+    state.conflated += merged;
+    if ( ! state.updated )
+        state.lastUpdate = eventMark;
+    else
+        ++state.conflated;
+    state.updated = true;
+    _enqueue(paperNo, state, nowMark);
+}
+
+void ADSubscriptionPrivate::_takeJob (
+    SubscriptionState& state,
+    ADConnection::TimeMark nowMark )
+{
+    state.updated = false;
+    state.appended = false;
+    ++state.delivered;
+    state.lastLag = ADConnection::msecsDiffTimeMark(state.readyTime, nowMark);
+
+    if ( state.maxDelay > state.minDelay ) {
+        // Backlog: conflate more, relax slowly while consumer keeps up
+        if ( state.lastLag > AdaptiveLagMsecs )
+            state.delay = qMin(state.maxDelay, qMax(state.delay * 2, state.minDelay + 1));
+        else if ( state.delay > state.minDelay )
+            state.delay -= qMax(1u, (state.delay - state.minDelay) / 4);
+    }
+    if ( state.delay != 0 )
+        state.wakeupTime = ADConnection::timeMarkAppendMsecs(nowMark, state.delay);
+}
+
+bool ADSubscriptionPrivate::getStatistics (
+    QVector<ADConnection::Subscription::PaperStatistics>& stats )
 {
     // Lock
     QMutexLocker locker(&m_mutex);
-    if ( ! m_vals.contains(paperNo) )
+    stats.resize( m_vals.size() );
+    int i = 0;
+    QMap<int, SubscriptionState>::ConstIterator it = m_vals.constBegin();
+    for ( ; it != m_vals.constEnd(); ++it, ++i ) {
+        ADConnection::Subscription::PaperStatistics& st = stats[i];
+        st.paperNo = it.key();
+        st.delay = it->delay;
+        st.lastLag = it->lastLag;
+        // Merges which are not drained yet are counted too
+        st.conflated = it->conflated +
+            atomic_load32(&m_merged[m_paperIndex.value(it.key())]);
+        st.delivered = it->delivered;
+    }
+    return true;
+}
+
+void ADSubscriptionPrivate::_enqueue (
+    int paperNo,
+    SubscriptionState& state,
+    ADConnection::TimeMark nowMark )
+{
+    // Taken paper is enqueued on release
+    if ( ! state.updated || state.appended || state.busy )
         return;
-    if ( ! (m_vals[paperNo].subscrType & subscrType) )
+
+    if ( state.wakeupTime <= nowMark ) {
+        state.appended = true;
+        // Paper is ready since update or since end of its delay
+        state.readyTime = qMax(state.lastUpdate, state.wakeupTime);
+        if ( ! state.queued ) {
+            state.queued = true;
+            _pushJob(paperNo);
+        }
         return;
+    }
 
-    ADConnection::TimeMark nowMark = 0;
-    ADConnection::timeMark(nowMark);
-    if ( ! m_vals[paperNo].updated )
-        m_vals[paperNo].lastUpdate = nowMark;
-    m_vals[paperNo].updated = true;
-
-    if ( m_vals[paperNo].wakeupTime <= nowMark && ! m_vals[paperNo].appended ) {
-        m_vals[paperNo].appended = true;
-        m_jobs.append(paperNo);
-        m_wait.wakeAll();
+    if ( state.scheduled )
+        return;
+    state.scheduled = true;
+    _pushTimer(state.wakeupTime, paperNo);
+}
+
+void ADSubscriptionPrivate::_pushJob ( int paperNo )
+{
+    Q_ASSERT(m_jobsNum < m_jobs.size());
+    m_jobs[(m_jobsHead + m_jobsNum) % m_jobs.size()] = paperNo;
+    ++m_jobsNum;
+}
+
+int ADSubscriptionPrivate::_popJob ()
+{
+    Q_ASSERT(m_jobsNum > 0);
+    int paperNo = m_jobs[m_jobsHead];
+    m_jobsHead = (m_jobsHead + 1) % m_jobs.size();
+    --m_jobsNum;
+    return paperNo;
+}
+
+bool ADSubscriptionPrivate::laterTimer ( const Timer& t1, const Timer& t2 )
+{
+    return t1.wakeupTime > t2.wakeupTime;
+}
+
+void ADSubscriptionPrivate::_pushTimer ( ADConnection::TimeMark wakeupTime,
+                                         int paperNo )
+{
+    Q_ASSERT(m_timersNum < m_timers.size());
+    Timer* timers = m_timers.data();
+    timers[m_timersNum].wakeupTime = wakeupTime;
+    timers[m_timersNum].paperNo = paperNo;
+    ++m_timersNum;
+    std::push_heap(timers, timers + m_timersNum, laterTimer);
+}
+
+void ADSubscriptionPrivate::_popTimer ()
+{
+    Q_ASSERT(m_timersNum > 0);
+    Timer* timers = m_timers.data();
+    std::pop_heap(timers, timers + m_timersNum, laterTimer);
+    --m_timersNum;
+}
+
+void ADSubscriptionPrivate::_expireTimers ( ADConnection::TimeMark nowMark )
+{
+    while ( m_timersNum > 0 && m_timers[0].wakeupTime <= nowMark ) {
+        int v = m_timers[0].paperNo;
+        _popTimer();
+        SubscriptionState& state = *m_vals.find(v);
+        state.scheduled = false;
+        // Paper could be returned meanwhile and delayed again,
+        // then it is scheduled again
+        _enqueue(v, state, nowMark);
     }
 }
 
@@ -3,22 +3,50 @@
 
 #include <QMutex>
 #include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QVector>
 #include <QWaitCondition>
-#include <QLinkedList>
 #include <QThread>
 #include <QReadWriteLock>
 
 #include "ADConnection.h"
+#include "ADAtomicOps.h"
 
+/**
+ * Connection thread is the only producer of updates. It never takes
+ * subscription mutex: updated papers are pushed to a bounded SPSC ring,
+ * pending types of every paper are accumulated in a de-duplication
+ * array, so every paper is in the ring at most once and ring never
+ * overflows. Consumer (holder of subscription mutex) drains the ring,
+ * spins a bit when nothing is ready and only then parks.
+ */
 class ADSubscriptionPrivate
 {
 public:
     ADSubscriptionPrivate ( ADConnection* adConn,
                             const QList<ADConnection::Subscription::Options>& opts );
+    ~ADSubscriptionPrivate ();
 
     ADConnection::Subscription::Result waitForUpdate ();
+    ADConnection::Subscription::ResultType waitForUpdates (
+        QVector<ADConnection::Subscription::Result>& out, int max,
+        quint32 msecs, QVector<ADConnection::QuoteSnapshot>* snapshots );
+    int eventFd ();
+    ADConnection::Subscription::ResultType pollUpdates (
+        QVector<ADConnection::Subscription::Result>& out, int max,
+        QVector<ADConnection::QuoteSnapshot>* snapshots );
+    bool setWorkers ( int workersNum );
+    ADConnection::Subscription::Result takeUpdate ( int worker, quint32 msecs );
+    void releaseUpdate ( int paperNo );
+    bool getStatistics ( QVector<ADConnection::Subscription::PaperStatistics>& );
     bool peekQuote ( int paperNo, ADConnection::Quote& );
+    bool peekQuoteSnapshot ( int paperNo, ADConnection::QuoteSnapshot& );
+    bool takeDelta ( int paperNo, ADConnection::QuoteDelta& );
+    // Producer side, called by connection thread only
     void update ( int paperNo, ADConnection::Subscription::Type );
+    // Pushes all papers at once, parked waiter is woken once
+    void update ( const QSet<int>& paperNos, ADConnection::Subscription::Type );
 
     const QList<ADConnection::Subscription::Options>& subscriptionOptions () const;
 
@@ -27,23 +55,154 @@ public:
     void zeroConnectionMember ();
 
 private:
+    ADSubscriptionPrivate ( const ADSubscriptionPrivate& );
+    ADSubscriptionPrivate& operator= ( const ADSubscriptionPrivate& );
+
+    // Spins of waiter before parking
+    enum { SpinCount = 4000 };
+    // Adaptive delay grows if paper waits for consumer longer
+    enum { AdaptiveLagMsecs = 2 };
+
+    // Takes up to max jobs into out, zero msecs waits forever
+    ADConnection::Subscription::ResultType waitForJobs (
+        ADConnection::Subscription::Result* out, int max, int& num,
+        quint32 msecs );
+    void fillSnapshots ( const QVector<ADConnection::Subscription::Result>&,
+                         QVector<ADConnection::QuoteSnapshot>& );
+
+    // Producer side, returns true if event was pushed
+    bool pushEvent ( int paperNo, quint32 subscrTypes,
+                     ADConnection::TimeMark nowMark );
+    void unpark ();
+    void signalFd ();
+    bool hasEvents () const;
+    bool hasWork () const;
+    // Consumer side, returns true if event or work came before timeout
+    bool park ( unsigned long msecs );
+    // Wakes all parked workers
+    void wakeWorkers ();
+    // Worker pool: pops own queue from back, steals from front of others
+    bool takeWork ( int worker, int& paperNo );
+
+    // Do not lock anything, must be called under subscription mutex
+    void _drainEvents ( ADConnection::TimeMark nowMark );
+    void _takeJobs ( ADConnection::Subscription::Result* out, int max, int& num,
+                     ADConnection::TimeMark nowMark );
+    // Pollable descriptor: readiness is cleared before jobs are taken,
+    // is set again after if jobs are left or timer is armed for delays
+    void _clearFd ();
+    void _rearmFd ( ADConnection::TimeMark nowMark );
+    void _update ( int paperNo, quint32 subscrTypes,
+                   ADConnection::TimeMark eventMark, quint32 merged,
+                   ADConnection::TimeMark nowMark );
+    // Moves all jobs to worker queues, returns number of moved jobs
+    int _dispatchJobs ( ADConnection::TimeMark nowMark );
+    void _pushJob ( int paperNo );
+    int _popJob ();
+    void _pushTimer ( ADConnection::TimeMark wakeupTime, int paperNo );
+    void _popTimer ();
+    // Moves expired timers to jobs
+    void _expireTimers ( ADConnection::TimeMark nowMark );
+
     struct SubscriptionState
     {
+        // Time of the first not taken update (producer time)
         ADConnection::TimeMark lastUpdate;
         ADConnection::TimeMark wakeupTime;
+        // Time when paper became a job
+        ADConnection::TimeMark readyTime;
         quint32 minDelay;
+        quint32 maxDelay;
+        // Current delay, adapts if maxDelay > minDelay
+        quint32 delay;
+        quint32 lastLag;
+        quint64 conflated;
+        quint64 delivered;
         quint32 subscrType;
         bool updated;
+        // Is a job, waiter will return it
         bool appended;
+        // Is in jobs FIFO (job can be cancelled by peek,
+        // but stays in FIFO until it is popped)
+        bool queued;
+        // Is in timers heap
+        bool scheduled;
+        // Is in worker queue or is processed by worker
+        bool busy;
     };
 
+    struct WorkerQueue
+    {
+        QMutex mutex;
+        QList<int> jobs;
+    };
+
+    struct Timer
+    {
+        ADConnection::TimeMark wakeupTime;
+        int paperNo;
+    };
+    static bool laterTimer ( const Timer&, const Timer& );
+
+    // Makes updated paper a job or schedules it, if it is not yet
+    void _enqueue ( int paperNo, SubscriptionState&,
+                    ADConnection::TimeMark nowMark );
+    // Paper is taken by consumer: clears job, adapts delay
+    void _takeJob ( SubscriptionState&, ADConnection::TimeMark nowMark );
+
     ADConnection* m_adConnection;
     QList<ADConnection::Subscription::Options> m_opts;
     QReadWriteLock m_rwConnLock;
-    QMap<int, SubscriptionState> m_vals;
+
+    // Immutable after construction, read by producer without locks
+    // paper_no -> index of paper in events arrays
+    QHash<int, int> m_paperIndex;
+    QVector<int> m_paperNos;
+    QVector<quint32> m_paperTypes;
+
+    // SPSC ring of paper indexes, head and tail are free running
+    int* m_events;
+    int m_eventsSize;
+    volatile atomic32_t m_eventsHead;
+    volatile atomic32_t m_eventsTail;
+    // Not yet drained types of every paper, paper is in the ring
+    // only if its pending types are not zero
+    volatile atomic32_t* m_pending;
+    // Time of the first pending update, written by producer
+    // only when pending types are zero
+    ADConnection::TimeMark* m_pendingMarks;
+    // Updates merged into pending ones
+    volatile atomic32_t* m_merged;
+
+    // Parking of waiters, producer locks only if somebody is parked
+    volatile atomic32_t m_parked;
+    QMutex m_parkMutex;
+    QWaitCondition m_parkWait;
+
+    // Pollable descriptor (Linux only): epoll over eventfd of pushed
+    // events and timerfd of delayed updates. Eventfd is written by
+    // producer only once until consumer clears the signaled flag
+    volatile int m_eventFd;
+    int m_timerFd;
+    int m_pollFd;
+    volatile atomic32_t m_fdSignaled;
+
+    // Consumer side (saved by subscription mutex)
     QMutex m_mutex;
-    QWaitCondition m_wait;
-    QLinkedList<int> m_jobs;
+    QMap<int, SubscriptionState> m_vals;
+    // Ring FIFO of jobs, every paper is queued at most once
+    QVector<int> m_jobs;
+    int m_jobsHead;
+    int m_jobsNum;
+    // Min-heap of delayed updates, every paper is scheduled at most once
+    QVector<Timer> m_timers;
+    int m_timersNum;
+
+    // Worker pool mode, queues are set once before workers start
+    WorkerQueue* m_workers;
+    int m_workersNum;
+    // Number of papers in all worker queues
+    volatile atomic32_t m_queuedWork;
     QThread* m_threadCreator;
 };
 
@@ -0,0 +1,546 @@
+#include <string.h>
+#include <limits.h>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+ #define AD_SIMD_SSE2 1
+ #include <emmintrin.h>
+ // AVX2 kernel is built for own target and is chosen at runtime
+ #if (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)) && \
+     (defined(__x86_64__) || defined(__i386__))
+  #define AD_SIMD_AVX2 1
+  #include <immintrin.h>
+ #endif
+#endif
+
+#include <QByteArray>
+#include <QTextCodec>
+
+#include "ADTextParser.h"
+
+/****************************************************************************/
+
+namespace
+{
+    // Exactly representable powers of ten
+    const double s_pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+        1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const int s_pow10Max = sizeof(s_pow10) / sizeof(s_pow10[0]) - 1;
+
+    // Mantissa is exact in double while it has not more digits
+    const int s_exactDigits = 15;
+
+    inline bool isSpace ( char c )
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    inline bool isDigit ( char c )
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    inline void trim ( const char*& begin, const char*& end )
+    {
+        while ( begin != end && isSpace(*begin) )
+            ++begin;
+        while ( begin != end && isSpace(*(end - 1)) )
+            --end;
+    }
+
+    // Reads from 'min' to 'max' digits
+    inline bool readNumber ( const char*& p, const char* end,
+                             int min, int max, int& val )
+    {
+        int n = 0;
+        val = 0;
+        while ( p != end && n < max && isDigit(*p) ) {
+            val = val * 10 + (*p - '0');
+            ++p;
+            ++n;
+        }
+        return n >= min;
+    }
+
+    inline bool readChar ( const char*& p, const char* end, char c )
+    {
+        if ( p == end || *p != c )
+            return false;
+        ++p;
+        return true;
+    }
+
+    struct DateFields
+    {
+        int year;
+        int month;
+        int day;
+        int hour;
+        int minute;
+        int second;
+    };
+
+    bool parseDateFields ( const ADTextRange& r, ADTextParser::DateOrder order,
+                           DateFields& f )
+    {
+        const char* p = r.begin;
+        const char* end = r.end;
+        trim( p, end );
+
+        int first = 0, second = 0;
+        if ( ! readNumber(p, end, 1, 2, first) || ! readChar(p, end, '/') ||
+             ! readNumber(p, end, 1, 2, second) || ! readChar(p, end, '/') ||
+             ! readNumber(p, end, 4, 4, f.year) )
+            return false;
+
+        if ( order == ADTextParser::DayMonthYear ) {
+            f.day = first;
+            f.month = second;
+        }
+        else {
+            f.month = first;
+            f.day = second;
+        }
+        f.hour = f.minute = f.second = 0;
+
+        if ( p != end ) {
+            if ( ! readChar(p, end, ' ') ||
+                 ! readNumber(p, end, 1, 2, f.hour) || ! readChar(p, end, ':') ||
+                 ! readNumber(p, end, 1, 2, f.minute) )
+                return false;
+            if ( p != end &&
+                 (! readChar(p, end, ':') || ! readNumber(p, end, 1, 2, f.second)) )
+                return false;
+            if ( p != end )
+                return false;
+        }
+
+        static const int daysInMonth[] =
+            { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+        if ( f.month < 1 || f.month > 12 || f.day < 1 ||
+             f.day > daysInMonth[f.month - 1] ||
+             f.hour > 23 || f.minute > 59 || f.second > 59 )
+            return false;
+        // February of non leap year
+        if ( f.month == 2 && f.day == 29 &&
+             ! ((f.year % 4 == 0 && f.year % 100 != 0) || f.year % 400 == 0) )
+            return false;
+
+        return true;
+    }
+
+    // Days since 1970-01-01 of proleptic Gregorian date
+    qint64 daysFromCivil ( int y, int m, int d )
+    {
+        y -= (m <= 2);
+        const int era = (y >= 0 ? y : y - 399) / 400;
+        const int yoe = y - era * 400;
+        const int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+        const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return static_cast<qint64>(era) * 146097 + doe - 719468;
+    }
+}
+
+/****************************************************************************/
+
+bool ADTextRange::equals ( const char* str ) const
+{
+    int len = ::strlen(str);
+    return len == size() && ::memcmp(begin, str, len) == 0;
+}
+
+QString ADTextRange::toString ( QTextCodec* codec ) const
+{
+    if ( codec )
+        return codec->toUnicode( begin, size() );
+    return QString::fromLatin1( begin, size() );
+}
+
+/****************************************************************************/
+
+ADLineTokenizer::ADLineTokenizer ( const char* data, int size ) :
+    m_pos(data),
+    m_end(data + size)
+{}
+
+bool ADLineTokenizer::next ( ADTextRange& line )
+{
+    while ( m_pos != m_end ) {
+        const char* eol = static_cast<const char*>(
+            ::memchr(m_pos, '\n', m_end - m_pos) );
+        const char* begin = m_pos;
+        const char* end = (eol ? eol : m_end);
+        m_pos = (eol ? eol + 1 : m_end);
+
+        if ( end != begin && *(end - 1) == '\r' )
+            --end;
+        if ( end != begin ) {
+            line = ADTextRange( begin, end );
+            return true;
+        }
+    }
+    return false;
+}
+
+/****************************************************************************/
+
+ADColumnTokenizer::ADColumnTokenizer () :
+    m_size(0)
+{}
+
+ADColumnTokenizer::ADColumnTokenizer ( const ADTextRange& line ) :
+    m_size(0)
+{
+    const char* p = line.begin;
+    while ( m_size < MaxColumns - 1 ) {
+        const char* sep = static_cast<const char*>(
+            ::memchr(p, '|', line.end - p) );
+        if ( sep == 0 )
+            break;
+        m_cols[m_size++] = ADTextRange( p, sep );
+        p = sep + 1;
+    }
+    m_cols[m_size++] = ADTextRange( p, line.end );
+}
+
+/****************************************************************************/
+
+namespace
+{
+    inline int scanScalar ( const char* data, int from, int size,
+                            QVector<int>& seps )
+    {
+        for ( int i = from; i < size; ++i )
+            if ( data[i] == '|' || data[i] == '\n' )
+                seps.append( i );
+        return size;
+    }
+
+#ifdef AD_SIMD_SSE2
+    inline void appendMask ( unsigned int mask, int offset, QVector<int>& seps )
+    {
+        while ( mask ) {
+            seps.append( offset + __builtin_ctz(mask) );
+            mask &= mask - 1;
+        }
+    }
+
+    int scanSSE2 ( const char* data, int size, QVector<int>& seps )
+    {
+        const __m128i pipe = _mm_set1_epi8( '|' );
+        const __m128i eol = _mm_set1_epi8( '\n' );
+        int i = 0;
+        for ( ; i + 16 <= size; i += 16 ) {
+            __m128i v = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(data + i) );
+            __m128i m = _mm_or_si128( _mm_cmpeq_epi8(v, pipe),
+                                      _mm_cmpeq_epi8(v, eol) );
+            appendMask( _mm_movemask_epi8(m), i, seps );
+        }
+        return i;
+    }
+#endif
+
+#ifdef AD_SIMD_AVX2
+    __attribute__((target("avx2")))
+    int scanAVX2 ( const char* data, int size, QVector<int>& seps )
+    {
+        const __m256i pipe = _mm256_set1_epi8( '|' );
+        const __m256i eol = _mm256_set1_epi8( '\n' );
+        int i = 0;
+        for ( ; i + 32 <= size; i += 32 ) {
+            __m256i v = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(data + i) );
+            __m256i m = _mm256_or_si256( _mm256_cmpeq_epi8(v, pipe),
+                                         _mm256_cmpeq_epi8(v, eol) );
+            appendMask( _mm256_movemask_epi8(m), i, seps );
+        }
+        return i;
+    }
+
+    bool hasAVX2 ()
+    {
+        static const bool avx2 = __builtin_cpu_supports( "avx2" );
+        return avx2;
+    }
+#endif
+}
+
+/****************************************************************************/
+
+ADBlockIndex::ADBlockIndex ( const char* data, int size ) :
+    m_data(data),
+    m_size(size),
+    m_sepPos(0),
+    m_lineBeg(0)
+{
+    // Every column is at least one byte with separator
+    m_seps.reserve( size / 4 + 1 );
+    scan( data, size, m_seps );
+}
+
+void ADBlockIndex::scan ( const char* data, int size, QVector<int>& seps )
+{
+    int done = 0;
+#if defined(AD_SIMD_AVX2)
+    if ( hasAVX2() )
+        done = scanAVX2( data, size, seps );
+    else
+        done = scanSSE2( data, size, seps );
+#elif defined(AD_SIMD_SSE2)
+    done = scanSSE2( data, size, seps );
+#endif
+    scanScalar( data, done, size, seps );
+}
+
+bool ADBlockIndex::next ( ADColumnTokenizer& cols )
+{
+    const int sepsNum = m_seps.size();
+    const int* seps = m_seps.constData();
+
+    while ( m_lineBeg < m_size ) {
+        const char* colBeg = m_data + m_lineBeg;
+        cols.m_size = 0;
+
+        // Take columns till end of line
+        int lineEnd = m_size;
+        for ( ; m_sepPos < sepsNum; ++m_sepPos ) {
+            int sep = seps[m_sepPos];
+            if ( m_data[sep] == '\n' ) {
+                lineEnd = sep;
+                ++m_sepPos;
+                break;
+            }
+            if ( cols.m_size < ADColumnTokenizer::MaxColumns - 1 ) {
+                cols.m_cols[cols.m_size++] = ADTextRange( colBeg, m_data + sep );
+                colBeg = m_data + sep + 1;
+            }
+        }
+        m_lineBeg = lineEnd + 1;
+
+        // Cut '\r' of last column
+        const char* end = m_data + lineEnd;
+        if ( end != colBeg && *(end - 1) == '\r' )
+            --end;
+
+        // Skip empty lines
+        if ( cols.m_size == 0 && end == colBeg )
+            continue;
+
+        cols.m_cols[cols.m_size++] = ADTextRange( colBeg, end );
+        return true;
+    }
+    return false;
+}
+
+/****************************************************************************/
+
+qint64 ADTextParser::toInt64 ( const ADTextRange& r, bool* ok )
+{
+    const char* p = r.begin;
+    const char* end = r.end;
+    trim( p, end );
+
+    if ( ok )
+        *ok = false;
+
+    bool neg = false;
+    if ( p != end && (*p == '-' || *p == '+') ) {
+        neg = (*p == '-');
+        ++p;
+    }
+    if ( p == end )
+        return 0;
+
+    // Accumulate negative, it has one value more
+    const qint64 min = Q_INT64_C(-9223372036854775807) - 1;
+    qint64 v = 0;
+    for ( ; p != end; ++p ) {
+        if ( ! isDigit(*p) )
+            return 0;
+        int d = *p - '0';
+        if ( v < (min + d) / 10 )
+            return 0;
+        v = v * 10 - d;
+    }
+    if ( ! neg ) {
+        if ( v == min )
+            return 0;
+        v = -v;
+    }
+    if ( ok )
+        *ok = true;
+    return v;
+}
+
+int ADTextParser::toInt ( const ADTextRange& r, bool* ok )
+{
+    bool res = false;
+    qint64 v = toInt64( r, &res );
+    if ( ! res || v < INT_MIN || v > INT_MAX ) {
+        if ( ok )
+            *ok = false;
+        return 0;
+    }
+    if ( ok )
+        *ok = true;
+    return static_cast<int>(v);
+}
+
+double ADTextParser::toDouble ( const ADTextRange& r, bool* ok )
+{
+    const char* p = r.begin;
+    const char* end = r.end;
+    trim( p, end );
+
+    const char* begin = p;
+    bool neg = false;
+    if ( p != end && (*p == '-' || *p == '+') ) {
+        neg = (*p == '-');
+        ++p;
+    }
+
+    quint64 mant = 0;
+    int digits = 0;
+    int exp = 0;
+    bool any = false;
+    double val = 0;
+
+    if ( ok )
+        *ok = false;
+
+    for ( ; p != end && isDigit(*p); ++p ) {
+        any = true;
+        if ( mant || *p != '0' ) {
+            mant = mant * 10 + (*p - '0');
+            ++digits;
+        }
+        if ( digits > s_exactDigits )
+            goto fallback;
+    }
+    if ( p != end && *p == '.' ) {
+        for ( ++p; p != end && isDigit(*p); ++p ) {
+            any = true;
+            if ( mant || *p != '0' ) {
+                mant = mant * 10 + (*p - '0');
+                ++digits;
+            }
+            --exp;
+            if ( digits > s_exactDigits )
+                goto fallback;
+        }
+    }
+    if ( ! any )
+        return 0;
+    if ( p != end )
+        // Exponent or garbage
+        goto fallback;
+    if ( -exp > s_pow10Max )
+        goto fallback;
+
+    // Both mantissa and power of ten are exact, so one
+    // division gives correctly rounded result
+    val = static_cast<double>(mant);
+    if ( exp < 0 )
+        val /= s_pow10[-exp];
+    if ( ok )
+        *ok = true;
+    return (neg ? -val : val);
+
+fallback:
+    return QByteArray::fromRawData( begin, end - begin ).toDouble( ok );
+}
+
+float ADTextParser::toFloat ( const ADTextRange& r, bool* ok )
+{
+    return static_cast<float>( toDouble(r, ok) );
+}
+
+ADPrice ADTextParser::toPrice ( const ADTextRange& r, bool* ok )
+{
+    const char* p = r.begin;
+    const char* end = r.end;
+    trim( p, end );
+
+    const char* begin = p;
+    bool neg = false;
+    if ( p != end && (*p == '-' || *p == '+') ) {
+        neg = (*p == '-');
+        ++p;
+    }
+
+    const qint64 intMax = Q_INT64_C(0x7fffffffffffffff) / ADPrice::Scale - 1;
+    qint64 intPart = 0;
+    qint64 frac = 0;
+    int fracDigits = 0;
+    bool roundUp = false;
+    bool any = false;
+    qint64 val = 0;
+
+    if ( ok )
+        *ok = false;
+
+    for ( ; p != end && isDigit(*p); ++p ) {
+        any = true;
+        intPart = intPart * 10 + (*p - '0');
+        if ( intPart > intMax )
+            goto fallback;
+    }
+    if ( p != end && *p == '.' ) {
+        for ( ++p; p != end && isDigit(*p); ++p ) {
+            any = true;
+            if ( fracDigits < ADPrice::Decimals ) {
+                frac = frac * 10 + (*p - '0');
+                ++fracDigits;
+            }
+            else if ( fracDigits++ == ADPrice::Decimals )
+                // Round half away from zero
+                roundUp = (*p >= '5');
+        }
+    }
+    if ( ! any )
+        return ADPrice();
+    if ( p != end )
+        // Exponent or garbage
+        goto fallback;
+
+    for ( ; fracDigits < ADPrice::Decimals; ++fracDigits )
+        frac *= 10;
+    val = intPart * ADPrice::Scale + frac + (roundUp ? 1 : 0);
+    if ( ok )
+        *ok = true;
+    return ADPrice::fromValue( neg ? -val : val );
+
+fallback:
+    return ADPrice::fromDouble(
+        QByteArray::fromRawData( begin, end - begin ).toDouble( ok ) );
+}
+
+qint64 ADTextParser::toMSecsSinceEpoch ( const ADTextRange& r,
+                                         ADTextParser::DateOrder order,
+                                         bool* ok )
+{
+    DateFields f;
+    bool res = parseDateFields( r, order, f );
+    if ( ok )
+        *ok = res;
+    if ( ! res )
+        return 0;
+    qint64 secs = daysFromCivil( f.year, f.month, f.day ) * 86400 +
+                  f.hour * 3600 + f.minute * 60 + f.second;
+    return secs * 1000;
+}
+
+QDateTime ADTextParser::toDateTime ( const ADTextRange& r,
+                                     ADTextParser::DateOrder order )
+{
+    DateFields f;
+    if ( ! parseDateFields(r, order, f) )
+        return QDateTime();
+    return QDateTime( QDate(f.year, f.month, f.day),
+                      QTime(f.hour, f.minute, f.second) );
+}
+
+/****************************************************************************/
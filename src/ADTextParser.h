@@ -0,0 +1,132 @@
+#ifndef ADTEXTPARSER_H
+#define ADTEXTPARSER_H
+
+#include <QtGlobal>
+#include <QString>
+#include <QDateTime>
+#include <QVector>
+
+#include "ADPrice.h"
+
+/**
+ * Byte range inside raw Windows-1251 block body.
+ * Does not own data, valid while block is alive.
+ */
+struct ADTextRange
+{
+    ADTextRange () : begin(0), end(0) {}
+    ADTextRange ( const char* b, const char* e ) : begin(b), end(e) {}
+
+    int size () const { return static_cast<int>(end - begin); }
+    bool isEmpty () const { return begin == end; }
+
+    /** Exact compare with C string */
+    bool equals ( const char* str ) const;
+
+    /** Decodes range, Latin-1 is used if codec is 0 */
+    QString toString ( class QTextCodec* codec ) const;
+
+    const char* begin;
+    const char* end;
+};
+
+/**
+ * Iterates non empty lines of block body (like split("\n",
+ * QString::SkipEmptyParts)), trailing '\r' is cut.
+ */
+class ADLineTokenizer
+{
+public:
+    ADLineTokenizer ( const char* data, int size );
+
+    bool next ( ADTextRange& line );
+
+private:
+    const char* m_pos;
+    const char* m_end;
+};
+
+/**
+ * Splits line by '|' in place, like split("|"): empty columns are kept.
+ * Columns beyond MaxColumns are not split.
+ */
+class ADColumnTokenizer
+{
+public:
+    enum { MaxColumns = 128 };
+
+    ADColumnTokenizer ();
+    ADColumnTokenizer ( const ADTextRange& line );
+
+    int size () const { return m_size; }
+    const ADTextRange& operator[] ( int i ) const { return m_cols[i]; }
+
+private:
+    friend class ADBlockIndex;
+
+    int m_size;
+    ADTextRange m_cols[ MaxColumns ];
+};
+
+/**
+ * Index of separators ('|' and '\n') of the whole block body, is built
+ * in one pass by SSE2/AVX2 kernel (scalar on other CPUs). Lines and
+ * columns are then taken from the index without rescanning bytes.
+ * Lines are iterated as ADLineTokenizer does, columns are split
+ * as ADColumnTokenizer does.
+ */
+class ADBlockIndex
+{
+public:
+    ADBlockIndex ( const char* data, int size );
+
+    /** Offsets of all separators in the body */
+    const QVector<int>& separators () const { return m_seps; }
+
+    /** Fills columns of the next non empty line, false at the end */
+    bool next ( ADColumnTokenizer& cols );
+
+    /** Appends offsets of '|' and '\n' to the vector */
+    static void scan ( const char* data, int size, QVector<int>& seps );
+
+private:
+    const char* m_data;
+    int m_size;
+    QVector<int> m_seps;
+    int m_sepPos;
+    int m_lineBeg;
+};
+
+/**
+ * Allocation free parsers of AD stream values. Numbers and timestamps
+ * are plain ASCII, so are parsed directly from raw bytes. Leading and
+ * trailing whitespace is ignored, as QString conversions do.
+ */
+namespace ADTextParser
+{
+    int toInt ( const ADTextRange&, bool* ok = 0 );
+    qint64 toInt64 ( const ADTextRange&, bool* ok = 0 );
+
+    /** Decimal 'digits[.digits]' is converted exactly, others fall back to Qt */
+    double toDouble ( const ADTextRange&, bool* ok = 0 );
+    float toFloat ( const ADTextRange&, bool* ok = 0 );
+
+    /** Decimal is converted exactly, digits beyond price precision are rounded */
+    ADPrice toPrice ( const ADTextRange&, bool* ok = 0 );
+
+    enum DateOrder
+    {
+        DayMonthYear = 0, // dd/MM/yyyy
+        MonthDayYear      // MM/dd/yyyy
+    };
+
+    /**
+     * Fixed format timestamps: date, date hh:mm, date hh:mm:ss.
+     * Epoch milliseconds treat wall time as UTC, QDateTime is
+     * local time, as QDateTime::fromString does (invalid on error).
+     */
+    qint64 toMSecsSinceEpoch ( const ADTextRange&, DateOrder, bool* ok = 0 );
+    QDateTime toDateTime ( const ADTextRange&, DateOrder );
+}
+
+#endif //ADTEXTPARSER_H
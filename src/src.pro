@@ -20,8 +20,15 @@ HEADERS += \
            ADLibrary.h \
            ADSmartPtr.h \
            ADAtomicOps.h \
+           ADStatLock.h \
            ADTemplateParser.h \
            ADCryptoAPI.h \
+           ADBlockFramer.h \
+           ADTextParser.h \
+           ADPrice.h \
+           ADQuoteSnapshots.h \
+           ADPaperInterest.h \
+           ADDecodeStream.h \
 
 SOURCES += \
            ADConnection.cpp \
@@ -30,6 +37,13 @@ SOURCES += \
            ADBootstrap.cpp \
            ADTemplateParser.cpp \
            ADCryptoAPI.cpp \
+           ADBlockFramer.cpp \
+           ADTextParser.cpp \
+           ADPrice.cpp \
+           ADQuoteSnapshots.cpp \
+           ADPaperInterest.cpp \
+           ADStatLock.cpp \
+           ADDecodeStream.cpp \
 
 win32:SOURCES += \
            ADLocalLibrary.cpp \
@@ -40,6 +54,9 @@ unix:SOURCES += \
            ADRemoteLibrary.cpp \
            ADRPC.cpp \
 
+# shm_open fallback of ADRPC shared memory transport
+linux-*:LIBS += -lrt
+
 # Check that CryptoPRO exists on Linux
 linux-*:exists( /opt/cprocsp/include/cpcsp ) {
 
@@ -0,0 +1,207 @@
+/*
+ * Regression test of pipelined calls with frames larger than socket
+ * buffer and shm ring: client sends all requests before it reads any
+ * reply, while server already replies to the first ones. Lane 0 calls
+ * are mixed with calls of other lanes, channel is opened while calls
+ * are in flight. Test hangs (and is killed by alarm) if server stops
+ * reading while its reply is blocked.
+ * Usage: ADRPCPipelineTest
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "ADRPC.h"
+
+/******************************************************************************/
+
+namespace
+{
+    enum { Calls = 8, Size = 200 << 10, TimeoutSecs = 30 };
+
+    void echo ( void*, const std::vector<ADRPC::value*>& params,
+                std::vector<ADRPC::value*>& retvals )
+    {
+        const unsigned char* data = 0;
+        uint32_t size = 0;
+        if ( params.size() == 1 && params[0]->to_bytearray_ptr(data, size) )
+            retvals.push_back( ADRPC::value::create_value(data, size) );
+    }
+
+    void* serve ( void* arg )
+    {
+        ((ADRPC*)arg)->exec_loop();
+        return 0;
+    }
+
+    struct Channel
+    {
+        ADRPC rpc;
+        int sock;
+        pthread_t thread;
+    };
+
+    bool openChannel ( void* param, int sock )
+    {
+        Channel* chan = (Channel*)param;
+        chan->sock = sock;
+        chan->rpc.set_fd( sock );
+        chan->rpc.register_call( "echo1", echo, 0, 1 );
+        return ::pthread_create( &chan->thread, 0, serve, &chan->rpc ) == 0;
+    }
+
+    bool echoCall ( ADRPC& client, unsigned char byte )
+    {
+        std::vector<unsigned char> payload( 16, byte );
+        std::vector<ADRPC::value*> params, retvals;
+        params.push_back( ADRPC::value::create_value(payload) );
+        const unsigned char* data = 0;
+        uint32_t size = 0;
+        bool ok = ( client.call("echo1", params, retvals) && retvals.size() == 1 &&
+                    retvals[0]->to_bytearray_ptr(data, size) && size == 16 &&
+                    data[0] == byte );
+        ADRPC::free( params );
+        ADRPC::free( retvals );
+        return ok;
+    }
+
+    // Channel reply is sent while replies of pipelined calls are pending
+    bool channel ( ADRPC& client, Channel& chan, bool& opened )
+    {
+        std::vector<unsigned char> payload( Size, 0x5a );
+        uint32_t ids[ Calls ];
+        for ( int i = 0; i < Calls; ++i ) {
+            std::vector<ADRPC::value*> params;
+            params.push_back( ADRPC::value::create_value(payload) );
+            ids[i] = client.call_async( i % 2 ? "echo1" : "echo2", params );
+            ADRPC::free( params );
+            if ( ids[i] == 0 )
+                return false;
+        }
+
+        int socks[2];
+        if ( ::socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0 )
+            return false;
+        opened = client.open_channel( socks[1] );
+        ::close( socks[1] );
+
+        ADRPC chanClient;
+        chanClient.set_fd( socks[0] );
+        bool ok = ( opened && echoCall(chanClient, 0x33) );
+        chanClient.set_fd( -1 );
+        ::close( socks[0] );
+
+        for ( int i = 0; i < Calls; ++i ) {
+            std::vector<ADRPC::value*> retvals;
+            const unsigned char* data = 0;
+            uint32_t size = 0;
+            if ( ! client.wait(ids[i], retvals) || retvals.size() != 1 ||
+                 ! retvals[0]->to_bytearray_ptr(data, size) || size != Size ||
+                 data[Size - 1] != 0x5a )
+                ok = false;
+            ADRPC::free( retvals );
+        }
+        return ok;
+    }
+
+    bool pipeline ( ADRPC& client, bool mixLanes )
+    {
+        std::vector<unsigned char> payload( Size );
+        uint32_t ids[ Calls ];
+        for ( int i = 0; i < Calls; ++i ) {
+            ::memset( &payload[0], i, Size );
+            std::vector<ADRPC::value*> params;
+            params.push_back( ADRPC::value::create_value(payload) );
+            char method[16];
+            ::snprintf( method, sizeof(method), "echo%d",
+                        mixLanes ? i % 3 : 1 + i % 2 );
+            ids[i] = client.call_async( method, params );
+            ADRPC::free( params );
+            if ( ids[i] == 0 )
+                return false;
+        }
+
+        bool ok = true;
+        for ( int i = 0; i < Calls; ++i ) {
+            std::vector<ADRPC::value*> retvals;
+            const unsigned char* data = 0;
+            uint32_t size = 0;
+            if ( ! client.wait(ids[i], retvals) || retvals.size() != 1 ||
+                 ! retvals[0]->to_bytearray_ptr(data, size) || size != Size ||
+                 data[0] != i || data[Size - 1] != i )
+                ok = false;
+            ADRPC::free( retvals );
+        }
+        return ok;
+    }
+
+    bool run ( uint32_t ringSize, bool mixLanes, bool withChannel )
+    {
+        int socks[2];
+        if ( ::socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0 )
+            return false;
+
+        ADRPC server;
+        server.set_fd( socks[1] );
+        server.register_call( "echo0", echo, 0, 0 );
+        server.register_call( "echo1", echo, 0, 1 );
+        server.register_call( "echo2", echo, 0, 2 );
+        Channel chan;
+        bool opened = false;
+        server.set_channel_handler( openChannel, &chan );
+        pthread_t thread;
+        if ( ::pthread_create(&thread, 0, serve, &server) != 0 ) {
+            ::close( socks[0] );
+            ::close( socks[1] );
+            return false;
+        }
+
+        ADRPC client;
+        client.set_fd( socks[0] );
+        bool ok = ( ringSize == 0 || client.attach_shm(ringSize) );
+        if ( ok )
+            ok = ( withChannel ? channel(client, chan, opened) :
+                                 pipeline(client, mixLanes) );
+
+        // Server loop exits when client side is closed
+        client.set_fd( -1 );
+        ::close( socks[0] );
+        ::pthread_join( thread, 0 );
+        ::close( socks[1] );
+        // Channel loop exits when channel client is closed
+        if ( opened ) {
+            ::pthread_join( chan.thread, 0 );
+            chan.rpc.set_fd( -1 );
+            ::close( chan.sock );
+        }
+        return ok;
+    }
+}
+
+/******************************************************************************/
+
+int main ()
+{
+    ::alarm( TimeoutSecs );
+    signal( SIGPIPE, SIG_IGN );
+
+    int failed = 0;
+    for ( int mix = 0; mix < 2; ++mix ) {
+        bool sock = run( 0, mix, false );
+        bool shm = run( 64 << 10, mix, false );
+        printf( "%-12s socket: %s  shm: %s\n",
+                mix ? "mixed lanes" : "lanes 1/2",
+                sock ? "ok" : "FAILED", shm ? "ok" : "FAILED" );
+        failed += !sock + !shm;
+    }
+
+    // Channels are opened only before shm is attached
+    bool chan = run( 0, false, true );
+    printf( "%-12s socket: %s\n", "channel", chan ? "ok" : "FAILED" );
+    failed += !chan;
+    return ( failed ? 1 : 0 );
+}
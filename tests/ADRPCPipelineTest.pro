@@ -0,0 +1,21 @@
+TARGET = ADRPCPipelineTest
+QT -= core gui
+CONFIG += warn_on console
+
+LEVEL = ..
+
+!include($$LEVEL/AlfaDirectAPI.pri):error("Can't load AlfaDirectAPI.pri")
+
+TEMPLATE = app
+
+INCLUDEPATH += $$LEVEL/src
+
+HEADERS += \
+           $$LEVEL/src/ADRPC.h \
+
+SOURCES += \
+           ADRPCPipelineTest.cpp \
+           $$LEVEL/src/ADRPC.cpp \
+
+LIBS += -lpthread
+linux-*:LIBS += -lrt